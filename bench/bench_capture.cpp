@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// start_capture で pcap に書き出している間の転送速度を、書き出さないときと比べる
+// 1本の接続で一方向に流し、送る大きさと snaplen を変える. filter に合わない接続は記録しない分だけ速い
+
+static const unsigned short Port = 720;
+static const int RecvLen = 16 * 1024;
+
+static void server_fn (VIRTUAL_SOCKET vsock0, unsigned short port, size_t &received)
+{
+	VirtualTcp vtcp("10.0.7.1", port, VIRTUAL_TCP_DIRECT);
+
+	struct sockaddr_in client;
+	unsigned int len = sizeof(client);
+	VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+
+	std::vector<char> buf(RecvLen);
+	received = 0;
+	while (true)
+	{
+		int n = vtcp.vrecv(vsock, buf.data(), RecvLen, 0);
+		if (n <= 0) { break; }
+		received += n;
+	}
+
+	vtcp.vclosesocket(vsock);
+}
+
+static void client_fn (unsigned short port, size_t total, int send_len)
+{
+	VirtualTcp vtcp("10.0.7.2", port, VIRTUAL_TCP_DIRECT);
+
+	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	server.sin_addr.s_addr = inet_addr("10.0.7.1");
+	vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+
+	std::vector<char> buf(send_len, 'x');
+	for (size_t sent = 0; sent < total; )
+	{
+		int n = vtcp.vsend(vsock, buf.data(), (int)std::min(total - sent, (size_t)send_len), 0);
+		if (n <= 0) { break; }
+		sent += n;
+	}
+
+	vtcp.vclosesocket(vsock);
+}
+
+// MiB/s. filter が空なら記録しない
+static double run (unsigned short port, size_t total, int send_len, const std::string &path, const std::string &filter
+		, size_t snaplen, uint64_t &dropped)
+{
+	VirtualTcp vtcp("10.0.7.1", port, VIRTUAL_TCP_DIRECT);
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr("10.0.7.1");
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	if (! filter.empty()) { VirtualTcp::start_capture(path, filter, snaplen); }
+
+	size_t received = 0;
+	auto begin = std::chrono::steady_clock::now();
+	std::thread server_th(server_fn, vsock0, port, std::ref(received));
+	std::thread client_th(client_fn, port, total, send_len);
+	server_th.join();
+	client_th.join();
+	auto end = std::chrono::steady_clock::now();
+
+	VirtualStats stats;
+	vtcp.stats(stats);
+	dropped = stats.capture_dropped;
+	VirtualTcp::stop_capture();
+	vtcp.vclosesocket(vsock0);
+
+	return (double)received / std::chrono::duration<double>(end - begin).count() / (1 << 20);
+}
+
+int main (int argc, char **argv)
+{
+	size_t total = (size_t)((argc > 1) ? atol(argv[1]) : 64) << 20;
+
+	static const int sizes[] = {64, 1024, 16 * 1024};
+	struct Setting
+	{
+		const char *name;
+		const char *filter;
+		size_t snaplen;
+	};
+	// 記録しない、合わない filter、ヘッダと先頭だけ、すべて
+	static const Setting settings[] = {{"off", "", 0}, {"filtered", "10.9.9.9", 65535}
+		, {"headers", "10.0.7.0/24", 40 + 64}, {"full", "10.0.7.0/24", 65535}};
+
+	std::string path = "/tmp/bench_capture." + std::to_string(getpid()) + ".pcap";
+
+	VirtualTcp::startup();
+	BenchReport report("capture");
+
+	printf("%10s %10s %12s %8s %10s\n", "capture", "send bytes", "MiB/s", "ratio", "dropped");
+	unsigned short port = Port;
+	for (int send_len : sizes)
+	{
+		size_t amount = std::min(total, (size_t)send_len * 65536);
+		double base = 0;
+		for (const Setting &setting : settings)
+		{
+			uint64_t dropped = 0;
+			double rate = run(port++, amount, send_len, path, setting.filter, setting.snaplen, dropped);
+			if (0 == base) { base = rate; }
+			printf("%10s %10d %12.1f %8.3f %10llu\n", setting.name, send_len, rate, rate / base
+					, (unsigned long long)dropped);
+
+			BenchReport::Params params = {{"capture", setting.name}, {"send_bytes", std::to_string(send_len)}};
+			report.add(params, "throughput", rate, "MiB/s");
+			report.add(params, "relative", rate / base, "");
+			report.add(params, "dropped", (double)dropped, "packets");
+		}
+	}
+	unlink(path.c_str());
+
+	VirtualTcp::cleanup();
+
+	return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// ソケット表の大きさを変えながら、1秒あたりの connect/accept 数と常駐メモリを計測する
+
+static const unsigned short Port = 600;
+
+// 常駐メモリ (MiB). 取れなければ 0
+static double rss_mib ()
+{
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (nullptr == fp) { return 0; }
+
+	long pages = 0;
+	long resident = 0;
+	if (2 != fscanf(fp, "%ld %ld", &pages, &resident)) { resident = 0; }
+	fclose(fp);
+
+	return (double)resident * sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static void server_fn (int connections)
+{
+	VirtualTcp vtcp("10.0.0.1", Port);
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(Port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 128);
+
+	for (int i = 0; i < connections; ++i)
+	{
+		struct sockaddr_in client;
+		unsigned int len = sizeof(client);
+		VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+		vtcp.vclosesocket(vsock);
+	}
+
+	vtcp.vclosesocket(vsock0);
+}
+
+static void client_fn (int connections)
+{
+	VirtualTcp vtcp("10.0.0.2", Port);
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(Port);
+	server.sin_addr.s_addr = inet_addr("10.0.0.1");
+
+	for (int i = 0; i < connections; ++i)
+	{
+		VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+		vtcp.vclosesocket(vsock);
+	}
+}
+
+int main (int argc, char **argv)
+{
+	// 受信領域は使うときだけ確保するので、使われないソケットが 100k あってもメモリは増えない
+	long max_sockets = (argc > 1) ? atol(argv[1]) : 100000;
+	int connections = (argc > 2) ? atoi(argv[2]) : 1000;
+
+	VirtualTcp::startup();
+	BenchReport report("connect");
+
+	// 接続と無関係なソケットで表を埋めていく
+	VirtualTcp filler("10.0.1.1", 1);
+	long table = 0;
+
+	printf("%12s %16s %12s\n", "sockets", "connects/s", "rss MiB");
+	for (long size = 100; size <= max_sockets; size *= 10)
+	{
+		for (; table < size; ++table) { filler.vsocket(AF_INET, SOCK_STREAM, 0); }
+
+		auto begin = std::chrono::steady_clock::now();
+		std::thread server_th(server_fn, connections);
+		std::thread client_th(client_fn, connections);
+		server_th.join();
+		client_th.join();
+		auto end = std::chrono::steady_clock::now();
+
+		double sec = std::chrono::duration<double>(end - begin).count();
+		double rss = rss_mib();
+		printf("%12ld %16.0f %12.1f\n", size, connections / sec, rss);
+
+		BenchReport::Params params = {{"sockets", std::to_string(size)}};
+		report.add(params, "connects", connections / sec, "1/s");
+		report.add(params, "rss", rss, "MiB");
+	}
+
+	VirtualTcp::cleanup();
+
+	return 0;
+}
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// 1つのスレッドが vepoll_wait で全接続のエコーを受け持つときの、接続数ごとの1秒あたりの往復数を計測する
+
+static const unsigned short Port = 610;
+static const int Clients = 4;
+static const int MessageSize = 64;
+
+static void server_fn (VIRTUAL_SOCKET vsock0, int connections)
+{
+	VirtualTcp vtcp("10.0.2.1", Port);
+
+	int epfd = vtcp.vepoll_create();
+	VirtualEpollEvent ev = {POLLIN, (uint64_t)vsock0};
+	vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, vsock0, &ev);
+
+	std::vector<VirtualEpollEvent> events(256);
+	char buf[MessageSize * 16];
+	int closed = 0;
+	while (closed < connections)
+	{
+		int n = vtcp.vepoll_wait(epfd, events.data(), (int)events.size(), -1);
+		if (n < 0) { break; }
+
+		for (int i = 0; i < n; ++i)
+		{
+			VIRTUAL_SOCKET vsock = (VIRTUAL_SOCKET)events[i].data;
+			if (vsock == vsock0)
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				VIRTUAL_SOCKET server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+				VirtualEpollEvent sev = {POLLIN, (uint64_t)server};
+				vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, server, &sev);
+				continue;
+			}
+
+			int res = vtcp.vrecv(vsock, buf, sizeof(buf), MSG_DONTWAIT);
+			if (res > 0)
+			{
+				vtcp.vsend(vsock, buf, res, 0);
+				continue;
+			}
+			if (events[i].events & POLLHUP)
+			{
+				vtcp.vclosesocket(vsock);
+				++closed;
+			}
+		}
+	}
+
+	vtcp.vepoll_close(epfd);
+}
+
+// 受け持つ接続すべてに送ってから、すべての応答を待つ
+static void client_fn (int connections, int rounds)
+{
+	VirtualTcp vtcp("10.0.2.2", Port);
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(Port);
+	server.sin_addr.s_addr = inet_addr("10.0.2.1");
+
+	std::vector<VIRTUAL_SOCKET> vsocks(connections);
+	for (VIRTUAL_SOCKET &vsock : vsocks)
+	{
+		vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+	}
+
+	char msg[MessageSize] = {0};
+	char ans[MessageSize];
+	for (int r = 0; r < rounds; ++r)
+	{
+		for (VIRTUAL_SOCKET vsock : vsocks) { vtcp.vsend(vsock, msg, MessageSize, 0); }
+		for (VIRTUAL_SOCKET vsock : vsocks) { vtcp.vrecv(vsock, ans, MessageSize, MSG_WAITALL); }
+	}
+
+	for (VIRTUAL_SOCKET vsock : vsocks) { vtcp.vclosesocket(vsock); }
+}
+
+int main (int argc, char **argv)
+{
+	int max_connections = (argc > 1) ? atoi(argv[1]) : 4000;
+	long messages = (argc > 2) ? atol(argv[2]) : 200000;
+
+	VirtualTcp::startup();
+	BenchReport report("epoll");
+
+	VirtualTcp vtcp("10.0.2.1", Port);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(Port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 1024);
+
+	printf("%12s %16s\n", "connections", "round trips/s");
+	for (int connections = 40; connections <= max_connections; connections *= 10)
+	{
+		int per_client = connections / Clients;
+		int rounds = (int)std::max(1L, messages / (per_client * Clients));
+
+		auto begin = std::chrono::steady_clock::now();
+		std::thread server_th(server_fn, vsock0, per_client * Clients);
+		std::vector<std::thread> clients;
+		for (int c = 0; c < Clients; ++c) { clients.emplace_back(client_fn, per_client, rounds); }
+		for (auto &th : clients) { th.join(); }
+		server_th.join();
+		auto end = std::chrono::steady_clock::now();
+
+		double sec = std::chrono::duration<double>(end - begin).count();
+		double rate = (double)rounds * per_client * Clients / sec;
+		printf("%12d %16.0f\n", per_client * Clients, rate);
+		report.add({{"connections", std::to_string(per_client * Clients)}}, "round_trips", rate, "1/s");
+	}
+
+	vtcp.vclosesocket(vsock0);
+	VirtualTcp::cleanup();
+
+	return 0;
+}
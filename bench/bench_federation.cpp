@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// 別のプロセスのブローカに nodes 個の待ち受けを置いて連合し、こちらのブローカから
+// 待ち受けがすべて見えるまでの時間、中継した connect の数/秒、中継した往復時間を計測する
+
+static const int PeerPort = 12347;
+static const unsigned short Port = 700;
+static const int MessageSize = 64;
+
+static std::string node_addr (int node)
+{
+	return "10.1." + std::to_string(node / 250) + "." + std::to_string(node % 250 + 1);
+}
+
+// 子プロセス: 待ち受けをすべて作ってから連合し、1つのスレッドの vepoll_wait でエコーする
+static void peer_fn (int nodes)
+{
+	VirtualTcp::set_alternative_port(PeerPort);
+	if (0 != VirtualTcp::startup()) { return; }
+
+	VirtualTcp vtcp("10.1.0.1", Port, VIRTUAL_TCP_DIRECT);
+	int epfd = vtcp.vepoll_create();
+
+	std::unordered_set<VIRTUAL_SOCKET> listeners;
+	for (int i = 0; i < nodes; ++i)
+	{
+		struct sockaddr_in addr;
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(Port);
+		addr.sin_addr.s_addr = inet_addr(node_addr(i).c_str());
+
+		VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+		vtcp.vlisten(vsock0, 128);
+		vtcp.vfcntl(vsock0, F_SETFL, O_NONBLOCK);
+
+		VirtualEpollEvent ev = {POLLIN, (uint64_t)vsock0};
+		vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, vsock0, &ev);
+		listeners.insert(vsock0);
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (0 != VirtualTcp::federate("127.0.0.1", 12345))
+	{
+		if (std::chrono::steady_clock::now() > deadline) { return; }
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	std::vector<VirtualEpollEvent> events(256);
+	char buf[MessageSize * 16];
+	while (true)
+	{
+		int n = vtcp.vepoll_wait(epfd, events.data(), (int)events.size(), -1);
+		if (n < 0) { break; }
+
+		for (int i = 0; i < n; ++i)
+		{
+			VIRTUAL_SOCKET vsock = (VIRTUAL_SOCKET)events[i].data;
+			if (listeners.count(vsock) > 0)
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				VIRTUAL_SOCKET server;
+				while (INVALID_SOCKET != (server = vtcp.vaccept(vsock, (struct sockaddr *)&client, &len)))
+				{
+					VirtualEpollEvent sev = {POLLIN, (uint64_t)server};
+					vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, server, &sev);
+				}
+				continue;
+			}
+
+			int res = vtcp.vrecv(vsock, buf, sizeof(buf), MSG_DONTWAIT);
+			if (res > 0)
+			{
+				vtcp.vsend(vsock, buf, res, 0);
+				continue;
+			}
+			if (events[i].events & POLLHUP) { vtcp.vclosesocket(vsock); }
+		}
+	}
+}
+
+static VIRTUAL_SOCKET open_node (VirtualTcp &vtcp, int node, int flags)
+{
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(Port);
+	server.sin_addr.s_addr = inet_addr(node_addr(node).c_str());
+
+	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	vtcp.vfcntl(vsock, F_SETFL, flags);
+	if (0 == vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server)))
+	{
+		vtcp.vfcntl(vsock, F_SETFL, 0);
+		return vsock;
+	}
+
+	vtcp.vclosesocket(vsock);
+	return INVALID_SOCKET;
+}
+
+int main (int argc, char **argv)
+{
+	int nodes = (argc > 1) ? atoi(argv[1]) : 50000;
+	int connections = (argc > 2) ? atoi(argv[2]) : 5000;
+	int iterations = (argc > 3) ? atoi(argv[3]) : 10000;
+
+	pid_t peer = fork();
+	if (0 == peer)
+	{
+		peer_fn(nodes);
+		_exit(0);
+	}
+
+	VirtualTcp::startup();
+	VirtualTcp vtcp("10.1.255.1", Port, VIRTUAL_TCP_DIRECT);
+
+	// 最後の待ち受けまで、待たない connect が通るようになるまで
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < nodes; ++i)
+	{
+		VIRTUAL_SOCKET vsock;
+		while (INVALID_SOCKET == (vsock = open_node(vtcp, i, O_NONBLOCK)))
+		{
+			if (std::chrono::steady_clock::now() - begin > std::chrono::seconds(60))
+			{
+				printf("peer broker did not federate\n");
+				kill(peer, SIGKILL);
+				waitpid(peer, nullptr, 0);
+				VirtualTcp::cleanup();
+				return 1;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		vtcp.vclosesocket(vsock);
+	}
+	double routed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	char msg[MessageSize] = {0};
+	begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < connections; ++i)
+	{
+		VIRTUAL_SOCKET vsock = open_node(vtcp, (int)(((long)i * 7919) % nodes), 0);
+		vtcp.vsend(vsock, msg, MessageSize, 0);
+		vtcp.vrecv(vsock, msg, MessageSize, MSG_WAITALL);
+		vtcp.vclosesocket(vsock);
+	}
+	double connected = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	VIRTUAL_SOCKET vsock = open_node(vtcp, 0, 0);
+	std::vector<double> rtts;
+	rtts.reserve(iterations);
+	for (int i = 0; i < iterations; ++i)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		vtcp.vsend(vsock, msg, MessageSize, 0);
+		vtcp.vrecv(vsock, msg, MessageSize, MSG_WAITALL);
+		rtts.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+	}
+	vtcp.vclosesocket(vsock);
+	std::sort(rtts.begin(), rtts.end());
+
+	printf("federation 2 brokers, %d nodes on the peer\n", nodes);
+	printf("  nodes reachable in %10.2f s (%.0f nodes/s)\n", routed, nodes / routed);
+	printf("  forwarded connect+echo %10.0f /s\n", connections / connected);
+	printf("  forwarded ping-pong p50 %10.2f us\n", rtts[rtts.size() * 50 / 100]);
+	printf("  forwarded ping-pong p99 %10.2f us\n", rtts[rtts.size() * 99 / 100]);
+
+	BenchReport report("federation");
+	BenchReport::Params params = {{"nodes", std::to_string(nodes)}};
+	report.add(params, "reachable", routed, "s");
+	report.add(params, "forwarded_connects", connections / connected, "1/s");
+	report.add(params, "rtt_p50", rtts[rtts.size() * 50 / 100], "us");
+	report.add(params, "rtt_p99", rtts[rtts.size() * 99 / 100], "us");
+
+	kill(peer, SIGKILL);
+	waitpid(peer, nullptr, 0);
+	VirtualTcp::cleanup();
+
+	return 0;
+}
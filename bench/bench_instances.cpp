@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// VirtualTcp を作って1回だけ使い、捨てるまでを1秒に何回できるかを計測する
+// テストで端点ごと、スレッドごとに VirtualTcp を作るときのトポロジの組み立ての速さにあたる
+
+static const unsigned short Port = 740;
+
+static void worker_fn (VirtualTcpMode mode, int index, int count, std::atomic<int> &failed)
+{
+	std::string addr = "10.0.8." + std::to_string(index + 1);
+	for (int i = 0; i < count; ++i)
+	{
+		VirtualTcp vtcp(addr, Port, mode);
+
+		VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		if ((INVALID_SOCKET == vsock) || (0 != vtcp.vclosesocket(vsock))) { ++failed; }
+	}
+}
+
+// 1秒あたりの数
+static double run (VirtualTcpMode mode, int nthreads, int count, int &failed)
+{
+	std::atomic<int> failures(0);
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthreads; ++t) { threads.emplace_back(worker_fn, mode, t, count, std::ref(failures)); }
+	for (auto &th : threads) { th.join(); }
+	auto end = std::chrono::steady_clock::now();
+
+	failed = failures;
+	return (double)(nthreads * count) / std::chrono::duration<double>(end - begin).count();
+}
+
+int main (int argc, char **argv)
+{
+	int count = (argc > 1) ? atoi(argv[1]) : 2000;
+
+	struct Mode
+	{
+		const char *name;
+		VirtualTcpMode mode;
+	};
+	static const Mode modes[] = {{"broker", VIRTUAL_TCP_BROKER}, {"shm", VIRTUAL_TCP_SHM}, {"direct", VIRTUAL_TCP_DIRECT}};
+	static const int threads[] = {1, 4, 16};
+
+	VirtualTcp::startup();
+	BenchReport report("instances");
+
+	printf("%8s %8s %16s %8s\n", "mode", "threads", "instances/s", "failed");
+	for (const Mode &m : modes)
+	{
+		for (int nthreads : threads)
+		{
+			int failed = 0;
+			double rate = run(m.mode, nthreads, count / nthreads, failed);
+			printf("%8s %8d %16.0f %8d\n", m.name, nthreads, rate, failed);
+
+			BenchReport::Params params = {{"mode", m.name}, {"threads", std::to_string(nthreads)}};
+			report.add(params, "instances", rate, "1/s");
+		}
+	}
+
+	VirtualTcp::cleanup();
+
+	return 0;
+}
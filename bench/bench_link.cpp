@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// 遅延を与えた経路の上で pairs 組の接続が一斉に往復したときの往復時間の分布と、
+// 1メッセージあたりの CPU 時間を計測する. 帯域を絞った経路で実際に出る帯域も確かめる
+
+static const unsigned short Port = 710;
+static const int MessageSize = 64;
+
+static std::string client_addr (int i)
+{
+	return "10.2." + std::to_string(i / 250) + "." + std::to_string(i % 250 + 1);
+}
+
+static double cpu_seconds ()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// 届いたものをそのまま送り返す. 相手が閉じたら閉じる
+static void echo_fn (VirtualTcp &vtcp, const std::vector<VIRTUAL_SOCKET> &servers)
+{
+	int epfd = vtcp.vepoll_create();
+	for (VIRTUAL_SOCKET vsock : servers)
+	{
+		VirtualEpollEvent ev = {POLLIN, (uint64_t)vsock};
+		vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, vsock, &ev);
+	}
+
+	size_t open = servers.size();
+	std::vector<VirtualEpollEvent> events(256);
+	char buf[MessageSize * 16];
+	while (0 < open)
+	{
+		int n = vtcp.vepoll_wait(epfd, events.data(), (int)events.size(), -1);
+		if (n < 0) { break; }
+
+		for (int i = 0; i < n; ++i)
+		{
+			VIRTUAL_SOCKET vsock = (VIRTUAL_SOCKET)events[i].data;
+			int res = vtcp.vrecv(vsock, buf, sizeof(buf), MSG_DONTWAIT);
+			if (res > 0)
+			{
+				vtcp.vsend(vsock, buf, res, 0);
+				continue;
+			}
+			if (events[i].events & POLLHUP)
+			{
+				vtcp.vclosesocket(vsock);
+				--open;
+			}
+		}
+	}
+	vtcp.vepoll_close(epfd);
+}
+
+static VIRTUAL_SOCKET open_pair (VirtualTcp &vtcp, VIRTUAL_SOCKET vsock0, const std::string &addr, VIRTUAL_SOCKET &server)
+{
+	struct sockaddr_in local;
+	local.sin_family = AF_INET;
+	local.sin_port = htons(Port);
+	local.sin_addr.s_addr = inet_addr(addr.c_str());
+
+	struct sockaddr_in remote;
+	remote.sin_family = AF_INET;
+	remote.sin_port = htons(Port);
+	remote.sin_addr.s_addr = inet_addr("10.3.0.1");
+
+	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	vtcp.vbind(vsock, (struct sockaddr *)&local, sizeof(local));
+	vtcp.vconnect(vsock, (struct sockaddr *)&remote, sizeof(remote));
+
+	struct sockaddr_in client;
+	unsigned int len = sizeof(client);
+	server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+
+	return vsock;
+}
+
+int main (int argc, char **argv)
+{
+	int pairs = (argc > 1) ? atoi(argv[1]) : 10000;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 5;
+	int delay_ms = (argc > 3) ? atoi(argv[3]) : 5;
+
+	VirtualTcp::startup();
+	VirtualTcp vtcp("10.3.0.1", Port, VIRTUAL_TCP_DIRECT);
+
+	VirtualLinkProfile wan;
+	wan.delay = std::chrono::milliseconds(delay_ms);
+	VirtualTcp::set_link("10.2.0.0/16", "10.3.0.1", wan);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(Port);
+	addr.sin_addr.s_addr = inet_addr("10.3.0.1");
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, VirtualSocketImpl::MAX_BACKLOG);
+
+	std::vector<VIRTUAL_SOCKET> clients(pairs);
+	std::vector<VIRTUAL_SOCKET> servers(pairs);
+	for (int i = 0; i < pairs; ++i) { clients[i] = open_pair(vtcp, vsock0, client_addr(i), servers[i]); }
+
+	std::thread echo_th(echo_fn, std::ref(vtcp), std::cref(servers));
+
+	// 全組が一斉に1つ送り、すべて戻るまでを1巡とする
+	int epfd = vtcp.vepoll_create();
+	std::unordered_map<VIRTUAL_SOCKET, int> index;
+	for (int i = 0; i < pairs; ++i)
+	{
+		VirtualEpollEvent ev = {POLLIN, (uint64_t)clients[i]};
+		vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, clients[i], &ev);
+		index[clients[i]] = i;
+	}
+
+	std::vector<double> rtts;
+	rtts.reserve((size_t)pairs * rounds);
+	std::vector<std::chrono::steady_clock::time_point> sent(pairs);
+	std::vector<VirtualEpollEvent> events(256);
+	char msg[MessageSize] = {0};
+	double cpu0 = cpu_seconds();
+	auto begin = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; ++r)
+	{
+		for (int i = 0; i < pairs; ++i)
+		{
+			sent[i] = std::chrono::steady_clock::now();
+			vtcp.vsend(clients[i], msg, MessageSize, 0);
+		}
+
+		int back = 0;
+		while (back < pairs)
+		{
+			int n = vtcp.vepoll_wait(epfd, events.data(), (int)events.size(), -1);
+			if (n < 0) { break; }
+
+			auto now = std::chrono::steady_clock::now();
+			for (int k = 0; k < n; ++k)
+			{
+				VIRTUAL_SOCKET vsock = (VIRTUAL_SOCKET)events[k].data;
+				if (MessageSize != vtcp.vrecv(vsock, msg, MessageSize, MSG_WAITALL)) { continue; }
+
+				rtts.push_back(std::chrono::duration<double, std::milli>(now - sent[index[vsock]]).count());
+				++back;
+			}
+		}
+	}
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	double cpu = cpu_seconds() - cpu0;
+	vtcp.vepoll_close(epfd);
+
+	// 他が動いていない1組の往復が、経路の遅延の往復分にどれだけ近いか
+	std::vector<double> alone;
+	for (int i = 0; i < 100; ++i)
+	{
+		auto t0 = std::chrono::steady_clock::now();
+		vtcp.vsend(clients[0], msg, MessageSize, 0);
+		vtcp.vrecv(clients[0], msg, MessageSize, MSG_WAITALL);
+		alone.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count());
+	}
+	std::sort(alone.begin(), alone.end());
+
+	for (VIRTUAL_SOCKET vsock : clients) { vtcp.vclosesocket(vsock); }
+	echo_th.join();
+	std::sort(rtts.begin(), rtts.end());
+
+	// 帯域を絞った1組で、送り切るまでの時間から出る帯域
+	const uint64_t rate = 10 * 1000 * 1000;
+	const int bulk = 4 * 1000 * 1000;
+	VirtualLinkProfile narrow;
+	narrow.rate = rate;
+	narrow.burst = 64 * 1024;
+	VirtualTcp::set_link("10.2.255.1", "10.3.0.1", narrow);
+
+	VIRTUAL_SOCKET server;
+	VIRTUAL_SOCKET client = open_pair(vtcp, vsock0, "10.2.255.1", server);
+	std::vector<char> data(bulk);
+	std::thread reader([&]()
+			{
+				std::vector<char> buf(VirtualSocketImpl::BUF_SIZE);
+				int got = 0;
+				int n = 1;
+				while ((got < bulk) && (0 < n))
+				{
+					n = vtcp.vrecv(server, buf.data(), (int)buf.size(), 0);
+					got += std::max(n, 0);
+				}
+			});
+	auto t0 = std::chrono::steady_clock::now();
+	vtcp.vsend(client, data.data(), bulk, 0);
+	reader.join();
+	double shaped = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	vtcp.vclosesocket(client);
+	vtcp.vclosesocket(server);
+
+	printf("link emulation %d pairs x %d rounds, one-way delay %d ms\n", pairs, rounds, delay_ms);
+	printf("  rtt p50 %10.2f ms\n", rtts[rtts.size() * 50 / 100]);
+	printf("  rtt p99 %10.2f ms\n", rtts[rtts.size() * 99 / 100]);
+	printf("  rtt max %10.2f ms\n", rtts.back());
+	printf("  messages %10.0f /s\n", rtts.size() / elapsed);
+	printf("  single pair rtt p50 %10.2f ms (max %.2f ms)\n", alone[alone.size() / 2], alone.back());
+	printf("  cpu per message %10.2f us\n", cpu * 1e6 / rtts.size());
+	printf("  shaped %.0f MB/s link carried %10.2f MB/s\n", rate / 1e6, bulk / shaped / 1e6);
+
+	BenchReport report("link");
+	BenchReport::Params params = {{"pairs", std::to_string(pairs)}, {"delay_ms", std::to_string(delay_ms)}};
+	report.add(params, "rtt_p50", rtts[rtts.size() * 50 / 100], "ms");
+	report.add(params, "rtt_p99", rtts[rtts.size() * 99 / 100], "ms");
+	report.add(params, "messages", rtts.size() / elapsed, "1/s");
+	report.add(params, "single_rtt_p50", alone[alone.size() / 2], "ms");
+	report.add(params, "cpu_per_message", cpu * 1e6 / rtts.size(), "us");
+	report.add({{"rate_mb", std::to_string(rate / 1000000)}}, "shaped_throughput", bulk / shaped / 1e6, "MB/s");
+
+	VirtualTcp::clear_links();
+	vtcp.vclosesocket(vsock0);
+	VirtualTcp::cleanup();
+
+	return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// test_virtual_tcp と同じ形の往復 (client send -> server recv -> server send -> client recv) の
+// 往復時間を計測する
+
+static const int MsgLen = 64;
+
+static void server_fn (VirtualTcpMode mode, int iterations)
+{
+	VirtualTcp vtcp("192.168.3.51", 501, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(501);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	struct sockaddr_in client;
+	unsigned int len = sizeof(client);
+	VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+
+	char msg[MsgLen];
+	for (int i = 0; i < iterations; ++i)
+	{
+		vtcp.vrecv(vsock, msg, MsgLen, 0);
+		vtcp.vsend(vsock, msg, MsgLen, 0);
+	}
+
+	vtcp.vclosesocket(vsock);
+	vtcp.vclosesocket(vsock0);
+}
+
+static void client_fn (VirtualTcpMode mode, int iterations, std::vector<double> &rtts)
+{
+	VirtualTcp vtcp("192.168.3.56", 501, mode);
+
+	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(501);
+	server.sin_addr.s_addr = inet_addr("192.168.3.51");
+	vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+
+	char msg[MsgLen];
+	memset(msg, 'x', MsgLen);
+	for (int i = 0; i < iterations; ++i)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		vtcp.vsend(vsock, msg, MsgLen, 0);
+		vtcp.vrecv(vsock, msg, MsgLen, 0);
+		auto end = std::chrono::steady_clock::now();
+
+		rtts.push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+	}
+}
+
+static void run (BenchReport &report, const char *name, VirtualTcpMode mode, int iterations)
+{
+	std::vector<double> rtts;
+	rtts.reserve(iterations);
+
+	std::thread server_th(server_fn, mode, iterations);
+	std::thread client_th(client_fn, mode, iterations, std::ref(rtts));
+
+	server_th.join();
+	client_th.join();
+
+	std::sort(rtts.begin(), rtts.end());
+	printf("ping-pong %s %d bytes x %d\n", name, MsgLen, iterations);
+	printf("  p50 %10.2f us\n", rtts[rtts.size() * 50 / 100]);
+	printf("  p90 %10.2f us\n", rtts[rtts.size() * 90 / 100]);
+	printf("  p99 %10.2f us\n", rtts[rtts.size() * 99 / 100]);
+	printf("  p999 %9.2f us\n", rtts[rtts.size() * 999 / 1000]);
+	printf("  max %10.2f us\n", rtts.back());
+
+	BenchReport::Params params = {{"mode", name}, {"bytes", std::to_string(MsgLen)}};
+	report.add(params, "rtt_p50", rtts[rtts.size() * 50 / 100], "us");
+	report.add(params, "rtt_p90", rtts[rtts.size() * 90 / 100], "us");
+	report.add(params, "rtt_p99", rtts[rtts.size() * 99 / 100], "us");
+	report.add(params, "rtt_p999", rtts[rtts.size() * 999 / 1000], "us");
+	report.add(params, "rtt_max", rtts.back(), "us");
+}
+
+int main (int argc, char **argv)
+{
+	int iterations = (argc > 1) ? atoi(argv[1]) : 10000;
+
+	VirtualTcp::startup();
+	BenchReport report("ping_pong");
+
+	run(report, "broker", VIRTUAL_TCP_BROKER, iterations);
+	run(report, "shm", VIRTUAL_TCP_SHM, iterations);
+	run(report, "direct", VIRTUAL_TCP_DIRECT, iterations);
+
+	VirtualTcp::cleanup();
+
+	return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef BENCH_REPORT_H__
+#define BENCH_REPORT_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// ベンチマークの結果を1行1件の JSON (JSON Lines) で書き出す
+// 書き出し先は環境変数 VIRTUAL_TCP_BENCH_OUT のファイルで、追記する. 設定されていなければ何もしない
+// 各行は {"bench", "rev", "params": {...}, "metric", "value", "unit"}. rev は VIRTUAL_TCP_BENCH_REV
+// make bench は版の名前を rev に入れて build/bench/results.jsonl へ書くので、版どうしを突き合わせられる
+class BenchReport
+{
+	public:
+		using Params = std::vector<std::pair<std::string, std::string>>;
+
+		explicit BenchReport (const std::string &bench_)
+			: bench(bench_)
+			  , fp(nullptr)
+		{
+			const char *path = getenv("VIRTUAL_TCP_BENCH_OUT");
+			if ((nullptr != path) && ('\0' != path[0])) { fp = fopen(path, "a"); }
+
+			const char *r = getenv("VIRTUAL_TCP_BENCH_REV");
+			rev = (nullptr != r) ? r : "";
+		}
+		BenchReport (const BenchReport &obj) = delete;
+		BenchReport &operator= (const BenchReport &obj) = delete;
+		~BenchReport ()
+		{
+			if (nullptr != fp) { fclose(fp); }
+		}
+
+		void add (const Params &params, const std::string &metric, double value, const std::string &unit)
+		{
+			if (nullptr == fp) { return; }
+
+			std::string line = "{\"bench\":" + quote(bench) + ",\"rev\":" + quote(rev) + ",\"params\":{";
+			for (size_t i = 0; i < params.size(); ++i)
+			{
+				if (0 < i) { line += ","; }
+				line += quote(params[i].first) + ":" + quote(params[i].second);
+			}
+
+			char num[64];
+			snprintf(num, sizeof(num), "%.6g", value);
+			line += "},\"metric\":" + quote(metric) + ",\"value\":" + num + ",\"unit\":" + quote(unit) + "}\n";
+
+			fputs(line.c_str(), fp);
+			fflush(fp);
+		}
+
+	private:
+		std::string bench;
+		std::string rev;
+		FILE *fp;
+
+		static std::string quote (const std::string &s)
+		{
+			std::string out = "\"";
+			for (char c : s)
+			{
+				if (('"' == c) || ('\\' == c)) { out += '\\'; }
+				if ((unsigned char)c < 0x20) { continue; }
+				out += c;
+			}
+			return out + "\"";
+		}
+};
+
+#endif // BENCH_REPORT_H__
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// 旧実装の VirtualSocketImpl::read (読み出しごとにバッファ全体を詰め直す) を再現したもの
+class ShiftDownBuffer
+{
+	public:
+		static const size_t BUF_SIZE = VirtualSocketImpl::BUF_SIZE;
+
+		char buffer[BUF_SIZE];
+		size_t bufend;
+
+		ShiftDownBuffer ()
+			: buffer()
+			  , bufend(0)
+		{
+			memset(buffer, '\0', BUF_SIZE);
+		}
+
+		void write (const char *msg, int len)
+		{
+			size_t nbufend = bufend + len;
+			if (nbufend > BUF_SIZE) { nbufend = BUF_SIZE; }
+
+			memcpy(&(buffer[bufend]), msg, nbufend - bufend);
+
+			bufend = nbufend;
+		}
+
+		int read (char *msg, int len, bool peek)
+		{
+			if (len > (int)BUF_SIZE) { len = (int)BUF_SIZE; }
+			if (bufend < (size_t)len) { return 0; }
+
+			memcpy(msg, buffer, len);
+
+			char temp[BUF_SIZE];
+			memcpy(temp, &(buffer[len]), BUF_SIZE - len);
+			memset(buffer, '\0', BUF_SIZE);
+			memcpy(buffer, temp, BUF_SIZE - len);
+
+			bufend -= len;
+			return len;
+		}
+};
+
+// 1メッセージずつ write/read を繰り返し、読み出しのスループット(MB/s)を返す
+template <typename Buffer>
+static double measure (Buffer &buf, size_t msglen, size_t total)
+{
+	std::vector<char> src(msglen, 'x');
+	std::vector<char> dst(msglen);
+	size_t iterations = std::max((size_t)1, total / msglen);
+
+	auto begin = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		buf.write(src.data(), (int)msglen);
+		if ((int)msglen != buf.read(dst.data(), (int)msglen, false)) { return 0.0; }
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	double sec = std::chrono::duration<double>(end - begin).count();
+	return (double)(iterations * msglen) / sec / (1024.0 * 1024.0);
+}
+
+int main (int argc, char **argv)
+{
+	static const size_t sizes[] = {1, 4, 16, 64, 256, 1024, 4096, 16384, 65536};
+
+	// write は接続中のソケットにしか書き込まない
+	auto ring = std::make_unique<VirtualSocketImpl>();
+	ring->connect(INVALID_SOCKET);
+	auto shift = std::make_unique<ShiftDownBuffer>();
+
+	BenchReport report("ring_buffer");
+
+	printf("%10s %16s %16s %10s\n", "msg bytes", "ring MB/s", "shift-down MB/s", "speedup");
+	for (size_t msglen : sizes)
+	{
+		// 旧実装は1回の読み出しで約192KBを動かすので、回数を抑えて測る
+		double r = measure(*ring, msglen, 256 * 1024 * 1024);
+		double s = measure(*shift, msglen, std::min((size_t)256 * 1024 * 1024, msglen * 20000));
+		printf("%10zu %16.1f %16.1f %9.1fx\n", msglen, r, s, r / s);
+
+		BenchReport::Params params = {{"bytes", std::to_string(msglen)}};
+		report.add(params, "ring", r, "MB/s");
+		report.add(params, "shift_down", s, "MB/s");
+	}
+
+	return 0;
+}
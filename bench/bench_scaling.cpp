@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// クライアントのスレッド数と、スレッドごとの接続の組数を変えながら、1秒あたりの往復数を計測する
+// スレッドごとに別のアドレスで待ち受け、vepoll_wait でエコーするサーバのスレッドと組にする
+
+static const unsigned short Port = 630;
+static const int MessageSize = 64;
+
+static std::string server_addr (int thread)
+{
+	return "10.0.4." + std::to_string(2 * thread + 1);
+}
+
+static void server_fn (VirtualTcpMode mode, int thread, VIRTUAL_SOCKET vsock0, int pairs)
+{
+	VirtualTcp vtcp(server_addr(thread), Port, mode);
+
+	int epfd = vtcp.vepoll_create();
+	for (int i = 0; i < pairs; ++i)
+	{
+		struct sockaddr_in client;
+		unsigned int len = sizeof(client);
+		VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+
+		VirtualEpollEvent ev = {POLLIN, (uint64_t)vsock};
+		vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, vsock, &ev);
+	}
+
+	std::vector<VirtualEpollEvent> events(256);
+	char buf[MessageSize * 16];
+	int closed = 0;
+	while (closed < pairs)
+	{
+		int n = vtcp.vepoll_wait(epfd, events.data(), (int)events.size(), -1);
+		if (n < 0) { break; }
+
+		for (int i = 0; i < n; ++i)
+		{
+			VIRTUAL_SOCKET vsock = (VIRTUAL_SOCKET)events[i].data;
+			int res = vtcp.vrecv(vsock, buf, sizeof(buf), MSG_DONTWAIT);
+			if (res > 0)
+			{
+				vtcp.vsend(vsock, buf, res, 0);
+				continue;
+			}
+			if (events[i].events & POLLHUP)
+			{
+				vtcp.vclosesocket(vsock);
+				++closed;
+			}
+		}
+	}
+	vtcp.vepoll_close(epfd);
+}
+
+// 受け持つ接続すべてに送ってから、すべての応答を待つ
+static void client_fn (VirtualTcpMode mode, int thread, int pairs, int rounds)
+{
+	VirtualTcp vtcp("10.0.4." + std::to_string(2 * thread + 2), Port, mode);
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(Port);
+	server.sin_addr.s_addr = inet_addr(server_addr(thread).c_str());
+
+	std::vector<VIRTUAL_SOCKET> vsocks(pairs);
+	for (VIRTUAL_SOCKET &vsock : vsocks)
+	{
+		vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+	}
+
+	char msg[MessageSize] = {0};
+	char ans[MessageSize];
+	for (int r = 0; r < rounds; ++r)
+	{
+		for (VIRTUAL_SOCKET vsock : vsocks) { vtcp.vsend(vsock, msg, MessageSize, 0); }
+		for (VIRTUAL_SOCKET vsock : vsocks) { vtcp.vrecv(vsock, ans, MessageSize, MSG_WAITALL); }
+	}
+
+	for (VIRTUAL_SOCKET vsock : vsocks) { vtcp.vclosesocket(vsock); }
+}
+
+static double run (VirtualTcpMode mode, int threads, int pairs, long messages)
+{
+	int rounds = (int)std::max(1L, messages / ((long)threads * pairs));
+
+	// 待ち受けは計測の前に済ませておく
+	VirtualTcp vtcp("10.0.4.0", Port, VIRTUAL_TCP_DIRECT);
+	std::vector<VIRTUAL_SOCKET> listeners(threads);
+	for (int t = 0; t < threads; ++t)
+	{
+		struct sockaddr_in addr;
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(Port);
+		addr.sin_addr.s_addr = inet_addr(server_addr(t).c_str());
+
+		listeners[t] = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		vtcp.vbind(listeners[t], (struct sockaddr *)&addr, sizeof(addr));
+		vtcp.vlisten(listeners[t], pairs);
+	}
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> ths;
+	for (int t = 0; t < threads; ++t)
+	{
+		ths.emplace_back(server_fn, mode, t, listeners[t], pairs);
+		ths.emplace_back(client_fn, mode, t, pairs, rounds);
+	}
+	for (auto &th : ths) { th.join(); }
+	auto end = std::chrono::steady_clock::now();
+
+	for (VIRTUAL_SOCKET vsock0 : listeners) { vtcp.vclosesocket(vsock0); }
+
+	double sec = std::chrono::duration<double>(end - begin).count();
+	return (double)rounds * threads * pairs / sec;
+}
+
+int main (int argc, char **argv)
+{
+	static const int thread_counts[] = {1, 2, 4, 8};
+	static const int pair_counts[] = {1, 64};
+	static const std::pair<const char *, VirtualTcpMode> modes[] =
+			{{"broker", VIRTUAL_TCP_BROKER}, {"shm", VIRTUAL_TCP_SHM}, {"direct", VIRTUAL_TCP_DIRECT}};
+
+	long messages = (argc > 1) ? atol(argv[1]) : 20000;
+
+	VirtualTcp::startup();
+	BenchReport report("scaling");
+
+	printf("%8s %8s %8s %16s\n", "mode", "threads", "pairs/th", "round trips/s");
+	for (const auto &mode : modes)
+	{
+		for (int threads : thread_counts)
+		{
+			for (int pairs : pair_counts)
+			{
+				double rate = run(mode.second, threads, pairs, messages);
+				printf("%8s %8d %8d %16.0f\n", mode.first, threads, pairs, rate);
+
+				report.add({{"mode", mode.first}, {"threads", std::to_string(threads)}, {"pairs", std::to_string(pairs)}}
+						, "round_trips", rate, "1/s");
+			}
+		}
+	}
+
+	VirtualTcp::cleanup();
+
+	return 0;
+}
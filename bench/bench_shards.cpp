@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// shard の数を 1 からコア数まで変えながら、別々のアドレスで待ち受ける組を並列に動かし、
+// 1秒あたりの接続数とメッセージ数を計測する
+// 組ごとに connect -> send -> recv (echo) -> close を繰り返す
+
+static const unsigned short Port = 620;
+static const int MsgLen = 64;
+
+static std::string server_addr (int pair)
+{
+	return "10.0.3." + std::to_string(2 * pair + 1);
+}
+
+static void server_fn (int pair, int connections)
+{
+	VirtualTcp vtcp(server_addr(pair), Port, VIRTUAL_TCP_DIRECT);
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(Port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 128);
+
+	char msg[MsgLen];
+	for (int i = 0; i < connections; ++i)
+	{
+		struct sockaddr_in client;
+		unsigned int len = sizeof(client);
+		VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+		vtcp.vrecv(vsock, msg, MsgLen, MSG_WAITALL);
+		vtcp.vsend(vsock, msg, MsgLen, 0);
+		vtcp.vclosesocket(vsock);
+	}
+
+	vtcp.vclosesocket(vsock0);
+}
+
+static void client_fn (int pair, int connections)
+{
+	VirtualTcp vtcp("10.0.3." + std::to_string(2 * pair + 2), Port, VIRTUAL_TCP_DIRECT);
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(Port);
+	server.sin_addr.s_addr = inet_addr(server_addr(pair).c_str());
+
+	char msg[MsgLen];
+	memset(msg, 'x', MsgLen);
+	for (int i = 0; i < connections; ++i)
+	{
+		VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+		vtcp.vsend(vsock, msg, MsgLen, 0);
+		vtcp.vrecv(vsock, msg, MsgLen, MSG_WAITALL);
+		vtcp.vclosesocket(vsock);
+	}
+}
+
+int main (int argc, char **argv)
+{
+	int ncores = (int)std::max(1u, std::thread::hardware_concurrency());
+	int max_shards = (argc > 1) ? atoi(argv[1]) : ncores;
+	int pairs = (argc > 2) ? atoi(argv[2]) : std::max(4, 2 * ncores);
+	int connections = (argc > 3) ? atoi(argv[3]) : 2000;
+
+	BenchReport report("shards");
+
+	printf("%8s %8s %16s %16s\n", "shards", "pairs", "connects/s", "msgs/s");
+	for (int shards = 1; shards <= max_shards; shards *= 2)
+	{
+		VirtualTcp::startup(shards);
+
+		auto begin = std::chrono::steady_clock::now();
+		std::vector<std::thread> ths;
+		for (int p = 0; p < pairs; ++p)
+		{
+			ths.emplace_back(server_fn, p, connections);
+			ths.emplace_back(client_fn, p, connections);
+		}
+		for (auto &th : ths) { th.join(); }
+		auto end = std::chrono::steady_clock::now();
+
+		VirtualTcp::cleanup();
+
+		double sec = std::chrono::duration<double>(end - begin).count();
+		double total = (double)pairs * connections;
+		printf("%8d %8d %16.0f %16.0f\n", shards, pairs, total / sec, 2 * total / sec);
+
+		BenchReport::Params params = {{"shards", std::to_string(shards)}, {"pairs", std::to_string(pairs)}};
+		report.add(params, "connects", total / sec, "1/s");
+		report.add(params, "messages", 2 * total / sec, "1/s");
+	}
+
+	return 0;
+}
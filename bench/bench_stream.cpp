@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "virtual_tcp.h"
+#include "bench_report.h"
+
+// 1本の接続で一方向に流し続けたときの転送速度を、送る大きさを変えながら計測する
+// 受け手は RecvLen ずつ読むので、大きく送る送り手は受信ウィンドウが空くのを待ちながら送ることになる
+
+static const unsigned short Port = 601;
+static const int RecvLen = 16 * 1024;
+
+static void server_fn (VirtualTcpMode mode, unsigned short port, size_t total, size_t &received, bool &intact)
+{
+	VirtualTcp vtcp("10.0.2.1", port, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	struct sockaddr_in client;
+	unsigned int len = sizeof(client);
+	VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+
+	// 先頭バイトだけ確かめる. 送り手は位置の下位 8 ビットを書く
+	std::vector<char> buf(RecvLen);
+	received = 0;
+	intact = true;
+	while (true)
+	{
+		int n = vtcp.vrecv(vsock, buf.data(), RecvLen, 0);
+		if (n <= 0) { break; }
+
+		intact = intact && (buf[0] == (char)(received & 0xff));
+		received += n;
+	}
+
+	vtcp.vclosesocket(vsock);
+	vtcp.vclosesocket(vsock0);
+}
+
+static void client_fn (VirtualTcpMode mode, unsigned short port, size_t total, int send_len)
+{
+	VirtualTcp vtcp("10.0.2.2", port, mode);
+
+	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(port);
+	server.sin_addr.s_addr = inet_addr("10.0.2.1");
+	vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+
+	// 先頭は常に位置の下位 8 ビットになるよう、256 の倍数ずつ送る
+	std::vector<char> buf(send_len + 256);
+	for (size_t i = 0; i < buf.size(); ++i) { buf[i] = (char)(i & 0xff); }
+
+	for (size_t sent = 0; sent < total; )
+	{
+		int n = vtcp.vsend(vsock, &(buf[sent & 0xff]), (int)std::min(total - sent, (size_t)send_len), 0);
+		if (n <= 0) { break; }
+		sent += n;
+	}
+
+	vtcp.vclosesocket(vsock);
+}
+
+static bool run (BenchReport &report, const char *name, VirtualTcpMode mode, unsigned short port, size_t total, int send_len)
+{
+	size_t received = 0;
+	bool intact = false;
+
+	auto begin = std::chrono::steady_clock::now();
+	std::thread server_th(server_fn, mode, port, total, std::ref(received), std::ref(intact));
+	std::thread client_th(client_fn, mode, port, total, send_len);
+
+	server_th.join();
+	client_th.join();
+	auto end = std::chrono::steady_clock::now();
+
+	double sec = std::chrono::duration<double>(end - begin).count();
+	double rate = (double)received / sec / (1 << 20);
+	printf("%8s %10d %10zu %12.1f%s\n", name, send_len, total >> 20, rate
+			, ((total == received) && intact) ? "" : "  (CORRUPTED)");
+
+	report.add({{"mode", name}, {"send_bytes", std::to_string(send_len)}, {"recv_bytes", std::to_string(RecvLen)}}
+			, "throughput", rate, "MiB/s");
+
+	return (total == received) && intact;
+}
+
+int main (int argc, char **argv)
+{
+	size_t total = (size_t)((argc > 1) ? atol(argv[1]) : 64) << 20;
+
+	static const int sizes[] = {64, 1024, 16 * 1024, 256 * 1024};
+
+	VirtualTcp::startup();
+	BenchReport report("stream");
+
+	// 小さく送るときは回数が多いので、量を抑えて測る
+	printf("%8s %10s %10s %12s\n", "mode", "send bytes", "MiB", "MiB/s");
+	bool ok = true;
+	unsigned short port = Port;
+	for (int send_len : sizes)
+	{
+		size_t amount = std::min(total, (size_t)send_len * 65536);
+		ok = run(report, "broker", VIRTUAL_TCP_BROKER, port++, amount, send_len) && ok;
+		ok = run(report, "shm", VIRTUAL_TCP_SHM, port++, amount, send_len) && ok;
+		ok = run(report, "direct", VIRTUAL_TCP_DIRECT, port++, amount, send_len) && ok;
+	}
+
+	VirtualTcp::cleanup();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,83 @@
+#ifndef VIRTUAL_ASYNC_H__
+#define VIRTUAL_ASYNC_H__
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// C++20 でコンパイルしたときは VirtualAsync を co_await できる
+// 0 を定義しておけば C++20 でも使わない
+#ifndef VIRTUAL_TCP_COROUTINE
+#	if defined(__cpp_impl_coroutine) && defined(__has_include)
+#		if __has_include(<coroutine>)
+#			define VIRTUAL_TCP_COROUTINE 1
+#		endif
+#	endif
+#endif
+#ifndef VIRTUAL_TCP_COROUTINE
+#	define VIRTUAL_TCP_COROUTINE 0
+#endif
+#if VIRTUAL_TCP_COROUTINE
+#	include <coroutine>
+#endif
+
+// async_* の完了を実行する. 渡された関数をどこかのスレッドで一度だけ呼ぶこと
+using VirtualExecutor = std::function<void(std::function<void()>)>;
+
+// async_* の結果. 同期版の v* と同じ戻り値と errno を、完了したときに then で渡した関数へ渡す
+// then の関数と co_await の再開は、async_* を呼んだ VirtualTcp の executor で実行する
+class VirtualAsync
+{
+	public:
+		using Callback = std::function<void(long result, int err)>;
+
+		// 完了を待つ側と完了させる側で共有する
+		class State
+		{
+			public:
+				explicit State (const VirtualExecutor &executor_);
+
+				// 一度だけ呼ぶこと
+				void complete (long result_, int err_);
+				// 完了していれば false を返し、cb は預けない
+				bool defer (const Callback &cb);
+				void then (const Callback &cb);
+				bool ready ();
+				long wait ();
+
+			private:
+				std::mutex mtx;
+				std::condition_variable cv;
+				VirtualExecutor executor;
+				bool done;
+				long result;
+				int err;
+				Callback callback;
+
+				void dispatch (const Callback &cb);
+		};
+
+		VirtualAsync () : state() {}
+		explicit VirtualAsync (const std::shared_ptr<State> &state_) : state(state_) {}
+
+		bool ready () const { return state->ready(); }
+		// 完了するまで待って結果を返す. 失敗なら errno も設定する
+		long wait () const { return state->wait(); }
+		// 完了していればすぐに executor へ渡す
+		void then (const Callback &cb) const { state->then(cb); }
+
+#if VIRTUAL_TCP_COROUTINE
+		bool await_ready () const { return state->ready(); }
+		bool await_suspend (std::coroutine_handle<> h) const
+		{
+			return state->defer([h](long, int) { h.resume(); });
+		}
+		long await_resume () const { return state->wait(); }
+#endif
+
+	private:
+		std::shared_ptr<State> state;
+};
+
+#endif // VIRTUAL_ASYNC_H__
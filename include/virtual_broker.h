@@ -0,0 +1,142 @@
+#ifndef VIRTUAL_BROKER_H__
+#define VIRTUAL_BROKER_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "virtual_segment.h"
+#include "virtual_stats.h"
+#include "virtual_stream.h"
+
+class VirtualBroker;
+
+// ブローカが受け付けた1本の制御用接続
+struct VirtualBrokerConnection
+{
+	// 1回の sendv_some に並べる切片の数の上限
+	static const int MaxIov = 64;
+	// 応答を溜めている間でも、これだけ溜まったら送り始める
+	static const size_t CorkLimit = VirtualSegment::SIZE;
+
+	uint64_t id;
+	VirtualBroker *broker;
+	std::unique_ptr<VirtualStream> stream;
+	// 受信済みでまだ処理していない要求は input の [input_begin, input->used)
+	// 要求の本文はこの領域を参照したまま、複製せずにソケットの受信キューへ渡せる
+	VirtualSegmentPtr input;
+	size_t input_begin;
+	// 処理中の要求と、それを最初に読んだ時刻 (待ちから再開しても変わらない)
+	VirtualSlice current;
+	std::chrono::steady_clock::time_point started;
+	// 送り切れずに残っている応答. 相手が読むまでワーカーは待たずに次へ進む
+	VirtualSegmentQueue output;
+	// 立っている間の応答は output に溜めるだけにして、読めた要求をすべて処理してから1回で送る
+	bool corked;
+
+	// 待ちになった要求. 他の要求はこれを追い越して処理する
+	struct Parked
+	{
+		VirtualSlice frame;
+		std::chrono::steady_clock::time_point started;
+	};
+	std::unordered_map<uint64_t, Parked> parked;
+	uint64_t next_key;
+	// いま処理している要求の継続. 呼ばれるとその要求が再開待ちに積まれる
+	std::function<void()> resume;
+
+	// 継続から再開を待っている要求 (parked のキー)
+	std::mutex resumed_mtx;
+	std::vector<uint64_t> resumed;
+
+	// 処理中に届いた起床の数. 0 から増やしたワーカーだけが処理する
+	std::atomic<uint32_t> wakeups;
+	bool closed;
+
+	VirtualBrokerConnection (uint64_t id_, VirtualStream *stream_, VirtualBroker *broker_);
+
+	// input の後ろに len バイト以上の連続した空きを作る
+	void reserve (size_t len);
+	// 処理し終えた len バイトを input から外す
+	void consume (size_t len);
+
+	// 次に処理する要求の継続を作る. 待ちになったら current を park で預ける
+	uint64_t prepare ();
+	void park (uint64_t key);
+	std::vector<uint64_t> take_resumed ();
+
+	// 応答を送る. iov の後に slices が続く. 送り切れなかった分と corked の間の分は output に残し、
+	// flush で送る (iov は複製し、slices は参照のまま積む)
+	void send (const struct iovec *iov, int iovcnt, const VirtualSlice *slices = nullptr, int nslices = 0);
+	// false なら接続が切れている
+	bool flush ();
+};
+
+// epoll で制御用接続を待つ固定数のワーカー
+// 進められない要求はソケットに継続を預けて脇へ置き、スレッドも後続の要求も塞がない
+class VirtualBroker
+{
+	public:
+		// 接続の input を処理できるだけ処理する. false なら要求が壊れているので切断する
+		using Handler = std::function<bool(VirtualBrokerConnection &)>;
+		// 受け付けたソケットを通信路にする. nullptr なら破棄する
+		using Acceptor = std::function<VirtualStream *(int)>;
+
+		VirtualBroker ();
+		VirtualBroker (const VirtualBroker &obj) = delete;
+		VirtualBroker &operator= (const VirtualBroker &obj) = delete;
+		~VirtualBroker ();
+
+		bool start (size_t nworkers, Handler handler_);
+		void stop ();
+
+		bool add_listener (int fd, Acceptor acceptor);
+		void add (VirtualStream *stream);
+		void post (uint64_t id);
+		void resume (uint64_t id, uint64_t key);
+		// ワーカーごとの数と、受け付けている接続の数を写す
+		void stats (std::vector<VirtualWorkerStats> &out, uint64_t &connections);
+
+	private:
+		// ワーカーごとの数. 書くのはそのワーカーだけで、stats は relaxed に読む
+		struct alignas(64) WorkerCounters
+		{
+			std::atomic<uint64_t> wakeups;
+			std::atomic<uint64_t> services;
+			std::atomic<uint64_t> busy_ns;
+			std::atomic<uint32_t> busy;
+
+			WorkerCounters () : wakeups(0), services(0), busy_ns(0), busy(0) {}
+		};
+
+		// epoll のイベントで使う id. 接続と待ち受けは 1 から順に振る
+		static const uint64_t EventId = 0;
+
+		int epfd;
+		// post で積んだ接続をワーカーに知らせる. 停止時は読まずに残して全員を起こす
+		int event;
+		std::atomic<bool> running;
+		std::vector<std::thread> workers;
+		std::vector<std::unique_ptr<WorkerCounters>> counters;
+		Handler handler;
+
+		std::mutex mtx;
+		uint64_t next_id;
+		std::unordered_map<uint64_t, std::shared_ptr<VirtualBrokerConnection>> conns;
+		std::unordered_map<uint64_t, std::pair<int, Acceptor>> listeners;
+		std::deque<uint64_t> ready;
+
+		void worker_fn (WorkerCounters &counter);
+		void accept_all (uint64_t id);
+		void drive (uint64_t id);
+		void service (VirtualBrokerConnection &conn);
+		void close (VirtualBrokerConnection &conn);
+};
+
+#endif // VIRTUAL_BROKER_H__
@@ -0,0 +1,97 @@
+#ifndef VIRTUAL_CAPTURE_H__
+#define VIRTUAL_CAPTURE_H__
+
+#include <stdio.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#ifdef __unix__
+#	include <sys/uio.h>
+#	include <arpa/inet.h>
+#endif
+
+// 記録する接続の条件. どちらかの端が net/bits に入り、port が 0 でなければどちらかの端のポートが合うこと
+// send ごとにロックを取らずに読めるよう、64 ビットに詰めて持つ
+struct VirtualCaptureFilter
+{
+	// ネットワークバイトオーダー
+	uint32_t net;
+	unsigned int bits;
+	uint16_t port;
+
+	// "10.0.0.0/8", "10.0.0.1:80", ":80" のいずれか. 空ならすべて
+	static bool parse (const std::string &filter, VirtualCaptureFilter &out);
+	static VirtualCaptureFilter unpack (uint64_t packed)
+	{
+		return VirtualCaptureFilter{(uint32_t)packed, (unsigned int)(packed >> 32) & 63, (uint16_t)(packed >> 38)};
+	}
+	uint64_t pack () const { return (uint64_t)net | ((uint64_t)bits << 32) | ((uint64_t)port << 38); }
+
+	bool match (unsigned long src_ip, unsigned short src_port, unsigned long dst_ip, unsigned short dst_port) const
+	{
+		uint32_t mask = htonl((0 == bits) ? 0 : (uint32_t)(0xffffffffu << (32 - bits)));
+		return ((0 == port) || (src_port == port) || (dst_port == port))
+			&& ((((uint32_t)src_ip & mask) == net) || (((uint32_t)dst_ip & mask) == net));
+	}
+};
+
+// 仮想の送受信を pcap ファイルに書き出す. 1回の書き込みを IPv4/TCP のパケット (LINKTYPE_RAW) として記録する
+// 送る側は record で固定長のリングへ複製するだけで、ファイルへはスレッドが1本でまとめて書く
+//
+// リングは複数の書き手と1つの読み手のバイト列で、書き手は head を CAS で進めて場所を取り、
+// 書き終えたら先頭の語を立てて公開する. 読み手は tail から公開済みの分を順に書き出し、0 で埋めて返す
+// リングが一杯なら待たずに捨てて dropped に数える
+class VirtualCapture
+{
+	public:
+		static const size_t RING_SIZE = 8 * 1024 * 1024;
+		// IPv4 の全長に入る1パケットのペイロードの上限. 長い書き込みは分けて記録する
+		static const size_t MAX_PAYLOAD = 65535 - 40;
+
+		VirtualCapture ();
+		VirtualCapture (const VirtualCapture &obj) = delete;
+		VirtualCapture &operator= (const VirtualCapture &obj) = delete;
+		~VirtualCapture ();
+
+		// snaplen はヘッダを含めて1パケットに残すバイト数. 開けなければ false
+		bool open (const std::string &path, size_t snaplen);
+		// 残りを書き出してファイルを閉じる
+		void close ();
+
+		// iov の先頭 len バイトを src から dst への seq からのデータとして記録する
+		// ip, port はネットワークバイトオーダー. filter は呼び出し側で見る
+		void record (unsigned long src_ip, unsigned short src_port, unsigned long dst_ip, unsigned short dst_port
+				, uint32_t seq, uint32_t ack, size_t window, const struct iovec *iov, int iovcnt, size_t len);
+
+		uint64_t packets () const { return written.load(std::memory_order_relaxed); }
+		uint64_t dropped () const { return lost.load(std::memory_order_relaxed); }
+
+	private:
+		// リングの記録の先頭の語. 0 は未公開、PAD は末尾の使わない分
+		static const uint32_t PAD = (uint32_t)1 << 31;
+
+		std::unique_ptr<char[]> ring;
+		alignas(64) std::atomic<uint64_t> head;
+		alignas(64) std::atomic<uint64_t> tail;
+		alignas(64) std::atomic<uint64_t> written;
+		std::atomic<uint64_t> lost;
+
+		size_t snaplen;
+
+		FILE *fp;
+		std::atomic<bool> running;
+		std::thread writer;
+
+		// パケット1つ分. payload は iov の offset から chunk バイト. ns は記録した時刻 (UNIX 時間)
+		void record_one (uint64_t ns, unsigned long src_ip, unsigned short src_port, unsigned long dst_ip
+				, unsigned short dst_port, uint32_t seq, uint32_t ack, size_t window, const struct iovec *iov, int iovcnt
+				, size_t offset, size_t chunk);
+		// 公開済みの分をファイルへ書いてリングから外す. 書いたものがあれば true
+		bool drain ();
+		void writer_fn ();
+};
+
+#endif // VIRTUAL_CAPTURE_H__
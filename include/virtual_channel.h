@@ -0,0 +1,115 @@
+#ifndef VIRTUAL_CHANNEL_H__
+#define VIRTUAL_CHANNEL_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "virtual_frame.h"
+#include "virtual_stream.h"
+
+// 1本の制御用接続に複数の要求を同時に流すクライアント側の口
+// 応答は request で待ち手に振り分ける. 待っているスレッドのうち1つが代表して応答を読む
+// 待つスレッドのいない begin_async の応答は、最初の begin_async で起こす受信スレッドが読む
+class VirtualChannel
+{
+	public:
+		// 応答の結果、ブローカ側の errno、受け取った本文の長さ
+		using Completion = std::function<void(int32_t result, int err, size_t len)>;
+
+	private:
+		// 応答を先読みしておく領域の大きさ
+		static const size_t INPUT_SIZE = 4096;
+		// 要求の本文の iovec の数の上限. 固定部分の1つと、vsendv から渡る IOV_MAX 個のデータ
+		static const int MAX_IOV = 1 + IOV_MAX;
+
+		struct Call
+		{
+			// 応答の本文の受け取り先. finish するまで呼び出し元が保持する
+			const struct iovec *out;
+			int outcnt;
+			size_t len;
+			int32_t result;
+			int err;
+			bool done;
+			// begin_async の要求. 応答を読んだスレッドが呼んで Call を消す
+			Completion completion;
+		};
+
+		// 読んだ応答が begin_async のものなら、その completion と結果
+		// 呼ぶのは reading を下ろして他のスレッドが読めるようにしてから (completion の中で call してもよい)
+		struct Completed
+		{
+			Completion completion;
+			int32_t result;
+			int err;
+			size_t len;
+		};
+
+		std::unique_ptr<VirtualStream> stream;
+		// 先読みして、まだ振り分けていない応答は input の [input_begin, input_end)
+		// 1回の受信で続けて届いた応答をまとめて読む. 触るのは代表して読んでいるスレッドだけ
+		std::unique_ptr<char[]> input;
+		size_t input_begin;
+		size_t input_end;
+
+		std::mutex send_mtx;
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::unordered_map<uint32_t, std::unique_ptr<Call>> calls;
+		uint32_t next_request;
+		// 代表して応答を読んでいるスレッドがいる
+		bool reading;
+		// 接続が切れた. 以降の要求はすべて失敗する
+		bool broken;
+		// 応答を待っている begin_async の数
+		size_t pending;
+		bool stopping;
+		std::thread reader;
+
+		bool start (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+				, uint32_t &request, const struct iovec *out, int outcnt, const Completion &completion);
+		bool send (const VirtualFrameHeader &head, const struct iovec *iov, int iovcnt);
+		bool read_one (Completed &completed);
+		// mtx を外して completed を呼ぶ
+		void complete (std::unique_lock<std::mutex> &lock, Completed &completed);
+		// 先読みした分から先に、ちょうど len バイトを受け取る
+		bool read_exact (const struct iovec *iov, int iovcnt);
+		void reader_fn ();
+		void fail_pending (std::unique_lock<std::mutex> &lock);
+
+	public:
+		explicit VirtualChannel (VirtualStream *stream_);
+		VirtualChannel (const VirtualChannel &obj) = delete;
+		VirtualChannel &operator= (const VirtualChannel &obj) = delete;
+		~VirtualChannel ();
+
+		// 要求を送って応答を待つ. 応答の本文は out に入る分だけ受け取り、len に長さを返す
+		bool call (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+				, int32_t &result, const struct iovec *out = nullptr, int outcnt = 0, size_t *len = nullptr);
+		bool call (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+				, int32_t &result, char *body, size_t cap, size_t *len = nullptr)
+		{
+			struct iovec out = {body, cap};
+			return call(command, value, iov, iovcnt, result, &out, 1, len);
+		}
+		// call を送信と応答待ちに分けたもの. begin で得た request を後で finish に渡す
+		// finish するまで out は応答の書き込み先として使われる
+		bool begin (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+				, uint32_t &request, const struct iovec *out = nullptr, int outcnt = 0);
+		bool finish (uint32_t request, int32_t &result, size_t *len = nullptr);
+		// 応答を待たずに返り、応答が届いたら completion を呼ぶ. 接続が切れたら結果 -1 で呼ぶ
+		// completion が呼ばれるまで out は応答の書き込み先として使われる
+		bool begin_async (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+				, const Completion &completion, const struct iovec *out = nullptr, int outcnt = 0);
+		// 応答を求めない要求を送る
+		bool post (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt);
+		// 切れたことにまだ気づいていなければ true. 相手が閉じていても、次に読み書きするまでは true のまま
+		bool alive ();
+};
+
+#endif // VIRTUAL_CHANNEL_H__
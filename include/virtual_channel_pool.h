@@ -0,0 +1,63 @@
+#ifndef VIRTUAL_CHANNEL_POOL_H__
+#define VIRTUAL_CHANNEL_POOL_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "virtual_channel.h"
+
+// ブローカへの制御用接続をプロセスの VirtualTcp で共有する
+// VirtualChannel は要求を request で振り分けるので、別の VirtualTcp やスレッドの要求を同じ接続に流せる
+// 接続は宛先ごとに size 本まで必要になったときに張り、借り手には順に割り振る
+// 揃った後の acquire は接続もスレッドも作らない. 切れた接続は次にその番が来たときに張り直す
+// 張るのは mtx を外して行うので、遅い接続や繋がらない宛先が他の acquire を塞がない
+class VirtualChannelPool
+{
+	public:
+		// key の宛先へ新しく繋ぐ. 繋がらなければ nullptr
+		using Connector = std::function<VirtualStream *(uint64_t key)>;
+
+		// 宛先ごとの接続の数の上限. size が 0 ならコア数 (MAX_SIZE まで)
+		static const size_t MAX_SIZE = 8;
+
+		explicit VirtualChannelPool (size_t size_ = 0);
+		VirtualChannelPool (const VirtualChannelPool &obj) = delete;
+		VirtualChannelPool &operator= (const VirtualChannelPool &obj) = delete;
+
+		// key の宛先への生きている接続を1本借りる. 新しく張れず、生きている接続もなければ nullptr
+		std::shared_ptr<VirtualChannel> acquire (uint64_t key, const Connector &connect);
+		// 持っている接続を手放す. 借りている VirtualTcp はそのまま使い続け、最後の1つが手放したときに閉じる
+		void clear ();
+
+	private:
+		struct Slot
+		{
+			std::shared_ptr<VirtualChannel> channel;
+			// 誰かが mtx を外して張っている最中
+			bool connecting;
+		};
+		// 宛先ごとの size 個の枠. 一度作った Entry は消さないので、mtx を外している間も参照できる
+		struct Entry
+		{
+			std::vector<Slot> slots;
+			size_t next;
+		};
+
+		size_t size;
+		std::mutex mtx;
+		// 張り終えたことを、同じ枠を待っている acquire に知らせる
+		std::condition_variable cv;
+		std::unordered_map<uint64_t, Entry> entries;
+		// clear のたびに増やす. 張っている間に clear されたら、張った接続は枠に置かない
+		uint64_t generation;
+
+		// entry の生きている接続のどれか. なければ nullptr. mtx を持って呼ぶ
+		static std::shared_ptr<VirtualChannel> any_alive (Entry &entry);
+};
+
+#endif // VIRTUAL_CHANNEL_POOL_H__
@@ -0,0 +1,69 @@
+#ifndef VIRTUAL_EPOLL_H__
+#define VIRTUAL_EPOLL_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "virtual_tcp.h"
+
+// vepoll_create で作る監視対象の集合. vpoll も待つ間だけ一時的に作る
+// 登録したソケットの状態が変わると VirtualSocketImpl::wake から mark され、
+// 変わったソケットだけが ready に積まれる. 待っている側は ready に積まれたものだけを調べ直す
+class VirtualEpoll
+{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		struct Entry
+		{
+			uint32_t events;
+			uint64_t data;
+			// ready に積まれている
+			bool queued;
+		};
+
+		VirtualEpoll ();
+		VirtualEpoll (const VirtualEpoll &obj) = delete;
+		VirtualEpoll &operator= (const VirtualEpoll &obj) = delete;
+
+		// s の状態が変わった. 登録されていれば ready に積んで待っている側を起こす
+		void mark (VIRTUAL_SOCKET s);
+
+		// 登録済みなら false. 登録したソケットは最初の wait で一度調べる
+		bool add (VIRTUAL_SOCKET s, uint32_t events, uint64_t data);
+		// 未登録なら false
+		bool modify (VIRTUAL_SOCKET s, uint32_t events, uint64_t data);
+		bool remove (VIRTUAL_SOCKET s);
+		bool lookup (VIRTUAL_SOCKET s, Entry &entry);
+
+		// ready に積まれたソケットを取り出す
+		std::vector<VIRTUAL_SOCKET> take_ready ();
+		// 調べ直したいソケットを ready へ戻す (レベルトリガで報告したものなど)
+		void requeue (const std::vector<VIRTUAL_SOCKET> &ss);
+
+		// ready が空なら resume を預けて true を返す. 預けた継続は次の mark か notify で一度だけ呼ばれる
+		bool park (const std::function<void()> &resume);
+		// ready に積まれるか、閉じられるか、deadline まで待つ
+		void wait_until (Clock::time_point deadline);
+		// 何も積まずに待っている側を起こす (タイムアウト用)
+		void notify ();
+
+		void close ();
+		bool closed ();
+
+	private:
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::unordered_map<VIRTUAL_SOCKET, Entry> entries;
+		std::vector<VIRTUAL_SOCKET> ready;
+		std::vector<std::function<void()>> parked;
+		bool is_closed;
+
+		void wake (std::unique_lock<std::mutex> &lock);
+};
+
+#endif // VIRTUAL_EPOLL_H__
@@ -0,0 +1,102 @@
+#ifndef VIRTUAL_FRAME_H__
+#define VIRTUAL_FRAME_H__
+
+#include <cstddef>
+#include <cstdint>
+#include "virtual_tcp.h"
+
+// ワイヤ上の整数はビッグエンディアン. char の符号拡張を避けて組み立てる
+static inline uint32_t get_u32 (const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+}
+
+static inline uint16_t get_u16 (const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return (uint16_t)(((uint16_t)u[0] << 8) | (uint16_t)u[1]);
+}
+
+static inline void put_u32 (char *p, uint32_t v)
+{
+	p[0] = (char)((v >> 24) & 0xff);
+	p[1] = (char)((v >> 16) & 0xff);
+	p[2] = (char)((v >> 8) & 0xff);
+	p[3] = (char)(v & 0xff);
+}
+
+static inline void put_u16 (char *p, uint16_t v)
+{
+	p[0] = (char)((v >> 8) & 0xff);
+	p[1] = (char)(v & 0xff);
+}
+
+static inline uint64_t get_u64 (const char *p)
+{
+	return ((uint64_t)get_u32(&(p[0])) << 32) | (uint64_t)get_u32(&(p[4]));
+}
+
+static inline void put_u64 (char *p, uint64_t v)
+{
+	put_u32(&(p[0]), (uint32_t)(v >> 32));
+	put_u32(&(p[4]), (uint32_t)(v & 0xffffffff));
+}
+
+// VirtualTcp とブローカの間でやりとりする要求/応答のフレーム
+//
+//  [version:1][command:1][flags:2][request:4][value:4][length:4][body:length]
+//
+// request は応答を要求と対応付ける番号で、ブローカは届いた順ではなく完了した順に応答する
+// value は要求では対象のソケット、応答では結果. 応答の flags は結果が負のときの errno
+const uint8_t VIRTUAL_TCP_PROTOCOL_VERSION = 2;
+
+enum VirtualFrameFlag: uint16_t
+{
+	// 応答を返さない
+	FRAME_NOREPLY = 0x0001
+};
+
+struct VirtualFrameHeader
+{
+	static const size_t SIZE = 16;
+	// 本文の上限. これを超えるフレームは壊れているとみなす
+	static const uint32_t MAX_BODY = 16 * 1024 * 1024;
+
+	uint8_t version;
+	VirtualTcpCommand command;
+	uint16_t flags;
+	uint32_t request;
+	uint32_t value;
+	uint32_t length;
+
+	VirtualFrameHeader ()
+		: version(VIRTUAL_TCP_PROTOCOL_VERSION), command(COM_SOCKET), flags(0), request(0), value(0), length(0) {}
+	VirtualFrameHeader (VirtualTcpCommand command_, uint16_t flags_, uint32_t request_, uint32_t value_, uint32_t length_)
+		: version(VIRTUAL_TCP_PROTOCOL_VERSION), command(command_), flags(flags_), request(request_), value(value_), length(length_) {}
+
+	void encode (char *p) const
+	{
+		p[0] = (char)version;
+		p[1] = (char)command;
+		put_u16(&(p[2]), flags);
+		put_u32(&(p[4]), request);
+		put_u32(&(p[8]), value);
+		put_u32(&(p[12]), length);
+	}
+
+	// 版が違うか本文が大きすぎれば false
+	bool decode (const char *p)
+	{
+		version = (uint8_t)p[0];
+		command = (VirtualTcpCommand)p[1];
+		flags = get_u16(&(p[2]));
+		request = get_u32(&(p[4]));
+		value = get_u32(&(p[8]));
+		length = get_u32(&(p[12]));
+
+		return (VIRTUAL_TCP_PROTOCOL_VERSION == version) && (length <= MAX_BODY);
+	}
+};
+
+#endif // VIRTUAL_FRAME_H__
@@ -0,0 +1,82 @@
+#ifndef VIRTUAL_LINK_H__
+#define VIRTUAL_LINK_H__
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "virtual_segment.h"
+
+// 経路の性質. 既定値はどれも「何もしない」
+struct VirtualLinkProfile
+{
+	// 片道の遅延と、その揺らぎ (±jitter の一様分布)
+	std::chrono::microseconds delay = std::chrono::microseconds(0);
+	std::chrono::microseconds jitter = std::chrono::microseconds(0);
+	// 帯域 (バイト/秒) とトークンバケツの深さ (バイト). rate が 0 なら制限しない
+	uint64_t rate = 0;
+	size_t burst = 0;
+	// 書き込み1回分が失われる確率と、再送までの時間. 失うたびに rto を倍にして最大 MAX_RETRIES 回再送する
+	double loss = 0.0;
+	std::chrono::microseconds rto = std::chrono::milliseconds(200);
+	// 書き込み1回分が後続に追い越される確率. 追い越された分は delay だけ遅れて届く
+	double reorder = 0.0;
+};
+
+// 2つのアドレス範囲の間の経路. どちらの向きにも同じ性質を持つ
+// アプリケーションから見える TCP と同じく、失われたものや追い越されたものもバイト列としては
+// 欠けず順番も変わらない. 再送や先頭の詰まりで届くのが遅れるだけ
+class VirtualLink
+{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		static const int MAX_RETRIES = 6;
+
+		const VirtualLinkProfile profile;
+
+		VirtualLink (unsigned long src_net_, unsigned long src_mask_, unsigned long dst_net_, unsigned long dst_mask_
+				, const VirtualLinkProfile &profile_);
+		VirtualLink (const VirtualLink &obj) = delete;
+		VirtualLink &operator= (const VirtualLink &obj) = delete;
+
+		// "10.0.0.0/8" や "10.0.0.1" (/32) を net と mask (いずれもネットワークバイトオーダー) にする
+		static bool parse (const std::string &cidr, unsigned long &net, unsigned long &mask);
+
+		bool match (unsigned long src, unsigned long dst) const;
+		// src から dst へ now に書き込んだ len バイトが相手に届く時刻
+		// 帯域は (src, dst) の向きごとのトークンバケツで、足りない分は送り出しを遅らせる
+		Clock::time_point arrival (unsigned long src, unsigned long dst, size_t len, Clock::time_point now);
+
+	private:
+		struct Bucket
+		{
+			double tokens;
+			Clock::time_point last;
+		};
+
+		unsigned long src_net;
+		unsigned long src_mask;
+		unsigned long dst_net;
+		unsigned long dst_mask;
+
+		std::mutex mtx;
+		std::unordered_map<uint64_t, Bucket> buckets;
+		std::mt19937 rng;
+};
+
+// 経路を通ってまだ届いていないデータ. 届く時刻の順に並ぶ
+struct VirtualInflight
+{
+	VirtualSegmentQueue queue;
+	// (届く時刻, バイト数). queue の先頭から順に対応する
+	std::deque<std::pair<VirtualLink::Clock::time_point, size_t>> arrivals;
+	// 最後に積んだ分の届く時刻. 後から書いた分はこれより先には届かない
+	VirtualLink::Clock::time_point last;
+};
+
+#endif // VIRTUAL_LINK_H__
@@ -0,0 +1,61 @@
+#ifndef VIRTUAL_PEER_H__
+#define VIRTUAL_PEER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "virtual_frame.h"
+#include "virtual_segment.h"
+#include "virtual_stream.h"
+
+// 連合した他のブローカへ張った片方向のリンク
+// 転送するフレームは post で積むだけで、書き込み用のスレッドが溜まった分をまとめて1回で送る
+// 相手からのフレームは相手が張ったリンクで届き、こちらのブローカのワーカーが受け取る
+// こちらのリンクには何も返ってこないので、読み込み用のスレッドは切断の検出にだけ使う
+class VirtualPeer
+{
+	public:
+		// 相手が切断したら一度だけ、リンクのスレッドから呼ばれる
+		using Broken = std::function<void(VirtualPeer &)>;
+
+		// 相手のブローカの待ち受け
+		const std::string host;
+		const int port;
+		// 相手のブローカの id. 相手から COM_PEER が届くまで 0
+		std::atomic<uint32_t> id;
+
+		VirtualPeer (VirtualStream *stream_, const std::string &host_, int port_, const Broken &broken_);
+		VirtualPeer (const VirtualPeer &obj) = delete;
+		VirtualPeer &operator= (const VirtualPeer &obj) = delete;
+		~VirtualPeer ();
+
+		// FRAME_NOREPLY のフレームを積む. 本文は body の後に slices が続く. 切断済みなら false
+		bool post (VirtualTcpCommand command, uint32_t request, uint32_t value
+				, const char *body = nullptr, size_t len = 0, const std::vector<VirtualSlice> *slices = nullptr);
+		bool broken ();
+		// 積んである分を送り切ってから閉じる. Broken は呼ばない
+		void close ();
+
+	private:
+		std::unique_ptr<VirtualStream> stream;
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<char> out;
+		bool stopping;
+		bool is_broken;
+		Broken on_broken;
+		std::thread writer;
+		std::thread reader;
+
+		void writer_fn ();
+		void reader_fn ();
+		void fail ();
+};
+
+#endif // VIRTUAL_PEER_H__
@@ -0,0 +1,193 @@
+#ifndef VIRTUAL_SEGMENT_H__
+#define VIRTUAL_SEGMENT_H__
+
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#ifdef __unix__
+#	include <sys/uio.h>
+#elif _WINDOWS
+	// vsendv/vrecvv で使う. POSIX と同じ並び
+	struct iovec
+	{
+		void *iov_base;
+		size_t iov_len;
+	};
+#endif
+
+// vsendv/vrecvv に1回で渡せる iovec の数の上限. 内部で切り分ける iovec の配列もこの大きさで持つ
+#ifndef IOV_MAX
+#	define IOV_MAX 1024
+#endif
+
+// 参照カウント付きのバイト列の領域. 受け取ったデータを複製せずに受信キューや応答へ繋ぐ
+// 本体の直後に cap バイトのデータが続く
+// MIN_SIZE から 4 倍ずつ SIZE までの大きさの領域は、大きさごとのプールで使い回す. 中身は消さない
+struct VirtualSegment
+{
+	static const size_t MIN_SIZE = 1024;
+	static const size_t SIZE = 64 * 1024;
+	static const int CLASSES = 4;
+
+	std::atomic<uint32_t> refs;
+	size_t cap;
+	// 書き込み済みの位置. 進めるのはこの領域へ書き込んでいる持ち主だけで、
+	// 切片が参照しているのは常に used より前
+	size_t used;
+	VirtualSegment *next_free;
+
+	char *data () { return (char *)(this + 1); }
+
+	// 参照カウント 1 で返す
+	static VirtualSegment *create (size_t cap);
+	// len バイト以上入る最小の段階の領域を返す. SIZE を超える分は別の領域に分けること
+	static VirtualSegment *pooled (size_t len = SIZE);
+	// プールに置いている領域をすべて解放する
+	static void trim ();
+	// プールに置いている領域の合計バイト数
+	static size_t pooled_bytes ();
+
+	void retain () { refs.fetch_add(1, std::memory_order_relaxed); }
+	void release ();
+};
+
+// VirtualSegment の参照を1つ持つ
+class VirtualSegmentPtr
+{
+	private:
+		VirtualSegment *seg;
+
+	public:
+		VirtualSegmentPtr () : seg(nullptr) {}
+		// 作ったときの参照を引き取る
+		explicit VirtualSegmentPtr (VirtualSegment *seg_) : seg(seg_) {}
+		VirtualSegmentPtr (const VirtualSegmentPtr &obj) : seg(obj.seg) { if (nullptr != seg) { seg->retain(); } }
+		VirtualSegmentPtr (VirtualSegmentPtr &&obj) : seg(obj.seg) { obj.seg = nullptr; }
+		~VirtualSegmentPtr () { reset(); }
+
+		VirtualSegmentPtr &operator= (const VirtualSegmentPtr &obj)
+		{
+			if (nullptr != obj.seg) { obj.seg->retain(); }
+			reset();
+			seg = obj.seg;
+			return *this;
+		}
+		VirtualSegmentPtr &operator= (VirtualSegmentPtr &&obj)
+		{
+			if (this != &obj)
+			{
+				reset();
+				seg = obj.seg;
+				obj.seg = nullptr;
+			}
+			return *this;
+		}
+
+		explicit operator bool () const { return nullptr != seg; }
+		VirtualSegment *operator-> () const { return seg; }
+		VirtualSegment *get () const { return seg; }
+		// 他に参照がなければ、used を巻き戻して使い直せる
+		bool unique () const { return (nullptr != seg) && (1 == seg->refs.load(std::memory_order_acquire)); }
+
+		void reset ()
+		{
+			if (nullptr != seg) { seg->release(); }
+			seg = nullptr;
+		}
+};
+
+// 領域の一部 [offset, offset + len)
+struct VirtualSlice
+{
+	VirtualSegmentPtr seg;
+	size_t offset;
+	size_t len;
+
+	char *data () const { return seg->data() + offset; }
+};
+
+// 切片を届いた順に並べたバイト列
+// 小さい書き込みは末尾の自前の領域へまとめてコピーし、大きいものは参照だけを繋ぐ
+// 空のあいだは領域を持たない. 自前の領域は溜まっている量に合わせて大きい段階を選ぶ
+class VirtualSegmentQueue
+{
+	public:
+		// これより短い切片は参照せずにコピーする (大きな領域を少しのデータで掴み続けないように)
+		static const size_t COPY_BELOW = 512;
+
+		VirtualSegmentQueue ();
+		VirtualSegmentQueue (const VirtualSegmentQueue &obj) = delete;
+		VirtualSegmentQueue &operator= (const VirtualSegmentQueue &obj) = delete;
+
+		size_t size () const { return bytes; }
+		bool empty () const { return 0 == bytes; }
+
+		// iov を limit バイトまで後ろに繋ぎ、繋いだバイト数を返す
+		// owner があり iov がその領域を指していれば、長い部分は参照で繋ぐ
+		size_t append (const struct iovec *iov, int iovcnt, size_t limit, const VirtualSegmentPtr *owner = nullptr);
+		void append (const VirtualSlice &slice);
+		// 先頭から iov に複製する. 取り除くのは consume
+		size_t copy (const struct iovec *iov, int iovcnt) const;
+		// 先頭から len バイトまでの切片の参照を out に足す
+		size_t share (size_t len, std::vector<VirtualSlice> &out) const;
+		void consume (size_t len);
+		// 先頭から max 個までの切片を iov に並べる
+		int gather (struct iovec *iov, int max) const;
+		void clear ();
+
+	private:
+		// 有効なのは [first, slices.size()). 空になるまで先頭は詰めない
+		// (deque は空でも確保するので、使われないソケットが多いと効く)
+		std::vector<VirtualSlice> slices;
+		size_t first;
+		size_t bytes;
+		// 小さい書き込みを詰めていく自前の領域
+		VirtualSegmentPtr tail;
+
+		void append_copy (const char *buf, size_t len);
+};
+
+// 1つの書き手と1つの読み手の間のバイトリング. 受信キューの手前に置き、ロックを取らずに受け渡す
+// tail は書き手だけが、head は読み手だけが進める. 書き手どうし、読み手どうしは呼び出し側で順に並べる
+// 領域は最初に書くときにプールから取り、足りなければ MAX_SIZE まで大きい段階へ移す
+class VirtualByteRing
+{
+	public:
+		static const size_t MIN_SIZE = 4 * 1024;
+		static const size_t MAX_SIZE = VirtualSegment::SIZE;
+
+		VirtualByteRing ();
+		VirtualByteRing (const VirtualByteRing &obj) = delete;
+		VirtualByteRing &operator= (const VirtualByteRing &obj) = delete;
+
+		// どのスレッドから呼んでもよい
+		size_t size () const { return (size_t)(tail.load() - head.load()); }
+		bool empty () const { return 0 == size(); }
+
+		// 以下は書き手から. capacity は領域を差し替えないあいだだけ変わらない
+		size_t capacity () const { return cap; }
+		size_t room () const { return cap - (size_t)(tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire)); }
+		// iov を limit バイトまで空きに書き込み、書いたバイト数を返す
+		size_t push (const struct iovec *iov, int iovcnt, size_t limit);
+
+		// 以下は読み手から. 先頭から skip バイト飛ばして iov に複製する. 取り除くのは consume
+		size_t copy (size_t skip, const struct iovec *iov, int iovcnt) const;
+		void consume (size_t len);
+
+		// 以下は書き手と読み手の両方を止めて呼ぶこと
+		// 溜まっている分に len バイト足せる大きさへ広げる (MAX_SIZE まで). 広げたら true
+		bool grow (size_t len);
+		// 溜まっている分を捨て、領域をプールへ返す
+		void clear ();
+
+	private:
+		// 領域を差し替えるときだけ変わるので、両端から読むだけ
+		VirtualSegmentPtr seg;
+		size_t cap;
+		alignas(64) std::atomic<uint64_t> head;
+		alignas(64) std::atomic<uint64_t> tail;
+};
+
+#endif // VIRTUAL_SEGMENT_H__
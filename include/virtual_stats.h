@@ -0,0 +1,163 @@
+#ifndef VIRTUAL_STATS_H__
+#define VIRTUAL_STATS_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// 値の分布 (ナノ秒の待ち時間など). HDR Histogram と同じく、値を最上位ビットから SUB_BITS ビットの
+// 精度で対数の区間に数えるので、どの大きさでも誤差は 1/16 以内に収まる
+// 記録は relaxed な加算だけで、ロックも確保もしない
+class VirtualHistogram
+{
+	public:
+		static const unsigned int SUB_BITS = 5;
+		static const size_t HALF = (size_t)1 << (SUB_BITS - 1);
+		static const size_t BUCKETS = (64 - SUB_BITS + 2) * HALF;
+
+		VirtualHistogram ();
+		VirtualHistogram (const VirtualHistogram &obj) = delete;
+		VirtualHistogram &operator= (const VirtualHistogram &obj) = delete;
+
+		void record (uint64_t value)
+		{
+			counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+
+			uint64_t m = max.load(std::memory_order_relaxed);
+			while ((m < value) && (! max.compare_exchange_weak(m, value, std::memory_order_relaxed))) {}
+		}
+
+		static size_t index (uint64_t value)
+		{
+			if (value < 2 * HALF) { return (size_t)value; }
+
+			unsigned int e = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+			return 2 * HALF + (e - 1) * HALF + (size_t)((value >> e) - HALF);
+		}
+		// 区間の下限
+		static uint64_t lower (size_t idx);
+
+		// 今の数を写す. 記録と同時に写しても、各区間の数が後から減ることはない
+		void snapshot (std::vector<uint64_t> &out, uint64_t &max_) const;
+		void clear ();
+
+	private:
+		std::atomic<uint64_t> counts[BUCKETS];
+		std::atomic<uint64_t> max;
+};
+
+// ソケットごとの数. 受信側の数は受信リングの書き手の write_mtx を持って書き、送信側の数は relaxed に足す
+// どちらも読むのはロックを取らない snapshot だけ
+struct VirtualSocketCounters
+{
+	std::atomic<uint64_t> bytes_in;
+	std::atomic<uint64_t> msgs_in;
+	std::atomic<uint64_t> bytes_out;
+	std::atomic<uint64_t> msgs_out;
+	// 読まれずに捨てた量 (閉じたときに受信キューと経路の途中に残っていた分)
+	std::atomic<uint64_t> dropped;
+	// 待たない send, recv, accept が EAGAIN で返った回数
+	std::atomic<uint64_t> would_block;
+	// 直接呼び出しのスレッドが塞がって待った時間. ブローカで待った時間はコマンドの分布に入る
+	std::atomic<uint64_t> wait_ns;
+	// 受信ウィンドウを使った量の最大
+	std::atomic<uint64_t> high_water;
+
+	VirtualSocketCounters ();
+
+	// 持ち主だけが書くもの. lock 付きの加算を使わない
+	static void bump (std::atomic<uint64_t> &counter, uint64_t n)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+	static void raise (std::atomic<uint64_t> &counter, uint64_t n)
+	{
+		if (counter.load(std::memory_order_relaxed) < n) { counter.store(n, std::memory_order_relaxed); }
+	}
+
+	void clear ();
+	// 閉じたソケットの数を全体の合計へ足す
+	void add_to (VirtualSocketCounters &total) const;
+};
+
+// 以下は VirtualTcp::stats が返す写し. COM_STATS では各フィールドをこの順に、ワイヤの整数と同じく並べて送る
+
+// ip, port はソケットと同じくネットワークバイトオーダー. status は VirtualSocketStatus
+struct VirtualSocketStats
+{
+	int64_t socket;
+	uint32_t ip;
+	uint16_t port;
+	uint16_t status;
+	uint64_t bytes_in;
+	uint64_t msgs_in;
+	uint64_t bytes_out;
+	uint64_t msgs_out;
+	uint64_t dropped;
+	uint64_t would_block;
+	uint64_t wait_ns;
+	// 受信キューと経路の途中にある量、その最大、受信ウィンドウ
+	uint64_t buffered;
+	uint64_t high_water;
+	uint64_t window;
+};
+
+// コマンドごとの処理時間 (ナノ秒). ブローカが要求を読んでから応答するまで、待ちになった時間も含む
+struct VirtualCommandStats
+{
+	uint32_t command;
+	uint64_t count;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+};
+
+// ブローカのワーカーごとの数
+struct VirtualWorkerStats
+{
+	// epoll_wait から戻った回数と、接続を処理した回数、その時間
+	uint64_t wakeups;
+	uint64_t services;
+	uint64_t busy_ns;
+	// 写したときに処理中だった
+	uint32_t busy;
+};
+
+struct VirtualStats
+{
+	uint64_t sockets_live;
+	uint64_t sockets_created;
+	uint64_t connects;
+	uint64_t accepts;
+	uint64_t connections;
+	// 全ソケット (閉じたものも含む) の合計. high_water は最大
+	uint64_t bytes_in;
+	uint64_t msgs_in;
+	uint64_t bytes_out;
+	uint64_t msgs_out;
+	uint64_t dropped;
+	uint64_t would_block;
+	uint64_t wait_ns;
+	uint64_t high_water;
+	// start_capture で書き出したパケットと、リングが一杯で捨てたパケット
+	uint64_t capture_packets;
+	uint64_t capture_dropped;
+	std::vector<VirtualCommandStats> commands;
+	std::vector<VirtualWorkerStats> workers;
+	// VirtualTcp::stats で per_socket を指定したときだけ
+	std::vector<VirtualSocketStats> sockets;
+
+	VirtualStats ();
+
+	void encode (std::vector<char> &out) const;
+	bool decode (const char *buf, size_t len);
+	void clear ();
+};
+
+// 分布の p (0 から 1) の位置の値. 区間の上限を返すので、実際の値より小さくはならない
+uint64_t virtual_percentile (const std::vector<uint64_t> &counts, uint64_t max, double p);
+
+#endif // VIRTUAL_STATS_H__
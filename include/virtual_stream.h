@@ -0,0 +1,156 @@
+#ifndef VIRTUAL_STREAM_H__
+#define VIRTUAL_STREAM_H__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include "virtual_tcp.h"
+#ifdef __unix__
+#	include <sys/uio.h>
+#endif
+
+// VirtualTcp とブローカの間の制御用の通信路
+// 要求/応答はどちらもバイト列としてそのまま流す
+class VirtualStream
+{
+	public:
+		virtual ~VirtualStream () {}
+
+		// すべて送る/受け取るまで戻らない. 相手が切断したら false
+		virtual bool sendv_all (const struct iovec *iov, int iovcnt) = 0;
+		virtual bool recvv_all (const struct iovec *iov, int iovcnt) = 0;
+
+		// least バイト届くまで待ち、その時点で届いている分を len バイトまで受け取る. 相手が切断したら -1
+		// 既定では least バイトだけ受け取る. 受け取りごとにシステムコールが要る通信路は先読みする
+		virtual ssize_t recv_least (char *buf, size_t least, size_t len)
+		{
+			(void)len;
+			return recv_all(buf, least) ? (ssize_t)least : -1;
+		}
+		// 届いている分だけ受け取る. 相手が切断したら 0、何も届いていなければ -1 (errno = EAGAIN)
+		virtual ssize_t recv_some (char *buf, size_t len) = 0;
+		// 空きがある分だけ送る. 1バイトも送れなければ -1 (errno = EAGAIN)
+		virtual ssize_t sendv_some (const struct iovec *iov, int iovcnt) = 0;
+		// 受信できるか送信の空きができたら epfd が id を返すように登録する (エッジトリガ)
+		virtual void watch (int epfd, uint64_t id) = 0;
+		virtual void unwatch (int epfd) = 0;
+		// 以降の送受信を失敗させる. 別のスレッドで待っている送受信も返る
+		virtual void shutdown () = 0;
+
+		bool send_all (const char *buf, size_t len)
+		{
+			struct iovec iov = {(void *)buf, len};
+			return sendv_all(&iov, 1);
+		}
+
+		bool recv_all (char *buf, size_t len)
+		{
+			struct iovec iov = {buf, len};
+			return recvv_all(&iov, 1);
+		}
+};
+
+// ループバックの TCP 接続
+class VirtualTcpStream : public VirtualStream
+{
+	private:
+		SOCKET sock;
+
+	public:
+		explicit VirtualTcpStream (SOCKET sock_);
+		~VirtualTcpStream ();
+
+		// 繋がらなければ nullptr
+		static VirtualTcpStream *connect (const char *ip, int port);
+
+		bool sendv_all (const struct iovec *iov, int iovcnt) override;
+		bool recvv_all (const struct iovec *iov, int iovcnt) override;
+		ssize_t recv_least (char *buf, size_t least, size_t len) override;
+		ssize_t recv_some (char *buf, size_t len) override;
+		ssize_t sendv_some (const struct iovec *iov, int iovcnt) override;
+		void watch (int epfd, uint64_t id) override;
+		void unwatch (int epfd) override;
+		void shutdown () override;
+};
+
+#ifdef __linux__
+
+// 共有メモリ上の単一生産者/単一消費者のバイトリング
+// head は消費者だけが、tail は生産者だけが進める
+struct VirtualShmRing
+{
+	static const size_t SIZE = 256 * 1024;
+	static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of two");
+
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+	// 相手がドアベル(eventfd)で眠っているかどうか
+	alignas(64) std::atomic<uint32_t> reader_waiting;
+	std::atomic<uint32_t> writer_waiting;
+	alignas(64) char data[SIZE];
+};
+
+// memfd に置く、1本の VirtualTcp 接続ぶんの領域
+struct VirtualShmRegion
+{
+	static const uint32_t MAGIC = 0x76746370; // "vtcp"
+	static const uint32_t VERSION = 1;
+
+	uint32_t magic;
+	uint32_t version;
+	// client -> broker
+	VirtualShmRing request;
+	// broker -> client
+	VirtualShmRing response;
+};
+
+// eventfd の並び. data は消費者を、space は生産者を起こす
+enum VirtualShmDoorbell
+{
+	SHM_REQUEST_DATA
+	, SHM_REQUEST_SPACE
+	, SHM_RESPONSE_DATA
+	, SHM_RESPONSE_SPACE
+	, SHM_DOORBELLS
+};
+
+// 共有メモリのリング上の通信路. ハンドシェイクは Unix ドメインソケットで行い、
+// memfd と eventfd を SCM_RIGHTS で受け渡す. ハンドシェイク後のソケットは相手の死活監視にだけ使う
+class VirtualShmStream : public VirtualStream
+{
+	private:
+		int ctl;
+		VirtualShmRegion *region;
+		int doorbells[SHM_DOORBELLS];
+
+		VirtualShmRing *tx;
+		VirtualShmRing *rx;
+		int tx_data;
+		int tx_space;
+		int rx_data;
+		int rx_space;
+
+		VirtualShmStream (int ctl_, VirtualShmRegion *region_, const int *doorbells_, bool broker);
+
+		bool sleep (int fd);
+
+	public:
+		~VirtualShmStream ();
+
+		// ブローカ側: 受け付けた ctl に領域を作って渡す
+		static VirtualShmStream *accept (int ctl);
+		// クライアント側: path のブローカへ接続して領域を受け取る
+		static VirtualShmStream *connect (const std::string &path);
+
+		bool sendv_all (const struct iovec *iov, int iovcnt) override;
+		bool recvv_all (const struct iovec *iov, int iovcnt) override;
+		ssize_t recv_some (char *buf, size_t len) override;
+		ssize_t sendv_some (const struct iovec *iov, int iovcnt) override;
+		void watch (int epfd, uint64_t id) override;
+		void unwatch (int epfd) override;
+		void shutdown () override;
+};
+
+#endif // __linux__
+
+#endif // VIRTUAL_STREAM_H__
@@ -1,32 +1,45 @@
 #ifndef VIRTUAL_TCP_H__
 #define VIRTUAL_TCP_H__
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <thread>
 #include <memory>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <unordered_map>
+#include <unordered_set>
 #include <functional>
+#include <chrono>
 #ifdef __unix__
 #	include <sys/types.h>
 #	include <sys/socket.h>
 #	include <netinet/in.h>
+#	include <netinet/tcp.h>
 #	include <arpa/inet.h>
 #	include <unistd.h>
+#	include <poll.h>
+#	include <fcntl.h>
 #elif _WINDOWS
 #	include <winsock2.h>
 #	include <ws2tcpip.h>
 #else
 #	error "unknonw operation system"
 #endif
+#include "virtual_segment.h"
+#include "virtual_async.h"
+#include "virtual_link.h"
+#include "virtual_stats.h"
 
 enum VirtualSocketStatus
 {
 	VIRTUAL_SOCKET_VOID
-	, VIRTUAL_SOCKET_INITIAL
+	, VIRTUAL_SOCKET_LISTEN
 	, VIRTUAL_SOCKET_CONNECT
+	, VIRTUAL_SOCKET_CLOSED
 };
 
 enum VirtualTcpCommand: char
@@ -39,6 +52,34 @@ enum VirtualTcpCommand: char
 	, COM_SEND
 	, COM_RECV
 	, COM_CLOSE
+	, COM_SETSOCKOPT
+	, COM_POLL
+	, COM_EPOLL_CREATE
+	, COM_EPOLL_CTL
+	, COM_EPOLL_WAIT
+	, COM_EPOLL_CLOSE
+	// 以下は連合したブローカどうしのリンクで使う
+	, COM_PEER
+	, COM_ROUTE
+	, COM_FORWARD_CONNECT
+	, COM_FORWARD_SEND
+	, COM_FORWARD_ACK
+	, COM_FORWARD_CLOSE
+	// ブローカの統計の写し (VirtualTcp::stats)
+	, COM_STATS
+};
+
+// VirtualTcp がブローカとどう通信するか
+enum VirtualTcpMode
+{
+	// 同じプロセスで startup() 済みなら直接呼び出し、そうでなければブローカへ接続する
+	VIRTUAL_TCP_AUTO
+	// ソケット表を直接呼び出す (同じプロセスで startup() 済みであること)
+	, VIRTUAL_TCP_DIRECT
+	// ALTERNATIVE_IP の alternative_port のブローカへ接続する
+	, VIRTUAL_TCP_BROKER
+	// 同じホストのブローカと共有メモリのリングで通信する (Linux のみ)
+	, VIRTUAL_TCP_SHM
 };
 
 #ifdef __unix__
@@ -48,66 +89,570 @@ enum VirtualTcpCommand: char
 using VIRTUAL_SOCKET = long;
 const long INVALID_SOCKET = -1;
 
+// vpoll に渡す pollfd. events, revents は POLLIN, POLLOUT, POLLHUP, POLLNVAL
+struct VirtualPollFd
+{
+	VIRTUAL_SOCKET fd;
+	short events;
+	short revents;
+};
+
+// vepoll_ctl, vepoll_wait で使う epoll_event. events は vpoll と同じ値に VEPOLLET を足せる
+struct VirtualEpollEvent
+{
+	uint32_t events;
+	uint64_t data;
+};
+
+enum VirtualEpollOp
+{
+	VEPOLL_CTL_ADD = 1
+	, VEPOLL_CTL_DEL
+	, VEPOLL_CTL_MOD
+};
+
+// エッジトリガ. 状態が変わったときだけ報告する
+const uint32_t VEPOLLET = (uint32_t)1 << 31;
+
+class VirtualEpoll;
+class VirtualCapture;
+
+// 状態が変わったら epoll に target を知らせる
+struct VirtualEpollWatch
+{
+	std::weak_ptr<VirtualEpoll> epoll;
+	VIRTUAL_SOCKET target;
+};
+
 class VirtualSocketImpl
 {
 	public:
+		// 受信ウィンドウの既定値
 		static const size_t BUF_SIZE = 65536;
+		// SO_RCVBUF で広げられる上限. VirtualTcp::set_window_max で変えられる
+		static std::atomic<size_t> window_max;
+		// listen の backlog の上限 (Linux の somaxconn の既定値)
+		static const int MAX_BACKLOG = 4096;
 
-		std::shared_ptr<std::mutex> mtx;
+		std::mutex mtx;
+		std::condition_variable cv;
+
+		// VirtualSocketTable 上の自分のハンドル
+		VIRTUAL_SOCKET self;
 
 		unsigned long ip;
 		unsigned short port;
 
-		std::shared_ptr<VirtualSocketImpl> partner;
+		// 相手側ソケットのハンドル. 相手が閉じて再利用されても世代の不一致で弾かれる
+		// 書くのは mtx を持ったときだけで、send は mtx を取らずに読む
+		std::atomic<VIRTUAL_SOCKET> partner;
 
 		VirtualSocketStatus status;
 
-		char buffer[BUF_SIZE];
-		size_t bufend;
+		// 受信リング. 相手の send と自分の recv はここでロックを取らずに受け渡す
+		// 書き手どうしは write_mtx、読み手どうしは read_mtx で並べ、mtx は待つときと queue に触れるときだけ取る
+		// 経路を通るもの、参照で渡すもの、リングに入りきらないものは queue へ回り、queue が空になるまで続く
+		// リングに溜まっている分は常に queue の分より前
+		VirtualByteRing ring;
+		alignas(64) std::mutex write_mtx;
+		alignas(64) std::mutex read_mtx;
+		// 受信キュー. 届いたデータは参照カウント付きの領域の切片として並ぶ
+		VirtualSegmentQueue queue;
+		// queue か inflight に溜まっている. 立てるのは書き手、倒すのは読み手で、どちらも mtx を持って書く
+		std::atomic<bool> queued;
+		// 受信ウィンドウ. 相手は ring と queue にこれを超えて溜めこめない (SO_RCVBUF, window_max まで)
+		// 領域は溜まった分だけプールから取り、空になったら返すので、使わないソケットは持たない
+		std::atomic<size_t> window;
+		// status が CONNECT のあいだ立つ. リングの書き手は mtx を取らずにこれを見る
+		std::atomic<bool> connected;
+		// cv で待つスレッド、parked、watchers のどれかがある. リングを進めた側はこれが立っていれば起こす
+		// 待つ側は立ててから条件を調べ直すので、リングの進みを見落とさない. 倒すのは wake だけ
+		std::atomic<bool> attended;
+		// 経路の遅延で、書き込まれたがまだ届いていない分. 届くまで queue には入らず、ウィンドウは使う
+		// 経路を通る書き込みがあったときだけ作り、届き切ったら捨てる
+		std::unique_ptr<VirtualInflight> inflight;
+		// 送受信の数. 閉じたら VirtualTcp の合計へ足す
+		VirtualSocketCounters counters;
+
+		// LISTEN のとき、connect 済みで accept を待っているサーバ側のソケット
+		// accepts は accept_head から accept_count 個の環状バッファで、backlog 個まで必要な分だけ伸ばす
+		int backlog;
+		std::vector<VIRTUAL_SOCKET> accepts;
+		size_t accept_head;
+		size_t accept_count;
+
+		// ブローカが預けた継続. cv で待つスレッドと同じ契機で一度だけ呼ばれる
+		std::vector<std::function<void()>> parked;
+		// このソケットを見ている epoll. 自分を登録したものと、相手として送信の空きを見ているもの
+		// parked と違って起こしても外さない. epoll が破棄されたら次に起こすときに外す
+		std::vector<VirtualEpollWatch> watchers;
 
 		VirtualSocketImpl ();
 		VirtualSocketImpl (unsigned long ip_, unsigned short port_);
-		VirtualSocketImpl (const VirtualSocketImpl &obj);
+		VirtualSocketImpl (const VirtualSocketImpl &obj) = delete;
+		VirtualSocketImpl &operator= (const VirtualSocketImpl &obj) = delete;
 		~VirtualSocketImpl ();
 
-		void connect (std::shared_ptr<VirtualSocketImpl> partner_);
-		void write (const char *msg, int len);
-		bool read (char *msg, int len);
+		void reset (VIRTUAL_SOCKET self_, unsigned long ip_, unsigned short port_);
+		void bind (unsigned long ip_, unsigned short port_);
+		void connect (VIRTUAL_SOCKET partner_);
+		VIRTUAL_SOCKET peer ();
+		int write (const char *msg, int len);
+		// link を渡すと inflight に積み、届く時刻になったら arrive が queue へ移す
+		// inflight が空だったときは、その時刻を arm に入れる (呼び出し元がタイマーに登録する)
+		// from は書き込んだ側のソケットで、経路と capture の記録で使う
+		int write (const struct iovec *iov, int iovcnt, const VirtualSegmentPtr *owner = nullptr
+				, VirtualLink *link = nullptr, const VirtualSocketImpl *from = nullptr
+				, std::chrono::steady_clock::time_point *arm = nullptr, VirtualCapture *capture = nullptr);
+		// now までに届く分を queue へ移す. まだ残っていれば次の時刻を next に入れて true
+		bool arrive (std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &next);
+		// mtx を保持して呼ぶこと. 受信ウィンドウを使っている量
+		size_t buffered () const { return ring.size() + queue.size() + (inflight ? inflight->queue.size() : 0); }
+		// mtx を保持して呼ぶこと. 読める量
+		size_t available () const { return ring.size() + queue.size(); }
+		// mtx を取らずに、リングへ書ける空きがあるか/リングだけで len バイト読めるかを見る
+		// 偽でも書けない/読めないとは限らないので、そのときは mtx を取って調べ直す
+		bool writable () const { return connected && (! queued.load(std::memory_order_acquire)) && (ring.size() < window); }
+		bool readable (size_t len) const { return ring.size() >= std::min(len, window.load()); }
+		int read (char *msg, int len, bool peek);
+		int read (const struct iovec *iov, int iovcnt, bool peek);
+		int share (size_t len, std::vector<VirtualSlice> &out, bool peek);
+		void set_window (size_t window_);
+		void listen (int backlog_);
+		// mtx を保持して呼ぶこと. 待ち受け中で accept 待ちの列に空きがあれば true
+		bool acceptable () const { return (VIRTUAL_SOCKET_LISTEN == status) && (accept_count < (size_t)backlog); }
+		// mtx を保持して呼ぶこと. acceptable であること
+		void enqueue (VIRTUAL_SOCKET server);
+		// accept 待ちの先頭を取り出す. 空なら INVALID_SOCKET
+		VIRTUAL_SOCKET dequeue ();
+		// 閉じた待ち受けに残っていた分を取り出す
+		std::vector<VIRTUAL_SOCKET> take_accepts ();
+		void disconnect ();
 		void close ();
+		void notify ();
+		void watch (const std::shared_ptr<VirtualEpoll> &epoll, VIRTUAL_SOCKET target);
+		void unwatch (const VirtualEpoll *epoll, VIRTUAL_SOCKET target);
+
+		// pred が真になるまで待つ (write, read, connect, disconnect, close で起こされる)
+		// pred は mtx を保持した状態で呼ばれる. 待った時間 (ナノ秒) を返す
+		template <typename Pred>
+		uint64_t wait (Pred pred)
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			if (pred()) { return 0; }
+
+			auto begin = std::chrono::steady_clock::now();
+			while (true)
+			{
+				// 起こされると印は倒れるので、眠るたびに立ててから調べ直す
+				attended = true;
+				if (pred()) { break; }
+				cv.wait(lock);
+			}
+			return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+		}
+
+		// pred を mtx を保持した状態で一度だけ評価する
+		template <typename Pred>
+		bool check (Pred pred)
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			return pred();
+		}
+
+		// pred が偽なら resume を預けて true を返す. スレッドは塞がない
+		template <typename Pred>
+		bool park (Pred pred, const std::function<void()> &resume)
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			attended = true;
+			if (pred()) { return false; }
+
+			parked.push_back(resume);
+			return true;
+		}
+
+	private:
+		void wake (std::unique_lock<std::mutex> &lock);
+		// mtx を保持して呼ぶこと. 起こした後も起こし続ける相手が残っていれば attended を立てたままにする
+		void attend () { attended = (! parked.empty()) || (! watchers.empty()); }
+		// write_mtx を保持して呼ぶこと. 書き込んだ n バイトを capture に記録する. seq は受け取った総量
+		// capture は記録する接続のときだけ渡すこと
+		void trace (VirtualCapture *capture, const VirtualSocketImpl *from, const struct iovec *iov, int iovcnt
+				, size_t n, size_t room);
+		// write_mtx を保持して呼ぶこと. n バイトを受け取り、受信ウィンドウを used 使っている
+		void count_in (size_t n, size_t used)
+		{
+			VirtualSocketCounters::bump(counters.bytes_in, n);
+			VirtualSocketCounters::bump(counters.msgs_in, 1);
+			VirtualSocketCounters::raise(counters.high_water, used);
+		}
 };
 
+// VirtualSocketImpl を固定アドレスのチャンクに確保し、閉じたスロットを再利用する表
+// VIRTUAL_SOCKET は [0][generation:11][slot:20] で、再利用済みスロットを指す古い値は拒否される
+// 生成・参照・解放はいずれもロックを取らない. 閉じたスロットは shard ごとのフリーリストへ戻し、
+// 別の shard で生成と解放を繰り返すスレッドどうしが同じ先頭を奪い合わないようにする
+class VirtualSocketTable
+{
+	private:
+		struct Slot
+		{
+			VirtualSocketImpl sock;
+			// [generation:32][live:1][refs:31]
+			std::atomic<uint64_t> state;
+			// フリーリストの次要素 (slot + 1, 0 は終端)
+			std::atomic<uint32_t> next_free;
+			uint32_t index;
+			// 閉じたら戻すフリーリスト. 最後に生成した shard
+			uint32_t shard;
+
+			Slot () : sock(), state(0), next_free(0), index(0), shard(0) {}
+		};
+
+		// [tag:32][slot + 1:32]
+		struct alignas(64) FreeList
+		{
+			std::atomic<uint64_t> head;
+
+			FreeList () : head(0) {}
+		};
+
+		static constexpr uint64_t LiveBit = (uint64_t)1 << 31;
+		static constexpr uint64_t RefMask = LiveBit - 1;
+
+	public:
+		static constexpr unsigned int SlotBits = 20;
+		static constexpr unsigned int GenerationBits = 11;
+		static constexpr size_t MaxSlots = (size_t)1 << SlotBits;
+		static constexpr size_t ChunkSlots = 64;
+		static constexpr size_t MaxChunks = MaxSlots / ChunkSlots;
+		static constexpr size_t MaxShards = 64;
+
+		// スロットの参照を保持している間は、そのスロットは再利用されない
+		class Ref
+		{
+			private:
+				VirtualSocketTable *table;
+				Slot *slot;
+
+			public:
+				Ref () : table(nullptr), slot(nullptr) {}
+				Ref (VirtualSocketTable *table_, Slot *slot_) : table(table_), slot(slot_) {}
+				Ref (const Ref &obj) = delete;
+				Ref (Ref &&obj) : table(obj.table), slot(obj.slot) { obj.slot = nullptr; }
+				~Ref () { reset(); }
+
+				Ref &operator= (const Ref &obj) = delete;
+				Ref &operator= (Ref &&obj)
+				{
+					if (this != &obj)
+					{
+						reset();
+						table = obj.table;
+						slot = obj.slot;
+						obj.slot = nullptr;
+					}
+					return *this;
+				}
+
+				explicit operator bool () const { return nullptr != slot; }
+				VirtualSocketImpl *operator-> () const { return &(slot->sock); }
+				VirtualSocketImpl &operator* () const { return slot->sock; }
+				void reset ();
+		};
+
+		VirtualSocketTable ();
+		~VirtualSocketTable ();
+
+		// shard のフリーリストから取る. 空なら新しいスロットを使い、それも尽きたら他の shard から取る
+		VIRTUAL_SOCKET create (unsigned long ip, unsigned short port, size_t shard = 0);
+		Ref acquire (VIRTUAL_SOCKET s);
+		bool retire (VIRTUAL_SOCKET s);
+		void for_each (const std::function<void(VirtualSocketImpl &)> &fn);
+		size_t allocated () const;
+		void clear ();
+
+	private:
+		std::atomic<Slot *> chunks[MaxChunks];
+		std::atomic<uint32_t> next_slot;
+		FreeList free_lists[MaxShards];
+
+		Slot *slot_at (uint32_t idx) const;
+		bool try_ref (Slot &slot);
+		void release (Slot &slot);
+		void recycle (Slot &slot);
+		void push_free (uint32_t idx);
+		bool pop_free (size_t shard, uint32_t &idx);
+};
+
+class VirtualStream;
+class VirtualChannel;
+class VirtualChannelPool;
+class VirtualTimer;
+class VirtualPeer;
+class VirtualBroker;
+struct VirtualBrokerConnection;
+
 class VirtualTcp
 {
 	private:
-		static constexpr unsigned int PollingMs = 100;
 		static constexpr const char *ALTERNATIVE_IP = "127.0.0.1";
 		static constexpr int ALTERNATIVE_PORT = 12345;
-		static bool running;
-		static std::thread alternative_tcp_server_th;
-		static std::vector<VirtualSocketImpl> sockets;
+		// ブローカの待ち受けポート. 既定は ALTERNATIVE_PORT
+		static int alternative_port;
+		// core_* が待ちになる代わりに継続を預けたことを表す
+		static const int PARKED = -2;
+
+		static std::atomic<bool> running;
+		static SOCKET alternative_listener;
+#ifdef __linux__
+		// 共有メモリ接続のハンドシェイク用 (抽象名前空間の Unix ドメインソケット)
+		static int alternative_shm_listener;
+#endif
+		// 制御用接続をすべて受け持つ epoll のワーカー
+		static VirtualBroker broker;
+		// クライアント側. VirtualTcp はブローカへの接続をここから借りて共有する
+		static VirtualChannelPool channels;
+		static VirtualSocketTable sockets;
+		// (ip, port) -> 待ち受けソケット. bind/listen/accept で登録し close で外す
+		// 待ち受けになったソケットは cv で connect 側へ知らせる
+		// ip:port のハッシュで shard に分け、別の宛先への connect と listen どうしはロックを奪い合わない
+		struct alignas(64) ListenShard
+		{
+			std::mutex mtx;
+			std::condition_variable cv;
+			std::unordered_map<uint64_t, VIRTUAL_SOCKET> listeners;
+			// 接続先の listen を待っている connect の継続
+			std::vector<std::function<void()>> parked;
+			// 連合した他のブローカで待ち受けているアドレスと、そこへのリンク. listeners の方を優先する
+			std::unordered_map<uint64_t, std::shared_ptr<VirtualPeer>> routes;
+		};
+		static ListenShard shards[VirtualSocketTable::MaxShards];
+		// 使う shard の数. startup で決める
+		static size_t nshards;
 		static std::unordered_map<VirtualTcpCommand
-			, std::function<void(SOCKET, const char *)>> services;
+			, std::function<bool(VirtualBrokerConnection &, char *)>> services;
+		// ブローカで待ちになった vpoll, vepoll_wait のタイムアウト
+		static VirtualTimer timer;
+		// vepoll_create で作った epoll
+		static std::mutex epoll_mtx;
+		static std::unordered_map<int, std::shared_ptr<VirtualEpoll>> epolls;
+		static int next_epoll;
 
-		SOCKET alternative_server;
+		// 連合の中でこのブローカを表す id. startup で乱数から決める
+		static uint32_t broker_id;
+		// 他のブローカへ張ったリンク. 切れたものも cleanup まで残す
+		static std::mutex peer_mtx;
+		static std::vector<std::shared_ptr<VirtualPeer>> peers;
+		static std::atomic<size_t> npeers;
+		// 他のブローカと中継している接続. どちらの側も自分のブローカに中継用のソケット (stub) を作り、
+		// 手元の相手と stub を繋いで、stub に届いたデータをリンクで送る
+		// 送ったデータは相手が書き込み終えて COM_FORWARD_ACK を返すまで次を送らない
+		struct Forward
+		{
+			// 接続を始めたブローカの id と、そこでの stub
+			uint32_t origin;
+			uint32_t id;
+			VIRTUAL_SOCKET stub;
+			std::shared_ptr<VirtualPeer> peer;
+		};
+		// 一度に転送する量の上限
+		static const size_t FORWARD_CHUNK = 256 * 1024;
+		static std::mutex forward_mtx;
+		// [origin:32][id:32] -> 中継
+		static std::unordered_map<uint64_t, std::shared_ptr<Forward>> forwards;
+
+		// set_link で設定した経路. 新しいものが先. send ごとに読むので、変えるときは丸ごと差し替える
+		static std::mutex link_mtx;
+		static std::shared_ptr<const std::vector<std::shared_ptr<VirtualLink>>> links;
+		// 経路が1つもなければ send は links を見ない
+		static std::atomic<bool> any_links;
+
+		// 閉じたソケットの数の合計. 生きているソケットの数は stats で写すときに足す
+		static VirtualSocketCounters retired;
+		static std::atomic<uint64_t> sockets_created;
+		static std::atomic<uint64_t> connects;
+		static std::atomic<uint64_t> accepts;
+		// ブローカが要求を読んでから応答するまでの時間. コマンドごと
+		static VirtualHistogram latency[COM_STATS + 1];
+
+		// start_capture で開いた書き出し先. 条件は VirtualCaptureFilter を詰めたもので、合わない send は capture に触れない
+		// 記録する send は capture_users を上げてから capture を読み、stop_capture は外してから capture_users が 0 になるのを待つ
+		// (shared_ptr の atomic_load はロックを取るので、send ごとには使わない)
+		static std::mutex capture_mtx;
+		static std::atomic<VirtualCapture *> capture;
+		static std::atomic<uint64_t> capture_users;
+		static std::atomic<bool> capturing;
+		static std::atomic<uint64_t> capture_filter;
+
+		// 応答を待たずに返した send. 同じソケットの次の send か close で結果を受け取る
+		struct PendingSend
+		{
+			bool busy;
+			bool pending;
+			uint32_t request;
+			// request を送った接続
+			std::shared_ptr<VirtualChannel> channel;
+		};
+
+		bool direct;
+		// プールから借りている接続と、借りる先 (共有メモリか, ブローカのポート)
+		std::mutex server_mtx;
+		std::shared_ptr<VirtualChannel> alternative_server;
+		uint64_t server_key;
+		std::mutex sends_mtx;
+		std::condition_variable sends_cv;
+		std::unordered_map<VIRTUAL_SOCKET, PendingSend> sends;
+		// O_NONBLOCK にしたソケット. 待たない設定はこの VirtualTcp から呼んだときだけ効く
+		std::mutex nonblocking_mtx;
+		std::unordered_set<VIRTUAL_SOCKET> nonblocking;
+		std::atomic<bool> any_nonblocking;
+		VirtualExecutor executor;
 		std::string virtual_addr;
 		int virtual_port;
 
-		static void alternative_tcp_server_fn ();
-		static void alternative_tcp_server_service_fn (SOCKET sock);
-		static void serve_socket (SOCKET sock, const char*com);
-		static void serve_connect (SOCKET sock, const char*com);
-		static void serve_bind (SOCKET sock, const char*com);
-		static void serve_listen (SOCKET sock, const char*com);
-		static void serve_accept (SOCKET sock, const char*com);
-		static void serve_recv (SOCKET sock, const char*com);
-		static void serve_send (SOCKET sock, const char*com);
-		static void serve_close (SOCKET sock, const char*com);
+		static uint64_t listener_key (unsigned long ip, unsigned short port);
+		static size_t shard_of (unsigned long ip, unsigned short port);
+		static bool register_listener (VirtualSocketImpl &vsock);
+		static void unregister_listener (VirtualSocketImpl &vsock);
+
+		// ブローカの処理本体. serve_* と直接モードの v* から呼ばれる
+		static VIRTUAL_SOCKET core_socket (unsigned long ip, unsigned short port);
+		// resume を渡すと、待つ代わりにそれを預けて PARKED を返す (ブローカ用)
+		// flags に MSG_DONTWAIT があれば待たずに失敗する
+		static int core_connect (VIRTUAL_SOCKET s, unsigned long ip, unsigned short port, int flags = 0
+				, const std::function<void()> &resume = nullptr);
+		static int core_bind (VIRTUAL_SOCKET s, unsigned long ip, unsigned short port);
+		static int core_listen (VIRTUAL_SOCKET s, int backlog);
+		static VIRTUAL_SOCKET core_accept (VIRTUAL_SOCKET s, unsigned long &ip, unsigned short &port, int flags = 0
+				, const std::function<void()> &resume = nullptr);
+		static int core_send (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags
+				, const std::function<void()> &resume = nullptr, const VirtualSegmentPtr *owner = nullptr);
+		static int core_recv_wait (VirtualSocketImpl &vsock, size_t len, int flags
+				, const std::function<void()> &resume);
+		static int core_recv (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags
+				, const std::function<void()> &resume = nullptr);
+		static int core_recv (VIRTUAL_SOCKET s, size_t len, int flags, std::vector<VirtualSlice> &out
+				, const std::function<void()> &resume = nullptr);
+		static int core_close (VIRTUAL_SOCKET s);
+		static int core_setsockopt (VIRTUAL_SOCKET s, int level, int optname, int value);
+		// s の今の状態のうち events で聞かれたもの (POLLHUP, POLLNVAL は常に返す)
+		// epoll を渡すと、以降の状態の変化をそこへ知らせるように登録する
+		static short core_readiness (VIRTUAL_SOCKET s, short events
+				, const std::shared_ptr<VirtualEpoll> &epoll = nullptr);
+		// deadline は steady_clock の時刻. 待たずに調べるだけなら現在より前を渡す
+		static int core_poll (VirtualPollFd *fds, unsigned long nfds
+				, std::chrono::steady_clock::time_point deadline, const std::function<void()> &resume = nullptr);
+		static int core_epoll_create ();
+		static int core_epoll_ctl (int epfd, int op, VIRTUAL_SOCKET s, const VirtualEpollEvent *event);
+		static int core_epoll_wait (int epfd, VirtualEpollEvent *events, int maxevents
+				, std::chrono::steady_clock::time_point deadline, const std::function<void()> &resume = nullptr);
+		static int core_epoll_close (int epfd);
+		static std::shared_ptr<VirtualEpoll> find_epoll (int epfd);
+		static void wake_listeners (ListenShard &shard);
+		static void core_stats (VirtualStats &out, bool per_socket);
+
+		// src から dst への経路. なければ nullptr
+		static std::shared_ptr<VirtualLink> find_link (unsigned long src, unsigned long dst);
+		// タイマーから呼ばれ、s の経路の途中で届く時刻になった分を受信キューへ移す
+		static void arrive (VIRTUAL_SOCKET s);
+
+		// 連合. peer_link は host:port へのリンクを探し、なければ張る
+		static std::shared_ptr<VirtualPeer> peer_link (const std::string &host, int port);
+		static std::shared_ptr<VirtualPeer> find_peer (uint32_t id);
+		static void peer_broken (VirtualPeer &peer);
+		// 自分の待ち受けをすべて peer へ知らせる
+		static void announce_all (VirtualPeer &peer);
+		// shard の mtx を保持して呼ぶこと
+		static void announce (unsigned long ip, unsigned short port, bool add);
+		static int forward_connect (VirtualSocketImpl &vsock, const std::shared_ptr<VirtualPeer> &peer
+				, unsigned long ip, unsigned short port);
+		static void forward_accept (const std::shared_ptr<Forward> &fw, unsigned long ip, unsigned short port);
+		static void forward_pump (const std::shared_ptr<Forward> &fw);
+		static void forward_deliver (const std::shared_ptr<Forward> &fw, const std::shared_ptr<VirtualSlice> &data
+				, size_t offset);
+		static std::shared_ptr<Forward> find_forward (uint32_t origin, uint32_t id);
+		// tell なら相手にも閉じさせる. 既に外れていれば何もしない
+		static void forward_drop (const std::shared_ptr<Forward> &fw, bool tell);
+
+#ifdef __linux__
+		static std::string alternative_shm_path (int port);
+#endif
+		static bool serve_frames (VirtualBrokerConnection &conn);
+		static bool serve_frame (VirtualBrokerConnection &conn, char *frame);
+		// 処理し終えた要求の時間を数える
+		static void served (const char *frame, std::chrono::steady_clock::time_point started
+				, std::chrono::steady_clock::time_point now);
+		static void reply (VirtualBrokerConnection &conn, const char *frame
+				, int32_t result, const char *body = nullptr, size_t len = 0, int err = 0
+				, const std::vector<VirtualSlice> *slices = nullptr);
+		static bool serve_socket (VirtualBrokerConnection &conn, char *com);
+		static bool serve_connect (VirtualBrokerConnection &conn, char *com);
+		static bool serve_bind (VirtualBrokerConnection &conn, char *com);
+		static bool serve_listen (VirtualBrokerConnection &conn, char *com);
+		static bool serve_accept (VirtualBrokerConnection &conn, char *com);
+		static bool serve_recv (VirtualBrokerConnection &conn, char *com);
+		static bool serve_send (VirtualBrokerConnection &conn, char *com);
+		static bool serve_close (VirtualBrokerConnection &conn, char *com);
+		static bool serve_setsockopt (VirtualBrokerConnection &conn, char *com);
+		static bool serve_poll (VirtualBrokerConnection &conn, char *com);
+		static bool serve_epoll_create (VirtualBrokerConnection &conn, char *com);
+		static bool serve_epoll_ctl (VirtualBrokerConnection &conn, char *com);
+		static bool serve_epoll_wait (VirtualBrokerConnection &conn, char *com);
+		static bool serve_epoll_close (VirtualBrokerConnection &conn, char *com);
+		static bool serve_peer (VirtualBrokerConnection &conn, char *com);
+		static bool serve_route (VirtualBrokerConnection &conn, char *com);
+		static bool serve_forward_connect (VirtualBrokerConnection &conn, char *com);
+		static bool serve_forward_send (VirtualBrokerConnection &conn, char *com);
+		static bool serve_forward_ack (VirtualBrokerConnection &conn, char *com);
+		static bool serve_forward_close (VirtualBrokerConnection &conn, char *com);
+		static bool serve_stats (VirtualBrokerConnection &conn, char *com);
+
+		// 借りている接続. 切れていればプールから借り直す. ブローカへ繋がらなければ nullptr
+		std::shared_ptr<VirtualChannel> server ();
+		// server_key のブローカへ新しく繋ぐ. channels が接続を増やすときに呼ぶ
+		static VirtualStream *connect_server (uint64_t key);
+		int finish_send (PendingSend &ps);
+		bool is_nonblocking (VIRTUAL_SOCKET s);
+
+		// 直接呼び出しの async_* の1回分の試行. 結果か、継続を預けたら PARKED を返す
+		using AsyncStep = std::function<long(const std::function<void()> &)>;
+		// 待ちになったら試行を継続としてソケットに預け、起こされたら同じスレッドでもう一度試す
+		static void async_run (const std::shared_ptr<AsyncStep> &step, const std::shared_ptr<VirtualAsync::State> &state);
+		// ブローカ経由の async_send. 1フレームに入らない分は前のフレームの完了を待って続きを送る
+		static void async_send_frame (VirtualChannel *channel, VIRTUAL_SOCKET s, const char *buf, int len, int flags
+				, int sent, const std::shared_ptr<VirtualAsync::State> &state);
 
 	public:
-		static int startup ();
+		// shards は待ち受けの表とソケットのフリーリストを分ける数. 0 ならコア数
+		static int startup (size_t shards_ = 0);
 		static int cleanup ();
+		// SO_RCVBUF で指定できる受信ウィンドウの上限を変える. ブローカのプロセスで呼ぶこと
+		static void set_window_max (size_t max);
+		// ブローカの待ち受けポートを変える. 同じホストで複数のブローカを動かすときに使う
+		// ブローカは startup の前に、クライアントは VirtualTcp を作る前に呼ぶこと
+		static void set_alternative_port (int port);
+		// host:port のブローカと連合する. 互いの待ち受けを知らせ合い、相手で待ち受けているアドレスへの
+		// connect は相手のブローカへ中継する. 相手が知っている他のブローカとも順に繋がる
+		// 相手へ繋がらなければ -1
+		static int federate (const std::string &host, int port);
+		// src と dst のアドレス範囲 ("10.0.0.0/8", "10.0.0.1" など) の間の経路に遅延、帯域、損失を与える
+		// どちらの向きの send にも効き、重なるときは後から設定したものを使う. ブローカのプロセスで呼ぶこと
+		// 範囲を読めなければ -1
+		static int set_link (const std::string &src, const std::string &dst, const VirtualLinkProfile &profile);
+		// 設定した経路をすべて外す. 既に経路の途中にあるデータはそのまま届く
+		static void clear_links ();
+		// 以降の send を path へ pcap (IPv4/TCP) で書き出す. ブローカのプロセスで呼ぶこと
+		// filter は "10.0.0.0/8", "10.0.0.1:80", ":80" のいずれかで、どちらかの端が合う接続だけを記録する
+		// snaplen はヘッダ 40 バイトを含めて1パケットに残す長さ. filter を読めないか開けなければ -1
+		static int start_capture (const std::string &path, const std::string &filter = "", size_t snaplen = 65535);
+		// 記録し残した分を書き出して閉じる
+		static void stop_capture ();
 
-		VirtualTcp (const std::string virtual_addr_, int virtual_port_);
+		VirtualTcp (const std::string virtual_addr_, int virtual_port_
+				, VirtualTcpMode mode = VIRTUAL_TCP_AUTO);
 		~VirtualTcp ();
 
 		VIRTUAL_SOCKET vsocket (int af, int type, int protocol);
@@ -117,7 +662,41 @@ class VirtualTcp
 		VIRTUAL_SOCKET vaccept (VIRTUAL_SOCKET s, sockaddr *addr, unsigned int *addrlen);
 		int vsend (VIRTUAL_SOCKET s, const char *buf, int len, int flags);
 		int vrecv (VIRTUAL_SOCKET s, char *buf, int len, int flags);
+		// 複数の領域をまとめて1回の send/recv として扱う
+		int vsendv (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags);
+		int vrecvv (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags);
 		int vclosesocket (VIRTUAL_SOCKET s);
+		int vsetsockopt (VIRTUAL_SOCKET s, int level, int optname, const char *optval, int optlen);
+
+		// poll と同じく、準備のできたソケットの数を返す. timeout はミリ秒で、負なら無期限に待つ
+		// 接続中のソケットは受信キューにデータがあれば POLLIN、相手の受信ウィンドウに空きがあれば POLLOUT
+		// 待ち受けは accept 待ちがあれば POLLIN、相手が切断したら POLLIN | POLLHUP
+		int vpoll (VirtualPollFd *fds, unsigned long nfds, int timeout);
+		// epoll と同じく、登録したソケットのうち状態が変わったものだけを調べる
+		// 閉じたソケットは自動的に外れる
+		int vepoll_create ();
+		int vepoll_ctl (int epfd, int op, VIRTUAL_SOCKET fd, VirtualEpollEvent *event);
+		int vepoll_wait (int epfd, VirtualEpollEvent *events, int maxevents, int timeout);
+		int vepoll_close (int epfd);
+
+		// F_GETFL と F_SETFL の O_NONBLOCK だけを扱う
+		// O_NONBLOCK のソケットの vaccept, vconnect, vsend, vrecv は待つ代わりに -1 (errno = EAGAIN) を返す
+		// vconnect は宛先が listen していなければ ECONNREFUSED
+		int vfcntl (VIRTUAL_SOCKET s, int cmd, int arg = 0);
+
+		// ブローカの統計を写す. per_socket なら生きているソケットごとの数も入れる
+		// ソケットの数は relaxed に数えているので、同時に動いている送受信の分は前後することがある
+		int stats (VirtualStats &out, bool per_socket = false);
+
+		// async_* の完了を渡す先. 既定では完了させたスレッド (ブローカの応答を読んだスレッドなど) でそのまま呼ぶ
+		void set_executor (const VirtualExecutor &executor_);
+		// 同期版と同じことを、呼び出し元のスレッドを待たせずに行う. O_NONBLOCK は見ない
+		// buf, addr, addrlen は完了するまで保持すること. 同じソケットの async_send は前の完了を待ってから呼ぶこと
+		VirtualAsync async_connect (VIRTUAL_SOCKET s, const sockaddr *name, int namelen);
+		VirtualAsync async_accept (VIRTUAL_SOCKET s, sockaddr *addr, unsigned int *addrlen);
+		// len をすべて書き込んだら完了する (MSG_DONTWAIT なら書き込めた分で完了する)
+		VirtualAsync async_send (VIRTUAL_SOCKET s, const char *buf, int len, int flags);
+		VirtualAsync async_recv (VIRTUAL_SOCKET s, char *buf, int len, int flags);
 };
 
 #endif // VIRTUAL_TCP_H__
@@ -0,0 +1,71 @@
+#ifndef VIRTUAL_TIMER_H__
+#define VIRTUAL_TIMER_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 期限が来たら関数を呼ぶ. ブローカで待ちになった要求のタイムアウトと、経路の遅延の再現に使う
+// 関数は専用のスレッドからロックを外して呼ぶので、ブローカの継続をそのまま渡せる
+//
+// 期限は TICK 刻みの階層化タイマーホイールに置く. 登録も発火も数に依らず一定の手間で、
+// 次の期限までは眠るので、遅延のある経路が何万あっても空回りしない
+class VirtualTimer
+{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+		// 分解能. 期限はこれに切り上げて発火する
+		static constexpr std::chrono::microseconds TICK = std::chrono::microseconds(100);
+		static const unsigned int SLOT_BITS = 8;
+		static const size_t SLOTS = (size_t)1 << SLOT_BITS;
+		// 4段で 100us * 2^32 (約5日) まで. それより先は最上段に置いて回ってくるたびに置き直す
+		static const int LEVELS = 4;
+
+		VirtualTimer ();
+		VirtualTimer (const VirtualTimer &obj) = delete;
+		VirtualTimer &operator= (const VirtualTimer &obj) = delete;
+		~VirtualTimer ();
+
+		void start ();
+		// 残っている関数は呼ばずに捨てる
+		void stop ();
+
+		void schedule (Clock::time_point when, const std::function<void()> &fn);
+
+	private:
+		struct Entry
+		{
+			uint64_t tick;
+			std::function<void()> fn;
+		};
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<Entry> wheel[LEVELS][SLOTS];
+		// 空でない枠の印
+		uint64_t occupied[LEVELS][SLOTS / 64];
+		size_t count;
+		// 時刻 0 の tick と、次に処理する tick
+		Clock::time_point origin;
+		uint64_t current;
+		// スレッドが眠っている間に起きる予定の tick. これより早い期限が来たら起こす
+		uint64_t wake_tick;
+		bool running;
+		std::thread thread;
+
+		uint64_t tick_of (Clock::time_point when) const;
+		void insert (Entry &&entry);
+		void clear ();
+		// current を1つ進める. 段の境目なら上の段を下ろし、期限の来た関数を due に移す
+		void advance (std::vector<std::function<void()>> &due);
+		// current から見て最初に処理の要る tick (枠が空でないか、段の境目)
+		uint64_t next_tick () const;
+		void thread_fn ();
+};
+
+#endif // VIRTUAL_TIMER_H__
@@ -1,12 +1,24 @@
 #include <iostream>
 #include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include "virtual_tcp.h"
+#include "virtual_channel_pool.h"
 
 
-void server_fn ()
+void server_fn (VirtualTcpMode mode)
 {
-	VirtualTcp vtcp("192.168.3.51", 501);
+	VirtualTcp vtcp("192.168.3.51", 501, mode);
 
 	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
 
@@ -33,11 +45,12 @@ void server_fn ()
 	vtcp.vsend(vsock, "bye.", 4, 0);
 
 	vtcp.vclosesocket(vsock);
+	vtcp.vclosesocket(vsock0);
 }
 
-void client_fn ()
+void client_fn (VirtualTcpMode mode)
 {
-	VirtualTcp vtcp("192.168.3.56", 501);
+	VirtualTcp vtcp("192.168.3.56", 501, mode);
 
 	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
 
@@ -62,17 +75,1484 @@ void client_fn ()
 	std::cout << "RECV: " << msg << std::endl;
 }
 
+// addr:port で待ち受けた vsock0 と、そこへ繋いだ client、accept した server を作る. 繋がれば true
+static bool connect_pair (VirtualTcp &vtcp, const char *addr_, unsigned short port
+		, VIRTUAL_SOCKET &vsock0, VIRTUAL_SOCKET &client, VIRTUAL_SOCKET &server)
+{
+	vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = inet_addr(addr_);
+	bool ok = (0 == vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr)));
+	ok = (0 == vtcp.vlisten(vsock0, 5)) && ok;
+
+	server = INVALID_SOCKET;
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in peer;
+				unsigned int len = sizeof(peer);
+				server = vtcp.vaccept(vsock0, (struct sockaddr *)&peer, &len);
+			});
+	client = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	ok = (0 == vtcp.vconnect(client, (struct sockaddr *)&addr, sizeof(addr))) && ok;
+	server_th.join();
+
+	return (INVALID_SOCKET != server) && ok;
+}
+
+// 閉じたソケットのスロットは再利用され、古いハンドルは拒否される
+bool churn_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.3.57", 502, mode);
+
+	VIRTUAL_SOCKET first = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	vtcp.vclosesocket(first);
+
+	for (int i = 0; i < 1000; ++i)
+	{
+		VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		if ((INVALID_SOCKET == vsock) || (first == vsock)) { return false; }
+		vtcp.vclosesocket(vsock);
+	}
+
+	char msg[4];
+	bool ok = (-1 == vtcp.vrecv(first, msg, sizeof(msg), 0));
+	std::cout << "CHURN: " << (ok ? "ok" : "stale handle accepted") << std::endl;
+	return ok;
+}
+
+// 多数の接続が同時に accept/recv で待っても、ブローカのワーカーは塞がらない
+bool crowd_fn (VirtualTcpMode mode)
+{
+	const int pairs = 64;
+	std::atomic<int> echoed(0);
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < pairs; ++i)
+	{
+		unsigned short port = (unsigned short)(1000 + i);
+
+		threads.emplace_back([mode, port]()
+				{
+					VirtualTcp vtcp("192.168.4.1", port, mode);
+					VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+
+					struct sockaddr_in addr;
+					addr.sin_family = AF_INET;
+					addr.sin_port = htons(port);
+					addr.sin_addr.s_addr = INADDR_ANY;
+					vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+					vtcp.vlisten(vsock0, 5);
+
+					struct sockaddr_in client;
+					unsigned int len = sizeof(client);
+					VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+
+					char msg[4];
+					vtcp.vrecv(vsock, msg, sizeof(msg), 0);
+					vtcp.vsend(vsock, msg, sizeof(msg), 0);
+					vtcp.vclosesocket(vsock);
+					vtcp.vclosesocket(vsock0);
+				});
+		threads.emplace_back([mode, port, &echoed]()
+				{
+					VirtualTcp vtcp("192.168.4.2", port, mode);
+					VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+
+					struct sockaddr_in server;
+					server.sin_family = AF_INET;
+					server.sin_port = htons(port);
+					server.sin_addr.s_addr = inet_addr("192.168.4.1");
+					vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+
+					char msg[4] = {'p', 'i', 'n', 'g'};
+					vtcp.vsend(vsock, msg, sizeof(msg), 0);
+					memset(msg, '\0', sizeof(msg));
+					if ((4 == vtcp.vrecv(vsock, msg, sizeof(msg), 0)) && (0 == memcmp(msg, "ping", 4)))
+					{
+						++echoed;
+					}
+					vtcp.vclosesocket(vsock);
+				});
+	}
+
+	for (auto &th : threads) { th.join(); }
+
+	bool ok = (pairs == echoed);
+	std::cout << "CROWD: " << (ok ? "ok" : "lost echoes") << std::endl;
+	return ok;
+}
+
+// 1つの VirtualTcp を複数スレッドで共有し、recv で待っている間も他の要求が進む
+bool mux_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.5.1", 700, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(700);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	std::atomic<bool> receiving(false);
+	char got[4];
+	memset(got, '\0', sizeof(got));
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+
+				receiving = true;
+				vtcp.vrecv(vsock, got, sizeof(got), 0);
+				vtcp.vclosesocket(vsock);
+			});
+
+	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(700);
+	server.sin_addr.s_addr = inet_addr("192.168.5.1");
+	vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+
+	// 相手の recv がブローカで待ちになってから、同じ接続で別の要求を流す
+	while (! receiving) { std::this_thread::yield(); }
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+	bool ok = true;
+	for (int i = 0; i < 100; ++i)
+	{
+		VIRTUAL_SOCKET other = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		ok = (INVALID_SOCKET != other) && ok;
+		vtcp.vclosesocket(other);
+	}
+
+	vtcp.vsend(vsock, "pong", 4, 0);
+	server_th.join();
+	vtcp.vclosesocket(vsock);
+	vtcp.vclosesocket(vsock0);
+
+	ok = ok && (0 == memcmp(got, "pong", 4));
+	std::cout << "MUX: " << (ok ? "ok" : "blocked") << std::endl;
+	return ok;
+}
+
+// 届いた分だけ返す recv と MSG_DONTWAIT, MSG_PEEK, MSG_WAITALL
+bool flags_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.6.1", 800, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(800);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	VIRTUAL_SOCKET server = INVALID_SOCKET;
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+			});
+
+	VIRTUAL_SOCKET client = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in peer;
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(800);
+	peer.sin_addr.s_addr = inet_addr("192.168.6.1");
+	vtcp.vconnect(client, (struct sockaddr *)&peer, sizeof(peer));
+	server_th.join();
+
+	bool ok = true;
+	char msg[64];
+
+	// 何も届いていなければ待たずに EAGAIN
+	errno = 0;
+	ok = (-1 == vtcp.vrecv(server, msg, sizeof(msg), MSG_DONTWAIT)) && (EAGAIN == errno) && ok;
+
+	// 覗いても消費しない. 既定の recv は届いている分だけ返す
+	vtcp.vsend(client, "abcdef", 6, 0);
+	memset(msg, '\0', sizeof(msg));
+	ok = (4 == vtcp.vrecv(server, msg, 4, MSG_PEEK)) && (0 == memcmp(msg, "abcd", 4)) && ok;
+	memset(msg, '\0', sizeof(msg));
+	ok = (6 == vtcp.vrecv(server, msg, sizeof(msg), 0)) && (0 == memcmp(msg, "abcdef", 6)) && ok;
+
+	// MSG_WAITALL は分けて届いた分を揃えて返す
+	std::thread sender_th([&]()
+			{
+				vtcp.vsend(client, "gh", 2, 0);
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+				vtcp.vsend(client, "ij", 2, 0);
+			});
+	memset(msg, '\0', sizeof(msg));
+	ok = (4 == vtcp.vrecv(server, msg, 4, MSG_WAITALL)) && (0 == memcmp(msg, "ghij", 4)) && ok;
+	sender_th.join();
+
+	// 相手が閉じた後は 0
+	vtcp.vclosesocket(client);
+	ok = (0 == vtcp.vrecv(server, msg, sizeof(msg), 0)) && ok;
+	vtcp.vclosesocket(server);
+	vtcp.vclosesocket(vsock0);
+
+	std::cout << "FLAGS: " << (ok ? "ok" : "wrong recv semantics") << std::endl;
+	return ok;
+}
+
+// 受信ウィンドウを超える send は待たされ、遅い受け手でも欠けずに順番どおり届く
+bool bulk_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.7.1", 900, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(900);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	VIRTUAL_SOCKET server = INVALID_SOCKET;
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+			});
+
+	VIRTUAL_SOCKET client = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in peer;
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(900);
+	peer.sin_addr.s_addr = inet_addr("192.168.7.1");
+	vtcp.vconnect(client, (struct sockaddr *)&peer, sizeof(peer));
+	server_th.join();
+
+	bool ok = true;
+
+	// ウィンドウに入る分だけ書き込み、一杯なら EAGAIN
+	int window = 4096;
+	vtcp.vsetsockopt(server, SOL_SOCKET, SO_RCVBUF, (const char *)&window, sizeof(window));
+	std::vector<char> chunk(200000);
+	ok = (window == vtcp.vsend(client, chunk.data(), 2 * window, MSG_DONTWAIT)) && ok;
+	errno = 0;
+	ok = (-1 == vtcp.vsend(client, chunk.data(), 1, MSG_DONTWAIT)) && (EAGAIN == errno) && ok;
+	ok = (window == vtcp.vrecv(server, chunk.data(), window, MSG_WAITALL)) && ok;
+
+	// 65535 バイトを超える send を、小さく読んでは休む受け手へ流す
+	const size_t total = 1 << 20;
+	bool sent = true;
+	std::thread sender_th([&]()
+			{
+				std::vector<char> data(chunk.size());
+				for (size_t pos = 0; pos < total; pos += data.size())
+				{
+					size_t n = std::min(data.size(), total - pos);
+					for (size_t i = 0; i < n; ++i) { data[i] = (char)((pos + i) * 7 + (pos + i) / 251); }
+					if ((int)n != vtcp.vsend(client, data.data(), (int)n, 0)) { sent = false; }
+				}
+				vtcp.vclosesocket(client);
+			});
+
+	size_t got = 0;
+	char msg[1000];
+	for (int reads = 0; ; ++reads)
+	{
+		int n = vtcp.vrecv(server, msg, sizeof(msg), 0);
+		if (n <= 0) { break; }
+
+		for (int i = 0; i < n; ++i)
+		{
+			if (msg[i] != (char)((got + i) * 7 + (got + i) / 251)) { ok = false; }
+		}
+		got += n;
+
+		if (0 == reads % 100) { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+	}
+	sender_th.join();
+	vtcp.vclosesocket(server);
+	vtcp.vclosesocket(vsock0);
+
+	ok = sent && (total == got) && ok;
+	std::cout << "BULK: " << (ok ? "ok" : "corrupted stream") << std::endl;
+	return ok;
+}
+
+// vsendv で分けた部分は1つの send として届き、vrecvv で複数の領域へ分けて受け取れる
+bool gather_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.8.1", 950, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(950);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	VIRTUAL_SOCKET server = INVALID_SOCKET;
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+			});
+
+	VIRTUAL_SOCKET client = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in peer;
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(950);
+	peer.sin_addr.s_addr = inet_addr("192.168.8.1");
+	vtcp.vconnect(client, (struct sockaddr *)&peer, sizeof(peer));
+	server_th.join();
+
+	bool ok = true;
+
+	char head[4] = {'H', 'D', 'R', ':'};
+	char body[] = "payload";
+	struct iovec out[3] = {{head, 4}, {nullptr, 0}, {body, 7}};
+	ok = (11 == vtcp.vsendv(client, out, 3, 0)) && ok;
+
+	char rhead[4];
+	char rbody[16];
+	memset(rbody, '\0', sizeof(rbody));
+	struct iovec in[2] = {{rhead, 4}, {rbody, 7}};
+	ok = (11 == vtcp.vrecvv(server, in, 2, MSG_WAITALL)) && ok;
+	ok = (0 == memcmp(rhead, "HDR:", 4)) && (0 == memcmp(rbody, "payload", 7)) && ok;
+
+	// iovec は IOV_MAX 個まで渡せる. 負の数や IOV_MAX を超える数は EINVAL
+	std::vector<char> bytes(IOV_MAX);
+	std::vector<char> received(IOV_MAX);
+	std::vector<struct iovec> many(IOV_MAX + 1);
+	std::vector<struct iovec> into(IOV_MAX);
+	for (int i = 0; i < IOV_MAX; ++i)
+	{
+		bytes[i] = (char)i;
+		many[i] = {&(bytes[i]), 1};
+		into[i] = {&(received[i]), 1};
+	}
+	many[IOV_MAX] = many[0];
+	for (int bad : {-1, IOV_MAX + 1})
+	{
+		errno = 0;
+		ok = (-1 == vtcp.vsendv(client, many.data(), bad, 0)) && (EINVAL == errno) && ok;
+		errno = 0;
+		ok = (-1 == vtcp.vrecvv(server, many.data(), bad, 0)) && (EINVAL == errno) && ok;
+	}
+	ok = (IOV_MAX == vtcp.vsendv(client, many.data(), IOV_MAX, 0)) && ok;
+	ok = (IOV_MAX == vtcp.vrecvv(server, into.data(), IOV_MAX, MSG_WAITALL)) && (bytes == received) && ok;
+
+	vtcp.vclosesocket(client);
+	vtcp.vclosesocket(server);
+	vtcp.vclosesocket(vsock0);
+
+	std::cout << "GATHER: " << (ok ? "ok" : "wrong vectored io") << std::endl;
+	return ok;
+}
+
+// SO_RCVBUF で既定の 64KB より広げたウィンドウには、受け手が読まなくてもその分まで溜まる
+bool window_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.9.1", 960, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(960);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 5);
+
+	VIRTUAL_SOCKET server = INVALID_SOCKET;
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+			});
+
+	VIRTUAL_SOCKET client = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in peer;
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(960);
+	peer.sin_addr.s_addr = inet_addr("192.168.9.1");
+	vtcp.vconnect(client, (struct sockaddr *)&peer, sizeof(peer));
+	server_th.join();
+
+	bool ok = true;
+
+	int window = 1 << 20;
+	ok = (0 == vtcp.vsetsockopt(server, SOL_SOCKET, SO_RCVBUF, (const char *)&window, sizeof(window))) && ok;
+
+	std::vector<char> data(window);
+	for (size_t i = 0; i < data.size(); ++i) { data[i] = (char)(i * 13 + i / 509); }
+	ok = (window == vtcp.vsend(client, data.data(), window, MSG_DONTWAIT)) && ok;
+
+	std::vector<char> got(window);
+	ok = (window == vtcp.vrecv(server, got.data(), window, MSG_WAITALL)) && (data == got) && ok;
+
+	vtcp.vclosesocket(client);
+	vtcp.vclosesocket(server);
+	vtcp.vclosesocket(vsock0);
+
+	std::cout << "WINDOW: " << (ok ? "ok" : "window not widened") << std::endl;
+	return ok;
+}
+
+// 多数のクライアントが同時に1つの待ち受けへ connect しても、backlog の分ずつ accept 待ちに積まれて漏れなく繋がる
+bool storm_fn (VirtualTcpMode mode)
+{
+	const int clients = 16;
+	const int per_client = 128;
+
+	VirtualTcp vtcp("192.168.10.1", 970, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(970);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	bool ok = (0 == vtcp.vlisten(vsock0, 8));
+
+	std::atomic<int> connected(0);
+	std::vector<std::thread> threads;
+	for (int c = 0; c < clients; ++c)
+	{
+		threads.emplace_back([mode, c, per_client, &connected]()
+				{
+					VirtualTcp vtcp("192.168.10.2", 970, mode);
+
+					struct sockaddr_in server;
+					server.sin_family = AF_INET;
+					server.sin_port = htons(970);
+					server.sin_addr.s_addr = inet_addr("192.168.10.1");
+
+					for (int i = 0; i < per_client; ++i)
+					{
+						VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+						if (0 == vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server)))
+						{
+							int id = c * per_client + i;
+							if (sizeof(id) == vtcp.vsend(vsock, (const char *)&id, sizeof(id), 0)) { ++connected; }
+						}
+						vtcp.vclosesocket(vsock);
+					}
+				});
+	}
+
+	// 相手が閉じた後に accept しても、届いていたデータは読める
+	std::vector<bool> seen(clients * per_client, false);
+	for (int i = 0; i < clients * per_client; ++i)
+	{
+		struct sockaddr_in client;
+		unsigned int len = sizeof(client);
+		VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+		if (INVALID_SOCKET == vsock)
+		{
+			ok = false;
+			break;
+		}
+
+		int id = -1;
+		if ((sizeof(id) == vtcp.vrecv(vsock, (char *)&id, sizeof(id), MSG_WAITALL))
+				&& (0 <= id) && (id < clients * per_client) && (! seen[id]))
+		{
+			seen[id] = true;
+		}
+		else
+		{
+			ok = false;
+		}
+		vtcp.vclosesocket(vsock);
+	}
+
+	for (auto &th : threads) { th.join(); }
+	vtcp.vclosesocket(vsock0);
+
+	ok = (clients * per_client == connected) && ok;
+	std::cout << "STORM: " << (ok ? "ok" : "lost connections") << std::endl;
+	return ok;
+}
+
+// 1つのスレッドが vepoll_wait で待ち受けと多数の接続をまとめて受け持つ
+bool poll_fn (VirtualTcpMode mode)
+{
+	const int clients = 8;
+	const int per_client = 64;
+
+	VirtualTcp vtcp("192.168.11.1", 980, mode);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(980);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	bool ok = (0 == vtcp.vlisten(vsock0, 128));
+
+	int epfd = vtcp.vepoll_create();
+	VirtualEpollEvent ev = {POLLIN, (uint64_t)vsock0};
+	// errno は失敗したときだけ変わる
+	errno = 0;
+	ok = (0 == vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, vsock0, &ev)) && (0 == errno) && ok;
+	ok = (-1 == vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, vsock0, &ev)) && (EEXIST == errno) && ok;
+	errno = 0;
+	ok = (0 == vtcp.vepoll_ctl(epfd, VEPOLL_CTL_MOD, vsock0, &ev)) && (0 == errno) && ok;
+
+	// 各クライアントは接続ごとに番号を送り、送り返されたら閉じる
+	std::atomic<int> echoed(0);
+	std::vector<std::thread> threads;
+	for (int c = 0; c < clients; ++c)
+	{
+		threads.emplace_back([mode, c, per_client, &echoed]()
+				{
+					VirtualTcp vtcp("192.168.11.2", 980, mode);
+
+					struct sockaddr_in server;
+					server.sin_family = AF_INET;
+					server.sin_port = htons(980);
+					server.sin_addr.s_addr = inet_addr("192.168.11.1");
+
+					std::vector<VIRTUAL_SOCKET> vsocks;
+					for (int i = 0; i < per_client; ++i)
+					{
+						VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+						int id = c * per_client + i;
+						if ((0 == vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server)))
+								&& (sizeof(id) == vtcp.vsend(vsock, (const char *)&id, sizeof(id), 0)))
+						{
+							vsocks.push_back(vsock);
+						}
+					}
+
+					for (int i = 0; i < (int)vsocks.size(); ++i)
+					{
+						int id = -1;
+						if ((sizeof(id) == vtcp.vrecv(vsocks[i], (char *)&id, sizeof(id), MSG_WAITALL))
+								&& (c * per_client + i == id))
+						{
+							++echoed;
+						}
+						vtcp.vclosesocket(vsocks[i]);
+					}
+				});
+	}
+
+	// 相手が閉じたら POLLHUP が届き、閉じたソケットは epoll から外れる
+	int hungup = 0;
+	VirtualEpollEvent events[64];
+	while (ok && (hungup < clients * per_client))
+	{
+		int n = vtcp.vepoll_wait(epfd, events, 64, 10000);
+		if (n <= 0)
+		{
+			ok = false;
+			break;
+		}
+
+		for (int i = 0; i < n; ++i)
+		{
+			VIRTUAL_SOCKET vsock = (VIRTUAL_SOCKET)events[i].data;
+			if (vsock == vsock0)
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				VIRTUAL_SOCKET server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+				VirtualEpollEvent sev = {POLLIN, (uint64_t)server};
+				ok = (0 == vtcp.vepoll_ctl(epfd, VEPOLL_CTL_ADD, server, &sev)) && ok;
+				continue;
+			}
+
+			if (events[i].events & POLLIN)
+			{
+				int id;
+				int res = vtcp.vrecv(vsock, (char *)&id, sizeof(id), MSG_DONTWAIT);
+				if (sizeof(id) == res)
+				{
+					ok = (sizeof(id) == vtcp.vsend(vsock, (const char *)&id, sizeof(id), 0)) && ok;
+					continue;
+				}
+			}
+			if (events[i].events & POLLHUP)
+			{
+				vtcp.vclosesocket(vsock);
+				++hungup;
+			}
+		}
+	}
+	for (auto &th : threads) { th.join(); }
+
+	ok = (clients * per_client == echoed) && ok;
+	ok = (0 == vtcp.vepoll_close(epfd)) && ok;
+
+	// vpoll: 何も届いていなければタイムアウトで 0、相手のウィンドウが空いていれば POLLOUT
+	VIRTUAL_SOCKET server = INVALID_SOCKET;
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in client;
+				unsigned int len = sizeof(client);
+				server = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+			});
+	VIRTUAL_SOCKET client = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in peer;
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(980);
+	peer.sin_addr.s_addr = inet_addr("192.168.11.1");
+	vtcp.vconnect(client, (struct sockaddr *)&peer, sizeof(peer));
+	server_th.join();
+
+	VirtualPollFd fds[2] = {{server, POLLIN, 0}, {client, POLLOUT, 0}};
+	ok = (0 == vtcp.vpoll(fds, 1, 20)) && (0 == fds[0].revents) && ok;
+	ok = (1 == vtcp.vpoll(fds, 2, 20)) && (0 == fds[0].revents) && (POLLOUT == fds[1].revents) && ok;
+
+	// 待っている間に届けば起きる
+	std::thread sender_th([&]()
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				vtcp.vsend(client, "x", 1, 0);
+			});
+	ok = (1 == vtcp.vpoll(fds, 1, -1)) && (POLLIN == fds[0].revents) && ok;
+	sender_th.join();
+
+	vtcp.vclosesocket(client);
+	ok = (1 == vtcp.vpoll(fds, 1, -1)) && (fds[0].revents & POLLHUP) && ok;
+
+	vtcp.vclosesocket(server);
+	vtcp.vclosesocket(vsock0);
+
+	std::cout << "POLL: " << (ok ? "ok" : "missed readiness") << std::endl;
+	return ok;
+}
+
+// async_* の完了を1本のスレッドで順に実行する
+class SerialExecutor
+{
+	private:
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::deque<std::function<void()>> tasks;
+		bool stopping;
+		std::thread th;
+
+	public:
+		SerialExecutor () : mtx(), cv(), tasks(), stopping(false), th()
+		{
+			th = std::thread([this]()
+					{
+						std::unique_lock<std::mutex> lock(mtx);
+						while (true)
+						{
+							cv.wait(lock, [&]() { return stopping || (! tasks.empty()); });
+							if (tasks.empty()) { return; }
+
+							std::function<void()> fn = std::move(tasks.front());
+							tasks.pop_front();
+							lock.unlock();
+							fn();
+							lock.lock();
+						}
+					});
+		}
+
+		~SerialExecutor ()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				stopping = true;
+			}
+			cv.notify_all();
+			th.join();
+		}
+
+		void post (std::function<void()> fn)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				tasks.push_back(std::move(fn));
+			}
+			cv.notify_all();
+		}
+};
+
+// 1本の executor のスレッドだけで、多数の接続の accept と echo を非同期に受け持つ
+// O_NONBLOCK にしたソケットは待たずに EAGAIN を返す
+struct AsyncEchoServer
+{
+	VirtualTcp &vtcp;
+	VIRTUAL_SOCKET vsock0;
+	int remaining;
+	std::atomic<int> echoed;
+	std::atomic<int> closed;
+	struct sockaddr_in client;
+	unsigned int len;
+
+	struct Conn
+	{
+		VIRTUAL_SOCKET vsock;
+		char buf[16];
+	};
+
+	AsyncEchoServer (VirtualTcp &vtcp_, VIRTUAL_SOCKET vsock0_, int connections)
+		: vtcp(vtcp_), vsock0(vsock0_), remaining(connections), echoed(0), closed(0), client(), len(sizeof(client))
+	{
+	}
+
+	void accept ()
+	{
+		if (0 == remaining--) { return; }
+
+		vtcp.async_accept(vsock0, (struct sockaddr *)&client, &len).then([this](long vsock, int err)
+				{
+					if (vsock < 0) { return; }
+
+					auto conn = std::make_shared<Conn>();
+					conn->vsock = vsock;
+					recv(conn);
+					accept();
+				});
+	}
+
+	void recv (const std::shared_ptr<Conn> &conn)
+	{
+		vtcp.async_recv(conn->vsock, conn->buf, sizeof(conn->buf), 0).then([this, conn](long n, int err)
+				{
+					if (n <= 0)
+					{
+						vtcp.vclosesocket(conn->vsock);
+						++closed;
+						return;
+					}
+
+					vtcp.async_send(conn->vsock, conn->buf, (int)n, 0).then([this, conn](long n, int err)
+							{
+								if (0 < n) { ++echoed; }
+								recv(conn);
+							});
+				});
+	}
+};
+
+// executor を持たない waiter の async_accept の then から、caller で待つ呼び出しをする
+// ブローカ経由では応答を読んだスレッドで then が呼ばれるので、読み終えたことにしてから呼ばないと塞がる
+bool inline_fn (VirtualTcpMode mode, VirtualTcp &waiter, VirtualTcp &caller, unsigned short port)
+{
+	VIRTUAL_SOCKET vsock0 = waiter.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	waiter.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	bool ok = (0 == waiter.vlisten(vsock0, 1));
+
+	std::atomic<int> stage(0);
+	std::atomic<VIRTUAL_SOCKET> accepted(INVALID_SOCKET);
+	std::atomic<VIRTUAL_SOCKET> created(INVALID_SOCKET);
+	struct sockaddr_in client;
+	unsigned int len = sizeof(client);
+	waiter.async_accept(vsock0, (struct sockaddr *)&client, &len).then([&](long vsock, int err)
+			{
+				stage = 1;
+				accepted = vsock;
+				created = caller.vsocket(AF_INET, SOCK_STREAM, 0);
+				stage = 2;
+			});
+
+	VirtualTcp peer("192.168.12.2", port, mode);
+	VIRTUAL_SOCKET vsock = peer.vsocket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_addr.s_addr = inet_addr("192.168.12.1");
+	ok = (0 == peer.vconnect(vsock, (struct sockaddr *)&addr, sizeof(addr))) && ok;
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while ((2 != stage) && (std::chrono::steady_clock::now() < deadline))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	ok = (2 == stage) && (INVALID_SOCKET != accepted) && (INVALID_SOCKET != created) && ok;
+
+	caller.vclosesocket(created);
+	waiter.vclosesocket(accepted);
+	peer.vclosesocket(vsock);
+	waiter.vclosesocket(vsock0);
+	return ok;
+}
+
+bool async_fn (VirtualTcpMode mode)
+{
+	const int connections = 200;
+
+	SerialExecutor executor;
+	VirtualTcp vtcp("192.168.12.1", 990, mode);
+	vtcp.set_executor([&executor](std::function<void()> fn) { executor.post(std::move(fn)); });
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(990);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	bool ok = (0 == vtcp.vlisten(vsock0, 16));
+
+	ok = (0 == vtcp.vfcntl(vsock0, F_SETFL, O_NONBLOCK)) && (O_NONBLOCK & vtcp.vfcntl(vsock0, F_GETFL)) && ok;
+	struct sockaddr_in client;
+	unsigned int len = sizeof(client);
+	ok = (INVALID_SOCKET == vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len)) && (EAGAIN == errno) && ok;
+
+	struct sockaddr_in peer;
+	peer.sin_family = AF_INET;
+	peer.sin_port = htons(991);
+	peer.sin_addr.s_addr = inet_addr("192.168.12.1");
+	VIRTUAL_SOCKET refused = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	vtcp.vfcntl(refused, F_SETFL, O_NONBLOCK);
+	ok = (-1 == vtcp.vconnect(refused, (struct sockaddr *)&peer, sizeof(peer))) && (ECONNREFUSED == errno) && ok;
+	vtcp.vclosesocket(refused);
+
+	AsyncEchoServer server(vtcp, vsock0, connections);
+	server.accept();
+
+	// クライアントは1本のスレッドから、完了を待ちながら順に繋いで確かめる
+	peer.sin_port = htons(990);
+	for (int i = 0; ok && (i < connections); ++i)
+	{
+		VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		ok = (0 == vtcp.async_connect(vsock, (struct sockaddr *)&peer, sizeof(peer)).wait()) && ok;
+
+		vtcp.vfcntl(vsock, F_SETFL, O_NONBLOCK);
+		char buf[16];
+		ok = (-1 == vtcp.vrecv(vsock, buf, sizeof(buf), 0)) && (EAGAIN == errno) && ok;
+		vtcp.vfcntl(vsock, F_SETFL, 0);
+
+		std::string msg = "echo " + std::to_string(i);
+		VirtualAsync received = vtcp.async_recv(vsock, buf, (int)msg.size(), MSG_WAITALL);
+		ok = ((long)msg.size() == vtcp.async_send(vsock, msg.data(), (int)msg.size(), 0).wait()) && ok;
+		ok = ((long)msg.size() == received.wait()) && (0 == memcmp(buf, msg.data(), msg.size())) && ok;
+
+		vtcp.vclosesocket(vsock);
+	}
+
+	// 送り返した後の完了と、閉じられたことに気付くのは少し遅れる
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while ((server.closed < connections) && (std::chrono::steady_clock::now() < deadline))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	ok = (connections == server.echoed) && (connections == server.closed) && ok;
+	vtcp.vclosesocket(vsock0);
+
+	// executor がなければ then は完了させたスレッドで呼ばれる. そこから待つ呼び出しをしても塞がらない
+	VirtualTcp plain("192.168.12.1", 992, mode);
+	ok = inline_fn(mode, plain, plain, 992) && ok;
+
+	std::cout << "ASYNC: " << (ok ? "ok" : "async call not completed") << std::endl;
+	return ok;
+}
+
+// 別のプロセスで動かすもう1つのブローカ. 親のブローカと連合し、192.168.13.1:1000 で
+// 受け取ったものを送り返す. "bye" が届いたらこちらから閉じる. 親に kill されるまで待ち受ける
+const int FederationPort = 12346;
+
+void federation_peer_fn ()
+{
+	VirtualTcp::set_alternative_port(FederationPort);
+	if (0 != VirtualTcp::startup()) { return; }
+
+	// 親のブローカが立ち上がるまで繋ぎ直す
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (0 != VirtualTcp::federate("127.0.0.1", 12345))
+	{
+		if (std::chrono::steady_clock::now() > deadline) { return; }
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	VirtualTcp vtcp("192.168.13.1", 1000, VIRTUAL_TCP_DIRECT);
+
+	VIRTUAL_SOCKET vsock0 = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(1000);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	vtcp.vbind(vsock0, (struct sockaddr *)&addr, sizeof(addr));
+	vtcp.vlisten(vsock0, 128);
+
+	while (true)
+	{
+		struct sockaddr_in client;
+		unsigned int len = sizeof(client);
+		VIRTUAL_SOCKET vsock = vtcp.vaccept(vsock0, (struct sockaddr *)&client, &len);
+		if (INVALID_SOCKET == vsock) { break; }
+
+		std::thread([&vtcp, vsock]()
+				{
+					char buf[4096];
+					int n;
+					while (0 < (n = vtcp.vrecv(vsock, buf, sizeof(buf), 0)))
+					{
+						if ((3 == n) && (0 == memcmp(buf, "bye", 3))) { break; }
+						if (n != vtcp.vsend(vsock, buf, n, 0)) { break; }
+					}
+					vtcp.vclosesocket(vsock);
+				}).detach();
+	}
+}
+
+// 別のプロセスのブローカで待ち受けているアドレスへ、親のブローカ経由で繋ぐ
+bool federation_fn (VirtualTcpMode mode)
+{
+	const int connections = 20;
+	const int bulk = 1024 * 1024;
+
+	VirtualTcp vtcp("192.168.13.2", 1000, mode);
+
+	struct sockaddr_in server;
+	server.sin_family = AF_INET;
+	server.sin_port = htons(1000);
+	server.sin_addr.s_addr = inet_addr("192.168.13.1");
+
+	// 相手の待ち受けが知らされるまでは、待たない connect は拒否される
+	bool ok = true;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (true)
+	{
+		VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		vtcp.vfcntl(vsock, F_SETFL, O_NONBLOCK);
+		int res = vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server));
+		vtcp.vclosesocket(vsock);
+
+		if (0 == res) { break; }
+		if ((ECONNREFUSED != errno) || (std::chrono::steady_clock::now() > deadline))
+		{
+			ok = false;
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	for (int i = 0; ok && (i < connections); ++i)
+	{
+		VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+		ok = (0 == vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server))) && ok;
+
+		std::string msg = "federated " + std::to_string(i);
+		char buf[64];
+		ok = ((int)msg.size() == vtcp.vsend(vsock, msg.data(), (int)msg.size(), 0)) && ok;
+		ok = ((int)msg.size() == vtcp.vrecv(vsock, buf, (int)msg.size(), MSG_WAITALL))
+			&& (0 == memcmp(buf, msg.data(), msg.size())) && ok;
+
+		vtcp.vclosesocket(vsock);
+	}
+
+	// 各段のウィンドウより大きいものは、送り返されてくる分を読みながらでないと送り切れない
+	VIRTUAL_SOCKET vsock = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	ok = ok && (0 == vtcp.vconnect(vsock, (struct sockaddr *)&server, sizeof(server)));
+
+	std::vector<char> sent(bulk);
+	for (int i = 0; i < bulk; ++i) { sent[i] = (char)(i * 7); }
+	std::vector<char> received(bulk);
+	std::thread reader([&]()
+			{
+				int got = 0;
+				int n = 1;
+				while ((got < bulk) && (0 < n))
+				{
+					n = vtcp.vrecv(vsock, &(received[got]), bulk - got, 0);
+					got += std::max(n, 0);
+				}
+			});
+	ok = ok && (bulk == vtcp.vsend(vsock, sent.data(), bulk, 0));
+	reader.join();
+	ok = (sent == received) && ok;
+
+	// 相手が閉じたことも中継される
+	char buf[16];
+	ok = (3 == vtcp.vsend(vsock, "bye", 3, 0)) && ok;
+	ok = (0 == vtcp.vrecv(vsock, buf, sizeof(buf), 0)) && ok;
+	vtcp.vclosesocket(vsock);
+
+	std::cout << "FEDERATION: " << (ok ? "ok" : "not forwarded") << std::endl;
+	return ok;
+}
+
+// 経路の遅延と帯域が send から recv までの時間に現れ、切断は届き切ってから見える
+bool link_fn (VirtualTcpMode mode)
+{
+	const int bulk = 200 * 1000;
+
+	VirtualTcp vtcp("192.168.14.2", 1010, mode);
+	VIRTUAL_SOCKET vsock0, client, server;
+	bool ok = connect_pair(vtcp, "192.168.14.1", 1010, vsock0, client, server);
+
+	VirtualLinkProfile wan;
+	wan.delay = std::chrono::milliseconds(20);
+	ok = (0 == VirtualTcp::set_link("192.168.14.1", "192.168.14.0/24", wan)) && ok;
+	ok = (-1 == VirtualTcp::set_link("192.168.14.1/33", "192.168.14.2", wan)) && ok;
+
+	// 片道 20ms なので、往復は 40ms より早くは戻らない
+	char buf[16];
+	auto begin = std::chrono::steady_clock::now();
+	ok = (4 == vtcp.vsend(client, "ping", 4, 0)) && ok;
+	ok = (-1 == vtcp.vrecv(server, buf, sizeof(buf), MSG_DONTWAIT)) && (EAGAIN == errno) && ok;
+	ok = (4 == vtcp.vrecv(server, buf, 4, MSG_WAITALL)) && (0 == memcmp(buf, "ping", 4)) && ok;
+	ok = (4 == vtcp.vsend(server, "pong", 4, 0)) && ok;
+	ok = (4 == vtcp.vrecv(client, buf, 4, MSG_WAITALL)) && (0 == memcmp(buf, "pong", 4)) && ok;
+	ok = (std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(40)) && ok;
+
+	// 後から設定した経路が優先される. 1MB/s で 200KB は 0.2 秒かかる
+	VirtualLinkProfile narrow;
+	narrow.rate = 1000 * 1000;
+	ok = (0 == VirtualTcp::set_link("192.168.14.2", "192.168.14.1", narrow)) && ok;
+
+	std::vector<char> sent(bulk);
+	for (int i = 0; i < bulk; ++i) { sent[i] = (char)(i * 11); }
+	std::vector<char> received(bulk);
+	begin = std::chrono::steady_clock::now();
+	std::thread reader([&]()
+			{
+				int got = 0;
+				int n = 1;
+				while ((got < bulk) && (0 < n))
+				{
+					n = vtcp.vrecv(server, &(received[got]), bulk - got, 0);
+					got += std::max(n, 0);
+				}
+			});
+	ok = (bulk == vtcp.vsend(client, sent.data(), bulk, 0)) && ok;
+	reader.join();
+	ok = (sent == received) && ok;
+	ok = (std::chrono::steady_clock::now() - begin >= std::chrono::milliseconds(190)) && ok;
+
+	// 経路の途中にある分を読み終えてから切断が見える
+	ok = (3 == vtcp.vsend(client, "bye", 3, 0)) && ok;
+	vtcp.vclosesocket(client);
+	ok = (3 == vtcp.vrecv(server, buf, sizeof(buf), MSG_WAITALL)) && (0 == memcmp(buf, "bye", 3)) && ok;
+	ok = (0 == vtcp.vrecv(server, buf, sizeof(buf), 0)) && ok;
+
+	VirtualTcp::clear_links();
+	vtcp.vclosesocket(server);
+	vtcp.vclosesocket(vsock0);
+
+	std::cout << "LINK: " << (ok ? "ok" : "not shaped") << std::endl;
+	return ok;
+}
+
+// 送受信の数とコマンドの時間が stats に現れる. 他のテストの分も入っているので差で見る
+bool stats_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.15.2", 1020, mode);
+
+	VirtualStats before;
+	bool ok = (0 == vtcp.stats(before));
+
+	VIRTUAL_SOCKET vsock0, client, server;
+	ok = connect_pair(vtcp, "192.168.15.1", 1020, vsock0, client, server) && ok;
+
+	char buf[300] = {0};
+	for (int i = 0; i < 3; ++i) { ok = (100 == vtcp.vsend(client, buf, 100, 0)) && ok; }
+	ok = (300 == vtcp.vrecv(server, buf, 300, MSG_WAITALL)) && ok;
+	ok = (-1 == vtcp.vrecv(server, buf, 300, MSG_DONTWAIT)) && (EAGAIN == errno) && ok;
+
+	VirtualStats after;
+	ok = (0 == vtcp.stats(after, true)) && ok;
+	ok = (after.bytes_in >= before.bytes_in + 300) && (after.msgs_in >= before.msgs_in + 3) && ok;
+	ok = (after.bytes_out >= before.bytes_out + 300) && (after.msgs_out >= before.msgs_out + 3) && ok;
+	ok = (after.would_block > before.would_block) && ok;
+	ok = (after.sockets_created >= before.sockets_created + 3) && ok;
+	ok = (after.connects > before.connects) && (after.accepts > before.accepts) && ok;
+	ok = (after.sockets_live >= 3) && (after.sockets.size() == after.sockets_live) && ok;
+
+	bool found = false;
+	for (const VirtualSocketStats &entry : after.sockets)
+	{
+		if (entry.socket != server) { continue; }
+
+		found = (entry.ip == inet_addr("192.168.15.1")) && (entry.port == htons(1020))
+			&& (VIRTUAL_SOCKET_CONNECT == entry.status) && (300 == entry.bytes_in) && (3 == entry.msgs_in)
+			&& (300 == entry.high_water) && (0 == entry.buffered) && (1 == entry.would_block)
+			&& (VirtualSocketImpl::BUF_SIZE == entry.window);
+	}
+	ok = found && ok;
+
+	// ブローカの処理時間は順に並び、ワーカーは startup で立てた分だけある
+	bool sends = false;
+	for (const VirtualCommandStats &command : after.commands)
+	{
+		ok = (0 < command.count) && (command.p50_ns <= command.p99_ns) && (command.p99_ns <= command.max_ns) && ok;
+		sends = sends || (COM_SEND == command.command);
+	}
+	ok = sends && (! after.workers.empty()) && ok;
+
+	// 読まずに閉じた分は捨てた数になる
+	ok = (5 == vtcp.vsend(client, buf, 5, 0)) && ok;
+	vtcp.vclosesocket(server);
+	vtcp.vclosesocket(client);
+	vtcp.vclosesocket(vsock0);
+
+	VirtualStats closed;
+	ok = (0 == vtcp.stats(closed)) && ok;
+	ok = (closed.dropped >= after.dropped + 5) && (closed.bytes_in >= after.bytes_in + 5) && ok;
+	ok = closed.sockets.empty() && ok;
+
+	std::cout << "STATS: " << (ok ? "ok" : "not counted") << std::endl;
+	return ok;
+}
+
+// VirtualTcp をスレッドごとに大量に作っても、ブローカへの制御用接続は共有されて増えない
+// 共有した接続では、ある VirtualTcp の then から別の VirtualTcp で待つ呼び出しをしても塞がらない
+bool pool_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.17.1", 1040, mode);
+
+	// プールの枠をすべて埋めてから数える. 以降に作る VirtualTcp は新しく接続しない
+	std::vector<std::unique_ptr<VirtualTcp>> warm;
+	for (size_t i = 0; i < VirtualChannelPool::MAX_SIZE; ++i)
+	{
+		warm.emplace_back(new VirtualTcp("192.168.17.1", 1040, mode));
+		VirtualStats stats;
+		warm.back()->stats(stats);
+	}
+
+	VirtualStats before;
+	bool ok = (0 == vtcp.stats(before));
+
+	const int nthreads = 8;
+	const int instances = 50;
+	std::atomic<int> used(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < nthreads; ++t)
+	{
+		threads.emplace_back([&, t]()
+				{
+					std::string addr = "192.168.17." + std::to_string(t + 2);
+					std::vector<std::unique_ptr<VirtualTcp>> endpoints;
+					for (int i = 0; i < instances; ++i) { endpoints.emplace_back(new VirtualTcp(addr, 1040 + i, mode)); }
+
+					for (auto &endpoint : endpoints)
+					{
+						VIRTUAL_SOCKET vsock = endpoint->vsocket(AF_INET, SOCK_STREAM, 0);
+						if ((INVALID_SOCKET != vsock) && (0 == endpoint->vclosesocket(vsock))) { ++used; }
+					}
+				});
+	}
+	for (auto &th : threads) { th.join(); }
+	ok = (nthreads * instances == used) && ok;
+
+	// 直接呼び出しはブローカへ接続しないので、接続の数は見ない
+	VirtualStats after;
+	ok = (0 == vtcp.stats(after)) && ok;
+	if (VIRTUAL_TCP_DIRECT != mode) { ok = (after.connections == before.connections) && ok; }
+
+	VirtualTcp waiter("192.168.12.1", 1041, mode);
+	ok = inline_fn(mode, waiter, vtcp, 1041) && ok;
+
+	std::cout << "POOL: " << (ok ? "ok" : "not shared") << std::endl;
+	return ok;
+}
+
+// send したデータが pcap に IPv4/TCP のパケットとして並び、filter に合わない接続は入らない
+bool capture_fn (VirtualTcpMode mode)
+{
+	std::string path = "/tmp/virtual_tcp_capture." + std::to_string(getpid()) + ".pcap";
+
+	bool ok = (-1 == VirtualTcp::start_capture(path, "192.168.16.0/33"));
+	ok = (0 == VirtualTcp::start_capture(path, "192.168.16.0/24:1030", 40 + 8)) && ok;
+
+	VirtualTcp vtcp("192.168.16.2", 1030, mode);
+	VirtualTcp other("192.168.16.4", 1031, mode);
+	VIRTUAL_SOCKET vsock0, client, server;
+	VIRTUAL_SOCKET other0, other_client, other_server;
+	ok = connect_pair(vtcp, "192.168.16.1", 1030, vsock0, client, server) && ok;
+	ok = connect_pair(other, "192.168.16.3", 1031, other0, other_client, other_server) && ok;
+
+	char buf[64];
+	ok = (5 == vtcp.vsend(client, "hello", 5, 0)) && ok;
+	ok = (11 == vtcp.vsend(client, " capture me", 11, 0)) && ok;
+	ok = (16 == vtcp.vrecv(server, buf, 16, MSG_WAITALL)) && ok;
+	ok = (3 == vtcp.vsend(server, "ack", 3, 0)) && ok;
+	ok = (3 == vtcp.vrecv(client, buf, 3, MSG_WAITALL)) && ok;
+	ok = (5 == other.vsend(other_client, "other", 5, 0)) && ok;
+	ok = (5 == other.vrecv(other_server, buf, 5, MSG_WAITALL)) && ok;
+
+	VirtualTcp::stop_capture();
+
+	for (VIRTUAL_SOCKET vsock : {client, server, vsock0}) { vtcp.vclosesocket(vsock); }
+	for (VIRTUAL_SOCKET vsock : {other_client, other_server, other0}) { other.vclosesocket(vsock); }
+
+	std::vector<char> file;
+	FILE *fp = fopen(path.c_str(), "rb");
+	if (nullptr != fp)
+	{
+		char chunk[4096];
+		size_t n;
+		while (0 < (n = fread(chunk, 1, sizeof(chunk), fp))) { file.insert(file.end(), chunk, chunk + n); }
+		fclose(fp);
+	}
+	unlink(path.c_str());
+
+	// ファイルヘッダ: magic (ナノ秒), snaplen, LINKTYPE_RAW
+	uint32_t header[6] = {0};
+	ok = (24 <= file.size()) && ok;
+	if (24 <= file.size()) { memcpy(header, file.data(), sizeof(header)); }
+	ok = (0xa1b23c4d == header[0]) && (48 == header[4]) && (101 == header[5]) && ok;
+
+	// 各パケットは [記録:16][IPv4:20][TCP:20][ペイロードは snaplen まで]
+	std::vector<std::string> packets;
+	size_t pos = 24;
+	while (pos + 16 <= file.size())
+	{
+		uint32_t rec[4];
+		memcpy(rec, &(file[pos]), sizeof(rec));
+		const char *ip = &(file[pos + 16]);
+		pos += 16 + rec[2];
+		if ((pos > file.size()) || (rec[2] < 40)) { ok = false; break; }
+
+		uint32_t src, dst;
+		memcpy(&src, ip + 12, 4);
+		memcpy(&dst, ip + 16, 4);
+		const unsigned char *tcp = (const unsigned char *)ip + 20;
+		uint32_t seq = ((uint32_t)tcp[4] << 24) | ((uint32_t)tcp[5] << 16) | ((uint32_t)tcp[6] << 8) | tcp[7];
+		std::string line = std::string(inet_ntoa(*(struct in_addr *)&src)) + ">";
+		line += std::string(inet_ntoa(*(struct in_addr *)&dst)) + " " + std::to_string(seq) + " "
+			+ std::to_string(rec[3] - 40) + " " + std::string(ip + 40, rec[2] - 40);
+		ok = (0x45 == (unsigned char)ip[0]) && (6 == ip[9]) && ok;
+		packets.push_back(line);
+	}
+	ok = (pos == file.size()) && ok;
+
+	// 2つめは snaplen で 8 バイトに切られ、元の長さは残る
+	std::vector<std::string> expected = {"192.168.16.2>192.168.16.1 0 5 hello"
+		, "192.168.16.2>192.168.16.1 5 11  capture", "192.168.16.1>192.168.16.2 0 3 ack"};
+	ok = (expected == packets) && ok;
+
+	std::cout << "CAPTURE: " << (ok ? "ok" : "not captured") << std::endl;
+	return ok;
+}
+
+// 待ち受け中や接続済みのソケットは bind し直せず、接続済みのソケットは listen できない
+// 断られた後も待ち受けはそのまま残り、次の接続を受け付ける
+bool bind_fn (VirtualTcpMode mode)
+{
+	VirtualTcp vtcp("192.168.20.2", 1070, mode);
+	VIRTUAL_SOCKET vsock0, client, server;
+	bool ok = connect_pair(vtcp, "192.168.20.1", 1070, vsock0, client, server);
+
+	struct sockaddr_in other;
+	other.sin_family = AF_INET;
+	other.sin_port = htons(1071);
+	other.sin_addr.s_addr = inet_addr("192.168.20.1");
+	for (VIRTUAL_SOCKET vsock : {vsock0, client, server})
+	{
+		errno = 0;
+		ok = (-1 == vtcp.vbind(vsock, (struct sockaddr *)&other, sizeof(other))) && (EINVAL == errno) && ok;
+	}
+	errno = 0;
+	ok = (-1 == vtcp.vlisten(client, 5)) && (EINVAL == errno) && ok;
+
+	struct sockaddr_in addr = other;
+	addr.sin_port = htons(1070);
+	VIRTUAL_SOCKET again = INVALID_SOCKET;
+	std::thread server_th([&]()
+			{
+				struct sockaddr_in peer;
+				unsigned int len = sizeof(peer);
+				again = vtcp.vaccept(vsock0, (struct sockaddr *)&peer, &len);
+			});
+	VIRTUAL_SOCKET second = vtcp.vsocket(AF_INET, SOCK_STREAM, 0);
+	ok = (0 == vtcp.vconnect(second, (struct sockaddr *)&addr, sizeof(addr))) && ok;
+	server_th.join();
+	ok = (INVALID_SOCKET != again) && ok;
+
+	for (VIRTUAL_SOCKET vsock : {second, again, client, server, vsock0}) { vtcp.vclosesocket(vsock); }
+
+	std::cout << "BIND: " << (ok ? "ok" : "rebound") << std::endl;
+	return ok;
+}
+
+// 本文の足りない send の要求や、範囲外の offset をもつ send の要求は、ブローカがデータに触らずに EINVAL で断る
+bool frame_fn ()
+{
+	VirtualTcp vtcp("192.168.19.2", 1060, VIRTUAL_TCP_BROKER);
+	VIRTUAL_SOCKET vsock0, client, server;
+	bool ok = connect_pair(vtcp, "192.168.19.1", 1060, vsock0, client, server);
+
+	VirtualChannel channel(VirtualTcpStream::connect("127.0.0.1", 12345));
+	ok = channel.alive() && ok;
+
+	// 本文は [flags:4][offset:4][data]
+	char body[4 + 4 + 4];
+	put_u32(&(body[0]), 0);
+	memcpy(&(body[8]), "good", 4);
+	struct Case
+	{
+		size_t length;
+		uint32_t offset;
+	};
+	static const Case cases[] = {{0, 0}, {4, 0}, {12, 5}, {12, 0x80000000}};
+	for (const Case &c : cases)
+	{
+		put_u32(&(body[4]), c.offset);
+		struct iovec iov = {body, c.length};
+		int32_t result = 0;
+		errno = 0;
+		ok = channel.call(COM_SEND, (uint32_t)client, &iov, 1, result) && (-1 == result) && (EINVAL == errno) && ok;
+	}
+
+	// 正しい要求は通り、断った要求の分は届いていない
+	put_u32(&(body[4]), 0);
+	struct iovec iov = {body, sizeof(body)};
+	int32_t result = 0;
+	ok = channel.call(COM_SEND, (uint32_t)client, &iov, 1, result) && (4 == result) && ok;
+
+	char buf[16];
+	ok = (4 == vtcp.vrecv(server, buf, sizeof(buf), 0)) && (0 == memcmp(buf, "good", 4)) && ok;
+
+	for (VIRTUAL_SOCKET vsock : {client, server, vsock0}) { vtcp.vclosesocket(vsock); }
+
+	std::cout << "FRAME: " << (ok ? "ok" : "not rejected") << std::endl;
+	return ok;
+}
+
+// startup を呼ばない別のプロセスから、親のブローカへ TCP と共有メモリで繋いで使う
+// そのプロセスの複数の VirtualTcp も、プールした接続を共有する
+// 親の他のテストがブローカの統計を見ている間は繋がないよう、親が ready に書くまで待つ
+bool client_process_fn (int ready)
+{
+	char go;
+	if (1 != read(ready, &go, 1)) { return false; }
+
+	bool ok = true;
+	for (VirtualTcpMode mode : {VIRTUAL_TCP_BROKER, VIRTUAL_TCP_SHM})
+	{
+		VirtualTcp vtcp("192.168.18.2", 1050, mode);
+		VIRTUAL_SOCKET vsock0, client, server;
+		ok = connect_pair(vtcp, "192.168.18.1", 1050, vsock0, client, server) && ok;
+
+		char buf[16];
+		ok = (5 == vtcp.vsend(client, "hello", 5, 0)) && ok;
+		ok = (5 == vtcp.vrecv(server, buf, 5, MSG_WAITALL)) && (0 == memcmp(buf, "hello", 5)) && ok;
+		ok = (3 == vtcp.vsend(server, "bye", 3, 0)) && ok;
+		ok = (3 == vtcp.vrecv(client, buf, 3, MSG_WAITALL)) && (0 == memcmp(buf, "bye", 3)) && ok;
+
+		VirtualStats stats;
+		ok = (0 == vtcp.stats(stats)) && ok;
+
+		for (VIRTUAL_SOCKET vsock : {client, server, vsock0}) { ok = (0 == vtcp.vclosesocket(vsock)) && ok; }
+
+		// プールの枠を埋めた後は、スレッドごとに VirtualTcp を作っても接続は増えない
+		std::vector<std::unique_ptr<VirtualTcp>> warm;
+		for (size_t i = 0; i < VirtualChannelPool::MAX_SIZE; ++i)
+		{
+			warm.emplace_back(new VirtualTcp("192.168.18.2", 1050, mode));
+			ok = (0 == warm.back()->stats(stats)) && ok;
+		}
+		VirtualStats before;
+		ok = (0 == vtcp.stats(before)) && ok;
+
+		const int nthreads = 4;
+		std::atomic<int> served(0);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < nthreads; ++t)
+		{
+			threads.emplace_back([&, t]()
+					{
+						std::string addr = "192.168.18." + std::to_string(t + 3);
+						VirtualTcp endpoint(addr, 1051 + t, mode);
+						VIRTUAL_SOCKET e0, c, v;
+						char b[4];
+						if (connect_pair(endpoint, addr.c_str(), 1051 + t, e0, c, v)
+								&& (4 == endpoint.vsend(c, "pool", 4, 0)) && (4 == endpoint.vrecv(v, b, 4, MSG_WAITALL))
+								&& (0 == memcmp(b, "pool", 4))) { ++served; }
+						for (VIRTUAL_SOCKET vsock : {c, v, e0}) { endpoint.vclosesocket(vsock); }
+					});
+		}
+		for (auto &th : threads) { th.join(); }
+		ok = (nthreads == served) && ok;
+
+		VirtualStats after;
+		ok = (0 == vtcp.stats(after)) && (after.connections == before.connections) && ok;
+	}
+
+	std::cout << "CLIENT PROCESS: " << (ok ? "ok" : "not served") << std::endl;
+	return ok;
+}
+
 int main (int argc, char **argv)
 {
+	// スレッドを作る前に、連合するもう1つのブローカを別のプロセスで立てる
+	pid_t peer = fork();
+	if (0 == peer)
+	{
+		federation_peer_fn();
+		_exit(0);
+	}
+
+	// ブローカを持たないクライアントだけのプロセスも、スレッドを作る前に分けておく
+	int ready[2];
+	if (0 != pipe(ready)) { return 1; }
+	pid_t client = fork();
+	if (0 == client)
+	{
+		close(ready[1]);
+		_exit(client_process_fn(ready[0]) ? 0 : 1);
+	}
+	close(ready[0]);
+
 	VirtualTcp::startup();
 
-	std::thread server_th(server_fn);
-	std::thread client_th(client_fn);
+	bool ok = true;
 
-	server_th.join();
-	client_th.join();
+	// ブローカ経由と、同一プロセスでの直接呼び出しの両方で確認する
+	for (VirtualTcpMode mode : {VIRTUAL_TCP_BROKER, VIRTUAL_TCP_DIRECT, VIRTUAL_TCP_SHM})
+	{
+		std::thread server_th(server_fn, mode);
+		std::thread client_th(client_fn, mode);
+
+		server_th.join();
+		client_th.join();
+
+		ok = churn_fn(mode) && ok;
+		ok = crowd_fn(mode) && ok;
+		ok = mux_fn(mode) && ok;
+		ok = flags_fn(mode) && ok;
+		ok = bulk_fn(mode) && ok;
+		ok = gather_fn(mode) && ok;
+		ok = window_fn(mode) && ok;
+		ok = storm_fn(mode) && ok;
+		ok = poll_fn(mode) && ok;
+		ok = async_fn(mode) && ok;
+		ok = federation_fn(mode) && ok;
+		ok = link_fn(mode) && ok;
+		ok = stats_fn(mode) && ok;
+		ok = capture_fn(mode) && ok;
+		ok = pool_fn(mode) && ok;
+		ok = bind_fn(mode) && ok;
+	}
+	ok = frame_fn() && ok;
+
+	// クライアントだけのプロセスを動かして終わるのを待つ. 返ってこなければ止めて失敗にする
+	int status = -1;
+	ok = (1 == write(ready[1], "g", 1)) && ok;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+	while (0 == waitpid(client, &status, WNOHANG))
+	{
+		if (std::chrono::steady_clock::now() > deadline)
+		{
+			kill(client, SIGKILL);
+			waitpid(client, &status, 0);
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	close(ready[1]);
+	ok = WIFEXITED(status) && (0 == WEXITSTATUS(status)) && ok;
 
 	VirtualTcp::cleanup();
+	kill(peer, SIGKILL);
+	waitpid(peer, nullptr, 0);
 
-	return 0;
+	return ok ? 0 : 1;
 }
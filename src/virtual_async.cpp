@@ -0,0 +1,79 @@
+#include <errno.h>
+#include "virtual_async.h"
+
+VirtualAsync::State::State (const VirtualExecutor &executor_)
+	: mtx()
+	  , cv()
+	  , executor(executor_)
+	  , done(false)
+	  , result(-1)
+	  , err(0)
+	  , callback()
+{
+}
+
+void VirtualAsync::State::complete (long result_, int err_)
+{
+	Callback cb;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		done = true;
+		result = result_;
+		err = err_;
+		cb.swap(callback);
+	}
+	cv.notify_all();
+
+	if (cb) { dispatch(cb); }
+}
+
+bool VirtualAsync::State::defer (const Callback &cb)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	if (done) { return false; }
+	callback = cb;
+	return true;
+}
+
+void VirtualAsync::State::then (const Callback &cb)
+{
+	if (! defer(cb)) { dispatch(cb); }
+}
+
+bool VirtualAsync::State::ready ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	return done;
+}
+
+long VirtualAsync::State::wait ()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	cv.wait(lock, [&]() { return done; });
+	if ((result < 0) && (0 != err)) { errno = err; }
+	return result;
+}
+
+// executor がなければ完了させたスレッドでそのまま呼ぶ
+void VirtualAsync::State::dispatch (const Callback &cb)
+{
+	long res;
+	int e;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		res = result;
+		e = err;
+	}
+
+	if (! executor)
+	{
+		cb(res, e);
+		return;
+	}
+	executor([cb, res, e]() { cb(res, e); });
+}
@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <algorithm>
+#include "virtual_broker.h"
+
+VirtualBrokerConnection::VirtualBrokerConnection (uint64_t id_, VirtualStream *stream_, VirtualBroker *broker_)
+	: id(id_)
+	  , broker(broker_)
+	  , stream(stream_)
+	  , input()
+	  , input_begin(0)
+	  , current()
+	  , started()
+	  , output()
+	  , corked(false)
+	  , parked()
+	  , next_key(0)
+	  , resume()
+	  , resumed_mtx()
+	  , resumed()
+	  , wakeups(0)
+	  , closed(false)
+{
+}
+
+void VirtualBrokerConnection::reserve (size_t len)
+{
+	size_t pending = input ? input->used - input_begin : 0;
+	if (input && (input->cap - input->used >= len)) { return; }
+
+	// 誰も参照していなければ未処理の分を先頭へ寄せる
+	if (input.unique() && (input->cap - pending >= len))
+	{
+		memmove(input->data(), input->data() + input_begin, pending);
+		input->used = pending;
+		input_begin = 0;
+		return;
+	}
+
+	// 参照されている領域はそのまま手放し、未処理の分だけ新しい領域へ移す
+	VirtualSegmentPtr seg((pending + len <= VirtualSegment::SIZE)
+			? VirtualSegment::pooled() : VirtualSegment::create(pending + len));
+	if (pending > 0) { memcpy(seg->data(), input->data() + input_begin, pending); }
+	seg->used = pending;
+	input = std::move(seg);
+	input_begin = 0;
+}
+
+// 処理し終えたら領域を手放す. 待機中の接続は領域を持たず、次に届いたときに reserve で取り直す
+void VirtualBrokerConnection::consume (size_t len)
+{
+	input_begin += len;
+	if (input_begin == input->used)
+	{
+		input.reset();
+		input_begin = 0;
+	}
+}
+
+uint64_t VirtualBrokerConnection::prepare ()
+{
+	uint64_t key = next_key++;
+	VirtualBroker *b = broker;
+	uint64_t conn = id;
+	resume = [b, conn, key]() { b->resume(conn, key); };
+
+	return key;
+}
+
+// 小さい要求は複製して、input の領域を掴み続けないようにする
+void VirtualBrokerConnection::park (uint64_t key)
+{
+	if (current.len >= VirtualSegmentQueue::COPY_BELOW)
+	{
+		parked[key] = Parked{current, started};
+		return;
+	}
+
+	VirtualSegmentPtr seg(VirtualSegment::create(current.len));
+	memcpy(seg->data(), current.data(), current.len);
+	seg->used = current.len;
+	parked[key] = Parked{VirtualSlice{std::move(seg), 0, current.len}, started};
+}
+
+std::vector<uint64_t> VirtualBrokerConnection::take_resumed ()
+{
+	std::vector<uint64_t> keys;
+
+	std::lock_guard<std::mutex> lock(resumed_mtx);
+	keys.swap(resumed);
+	return keys;
+}
+
+// 応答の順序を保つため、残りがあるうちは新しい応答も後ろに積む
+void VirtualBrokerConnection::send (const struct iovec *iov, int iovcnt, const VirtualSlice *slices, int nslices)
+{
+	size_t sent = 0;
+	if (output.empty() && (! corked))
+	{
+		int n = std::min(iovcnt + nslices, (int)MaxIov);
+		struct iovec vec[n];
+		for (int i = 0; i < n; ++i)
+		{
+			if (i < iovcnt) { vec[i] = iov[i]; continue; }
+
+			vec[i].iov_base = slices[i - iovcnt].data();
+			vec[i].iov_len = slices[i - iovcnt].len;
+		}
+
+		ssize_t res = stream->sendv_some(vec, n);
+		if (res > 0) { sent = (size_t)res; }
+	}
+
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		size_t skip = std::min(sent, iov[i].iov_len);
+		struct iovec rest = {(char *)iov[i].iov_base + skip, iov[i].iov_len - skip};
+		output.append(&rest, 1, rest.iov_len);
+		sent -= skip;
+	}
+	for (int i = 0; i < nslices; ++i)
+	{
+		size_t skip = std::min(sent, slices[i].len);
+		if (skip < slices[i].len)
+		{
+			output.append(VirtualSlice{slices[i].seg, slices[i].offset + skip, slices[i].len - skip});
+		}
+		sent -= skip;
+	}
+
+	// 溜めすぎないよう、大きくなったら途中でも送る. 切断は最後の flush で気づく
+	if (corked && (output.size() >= CorkLimit)) { flush(); }
+}
+
+bool VirtualBrokerConnection::flush ()
+{
+	while (! output.empty())
+	{
+		struct iovec iov[MaxIov];
+		ssize_t n = stream->sendv_some(iov, output.gather(iov, MaxIov));
+		if (n > 0)
+		{
+			output.consume((size_t)n);
+			continue;
+		}
+		if ((n < 0) && (EINTR == errno)) { continue; }
+
+		return (n < 0) && (EAGAIN == errno);
+	}
+
+	return true;
+}
+
+VirtualBroker::VirtualBroker ()
+	: epfd(-1)
+	  , event(-1)
+	  , running(false)
+	  , workers()
+	  , counters()
+	  , handler()
+	  , mtx()
+	  , next_id(EventId + 1)
+	  , conns()
+	  , listeners()
+	  , ready()
+{
+}
+
+VirtualBroker::~VirtualBroker ()
+{
+	stop();
+}
+
+bool VirtualBroker::start (size_t nworkers, Handler handler_)
+{
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if ((epfd < 0) || (event < 0)) { stop(); return false; }
+
+	// event だけはレベルトリガで、停止時に全ワーカーが抜けられるようにする
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.u64 = EventId;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, event, &ev);
+
+	handler = handler_;
+	running = true;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		for (size_t i = 0; i < nworkers; ++i) { counters.emplace_back(new WorkerCounters()); }
+	}
+	for (size_t i = 0; i < nworkers; ++i)
+	{
+		workers.emplace_back(&VirtualBroker::worker_fn, this, std::ref(*counters[i]));
+	}
+
+	return true;
+}
+
+void VirtualBroker::stop ()
+{
+	running = false;
+	if (0 <= event) { eventfd_write(event, 1); }
+
+	for (auto &th : workers) { th.join(); }
+	workers.clear();
+
+	std::lock_guard<std::mutex> lock(mtx);
+
+	for (auto &it : conns) { it.second->stream->unwatch(epfd); }
+	conns.clear();
+	counters.clear();
+	listeners.clear();
+	ready.clear();
+
+	if (0 <= epfd) { ::close(epfd); }
+	if (0 <= event) { ::close(event); }
+	epfd = -1;
+	event = -1;
+}
+
+// 待ち受けソケットは非ブロッキングにして、イベントごとに受け付けられるだけ受け付ける
+bool VirtualBroker::add_listener (int fd, Acceptor acceptor)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	uint64_t id;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		id = next_id++;
+		listeners.emplace(id, std::make_pair(fd, acceptor));
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u64 = id;
+	return 0 == epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void VirtualBroker::add (VirtualStream *stream)
+{
+	uint64_t id;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		id = next_id++;
+		conns.emplace(id, std::make_shared<VirtualBrokerConnection>(id, stream, this));
+	}
+
+	stream->watch(epfd, id);
+
+	// 登録前に届いていた要求を読む. 共有メモリは待ちを宣言するまでドアベルが鳴らない
+	post(id);
+}
+
+// 接続をワーカーの実行待ちに積む. 停止後は何もしない
+void VirtualBroker::post (uint64_t id)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		if (! running) { return; }
+		ready.push_back(id);
+	}
+
+	eventfd_write(event, 1);
+}
+
+// 預けた継続が呼ばれた. 接続が閉じていれば何もしない
+void VirtualBroker::resume (uint64_t id, uint64_t key)
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto it = conns.find(id);
+		if (conns.end() == it) { return; }
+
+		std::lock_guard<std::mutex> rlock(it->second->resumed_mtx);
+		it->second->resumed.push_back(key);
+	}
+
+	post(id);
+}
+
+void VirtualBroker::stats (std::vector<VirtualWorkerStats> &out, uint64_t &connections)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	out.clear();
+	for (const auto &counter : counters)
+	{
+		out.push_back(VirtualWorkerStats{counter->wakeups.load(std::memory_order_relaxed)
+				, counter->services.load(std::memory_order_relaxed)
+				, counter->busy_ns.load(std::memory_order_relaxed)
+				, counter->busy.load(std::memory_order_relaxed)});
+	}
+	connections = conns.size();
+}
+
+// 書くのは自分だけなので、lock 付きの加算を使わない
+static void bump (std::atomic<uint64_t> &counter, uint64_t n)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void VirtualBroker::worker_fn (WorkerCounters &counter)
+{
+	struct epoll_event events[64];
+
+	while (running)
+	{
+		int n = epoll_wait(epfd, events, 64, -1);
+
+		// epoll_wait から戻ってから次に待つまでを処理中とする
+		auto begin = std::chrono::steady_clock::now();
+		counter.busy.store(1, std::memory_order_relaxed);
+		bump(counter.wakeups, 1);
+		uint64_t services = 0;
+
+		for (int i = 0; i < n; ++i)
+		{
+			uint64_t id = events[i].data.u64;
+			if (EventId == id)
+			{
+				if (running)
+				{
+					eventfd_t value;
+					eventfd_read(event, &value);
+				}
+				continue;
+			}
+
+			bool listener;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				listener = (listeners.end() != listeners.find(id));
+			}
+
+			if (listener) { accept_all(id); }
+			else { drive(id); }
+			++services;
+		}
+
+		// 起こされた継続を処理する
+		while (running)
+		{
+			uint64_t id;
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+
+				if (ready.empty()) { break; }
+				id = ready.front();
+				ready.pop_front();
+			}
+
+			drive(id);
+			++services;
+		}
+
+		bump(counter.services, services);
+		bump(counter.busy_ns, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - begin).count());
+		counter.busy.store(0, std::memory_order_relaxed);
+	}
+}
+
+void VirtualBroker::accept_all (uint64_t id)
+{
+	int fd;
+	Acceptor acceptor;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto it = listeners.find(id);
+		if (listeners.end() == it) { return; }
+		fd = it->second.first;
+		acceptor = it->second.second;
+	}
+
+	while (running)
+	{
+		int sock = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (sock < 0)
+		{
+			if (EINTR == errno) { continue; }
+			break;
+		}
+
+		VirtualStream *stream = acceptor(sock);
+		if (nullptr != stream) { add(stream); }
+	}
+}
+
+// 同じ接続を同時に処理するのは1つのワーカーだけ. 処理中の起床は処理したワーカーが拾い直す
+void VirtualBroker::drive (uint64_t id)
+{
+	std::shared_ptr<VirtualBrokerConnection> conn;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto it = conns.find(id);
+		if (conns.end() == it) { return; }
+		conn = it->second;
+	}
+
+	if (0 != conn->wakeups.fetch_add(1)) { return; }
+
+	uint32_t seen;
+	do
+	{
+		seen = conn->wakeups.load();
+		if (! conn->closed) { service(*conn); }
+	}
+	while (seen != conn->wakeups.fetch_sub(seen));
+}
+
+void VirtualBroker::service (VirtualBrokerConnection &conn)
+{
+	bool eof = false;
+
+	// 処理中の応答はまとめて最後に送る. 要求をいくつ読めても送信のシステムコールは1回で済む
+	conn.corked = true;
+
+	// 届いている分を input の領域へ直接読めるだけ読む
+	while (true)
+	{
+		conn.reserve(1);
+		VirtualSegment *seg = conn.input.get();
+
+		ssize_t n = conn.stream->recv_some(seg->data() + seg->used, seg->cap - seg->used);
+		if (n > 0)
+		{
+			seg->used += n;
+
+			// 領域が埋まったら処理して空ける. 続きを待つ要求の分は handler が reserve する
+			if ((seg->used == seg->cap) && (! handler(conn)))
+			{
+				conn.corked = false;
+				close(conn);
+				return;
+			}
+			continue;
+		}
+		if ((n < 0) && (EINTR == errno)) { continue; }
+
+		eof = (0 == n) || (EAGAIN != errno);
+		break;
+	}
+
+	// 切断前に届いた要求は処理してから閉じる
+	bool ok = handler(conn);
+	conn.corked = false;
+	if ((! ok) || (! conn.flush()) || eof) { close(conn); }
+}
+
+void VirtualBroker::close (VirtualBrokerConnection &conn)
+{
+	conn.closed = true;
+	conn.stream->unwatch(epfd);
+
+	// ソケットに預けた継続は id で引くので、外した後に呼ばれても何もしない
+	std::lock_guard<std::mutex> lock(mtx);
+	conns.erase(conn.id);
+}
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include "virtual_tcp.h"
+#include "virtual_frame.h"
+#include "virtual_link.h"
+#include "virtual_capture.h"
+
+// pcap のファイルヘッダ. 時刻はナノ秒で、パケットは IPv4 のヘッダから始まる
+static const uint32_t PcapMagicNanoseconds = 0xa1b23c4d;
+static const uint32_t LinktypeRaw = 101;
+static const size_t PcapRecordSize = 16;
+static const size_t HeadersSize = 20 + 20;
+
+// リングの記録は [語:4][予備:4][pcap の記録] を 8 バイトに揃えて並べる
+static size_t record_size (size_t len)
+{
+	return (8 + len + 7) & ~(size_t)7;
+}
+
+static uint16_t ip_checksum (const char *header)
+{
+	uint32_t sum = 0;
+	for (int i = 0; i < 20; i += 2) { sum += get_u16(header + i); }
+	while (sum >> 16) { sum = (sum & 0xffff) + (sum >> 16); }
+	return (uint16_t)~sum;
+}
+
+VirtualCapture::VirtualCapture ()
+	: ring()
+	  , head(0)
+	  , tail(0)
+	  , written(0)
+	  , lost(0)
+	  , snaplen(0)
+	  , fp(nullptr)
+	  , running(false)
+	  , writer()
+{
+}
+
+VirtualCapture::~VirtualCapture ()
+{
+	close();
+}
+
+bool VirtualCaptureFilter::parse (const std::string &filter, VirtualCaptureFilter &out)
+{
+	out = VirtualCaptureFilter{0, 0, 0};
+
+	std::string addr = filter;
+	size_t colon = filter.rfind(':');
+	if (std::string::npos != colon)
+	{
+		addr = filter.substr(0, colon);
+		char *end = nullptr;
+		long value = strtol(filter.c_str() + colon + 1, &end, 10);
+		if ((filter.c_str() + colon + 1 == end) || ('\0' != *end) || (value <= 0) || (65535 < value)) { return false; }
+		out.port = htons((unsigned short)value);
+	}
+	if (addr.empty()) { return true; }
+
+	unsigned long net, mask;
+	if (! VirtualLink::parse(addr, net, mask)) { return false; }
+	out.net = (uint32_t)net;
+	out.bits = (unsigned int)__builtin_popcount((uint32_t)mask);
+	return true;
+}
+
+bool VirtualCapture::open (const std::string &path, size_t snaplen_)
+{
+	snaplen = std::min(std::max(snaplen_, HeadersSize), HeadersSize + MAX_PAYLOAD);
+
+	fp = fopen(path.c_str(), "wb");
+	if (nullptr == fp) { return false; }
+	setvbuf(fp, nullptr, _IOFBF, 1024 * 1024);
+
+	// pcap はこのホストのバイトオーダーで書く (magic で読み手が判別する). version は 2.4
+	uint32_t header[6] = {PcapMagicNanoseconds, 0, 0, 0, (uint32_t)snaplen, LinktypeRaw};
+	uint16_t version[2] = {2, 4};
+	memcpy(&(header[1]), version, sizeof(version));
+	fwrite(header, sizeof(header), 1, fp);
+
+	ring.reset(new char[RING_SIZE]());
+	running = true;
+	writer = std::thread(&VirtualCapture::writer_fn, this);
+	return true;
+}
+
+void VirtualCapture::close ()
+{
+	running = false;
+	if (writer.joinable()) { writer.join(); }
+
+	if (nullptr != fp) { fclose(fp); }
+	fp = nullptr;
+}
+
+void VirtualCapture::record (unsigned long src_ip, unsigned short src_port, unsigned long dst_ip, unsigned short dst_port
+		, uint32_t seq, uint32_t ack, size_t window, const struct iovec *iov, int iovcnt, size_t len)
+{
+	uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+
+	for (size_t offset = 0; offset < len; offset += MAX_PAYLOAD)
+	{
+		size_t chunk = std::min(len - offset, (size_t)MAX_PAYLOAD);
+		record_one(ns, src_ip, src_port, dst_ip, dst_port, seq + (uint32_t)offset, ack, window, iov, iovcnt, offset, chunk);
+	}
+}
+
+void VirtualCapture::record_one (uint64_t ns, unsigned long src_ip, unsigned short src_port, unsigned long dst_ip
+		, unsigned short dst_port, uint32_t seq, uint32_t ack, size_t window, const struct iovec *iov, int iovcnt
+		, size_t offset, size_t chunk)
+{
+	size_t caplen = std::min(HeadersSize + chunk, snaplen);
+	size_t len = PcapRecordSize + caplen;
+	size_t need = record_size(len);
+
+	// 末尾に入らなければ、残りを捨てる記録にして先頭から取る
+	uint64_t h = head.load(std::memory_order_relaxed);
+	size_t pad;
+	do
+	{
+		size_t off = (size_t)(h & (RING_SIZE - 1));
+		pad = (RING_SIZE - off < need) ? RING_SIZE - off : 0;
+		if (h + pad + need - tail.load(std::memory_order_acquire) > RING_SIZE)
+		{
+			lost.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+	while (! head.compare_exchange_weak(h, h + pad + need, std::memory_order_relaxed));
+
+	if (pad > 0) { __atomic_store_n((uint32_t *)&(ring[h & (RING_SIZE - 1)]), PAD | (uint32_t)pad, __ATOMIC_RELEASE); }
+	char *rec = &(ring[(h + pad) & (RING_SIZE - 1)]);
+	char *p = rec + 8;
+
+	uint32_t times[4] = {(uint32_t)(ns / 1000000000), (uint32_t)(ns % 1000000000), (uint32_t)caplen
+		, (uint32_t)(HeadersSize + chunk)};
+	memcpy(p, times, sizeof(times));
+	p += PcapRecordSize;
+
+	// IPv4. アドレスとポートは既にネットワークバイトオーダー
+	char *ip = p;
+	memset(ip, 0, HeadersSize);
+	ip[0] = 0x45;
+	put_u16(ip + 2, (uint16_t)(HeadersSize + chunk));
+	put_u16(ip + 6, 0x4000);
+	ip[8] = 64;
+	ip[9] = IPPROTO_TCP;
+	uint32_t addrs[2] = {(uint32_t)src_ip, (uint32_t)dst_ip};
+	memcpy(ip + 12, addrs, sizeof(addrs));
+	put_u16(ip + 10, ip_checksum(ip));
+
+	// TCP. データはすべて PSH | ACK で、チェックサムは計算しない
+	char *tcp = ip + 20;
+	uint16_t ports[2] = {src_port, dst_port};
+	memcpy(tcp, ports, sizeof(ports));
+	put_u32(tcp + 4, seq);
+	put_u32(tcp + 8, ack);
+	tcp[12] = 5 << 4;
+	tcp[13] = 0x18;
+	put_u16(tcp + 14, (uint16_t)std::min(window, (size_t)65535));
+	p += HeadersSize;
+
+	size_t copy = caplen - HeadersSize;
+	for (int i = 0; (i < iovcnt) && (copy > 0); ++i)
+	{
+		if (offset >= iov[i].iov_len)
+		{
+			offset -= iov[i].iov_len;
+			continue;
+		}
+
+		size_t n = std::min(iov[i].iov_len - offset, copy);
+		memcpy(p, (const char *)iov[i].iov_base + offset, n);
+		p += n;
+		copy -= n;
+		offset = 0;
+	}
+
+	__atomic_store_n((uint32_t *)rec, (uint32_t)len, __ATOMIC_RELEASE);
+}
+
+// 書き手はまだ公開していない記録の先で止まる. 読んだ分はまとめて 0 で埋めてから tail を進める
+bool VirtualCapture::drain ()
+{
+	uint64_t begin = tail.load(std::memory_order_relaxed);
+	uint64_t t = begin;
+	uint64_t packets = 0;
+	while (t - begin < RING_SIZE)
+	{
+		char *rec = &(ring[t & (RING_SIZE - 1)]);
+		uint32_t word = __atomic_load_n((uint32_t *)rec, __ATOMIC_ACQUIRE);
+		if (0 == word) { break; }
+
+		if (word & PAD)
+		{
+			t += word & ~PAD;
+			continue;
+		}
+
+		fwrite_unlocked(rec + 8, 1, word, fp);
+		t += record_size(word);
+		++packets;
+	}
+	if (t == begin) { return false; }
+
+	// 折り返していれば2回に分けて埋める
+	size_t from = (size_t)(begin & (RING_SIZE - 1));
+	size_t len = (size_t)(t - begin);
+	size_t first = std::min(len, RING_SIZE - from);
+	memset(&(ring[from]), 0, first);
+	memset(&(ring[0]), 0, len - first);
+
+	tail.store(t, std::memory_order_release);
+	written.fetch_add(packets, std::memory_order_relaxed);
+	return true;
+}
+
+// 書くものがなければ少し眠る. 書き手は起こさないので、send の経路にシステムコールは入らない
+void VirtualCapture::writer_fn ()
+{
+	bool dirty = false;
+	while (running)
+	{
+		if (drain())
+		{
+			dirty = true;
+			continue;
+		}
+
+		if (dirty) { fflush(fp); }
+		dirty = false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	drain();
+	fflush(fp);
+}
@@ -0,0 +1,340 @@
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "virtual_channel.h"
+
+VirtualChannel::VirtualChannel (VirtualStream *stream_)
+	: stream(stream_)
+	  , input(new char[INPUT_SIZE])
+	  , input_begin(0)
+	  , input_end(0)
+	  , send_mtx()
+	  , mtx()
+	  , cv()
+	  , calls()
+	  , next_request(0)
+	  , reading(false)
+	  , broken(nullptr == stream_)
+	  , pending(0)
+	  , stopping(false)
+	  , reader()
+{
+}
+
+// 応答を読んでいる受信スレッドは、通信路を閉じて起こす
+VirtualChannel::~VirtualChannel ()
+{
+	if (! reader.joinable()) { return; }
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stopping = true;
+	}
+	cv.notify_all();
+	stream->shutdown();
+
+	reader.join();
+}
+
+// ヘッダと本文をまとめて送る. 複数スレッドのフレームが混ざらないよう送信は直列にする
+// iovcnt は start と post で MAX_IOV までに絞ってある
+bool VirtualChannel::send (const VirtualFrameHeader &head, const struct iovec *iov, int iovcnt)
+{
+	char buf[VirtualFrameHeader::SIZE];
+	head.encode(buf);
+
+	struct iovec vec[1 + MAX_IOV];
+	vec[0].iov_base = buf;
+	vec[0].iov_len = VirtualFrameHeader::SIZE;
+	std::copy(iov, iov + iovcnt, &(vec[1]));
+
+	std::lock_guard<std::mutex> lock(send_mtx);
+	return stream->sendv_all(vec, 1 + iovcnt);
+}
+
+bool VirtualChannel::call (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+		, int32_t &result, const struct iovec *out, int outcnt, size_t *len)
+{
+	uint32_t request;
+	if (! begin(command, value, iov, iovcnt, request, out, outcnt)) { return false; }
+
+	return finish(request, result, len);
+}
+
+bool VirtualChannel::begin (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+		, uint32_t &request, const struct iovec *out, int outcnt)
+{
+	return start(command, value, iov, iovcnt, request, out, outcnt, nullptr);
+}
+
+bool VirtualChannel::begin_async (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+		, const Completion &completion, const struct iovec *out, int outcnt)
+{
+	uint32_t request;
+	return start(command, value, iov, iovcnt, request, out, outcnt, completion);
+}
+
+bool VirtualChannel::start (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt
+		, uint32_t &request, const struct iovec *out, int outcnt, const Completion &completion)
+{
+	// 本文はヘッダを付けて 1 + MAX_IOV 個の配列に、受け取り先は read_one で IOV_MAX 個の配列に並べ直す
+	if ((iovcnt < 0) || (iovcnt > MAX_IOV) || (outcnt < 0) || (outcnt > IOV_MAX))
+	{
+		errno = EINVAL;
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		if (broken) { return false; }
+		request = next_request++;
+		calls[request].reset(new Call{out, outcnt, 0, -1, 0, false, completion});
+
+		if (completion)
+		{
+			++pending;
+			if (! reader.joinable()) { reader = std::thread(&VirtualChannel::reader_fn, this); }
+		}
+	}
+	if (completion) { cv.notify_all(); }
+
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; ++i) { length += iov[i].iov_len; }
+
+	if (send(VirtualFrameHeader(command, 0, request, value, (uint32_t)length), iov, iovcnt)) { return true; }
+
+	// 応答待ちの他のスレッドも失敗させる. 自分の分は finish か受信スレッドで片付ける
+	std::lock_guard<std::mutex> lock(mtx);
+	broken = true;
+	cv.notify_all();
+	return true;
+}
+
+bool VirtualChannel::finish (uint32_t request, int32_t &result, size_t *len)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	auto it = calls.find(request);
+	if (calls.end() == it) { return false; }
+	Call *c = it->second.get();
+
+	while (! c->done)
+	{
+		// 読んでいる最中は本文を書き込まれうるので、切れていても読み終わりを待つ
+		if (reading)
+		{
+			cv.wait(lock);
+			continue;
+		}
+
+		if (broken)
+		{
+			calls.erase(request);
+			return false;
+		}
+
+		// 代表して1つ読む. 自分の応答でなければ持ち主を起こして続ける
+		Completed completed;
+		reading = true;
+		lock.unlock();
+		bool ok = read_one(completed);
+		lock.lock();
+		reading = false;
+		if (! ok) { broken = true; }
+		cv.notify_all();
+		complete(lock, completed);
+	}
+
+	result = c->result;
+	if (nullptr != len) { *len = c->len; }
+	// ブローカ側の errno をそのまま見せる
+	int err = c->err;
+	calls.erase(request);
+	if ((result < 0) && (0 != err)) { errno = err; }
+	return true;
+}
+
+bool VirtualChannel::post (VirtualTcpCommand command, uint32_t value, const struct iovec *iov, int iovcnt)
+{
+	if ((iovcnt < 0) || (iovcnt > MAX_IOV))
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	size_t length = 0;
+	for (int i = 0; i < iovcnt; ++i) { length += iov[i].iov_len; }
+
+	if (send(VirtualFrameHeader(command, FRAME_NOREPLY, 0, value, (uint32_t)length), iov, iovcnt)) { return true; }
+
+	std::lock_guard<std::mutex> lock(mtx);
+	broken = true;
+	cv.notify_all();
+	return false;
+}
+
+bool VirtualChannel::alive ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+	return ! broken;
+}
+
+// 先読みした分を写し、足りない分は iov へ直接読む
+bool VirtualChannel::read_exact (const struct iovec *iov, int iovcnt)
+{
+	struct iovec rest[IOV_MAX];
+	int m = 0;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		size_t n = std::min(iov[i].iov_len, input_end - input_begin);
+		memcpy(iov[i].iov_base, &(input[input_begin]), n);
+		input_begin += n;
+
+		if (n < iov[i].iov_len)
+		{
+			rest[m].iov_base = (char *)iov[i].iov_base + n;
+			rest[m].iov_len = iov[i].iov_len - n;
+			++m;
+		}
+	}
+
+	return (0 == m) || stream->recvv_all(rest, m);
+}
+
+// 応答を1つ読み、待ち手の領域へ本文を直接書き込む
+// begin_async の応答なら completed に移し、呼ぶのは呼び出し側に任せる
+// 持ち主は done になるか broken になるまで Call を消さないので、ここではロックを持たずに書ける
+bool VirtualChannel::read_one (Completed &completed)
+{
+	// ヘッダが揃うまで読む. 続けて届いている本文や次の応答も同じ受信で先読みする
+	if (input_end - input_begin < VirtualFrameHeader::SIZE)
+	{
+		size_t have = input_end - input_begin;
+		memmove(&(input[0]), &(input[input_begin]), have);
+		input_begin = 0;
+		input_end = have;
+
+		ssize_t n = stream->recv_least(&(input[have]), VirtualFrameHeader::SIZE - have, INPUT_SIZE - have);
+		if (n < 0) { return false; }
+		input_end += (size_t)n;
+	}
+
+	VirtualFrameHeader head;
+	if (! head.decode(&(input[input_begin]))) { return false; }
+	input_begin += VirtualFrameHeader::SIZE;
+
+	Call *c = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		auto it = calls.find(head.request);
+		if (calls.end() != it) { c = it->second.get(); }
+	}
+
+	// 受け取り先の iovec を本文の長さで切り詰めてまとめて読む
+	size_t n = 0;
+	int outcnt = (nullptr != c) ? c->outcnt : 0;
+	struct iovec out[IOV_MAX];
+	int m = 0;
+	for (int i = 0; (i < outcnt) && (n < head.length); ++i)
+	{
+		out[m].iov_base = c->out[i].iov_base;
+		out[m].iov_len = std::min(c->out[i].iov_len, head.length - n);
+		n += out[m].iov_len;
+		++m;
+	}
+	if ((n > 0) && (! read_exact(out, m))) { return false; }
+
+	// 受け取り先に入りきらない分は読み捨てる
+	char scratch[4096];
+	for (size_t rest = head.length - n; rest > 0; )
+	{
+		struct iovec iov = {scratch, std::min(rest, sizeof(scratch))};
+		if (! read_exact(&iov, 1)) { return false; }
+		rest -= iov.iov_len;
+	}
+
+	if (nullptr == c) { return true; }
+
+	std::lock_guard<std::mutex> lock(mtx);
+	c->len = n;
+	c->result = (int32_t)head.value;
+	c->err = head.flags;
+	c->done = true;
+
+	if (c->completion)
+	{
+		completed.completion.swap(c->completion);
+		completed.result = (int32_t)head.value;
+		completed.err = head.flags;
+		completed.len = n;
+		calls.erase(head.request);
+		--pending;
+	}
+	return true;
+}
+
+void VirtualChannel::complete (std::unique_lock<std::mutex> &lock, Completed &completed)
+{
+	if (! completed.completion) { return; }
+
+	lock.unlock();
+	completed.completion(completed.result, completed.err, completed.len);
+	lock.lock();
+}
+
+// begin_async の応答を待っている間だけ読む. finish で待っているスレッドが読んでいればそちらに任せる
+void VirtualChannel::reader_fn ()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	while (! stopping)
+	{
+		if (reading || ((! broken) && (0 == pending)))
+		{
+			cv.wait(lock);
+			continue;
+		}
+		if (broken)
+		{
+			fail_pending(lock);
+			cv.wait(lock);
+			continue;
+		}
+
+		Completed completed;
+		reading = true;
+		lock.unlock();
+		bool ok = read_one(completed);
+		lock.lock();
+		reading = false;
+		if (! ok) { broken = true; }
+		cv.notify_all();
+		complete(lock, completed);
+	}
+
+	fail_pending(lock);
+}
+
+// 応答の来なくなった begin_async を失敗させる. mtx を保持し、読んでいるスレッドがいないこと
+void VirtualChannel::fail_pending (std::unique_lock<std::mutex> &lock)
+{
+	std::vector<Completion> failed;
+	for (auto it = calls.begin(); it != calls.end(); )
+	{
+		if (! it->second->completion)
+		{
+			++it;
+			continue;
+		}
+
+		failed.push_back(std::move(it->second->completion));
+		it = calls.erase(it);
+	}
+	pending = 0;
+
+	lock.unlock();
+	for (auto &completion : failed) { completion(-1, ECONNRESET, 0); }
+	lock.lock();
+}
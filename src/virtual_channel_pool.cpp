@@ -0,0 +1,70 @@
+#include <algorithm>
+#include <thread>
+#include "virtual_channel_pool.h"
+
+VirtualChannelPool::VirtualChannelPool (size_t size_)
+	: size(size_)
+	  , mtx()
+	  , cv()
+	  , entries()
+	  , generation(0)
+{
+	if (0 == size) { size = std::min(std::max((size_t)std::thread::hardware_concurrency(), (size_t)1), (size_t)MAX_SIZE); }
+}
+
+std::shared_ptr<VirtualChannel> VirtualChannelPool::any_alive (Entry &entry)
+{
+	for (Slot &slot : entry.slots)
+	{
+		if (slot.channel && slot.channel->alive()) { return slot.channel; }
+	}
+	return nullptr;
+}
+
+// 順番の枠が生きていればそれを、空いているか切れていれば張り直して返す
+std::shared_ptr<VirtualChannel> VirtualChannelPool::acquire (uint64_t key, const Connector &connect)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	Entry &entry = entries[key];
+	if (entry.slots.empty()) { entry.slots.resize(size, Slot{nullptr, false}); }
+	Slot &slot = entry.slots[entry.next];
+	entry.next = (entry.next + 1) % size;
+
+	// 他の acquire が張っている最中なら、生きている別の接続を借りるか、張り終えるのを待つ
+	while (slot.connecting)
+	{
+		std::shared_ptr<VirtualChannel> other = any_alive(entry);
+		if (other) { return other; }
+		cv.wait(lock);
+	}
+	if (slot.channel && slot.channel->alive()) { return slot.channel; }
+
+	slot.channel.reset();
+	slot.connecting = true;
+	uint64_t gen = generation;
+	lock.unlock();
+
+	std::shared_ptr<VirtualChannel> channel(new VirtualChannel(connect(key)));
+	bool ok = channel->alive();
+
+	lock.lock();
+	slot.connecting = false;
+	if (ok && (gen == generation)) { slot.channel = channel; }
+	cv.notify_all();
+
+	// 繋がらなければ、他の枠の生きている接続で代える
+	return ok ? channel : any_alive(entry);
+}
+
+// 枠は残して接続だけ外す. 張っている最中の枠は、張り終えた acquire が generation を見て置かずに返す
+void VirtualChannelPool::clear ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	++generation;
+	for (auto &it : entries)
+	{
+		for (Slot &slot : it.second.slots) { slot.channel.reset(); }
+	}
+}
@@ -0,0 +1,159 @@
+#include "virtual_epoll.h"
+
+VirtualEpoll::VirtualEpoll ()
+	: mtx()
+	  , cv()
+	  , entries()
+	  , ready()
+	  , parked()
+	  , is_closed(false)
+{
+}
+
+void VirtualEpoll::mark (VIRTUAL_SOCKET s)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	auto it = entries.find(s);
+	if ((entries.end() == it) || it->second.queued) { return; }
+
+	it->second.queued = true;
+	ready.push_back(s);
+
+	wake(lock);
+}
+
+bool VirtualEpoll::add (VIRTUAL_SOCKET s, uint32_t events, uint64_t data)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	if (! entries.emplace(s, Entry{events, data, true}).second) { return false; }
+	ready.push_back(s);
+
+	wake(lock);
+	return true;
+}
+
+// 条件が変わったので調べ直させる
+bool VirtualEpoll::modify (VIRTUAL_SOCKET s, uint32_t events, uint64_t data)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	auto it = entries.find(s);
+	if (entries.end() == it) { return false; }
+
+	it->second.events = events;
+	it->second.data = data;
+	if (it->second.queued) { return true; }
+
+	it->second.queued = true;
+	ready.push_back(s);
+
+	wake(lock);
+	return true;
+}
+
+// ready に残っていても、取り出した側が lookup で読み飛ばす
+bool VirtualEpoll::remove (VIRTUAL_SOCKET s)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	return 0 < entries.erase(s);
+}
+
+bool VirtualEpoll::lookup (VIRTUAL_SOCKET s, Entry &entry)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	auto it = entries.find(s);
+	if (entries.end() == it) { return false; }
+
+	entry = it->second;
+	return true;
+}
+
+std::vector<VIRTUAL_SOCKET> VirtualEpoll::take_ready ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	std::vector<VIRTUAL_SOCKET> ss;
+	ss.swap(ready);
+	for (VIRTUAL_SOCKET s : ss)
+	{
+		auto it = entries.find(s);
+		if (entries.end() != it) { it->second.queued = false; }
+	}
+
+	return ss;
+}
+
+void VirtualEpoll::requeue (const std::vector<VIRTUAL_SOCKET> &ss)
+{
+	if (ss.empty()) { return; }
+
+	std::lock_guard<std::mutex> lock(mtx);
+
+	for (VIRTUAL_SOCKET s : ss)
+	{
+		auto it = entries.find(s);
+		if ((entries.end() == it) || it->second.queued) { continue; }
+
+		it->second.queued = true;
+		ready.push_back(s);
+	}
+}
+
+bool VirtualEpoll::park (const std::function<void()> &resume)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	if ((! ready.empty()) || is_closed) { return false; }
+
+	parked.push_back(resume);
+	return true;
+}
+
+void VirtualEpoll::wait_until (Clock::time_point deadline)
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	cv.wait_until(lock, deadline, [&]() { return (! ready.empty()) || is_closed; });
+}
+
+void VirtualEpoll::notify ()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	wake(lock);
+}
+
+void VirtualEpoll::close ()
+{
+	std::unique_lock<std::mutex> lock(mtx);
+
+	is_closed = true;
+	entries.clear();
+	ready.clear();
+
+	wake(lock);
+}
+
+bool VirtualEpoll::closed ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	return is_closed;
+}
+
+// VirtualSocketImpl::wake と同じく、継続はロックを外してから呼ぶ
+// 継続が自分への最後の参照を持っていることがあるので (vpoll)、呼んだ後はメンバに触れない
+void VirtualEpoll::wake (std::unique_lock<std::mutex> &lock)
+{
+	std::vector<std::function<void()>> resumes;
+	resumes.swap(parked);
+
+	lock.unlock();
+	cv.notify_all();
+
+	for (auto &resume : resumes) { resume(); }
+}
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <algorithm>
+#include "virtual_tcp.h"
+#include "virtual_link.h"
+
+VirtualLink::VirtualLink (unsigned long src_net_, unsigned long src_mask_, unsigned long dst_net_, unsigned long dst_mask_
+		, const VirtualLinkProfile &profile_)
+	: profile(profile_)
+	  , src_net(src_net_ & src_mask_)
+	  , src_mask(src_mask_)
+	  , dst_net(dst_net_ & dst_mask_)
+	  , dst_mask(dst_mask_)
+	  , mtx()
+	  , buckets()
+	  , rng(std::random_device()())
+{
+}
+
+bool VirtualLink::parse (const std::string &cidr, unsigned long &net, unsigned long &mask)
+{
+	std::string addr = cidr;
+	int bits = 32;
+
+	size_t slash = cidr.find('/');
+	if (std::string::npos != slash)
+	{
+		addr = cidr.substr(0, slash);
+		char *end = nullptr;
+		bits = (int)strtol(cidr.c_str() + slash + 1, &end, 10);
+		if ((cidr.c_str() + slash + 1 == end) || ('\0' != *end) || (bits < 0) || (32 < bits)) { return false; }
+	}
+
+	struct in_addr in;
+	if (1 != inet_pton(AF_INET, addr.c_str(), &in)) { return false; }
+
+	mask = htonl((0 == bits) ? 0 : (uint32_t)(0xffffffffu << (32 - bits)));
+	net = in.s_addr & mask;
+	return true;
+}
+
+bool VirtualLink::match (unsigned long src, unsigned long dst) const
+{
+	return (((src & src_mask) == src_net) && ((dst & dst_mask) == dst_net))
+		|| (((src & dst_mask) == dst_net) && ((dst & src_mask) == src_net));
+}
+
+VirtualLink::Clock::time_point VirtualLink::arrival (unsigned long src, unsigned long dst, size_t len, Clock::time_point now)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	// 送り出せる時刻. トークンは負まで借りられ、借りた分を rate で返し終えるまで遅れる
+	Clock::time_point depart = now;
+	if (0 < profile.rate)
+	{
+		uint64_t key = ((uint64_t)(uint32_t)src << 32) | (uint32_t)dst;
+		auto it = buckets.find(key);
+		if (buckets.end() == it) { it = buckets.emplace(key, Bucket{(double)profile.burst, now}).first; }
+
+		Bucket &bucket = it->second;
+		double elapsed = std::chrono::duration<double>(now - bucket.last).count();
+		bucket.tokens = std::min(bucket.tokens + elapsed * profile.rate, (double)profile.burst);
+		bucket.last = now;
+		bucket.tokens -= (double)len;
+
+		if (bucket.tokens < 0)
+		{
+			depart += std::chrono::duration_cast<Clock::duration>(
+					std::chrono::duration<double>(-bucket.tokens / profile.rate));
+		}
+	}
+
+	Clock::duration delay = profile.delay;
+	if (0 < profile.jitter.count())
+	{
+		std::uniform_int_distribution<long long> dist(-profile.jitter.count(), profile.jitter.count());
+		delay += std::chrono::microseconds(dist(rng));
+		delay = std::max(delay, Clock::duration(0));
+	}
+
+	std::uniform_real_distribution<double> coin(0.0, 1.0);
+	if (0.0 < profile.loss)
+	{
+		Clock::duration rto = profile.rto;
+		for (int i = 0; (i < MAX_RETRIES) && (coin(rng) < profile.loss); ++i)
+		{
+			delay += rto;
+			rto *= 2;
+		}
+	}
+	if ((0.0 < profile.reorder) && (coin(rng) < profile.reorder)) { delay += profile.delay; }
+
+	return depart + delay;
+}
@@ -0,0 +1,135 @@
+#include <algorithm>
+#include "virtual_peer.h"
+
+VirtualPeer::VirtualPeer (VirtualStream *stream_, const std::string &host_, int port_, const Broken &broken_)
+	: host(host_)
+	  , port(port_)
+	  , id(0)
+	  , stream(stream_)
+	  , mtx()
+	  , cv()
+	  , out()
+	  , stopping(false)
+	  , is_broken(false)
+	  , on_broken(broken_)
+	  , writer()
+	  , reader()
+{
+	writer = std::thread(&VirtualPeer::writer_fn, this);
+	reader = std::thread(&VirtualPeer::reader_fn, this);
+}
+
+VirtualPeer::~VirtualPeer ()
+{
+	close();
+}
+
+bool VirtualPeer::post (VirtualTcpCommand command, uint32_t request, uint32_t value
+		, const char *body, size_t len, const std::vector<VirtualSlice> *slices)
+{
+	size_t length = len;
+	if (nullptr != slices)
+	{
+		for (const VirtualSlice &slice : *slices) { length += slice.len; }
+	}
+
+	bool first;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		if (is_broken || stopping) { return false; }
+
+		// 書き込み用のスレッドが送っている間に積まれた分は、次の1回にまとめて送る
+		first = out.empty();
+		size_t pos = out.size();
+		out.resize(pos + VirtualFrameHeader::SIZE + length);
+		char *p = &(out[pos]);
+		VirtualFrameHeader(command, FRAME_NOREPLY, request, value, (uint32_t)length).encode(p);
+		p += VirtualFrameHeader::SIZE;
+		if (len > 0)
+		{
+			std::copy(body, body + len, p);
+			p += len;
+		}
+		if (nullptr != slices)
+		{
+			for (const VirtualSlice &slice : *slices)
+			{
+				std::copy(slice.data(), slice.data() + slice.len, p);
+				p += slice.len;
+			}
+		}
+	}
+	if (first) { cv.notify_one(); }
+
+	return true;
+}
+
+bool VirtualPeer::broken ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	return is_broken;
+}
+
+void VirtualPeer::close ()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		stopping = true;
+	}
+	cv.notify_all();
+
+	if (writer.joinable()) { writer.join(); }
+	if (nullptr != stream) { stream->shutdown(); }
+	if (reader.joinable()) { reader.join(); }
+}
+
+void VirtualPeer::writer_fn ()
+{
+	std::vector<char> buf;
+
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true)
+	{
+		cv.wait(lock, [&]() { return stopping || is_broken || (! out.empty()); });
+		if (is_broken || out.empty()) { break; }
+
+		buf.clear();
+		buf.swap(out);
+
+		lock.unlock();
+		bool ok = stream->send_all(buf.data(), buf.size());
+		lock.lock();
+
+		if (! ok) { break; }
+	}
+	lock.unlock();
+
+	fail();
+}
+
+// 相手は何も送ってこないので、戻ってきたら切断されている
+void VirtualPeer::reader_fn ()
+{
+	char c;
+	while (stream->recv_all(&c, 1)) {}
+
+	fail();
+}
+
+void VirtualPeer::fail ()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		if (is_broken) { return; }
+		is_broken = true;
+		out.clear();
+		if (stopping) { return; }
+	}
+	cv.notify_all();
+
+	if (on_broken) { on_broken(*this); }
+}
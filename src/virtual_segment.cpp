@@ -0,0 +1,402 @@
+#include <string.h>
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include "virtual_segment.h"
+
+// 段階ごとの空き領域の置き場. 静的なソケット表より後まで使われうるので、破棄が要らない形で持つ
+struct SegmentPool
+{
+	std::mutex mtx;
+	VirtualSegment *head;
+	size_t count;
+};
+
+// 1段階あたりプールに置いておく上限. 超えた分は解放する
+static const size_t MaxPooledBytes = 16 * 1024 * 1024;
+static SegmentPool pools[VirtualSegment::CLASSES];
+
+static size_t class_size (int c)
+{
+	return VirtualSegment::MIN_SIZE << (2 * c);
+}
+
+// cap がちょうど段階の大きさならその番号、そうでなければ -1
+static int class_of (size_t cap)
+{
+	for (int c = 0; c < VirtualSegment::CLASSES; ++c)
+	{
+		if (class_size(c) == cap) { return c; }
+	}
+	return -1;
+}
+
+VirtualSegment *VirtualSegment::create (size_t cap)
+{
+	void *p = ::operator new(sizeof(VirtualSegment) + cap);
+	VirtualSegment *seg = new (p) VirtualSegment();
+	seg->refs.store(1, std::memory_order_relaxed);
+	seg->cap = cap;
+	seg->used = 0;
+	seg->next_free = nullptr;
+
+	return seg;
+}
+
+VirtualSegment *VirtualSegment::pooled (size_t len)
+{
+	int c = 0;
+	while ((c + 1 < CLASSES) && (class_size(c) < len)) { ++c; }
+
+	VirtualSegment *seg = nullptr;
+	{
+		SegmentPool &pool = pools[c];
+		std::lock_guard<std::mutex> lock(pool.mtx);
+
+		if (nullptr != pool.head)
+		{
+			seg = pool.head;
+			pool.head = seg->next_free;
+			--pool.count;
+		}
+	}
+	if (nullptr == seg) { return VirtualSegment::create(class_size(c)); }
+
+	seg->refs.store(1, std::memory_order_relaxed);
+	seg->used = 0;
+	seg->next_free = nullptr;
+	return seg;
+}
+
+void VirtualSegment::release ()
+{
+	if (1 != refs.fetch_sub(1, std::memory_order_acq_rel)) { return; }
+
+	int c = class_of(cap);
+	if (0 <= c)
+	{
+		SegmentPool &pool = pools[c];
+		std::lock_guard<std::mutex> lock(pool.mtx);
+
+		if ((pool.count + 1) * cap <= MaxPooledBytes)
+		{
+			next_free = pool.head;
+			pool.head = this;
+			++pool.count;
+			return;
+		}
+	}
+
+	this->~VirtualSegment();
+	::operator delete((void *)this);
+}
+
+void VirtualSegment::trim ()
+{
+	for (SegmentPool &pool : pools)
+	{
+		VirtualSegment *head;
+		{
+			std::lock_guard<std::mutex> lock(pool.mtx);
+
+			head = pool.head;
+			pool.head = nullptr;
+			pool.count = 0;
+		}
+
+		while (nullptr != head)
+		{
+			VirtualSegment *seg = head;
+			head = seg->next_free;
+			seg->~VirtualSegment();
+			::operator delete((void *)seg);
+		}
+	}
+}
+
+size_t VirtualSegment::pooled_bytes ()
+{
+	size_t total = 0;
+	for (int c = 0; c < CLASSES; ++c)
+	{
+		std::lock_guard<std::mutex> lock(pools[c].mtx);
+		total += pools[c].count * class_size(c);
+	}
+
+	return total;
+}
+
+VirtualSegmentQueue::VirtualSegmentQueue ()
+	: slices()
+	  , first(0)
+	  , bytes(0)
+	  , tail()
+{
+}
+
+size_t VirtualSegmentQueue::append (const struct iovec *iov, int iovcnt, size_t limit, const VirtualSegmentPtr *owner)
+{
+	const char *begin = ((nullptr != owner) && (*owner)) ? (*owner)->data() : nullptr;
+	const char *end = (nullptr != begin) ? begin + (*owner)->used : nullptr;
+
+	size_t n = 0;
+	for (int i = 0; (i < iovcnt) && (n < limit); ++i)
+	{
+		const char *buf = (const char *)iov[i].iov_base;
+		size_t m = std::min(iov[i].iov_len, limit - n);
+		if (0 == m) { continue; }
+
+		if ((nullptr != begin) && (m >= COPY_BELOW) && (begin <= buf) && (buf + m <= end))
+		{
+			slices.push_back(VirtualSlice{*owner, (size_t)(buf - begin), m});
+			bytes += m;
+		}
+		else
+		{
+			append_copy(buf, m);
+		}
+		n += m;
+	}
+
+	return n;
+}
+
+void VirtualSegmentQueue::append (const VirtualSlice &slice)
+{
+	if (slice.len < COPY_BELOW)
+	{
+		append_copy(slice.data(), slice.len);
+		return;
+	}
+
+	slices.push_back(slice);
+	bytes += slice.len;
+}
+
+void VirtualSegmentQueue::append_copy (const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		// 誰も参照していなければ先頭から使い直す
+		if (tail.unique()) { tail->used = 0; }
+		if ((! tail) || (tail->used == tail->cap)) { tail = VirtualSegmentPtr(VirtualSegment::pooled()); }
+
+		size_t m = std::min(len, tail->cap - tail->used);
+		memcpy(tail->data() + tail->used, buf, m);
+
+		// 直前の切片の続きならその切片を伸ばす
+		if ((first < slices.size()) && (slices.back().seg.get() == tail.get())
+				&& (slices.back().offset + slices.back().len == tail->used))
+		{
+			slices.back().len += m;
+		}
+		else
+		{
+			slices.push_back(VirtualSlice{tail, tail->used, m});
+		}
+
+		tail->used += m;
+		bytes += m;
+		buf += m;
+		len -= m;
+	}
+}
+
+size_t VirtualSegmentQueue::copy (const struct iovec *iov, int iovcnt) const
+{
+	size_t n = 0;
+	auto it = slices.begin() + first;
+	size_t off = 0;
+
+	for (int i = 0; (i < iovcnt) && (slices.end() != it); ++i)
+	{
+		char *buf = (char *)iov[i].iov_base;
+		size_t want = iov[i].iov_len;
+
+		while ((want > 0) && (slices.end() != it))
+		{
+			size_t m = std::min(want, it->len - off);
+			memcpy(buf, it->data() + off, m);
+
+			buf += m;
+			want -= m;
+			off += m;
+			n += m;
+			if (off == it->len)
+			{
+				++it;
+				off = 0;
+			}
+		}
+	}
+
+	return n;
+}
+
+size_t VirtualSegmentQueue::share (size_t len, std::vector<VirtualSlice> &out) const
+{
+	size_t n = 0;
+	for (auto it = slices.begin() + first; (slices.end() != it) && (n < len); ++it)
+	{
+		size_t m = std::min(it->len, len - n);
+		out.push_back(VirtualSlice{it->seg, it->offset, m});
+		n += m;
+	}
+
+	return n;
+}
+
+// 空になったら自前の領域も手放し、使っていないソケットが領域を持ち続けないようにする
+void VirtualSegmentQueue::consume (size_t len)
+{
+	while ((len > 0) && (first < slices.size()))
+	{
+		VirtualSlice &front = slices[first];
+		if (front.len <= len)
+		{
+			len -= front.len;
+			bytes -= front.len;
+			front = VirtualSlice();
+			++first;
+			continue;
+		}
+
+		front.offset += len;
+		front.len -= len;
+		bytes -= len;
+		len = 0;
+	}
+
+	if (0 == bytes)
+	{
+		clear();
+		return;
+	}
+
+	// 読み終えた先頭が溜まったら詰める
+	if ((first >= 64) && (first * 2 >= slices.size()))
+	{
+		slices.erase(slices.begin(), slices.begin() + first);
+		first = 0;
+	}
+}
+
+int VirtualSegmentQueue::gather (struct iovec *iov, int max) const
+{
+	int n = 0;
+	for (auto it = slices.begin() + first; (slices.end() != it) && (n < max); ++it, ++n)
+	{
+		iov[n].iov_base = it->data();
+		iov[n].iov_len = it->len;
+	}
+
+	return n;
+}
+
+void VirtualSegmentQueue::clear ()
+{
+	slices.clear();
+	if (slices.capacity() > 64) { slices.shrink_to_fit(); }
+	first = 0;
+	bytes = 0;
+	tail.reset();
+}
+
+VirtualByteRing::VirtualByteRing ()
+	: seg()
+	  , cap(0)
+	  , head(0)
+	  , tail(0)
+{
+}
+
+// 公開は tail の書き込みで行う. 読み手は tail を読んでから中身を読む
+size_t VirtualByteRing::push (const struct iovec *iov, int iovcnt, size_t limit)
+{
+	uint64_t t = tail.load(std::memory_order_relaxed);
+	limit = std::min(limit, room());
+
+	size_t n = 0;
+	for (int i = 0; (i < iovcnt) && (n < limit); ++i)
+	{
+		const char *buf = (const char *)iov[i].iov_base;
+		size_t m = std::min(iov[i].iov_len, limit - n);
+		while (m > 0)
+		{
+			size_t pos = (size_t)((t + n) & (cap - 1));
+			size_t k = std::min(m, cap - pos);
+			memcpy(seg->data() + pos, buf, k);
+			buf += k;
+			m -= k;
+			n += k;
+		}
+	}
+
+	if (n > 0) { tail.store(t + n); }
+	return n;
+}
+
+size_t VirtualByteRing::copy (size_t skip, const struct iovec *iov, int iovcnt) const
+{
+	uint64_t h = head.load(std::memory_order_relaxed);
+	size_t avail = (size_t)(tail.load() - h);
+	if (avail <= skip) { return 0; }
+	avail -= skip;
+	h += skip;
+
+	size_t n = 0;
+	for (int i = 0; (i < iovcnt) && (n < avail); ++i)
+	{
+		char *buf = (char *)iov[i].iov_base;
+		size_t m = std::min(iov[i].iov_len, avail - n);
+		while (m > 0)
+		{
+			size_t pos = (size_t)((h + n) & (cap - 1));
+			size_t k = std::min(m, cap - pos);
+			memcpy(buf, seg->data() + pos, k);
+			buf += k;
+			m -= k;
+			n += k;
+		}
+	}
+
+	return n;
+}
+
+// 空いた分は書き手が head を読んだときに見える
+void VirtualByteRing::consume (size_t len)
+{
+	head.store(head.load(std::memory_order_relaxed) + len);
+}
+
+// 位置はそのままで、溜まっている分を新しい領域の同じ位置へ移す
+bool VirtualByteRing::grow (size_t len)
+{
+	uint64_t h = head.load(std::memory_order_relaxed);
+	uint64_t t = tail.load(std::memory_order_relaxed);
+	size_t want = std::min(std::max((size_t)(t - h) + len, (size_t)MIN_SIZE), (size_t)MAX_SIZE);
+	if (want <= cap) { return false; }
+
+	VirtualSegmentPtr next(VirtualSegment::pooled(want));
+	size_t ncap = next->cap;
+	for (uint64_t i = h; i < t; )
+	{
+		size_t from = (size_t)(i & (cap - 1));
+		size_t to = (size_t)(i & (ncap - 1));
+		size_t k = std::min({(size_t)(t - i), cap - from, ncap - to});
+		memcpy(next->data() + to, seg->data() + from, k);
+		i += k;
+	}
+
+	seg = std::move(next);
+	cap = ncap;
+	return true;
+}
+
+void VirtualByteRing::clear ()
+{
+	seg.reset();
+	cap = 0;
+	head.store(0, std::memory_order_relaxed);
+	tail.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include "virtual_tcp.h"
+
+static constexpr uint32_t GenerationMask = (1u << VirtualSocketTable::GenerationBits) - 1;
+static constexpr uint32_t SlotMask = (1u << VirtualSocketTable::SlotBits) - 1;
+
+void VirtualSocketTable::Ref::reset ()
+{
+	if (nullptr == slot) { return; }
+
+	table->release(*slot);
+	slot = nullptr;
+}
+
+VirtualSocketTable::VirtualSocketTable ()
+	: chunks()
+	  , next_slot(0)
+	  , free_lists()
+{
+	for (auto &chunk : chunks) { chunk.store(nullptr); }
+}
+
+VirtualSocketTable::~VirtualSocketTable ()
+{
+	clear();
+}
+
+VIRTUAL_SOCKET VirtualSocketTable::create (unsigned long ip, unsigned short port, size_t shard)
+{
+	shard %= MaxShards;
+
+	uint32_t idx;
+	if (! pop_free(shard, idx))
+	{
+		idx = next_slot.fetch_add(1);
+		if (idx < MaxSlots)
+		{
+			// チャンクは最初に使われたときに確保する. 競合した側は自分の確保分を捨てる
+			size_t c = idx / ChunkSlots;
+			Slot *chunk = chunks[c].load(std::memory_order_acquire);
+			if (nullptr == chunk)
+			{
+				Slot *nchunk = new Slot[ChunkSlots];
+				for (size_t i = 0; i < ChunkSlots; ++i) { nchunk[i].index = (uint32_t)(c * ChunkSlots + i); }
+				if (! chunks[c].compare_exchange_strong(chunk, nchunk, std::memory_order_acq_rel))
+				{
+					delete[] nchunk;
+				}
+			}
+		}
+		else
+		{
+			next_slot.fetch_sub(1);
+
+			// 新しいスロットが尽きたら他の shard が返したスロットを使う
+			bool found = false;
+			for (size_t i = 1; (i < MaxShards) && (! found); ++i) { found = pop_free((shard + i) % MaxShards, idx); }
+			if (! found) { return INVALID_SOCKET; }
+		}
+	}
+
+	Slot &slot = *slot_at(idx);
+	slot.shard = (uint32_t)shard;
+
+	uint64_t gen = slot.state.load(std::memory_order_relaxed) >> 32;
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)((((uint32_t)gen & GenerationMask) << SlotBits) | idx);
+	slot.sock.reset(s, ip, port);
+
+	slot.state.store((gen << 32) | LiveBit, std::memory_order_release);
+
+	return s;
+}
+
+VirtualSocketTable::Ref VirtualSocketTable::acquire (VIRTUAL_SOCKET s)
+{
+	if (s < 0) { return Ref(); }
+
+	uint32_t idx = (uint32_t)s & SlotMask;
+	uint32_t gen = ((uint32_t)s >> SlotBits) & GenerationMask;
+
+	Slot *slot = slot_at(idx);
+	if (nullptr == slot) { return Ref(); }
+
+	uint64_t state = slot->state.load(std::memory_order_acquire);
+	do
+	{
+		if (! (state & LiveBit)) { return Ref(); }
+		if (((uint32_t)(state >> 32) & GenerationMask) != gen) { return Ref(); }
+	}
+	while (! slot->state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel));
+
+	return Ref(this, slot);
+}
+
+// ハンドルを無効にする. 参照が残っている場合は最後の参照が外れたときに再利用へ回る
+bool VirtualSocketTable::retire (VIRTUAL_SOCKET s)
+{
+	if (s < 0) { return false; }
+
+	uint32_t idx = (uint32_t)s & SlotMask;
+	uint32_t gen = ((uint32_t)s >> SlotBits) & GenerationMask;
+
+	Slot *slot = slot_at(idx);
+	if (nullptr == slot) { return false; }
+
+	uint64_t state = slot->state.load(std::memory_order_acquire);
+	do
+	{
+		if (! (state & LiveBit)) { return false; }
+		if (((uint32_t)(state >> 32) & GenerationMask) != gen) { return false; }
+	}
+	while (! slot->state.compare_exchange_weak(state, state & ~LiveBit, std::memory_order_acq_rel));
+
+	if (0 == (state & RefMask)) { recycle(*slot); }
+	return true;
+}
+
+void VirtualSocketTable::for_each (const std::function<void(VirtualSocketImpl &)> &fn)
+{
+	uint32_t n = std::min((uint32_t)MaxSlots, next_slot.load(std::memory_order_acquire));
+	for (uint32_t idx = 0; idx < n; ++idx)
+	{
+		Slot *slot = slot_at(idx);
+		if ((nullptr == slot) || (! try_ref(*slot))) { continue; }
+
+		Ref ref(this, slot);
+		fn(slot->sock);
+	}
+}
+
+// 確保済みのスロット数 (再利用待ちを含む)
+size_t VirtualSocketTable::allocated () const
+{
+	return std::min((size_t)MaxSlots, (size_t)next_slot.load(std::memory_order_acquire));
+}
+
+// 参照が残っていないことを呼び出し側が保証すること
+void VirtualSocketTable::clear ()
+{
+	for (auto &chunk : chunks)
+	{
+		delete[] chunk.exchange(nullptr);
+	}
+	next_slot.store(0);
+	for (auto &list : free_lists) { list.head.store(0); }
+}
+
+VirtualSocketTable::Slot *VirtualSocketTable::slot_at (uint32_t idx) const
+{
+	if (idx >= MaxSlots) { return nullptr; }
+
+	Slot *chunk = chunks[idx / ChunkSlots].load(std::memory_order_acquire);
+	if (nullptr == chunk) { return nullptr; }
+
+	return &(chunk[idx % ChunkSlots]);
+}
+
+// 世代を問わず、生きているスロットの参照を取る
+bool VirtualSocketTable::try_ref (Slot &slot)
+{
+	uint64_t state = slot.state.load(std::memory_order_acquire);
+	do
+	{
+		if (! (state & LiveBit)) { return false; }
+	}
+	while (! slot.state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel));
+
+	return true;
+}
+
+void VirtualSocketTable::release (Slot &slot)
+{
+	uint64_t state = slot.state.fetch_sub(1, std::memory_order_acq_rel) - 1;
+	if ((0 == (state & RefMask)) && (! (state & LiveBit))) { recycle(slot); }
+}
+
+void VirtualSocketTable::recycle (Slot &slot)
+{
+	uint64_t gen = slot.state.load(std::memory_order_relaxed) >> 32;
+	slot.state.store((gen + 1) << 32, std::memory_order_release);
+
+	push_free(slot.index);
+}
+
+void VirtualSocketTable::push_free (uint32_t idx)
+{
+	Slot &slot = *slot_at(idx);
+	std::atomic<uint64_t> &free_head = free_lists[slot.shard].head;
+
+	uint64_t head = free_head.load(std::memory_order_acquire);
+	uint64_t nhead;
+	do
+	{
+		slot.next_free.store((uint32_t)head, std::memory_order_relaxed);
+		nhead = (((head >> 32) + 1) << 32) | (idx + 1);
+	}
+	while (! free_head.compare_exchange_weak(head, nhead, std::memory_order_acq_rel));
+}
+
+// 先頭のタグで ABA を避ける
+bool VirtualSocketTable::pop_free (size_t shard, uint32_t &idx)
+{
+	std::atomic<uint64_t> &free_head = free_lists[shard].head;
+
+	uint64_t head = free_head.load(std::memory_order_acquire);
+	while (0 != (uint32_t)head)
+	{
+		uint32_t top = (uint32_t)head - 1;
+		uint32_t next = slot_at(top)->next_free.load(std::memory_order_relaxed);
+		uint64_t nhead = (((head >> 32) + 1) << 32) | next;
+		if (free_head.compare_exchange_weak(head, nhead, std::memory_order_acq_rel))
+		{
+			idx = top;
+			return true;
+		}
+	}
+
+	return false;
+}
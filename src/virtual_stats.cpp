@@ -0,0 +1,224 @@
+#include <algorithm>
+#include "virtual_stats.h"
+#include "virtual_frame.h"
+
+VirtualHistogram::VirtualHistogram ()
+	: counts()
+	  , max(0)
+{
+	clear();
+}
+
+uint64_t VirtualHistogram::lower (size_t idx)
+{
+	if (idx < 2 * HALF) { return idx; }
+
+	unsigned int e = (unsigned int)((idx - 2 * HALF) / HALF) + 1;
+	return (uint64_t)((idx - 2 * HALF) % HALF + HALF) << e;
+}
+
+void VirtualHistogram::snapshot (std::vector<uint64_t> &out, uint64_t &max_) const
+{
+	out.resize(BUCKETS);
+	for (size_t i = 0; i < BUCKETS; ++i) { out[i] = counts[i].load(std::memory_order_relaxed); }
+	max_ = max.load(std::memory_order_relaxed);
+}
+
+void VirtualHistogram::clear ()
+{
+	for (auto &count : counts) { count.store(0, std::memory_order_relaxed); }
+	max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t virtual_percentile (const std::vector<uint64_t> &counts, uint64_t max, double p)
+{
+	uint64_t total = 0;
+	for (uint64_t count : counts) { total += count; }
+	if (0 == total) { return 0; }
+
+	uint64_t rank = (uint64_t)(p * (double)total);
+	if (rank >= total) { rank = total - 1; }
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < counts.size(); ++i)
+	{
+		seen += counts[i];
+		if (seen <= rank) { continue; }
+
+		uint64_t upper = (i + 1 < VirtualHistogram::BUCKETS) ? VirtualHistogram::lower(i + 1) - 1 : max;
+		return std::min(upper, max);
+	}
+	return max;
+}
+
+VirtualSocketCounters::VirtualSocketCounters ()
+	: bytes_in(0)
+	  , msgs_in(0)
+	  , bytes_out(0)
+	  , msgs_out(0)
+	  , dropped(0)
+	  , would_block(0)
+	  , wait_ns(0)
+	  , high_water(0)
+{
+}
+
+void VirtualSocketCounters::clear ()
+{
+	for (auto *counter : {&bytes_in, &msgs_in, &bytes_out, &msgs_out, &dropped, &would_block, &wait_ns, &high_water})
+	{
+		counter->store(0, std::memory_order_relaxed);
+	}
+}
+
+void VirtualSocketCounters::add_to (VirtualSocketCounters &total) const
+{
+	total.bytes_in.fetch_add(bytes_in.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	total.msgs_in.fetch_add(msgs_in.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	total.bytes_out.fetch_add(bytes_out.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	total.msgs_out.fetch_add(msgs_out.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	total.dropped.fetch_add(dropped.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	total.would_block.fetch_add(would_block.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	total.wait_ns.fetch_add(wait_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	uint64_t hw = high_water.load(std::memory_order_relaxed);
+	uint64_t m = total.high_water.load(std::memory_order_relaxed);
+	while ((m < hw) && (! total.high_water.compare_exchange_weak(m, hw, std::memory_order_relaxed))) {}
+}
+
+VirtualStats::VirtualStats ()
+	: sockets_live(0)
+	  , sockets_created(0)
+	  , connects(0)
+	  , accepts(0)
+	  , connections(0)
+	  , bytes_in(0)
+	  , msgs_in(0)
+	  , bytes_out(0)
+	  , msgs_out(0)
+	  , dropped(0)
+	  , would_block(0)
+	  , wait_ns(0)
+	  , high_water(0)
+	  , capture_packets(0)
+	  , capture_dropped(0)
+	  , commands()
+	  , workers()
+	  , sockets()
+{
+}
+
+void VirtualStats::clear ()
+{
+	*this = VirtualStats();
+}
+
+// 各フィールドを p へ書いて/から読んで、次の位置を返す
+static char *put_field (char *p, uint64_t v) { put_u64(p, v); return p + 8; }
+static char *put_field (char *p, uint32_t v) { put_u32(p, v); return p + 4; }
+static char *put_field (char *p, uint16_t v) { put_u16(p, v); return p + 2; }
+static const char *get_field (const char *p, uint64_t &v) { v = get_u64(p); return p + 8; }
+static const char *get_field (const char *p, uint32_t &v) { v = get_u32(p); return p + 4; }
+static const char *get_field (const char *p, uint16_t &v) { v = get_u16(p); return p + 2; }
+
+static const size_t HeaderSize = 15 * 8;
+static const size_t CommandSize = 4 + 6 * 8;
+static const size_t WorkerSize = 3 * 8 + 4;
+static const size_t SocketSize = 8 + 4 + 2 + 2 + 10 * 8;
+
+void VirtualStats::encode (std::vector<char> &out) const
+{
+	out.resize(HeaderSize + 3 * 4 + commands.size() * CommandSize + workers.size() * WorkerSize
+			+ sockets.size() * SocketSize);
+
+	char *p = out.data();
+	for (uint64_t v : {sockets_live, sockets_created, connects, accepts, connections
+			, bytes_in, msgs_in, bytes_out, msgs_out, dropped, would_block, wait_ns, high_water
+			, capture_packets, capture_dropped})
+	{
+		p = put_field(p, v);
+	}
+
+	p = put_field(p, (uint32_t)commands.size());
+	for (const VirtualCommandStats &c : commands)
+	{
+		p = put_field(p, c.command);
+		for (uint64_t v : {c.count, c.p50_ns, c.p90_ns, c.p99_ns, c.p999_ns, c.max_ns}) { p = put_field(p, v); }
+	}
+
+	p = put_field(p, (uint32_t)workers.size());
+	for (const VirtualWorkerStats &k : workers)
+	{
+		for (uint64_t v : {k.wakeups, k.services, k.busy_ns}) { p = put_field(p, v); }
+		p = put_field(p, k.busy);
+	}
+
+	p = put_field(p, (uint32_t)sockets.size());
+	for (const VirtualSocketStats &s : sockets)
+	{
+		p = put_field(p, (uint64_t)s.socket);
+		p = put_field(p, s.ip);
+		p = put_field(p, s.port);
+		p = put_field(p, s.status);
+		for (uint64_t v : {s.bytes_in, s.msgs_in, s.bytes_out, s.msgs_out, s.dropped, s.would_block, s.wait_ns
+				, s.buffered, s.high_water, s.window})
+		{
+			p = put_field(p, v);
+		}
+	}
+}
+
+// 要素の数と残りの長さが合わなければ false
+bool VirtualStats::decode (const char *buf, size_t len)
+{
+	clear();
+
+	const char *end = buf + len;
+	const char *p = buf;
+	if (len < HeaderSize + 4) { return false; }
+	for (uint64_t *v : {&sockets_live, &sockets_created, &connects, &accepts, &connections
+			, &bytes_in, &msgs_in, &bytes_out, &msgs_out, &dropped, &would_block, &wait_ns, &high_water
+			, &capture_packets, &capture_dropped})
+	{
+		p = get_field(p, *v);
+	}
+
+	uint32_t n;
+	p = get_field(p, n);
+	if ((size_t)(end - p) < (size_t)n * CommandSize + 4) { return false; }
+	commands.resize(n);
+	for (VirtualCommandStats &c : commands)
+	{
+		p = get_field(p, c.command);
+		for (uint64_t *v : {&c.count, &c.p50_ns, &c.p90_ns, &c.p99_ns, &c.p999_ns, &c.max_ns}) { p = get_field(p, *v); }
+	}
+
+	p = get_field(p, n);
+	if ((size_t)(end - p) < (size_t)n * WorkerSize + 4) { return false; }
+	workers.resize(n);
+	for (VirtualWorkerStats &k : workers)
+	{
+		for (uint64_t *v : {&k.wakeups, &k.services, &k.busy_ns}) { p = get_field(p, *v); }
+		p = get_field(p, k.busy);
+	}
+
+	p = get_field(p, n);
+	if ((size_t)(end - p) != (size_t)n * SocketSize) { return false; }
+	sockets.resize(n);
+	for (VirtualSocketStats &s : sockets)
+	{
+		uint64_t socket;
+		p = get_field(p, socket);
+		s.socket = (int64_t)socket;
+		p = get_field(p, s.ip);
+		p = get_field(p, s.port);
+		p = get_field(p, s.status);
+		for (uint64_t *v : {&s.bytes_in, &s.msgs_in, &s.bytes_out, &s.msgs_out, &s.dropped, &s.would_block, &s.wait_ns
+				, &s.buffered, &s.high_water, &s.window})
+		{
+			p = get_field(p, *v);
+		}
+	}
+
+	return true;
+}
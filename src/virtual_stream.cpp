@@ -0,0 +1,543 @@
+#include <errno.h>
+#include <string.h>
+#include <cstddef>
+#include <algorithm>
+#include <new>
+#include <vector>
+#include "virtual_stream.h"
+#ifdef __linux__
+#	include <poll.h>
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#	include <sys/mman.h>
+#	include <sys/un.h>
+#endif
+
+VirtualTcpStream::VirtualTcpStream (SOCKET sock_)
+	: sock(sock_)
+{
+	// 要求/応答が小さいので Nagle で遅延させない
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+}
+
+VirtualTcpStream::~VirtualTcpStream ()
+{
+#ifdef __unix__
+	close(sock);
+#elif _WINDOWS
+	closesocket(sock);
+#endif
+}
+
+VirtualTcpStream *VirtualTcpStream::connect (const char *ip, int port)
+{
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+#ifdef __unix__
+	addr.sin_addr.s_addr = inet_addr(ip);
+#elif _WINDOWS
+	addr.sin_addr.S_un.S_addr = inet_addr(ip);
+#endif
+
+	if (0 != ::connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+	{
+#ifdef __unix__
+		close(sock);
+#elif _WINDOWS
+		closesocket(sock);
+#endif
+		return nullptr;
+	}
+
+	return new VirtualTcpStream(sock);
+}
+
+bool VirtualTcpStream::sendv_all (const struct iovec *iov, int iovcnt)
+{
+	std::vector<struct iovec> rest(iov, iov + iovcnt);
+	struct iovec *cur = rest.data();
+	int n = iovcnt;
+
+	while (n > 0)
+	{
+		// ヘッダを前に付けた分 IOV_MAX を超えうるので、1回の writev には IOV_MAX 個まで渡す
+		ssize_t sent = writev(sock, cur, std::min(n, (int)IOV_MAX));
+		if (sent < 0)
+		{
+			if (EINTR == errno) { continue; }
+			return false;
+		}
+
+		// 送り切れなかったところから続ける
+		while ((n > 0) && ((size_t)sent >= cur->iov_len))
+		{
+			sent -= cur->iov_len;
+			++cur;
+			--n;
+		}
+		if (n > 0)
+		{
+			cur->iov_base = (char *)cur->iov_base + sent;
+			cur->iov_len -= sent;
+		}
+	}
+
+	return true;
+}
+
+bool VirtualTcpStream::recvv_all (const struct iovec *iov, int iovcnt)
+{
+	std::vector<struct iovec> rest(iov, iov + iovcnt);
+	struct iovec *cur = rest.data();
+	int n = iovcnt;
+
+	while ((n > 0) && (0 == cur->iov_len)) { ++cur; --n; }
+	while (n > 0)
+	{
+		ssize_t got = readv(sock, cur, std::min(n, (int)IOV_MAX));
+		if ((got < 0) && (EINTR == errno)) { continue; }
+		if (got <= 0) { return false; }
+
+		// 埋まりきらなかったところから続ける
+		while ((n > 0) && ((size_t)got >= cur->iov_len))
+		{
+			got -= cur->iov_len;
+			++cur;
+			--n;
+		}
+		if (n > 0)
+		{
+			cur->iov_base = (char *)cur->iov_base + got;
+			cur->iov_len -= got;
+		}
+	}
+
+	return true;
+}
+
+ssize_t VirtualTcpStream::recv_least (char *buf, size_t least, size_t len)
+{
+	size_t got = 0;
+	while (got < least)
+	{
+		ssize_t n = recv(sock, buf + got, len - got, 0);
+		if ((n < 0) && (EINTR == errno)) { continue; }
+		if (n <= 0) { return -1; }
+		got += n;
+	}
+
+	return (ssize_t)got;
+}
+
+ssize_t VirtualTcpStream::recv_some (char *buf, size_t len)
+{
+	return recv(sock, buf, len, MSG_DONTWAIT);
+}
+
+ssize_t VirtualTcpStream::sendv_some (const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+
+	return sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void VirtualTcpStream::watch (int epfd, uint64_t id)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.u64 = id;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+void VirtualTcpStream::unwatch (int epfd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, sock, nullptr);
+}
+
+void VirtualTcpStream::shutdown ()
+{
+#ifdef __unix__
+	::shutdown(sock, SHUT_RDWR);
+#elif _WINDOWS
+	::shutdown(sock, SD_BOTH);
+#endif
+}
+
+#ifdef __linux__
+
+static void close_doorbells (int *doorbells)
+{
+	for (int i = 0; i < SHM_DOORBELLS; ++i)
+	{
+		if (0 <= doorbells[i]) { close(doorbells[i]); }
+	}
+}
+
+VirtualShmStream::VirtualShmStream (int ctl_, VirtualShmRegion *region_, const int *doorbells_, bool broker)
+	: ctl(ctl_)
+	  , region(region_)
+{
+	std::copy(doorbells_, doorbells_ + SHM_DOORBELLS, doorbells);
+
+	if (broker)
+	{
+		tx = &(region->response);
+		rx = &(region->request);
+		tx_data = doorbells[SHM_RESPONSE_DATA];
+		tx_space = doorbells[SHM_RESPONSE_SPACE];
+		rx_data = doorbells[SHM_REQUEST_DATA];
+		rx_space = doorbells[SHM_REQUEST_SPACE];
+	}
+	else
+	{
+		tx = &(region->request);
+		rx = &(region->response);
+		tx_data = doorbells[SHM_REQUEST_DATA];
+		tx_space = doorbells[SHM_REQUEST_SPACE];
+		rx_data = doorbells[SHM_RESPONSE_DATA];
+		rx_space = doorbells[SHM_RESPONSE_SPACE];
+	}
+}
+
+VirtualShmStream::~VirtualShmStream ()
+{
+	munmap(region, sizeof(VirtualShmRegion));
+	close_doorbells(doorbells);
+	close(ctl);
+}
+
+VirtualShmStream *VirtualShmStream::accept (int ctl)
+{
+	int memfd = memfd_create("virtual_tcp", MFD_CLOEXEC);
+	if (memfd < 0) { close(ctl); return nullptr; }
+
+	int doorbells[SHM_DOORBELLS];
+	for (int i = 0; i < SHM_DOORBELLS; ++i)
+	{
+		doorbells[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	}
+
+	void *addr = MAP_FAILED;
+	if (0 == ftruncate(memfd, sizeof(VirtualShmRegion)))
+	{
+		addr = mmap(nullptr, sizeof(VirtualShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	}
+	if (MAP_FAILED == addr)
+	{
+		close(memfd);
+		close_doorbells(doorbells);
+		close(ctl);
+		return nullptr;
+	}
+
+	VirtualShmRegion *region = new (addr) VirtualShmRegion();
+	region->magic = VirtualShmRegion::MAGIC;
+	region->version = VirtualShmRegion::VERSION;
+
+	// memfd と eventfd をまとめて渡す
+	int fds[1 + SHM_DOORBELLS];
+	fds[0] = memfd;
+	std::copy(doorbells, doorbells + SHM_DOORBELLS, &(fds[1]));
+
+	char byte = 0;
+	struct iovec iov = {&byte, 1};
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	memset(cbuf, '\0', sizeof(cbuf));
+
+	struct msghdr msg;
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t sent = sendmsg(ctl, &msg, MSG_NOSIGNAL);
+	close(memfd);
+	if (1 != sent)
+	{
+		munmap(addr, sizeof(VirtualShmRegion));
+		close_doorbells(doorbells);
+		close(ctl);
+		return nullptr;
+	}
+
+	return new VirtualShmStream(ctl, region, doorbells, true);
+}
+
+VirtualShmStream *VirtualShmStream::connect (const std::string &path)
+{
+	int ctl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	// 先頭が '\0' なら抽象名前空間
+	struct sockaddr_un addr;
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t pathlen = std::min(path.size(), sizeof(addr.sun_path));
+	memcpy(addr.sun_path, path.data(), pathlen);
+	socklen_t addrlen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + pathlen);
+
+	if (0 != ::connect(ctl, (struct sockaddr *)&addr, addrlen))
+	{
+		close(ctl);
+		return nullptr;
+	}
+
+	int fds[1 + SHM_DOORBELLS];
+	char byte = 0;
+	struct iovec iov = {&byte, 1};
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+
+	struct msghdr msg;
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ssize_t n = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if ((1 != n) || (nullptr == cmsg) || (SCM_RIGHTS != cmsg->cmsg_type)
+			|| (CMSG_LEN(sizeof(fds)) != cmsg->cmsg_len))
+	{
+		close(ctl);
+		return nullptr;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	void *addr_ = mmap(nullptr, sizeof(VirtualShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	VirtualShmRegion *region = (MAP_FAILED == addr_) ? nullptr : (VirtualShmRegion *)addr_;
+	if ((nullptr == region)
+			|| (VirtualShmRegion::MAGIC != region->magic)
+			|| (VirtualShmRegion::VERSION != region->version))
+	{
+		if (nullptr != region) { munmap(region, sizeof(VirtualShmRegion)); }
+		close_doorbells(&(fds[1]));
+		close(ctl);
+		return nullptr;
+	}
+
+	return new VirtualShmStream(ctl, region, &(fds[1]), false);
+}
+
+// ドアベルが鳴るか、相手が切断するまで眠る
+bool VirtualShmStream::sleep (int fd)
+{
+	struct pollfd pfds[2];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	pfds[1].fd = ctl;
+	pfds[1].events = POLLIN;
+	pfds[1].revents = 0;
+
+	int n = poll(pfds, 2, -1);
+	if ((n < 0) && (EINTR != errno)) { return false; }
+	// ハンドシェイク後の ctl が読めるのは相手が閉じたときだけ
+	if (pfds[1].revents) { return false; }
+
+	eventfd_t value;
+	eventfd_read(fd, &value);
+	return true;
+}
+
+bool VirtualShmStream::sendv_all (const struct iovec *iov, int iovcnt)
+{
+	uint64_t tail = tx->tail.load(std::memory_order_relaxed);
+
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		const char *buf = (const char *)iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len > 0)
+		{
+			size_t space = VirtualShmRing::SIZE - (tail - tx->head.load(std::memory_order_acquire));
+			if (0 == space)
+			{
+				// 書いた分を見せてから空きを待つ
+				tx->tail.store(tail, std::memory_order_seq_cst);
+				if (tx->reader_waiting.load(std::memory_order_seq_cst)) { eventfd_write(tx_data, 1); }
+
+				tx->writer_waiting.store(1, std::memory_order_seq_cst);
+				if (tail == tx->head.load(std::memory_order_seq_cst) + VirtualShmRing::SIZE)
+				{
+					if (! sleep(tx_space)) { tx->writer_waiting.store(0); return false; }
+				}
+				tx->writer_waiting.store(0, std::memory_order_relaxed);
+				continue;
+			}
+
+			size_t n = std::min(len, space);
+			size_t pos = tail & (VirtualShmRing::SIZE - 1);
+			size_t first = std::min(n, VirtualShmRing::SIZE - pos);
+			memcpy(&(tx->data[pos]), buf, first);
+			memcpy(tx->data, &(buf[first]), n - first);
+
+			tail += n;
+			buf += n;
+			len -= n;
+		}
+	}
+
+	tx->tail.store(tail, std::memory_order_seq_cst);
+	if (tx->reader_waiting.load(std::memory_order_seq_cst)) { eventfd_write(tx_data, 1); }
+
+	return true;
+}
+
+bool VirtualShmStream::recvv_all (const struct iovec *iov, int iovcnt)
+{
+	uint64_t head = rx->head.load(std::memory_order_relaxed);
+	bool closed = false;
+
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		char *buf = (char *)iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len > 0)
+		{
+			size_t avail = rx->tail.load(std::memory_order_acquire) - head;
+			if (0 == avail)
+			{
+				// 相手は書き終えてから閉じるので、切断に気づいた後もリングに残った分は読む
+				if (closed) { return false; }
+
+				rx->reader_waiting.store(1, std::memory_order_seq_cst);
+				if (head == rx->tail.load(std::memory_order_seq_cst))
+				{
+					closed = ! sleep(rx_data);
+				}
+				rx->reader_waiting.store(0, std::memory_order_relaxed);
+				continue;
+			}
+
+			size_t n = std::min(len, avail);
+			size_t pos = head & (VirtualShmRing::SIZE - 1);
+			size_t first = std::min(n, VirtualShmRing::SIZE - pos);
+			memcpy(buf, &(rx->data[pos]), first);
+			memcpy(&(buf[first]), rx->data, n - first);
+
+			head += n;
+			buf += n;
+			len -= n;
+
+			rx->head.store(head, std::memory_order_seq_cst);
+			if (rx->writer_waiting.load(std::memory_order_seq_cst)) { eventfd_write(rx_space, 1); }
+		}
+	}
+
+	return true;
+}
+
+ssize_t VirtualShmStream::recv_some (char *buf, size_t len)
+{
+	uint64_t head = rx->head.load(std::memory_order_relaxed);
+
+	size_t avail = rx->tail.load(std::memory_order_acquire) - head;
+	if (0 == avail)
+	{
+		// 待ちを宣言してから見直す. 以降の書き込みはドアベルで知らされる
+		rx->reader_waiting.store(1, std::memory_order_seq_cst);
+		avail = rx->tail.load(std::memory_order_seq_cst) - head;
+		if (0 == avail)
+		{
+			// 相手が閉じていれば ctl が読める
+			char byte;
+			ssize_t n = recv(ctl, &byte, 1, MSG_DONTWAIT | MSG_PEEK);
+			if ((n < 0) && ((EAGAIN == errno) || (EINTR == errno))) { return -1; }
+			return 0;
+		}
+	}
+	rx->reader_waiting.store(0, std::memory_order_relaxed);
+
+	size_t n = std::min(len, avail);
+	size_t pos = head & (VirtualShmRing::SIZE - 1);
+	size_t first = std::min(n, VirtualShmRing::SIZE - pos);
+	memcpy(buf, &(rx->data[pos]), first);
+	memcpy(&(buf[first]), rx->data, n - first);
+
+	rx->head.store(head + n, std::memory_order_seq_cst);
+	if (rx->writer_waiting.load(std::memory_order_seq_cst)) { eventfd_write(rx_space, 1); }
+
+	return (ssize_t)n;
+}
+
+ssize_t VirtualShmStream::sendv_some (const struct iovec *iov, int iovcnt)
+{
+	uint64_t tail = tx->tail.load(std::memory_order_relaxed);
+
+	size_t space = VirtualShmRing::SIZE - (tail - tx->head.load(std::memory_order_acquire));
+	if (0 == space)
+	{
+		// 待ちを宣言してから見直す. 空きができれば tx_space が鳴る
+		tx->writer_waiting.store(1, std::memory_order_seq_cst);
+		space = VirtualShmRing::SIZE - (tail - tx->head.load(std::memory_order_seq_cst));
+		if (0 == space)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	tx->writer_waiting.store(0, std::memory_order_relaxed);
+
+	size_t total = 0;
+	for (int i = 0; (i < iovcnt) && (total < space); ++i)
+	{
+		const char *buf = (const char *)iov[i].iov_base;
+		size_t n = std::min(iov[i].iov_len, space - total);
+		size_t pos = (tail + total) & (VirtualShmRing::SIZE - 1);
+		size_t first = std::min(n, VirtualShmRing::SIZE - pos);
+		memcpy(&(tx->data[pos]), buf, first);
+		memcpy(tx->data, &(buf[first]), n - first);
+
+		total += n;
+	}
+
+	tx->tail.store(tail + total, std::memory_order_seq_cst);
+	if (tx->reader_waiting.load(std::memory_order_seq_cst)) { eventfd_write(tx_data, 1); }
+
+	return (ssize_t)total;
+}
+
+// ドアベルと ctl をすべて同じ id で登録する
+void VirtualShmStream::watch (int epfd, uint64_t id)
+{
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.u64 = id;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, rx_data, &ev);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, tx_space, &ev);
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ctl, &ev);
+}
+
+void VirtualShmStream::unwatch (int epfd)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, rx_data, nullptr);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, tx_space, nullptr);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, ctl, nullptr);
+}
+
+// 眠っている側は ctl が読めるようになって起きる
+void VirtualShmStream::shutdown ()
+{
+	::shutdown(ctl, SHUT_RDWR);
+}
+
+#endif // __linux__
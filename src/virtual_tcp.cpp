@@ -5,678 +5,2710 @@
 #include <signal.h>
 #include <iostream>
 #include <algorithm>
+#include <cstddef>
 #include <chrono>
+#include <climits>
+#include <random>
 #include "virtual_tcp.h"
+#include "virtual_stream.h"
+#include "virtual_broker.h"
+#include "virtual_channel.h"
+#include "virtual_channel_pool.h"
+#include "virtual_frame.h"
+#include "virtual_epoll.h"
+#include "virtual_timer.h"
+#include "virtual_peer.h"
+#include "virtual_capture.h"
+#ifdef __linux__
+#	include <sys/un.h>
+#endif
+
+// 既定では Linux の rmem_max 程度まで広げられる
+std::atomic<size_t> VirtualSocketImpl::window_max(4 * 1024 * 1024);
+
+static size_t iov_length (const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; ++i) { len += iov[i].iov_len; }
+	return len;
+}
+
+// iov の offset バイト目から len バイトまでを指す iovec を out に作り、その個数を返す
+// out は iovcnt 個入る大きさであること
+static int iov_slice (const struct iovec *iov, int iovcnt, size_t offset, size_t len, struct iovec *out)
+{
+	int n = 0;
+	for (int i = 0; (i < iovcnt) && (len > 0); ++i)
+	{
+		if (offset >= iov[i].iov_len)
+		{
+			offset -= iov[i].iov_len;
+			continue;
+		}
+
+		out[n].iov_base = (char *)iov[i].iov_base + offset;
+		out[n].iov_len = std::min(iov[i].iov_len - offset, len);
+		len -= out[n].iov_len;
+		offset = 0;
+		++n;
+	}
+
+	return n;
+}
 
 VirtualSocketImpl::VirtualSocketImpl ()
-	: mtx(std::make_shared<std::mutex>())
+	: mtx()
+	  , cv()
+	  , self(INVALID_SOCKET)
 	  , ip(0)
 	  , port(0)
-	  , partner()
+	  , partner(INVALID_SOCKET)
 	  , status(VIRTUAL_SOCKET_VOID)
-	  , buffer()
-	  , bufend(0)
+	  , ring()
+	  , write_mtx()
+	  , read_mtx()
+	  , queue()
+	  , queued(false)
+	  , window(BUF_SIZE)
+	  , connected(false)
+	  , attended(false)
+	  , inflight()
+	  , counters()
+	  , backlog(0)
+	  , accepts()
+	  , accept_head(0)
+	  , accept_count(0)
+	  , parked()
+	  , watchers()
 {
-	memset(buffer, '\0', BUF_SIZE);
 }
 
 VirtualSocketImpl::VirtualSocketImpl (unsigned long ip_, unsigned short port_)
-	: mtx(std::make_shared<std::mutex>())
+	: mtx()
+	  , cv()
+	  , self(INVALID_SOCKET)
 	  , ip(ip_)
 	  , port(port_)
-	  , partner()
+	  , partner(INVALID_SOCKET)
 	  , status(VIRTUAL_SOCKET_VOID)
-	  , buffer()
-	  , bufend(0)
+	  , ring()
+	  , write_mtx()
+	  , read_mtx()
+	  , queue()
+	  , queued(false)
+	  , window(BUF_SIZE)
+	  , connected(false)
+	  , attended(false)
+	  , inflight()
+	  , counters()
+	  , backlog(0)
+	  , accepts()
+	  , accept_head(0)
+	  , accept_count(0)
+	  , parked()
+	  , watchers()
 {
-	memset(buffer, '\0', BUF_SIZE);
 }
 
-VirtualSocketImpl::VirtualSocketImpl (const VirtualSocketImpl &obj)
-	: mtx(obj.mtx)
-	  , ip(obj.ip)
-	  , port(obj.port)
-	  , partner(obj.partner)
-	  , status(obj.status)
-	  , buffer()
-	  , bufend(obj.bufend)
+VirtualSocketImpl::~VirtualSocketImpl ()
 {
-	memcpy(buffer, obj.buffer, BUF_SIZE);
 }
 
-VirtualSocketImpl::~VirtualSocketImpl ()
+// VirtualSocketTable がスロットを再利用するときに呼ぶ
+void VirtualSocketImpl::reset (VIRTUAL_SOCKET self_, unsigned long ip_, unsigned short port_)
 {
-	partner.reset();
+	std::lock_guard<std::mutex> lock(mtx);
+
+	self = self_;
+	ip = ip_;
+	port = port_;
+	partner = INVALID_SOCKET;
+	status = VIRTUAL_SOCKET_VOID;
+	ring.clear();
+	queue.clear();
+	queued = false;
+	window = BUF_SIZE;
+	connected = false;
+	attended = false;
+	inflight.reset();
+	counters.clear();
+	backlog = 0;
+	std::vector<VIRTUAL_SOCKET>().swap(accepts);
+	accept_head = 0;
+	accept_count = 0;
+	parked.clear();
+	watchers.clear();
 }
 
-void VirtualSocketImpl::connect (std::shared_ptr<VirtualSocketImpl> partner_)
+// INADDR_ANY のときは VirtualTcp の仮想アドレスのまま
+void VirtualSocketImpl::bind (unsigned long ip_, unsigned short port_)
 {
-	std::lock_guard<std::mutex> lock(*mtx);
+	std::lock_guard<std::mutex> lock(mtx);
 
-	partner = partner_;
-	status = VIRTUAL_SOCKET_CONNECT;
+	if (INADDR_ANY != ip_) { ip = ip_; }
+	port = port_;
 }
 
-void VirtualSocketImpl::write (const char *msg, int len)
+void VirtualSocketImpl::connect (VIRTUAL_SOCKET partner_)
 {
-	std::lock_guard<std::mutex> lock(*mtx);
+	std::unique_lock<std::mutex> lock(mtx);
+
+	partner = partner_;
+	status = VIRTUAL_SOCKET_CONNECT;
+	connected = true;
 
-	size_t nbufend = bufend + len;
-	if (nbufend > BUF_SIZE) { nbufend = BUF_SIZE; }
+	wake(lock);
+}
 
-	memcpy(&(buffer[bufend]), msg, nbufend - bufend);
+VIRTUAL_SOCKET VirtualSocketImpl::peer ()
+{
+	return partner;
+}
 
-	bufend = nbufend;
+int VirtualSocketImpl::write (const char *msg, int len)
+{
+	struct iovec iov = {(void *)msg, (size_t)std::max(len, 0)};
+	return write(&iov, 1);
 }
 
-bool VirtualSocketImpl::read (char *msg, int len)
+// 受信ウィンドウの空きに入る分だけ、iov を順に書き込む. 接続中でなければ -1
+// queue が空で経路も参照もなければリングへ入れ、待ち手がいるときだけ mtx を取って起こす
+// owner の領域を指す長い部分は複製せずに参照で繋ぐ
+int VirtualSocketImpl::write (const struct iovec *iov, int iovcnt, const VirtualSegmentPtr *owner
+		, VirtualLink *link, const VirtualSocketImpl *from, std::chrono::steady_clock::time_point *arm
+		, VirtualCapture *capture)
 {
-	if (len > (int)BUF_SIZE) { len = (int)BUF_SIZE; }
-	if (bufend < len) { return false; }
+	std::unique_lock<std::mutex> writing(write_mtx);
+
+	if (! connected) { return -1; }
+
+	// queued が倒れていれば queue と inflight は空で、立てるのは自分だけ
+	size_t len = iov_length(iov, iovcnt);
+	size_t pushed = 0;
+	if ((nullptr == link) && ((nullptr == owner) || (! *owner)) && (! queued.load(std::memory_order_acquire)))
+	{
+		size_t used = ring.size();
+		size_t room = (window > used) ? window - used : 0;
+		size_t want = std::min(len, room);
+		if (0 == want) { return 0; }
+
+		if ((ring.room() < want) && (ring.capacity() < VirtualByteRing::MAX_SIZE))
+		{
+			std::lock_guard<std::mutex> reading(read_mtx);
+			ring.grow(want);
+		}
+
+		pushed = ring.push(iov, iovcnt, want);
+		if (pushed == want)
+		{
+			trace(capture, from, iov, iovcnt, pushed, room);
+			count_in(pushed, used + pushed);
+			writing.unlock();
+
+			if (attended) { notify(); }
+			return (int)pushed;
+		}
+		// リングに入りきらなかった分は queue へ続ける
+	}
 
-	std::lock_guard<std::mutex> lock(*mtx);
+	std::unique_lock<std::mutex> lock(mtx);
 
-	memcpy(msg, buffer, len);
+	if ((VIRTUAL_SOCKET_CONNECT != status) && (0 == pushed)) { return -1; }
 
-	char temp[BUF_SIZE];
-	memcpy(temp, &(buffer[len]), BUF_SIZE - len);
-	memset(buffer, '\0', BUF_SIZE);
-	memcpy(buffer, temp, BUF_SIZE - len);
+	size_t used = buffered() - pushed;
+	size_t room = (window > used) ? window - used : 0;
 
-	bufend -= len;
-	return true;
+	if (nullptr != link)
+	{
+		if (! inflight) { inflight.reset(new VirtualInflight()); }
+
+		size_t n = inflight->queue.append(iov, iovcnt, room, owner);
+		if (0 == n) { return 0; }
+		queued = true;
+
+		// 後から書いた分が先に届くことはない
+		auto now = std::chrono::steady_clock::now();
+		auto due = std::max(link->arrival((nullptr != from) ? from->ip : 0, ip, n, now), inflight->last);
+		if (inflight->arrivals.empty() && (nullptr != arm)) { *arm = due; }
+		inflight->arrivals.emplace_back(due, n);
+		inflight->last = due;
+		trace(capture, from, iov, iovcnt, n, room);
+		count_in(n, used + n);
+
+		// 届くまでは相手から見えないので起こさない
+		return (int)n;
+	}
+
+	size_t n = pushed;
+	if (VIRTUAL_SOCKET_CONNECT == status)
+	{
+		struct iovec rest[IOV_MAX];
+		int restcnt = iov_slice(iov, iovcnt, pushed, len - pushed, rest);
+		n += queue.append(rest, restcnt, (room > pushed) ? room - pushed : 0, owner);
+	}
+	if (0 == n) { return 0; }
+	if (n > pushed) { queued = true; }
+	trace(capture, from, iov, iovcnt, n, room);
+	count_in(n, used + n);
+	writing.unlock();
+
+	wake(lock);
+
+	return (int)n;
 }
 
-void VirtualSocketImpl::close ()
+// ack は書き込んだ側が受け取った総量. どちらも 32 ビットで折り返す
+void VirtualSocketImpl::trace (VirtualCapture *capture, const VirtualSocketImpl *from, const struct iovec *iov, int iovcnt
+		, size_t n, size_t room)
 {
-	std::lock_guard<std::mutex> lock(*mtx);
+	if ((nullptr == capture) || (nullptr == from)) { return; }
 
-	status = VIRTUAL_SOCKET_INITIAL;
-	partner.reset();
-	memset(buffer, '\0', BUF_SIZE);
-	bufend = 0;
+	capture->record(from->ip, from->port, ip, port, (uint32_t)counters.bytes_in.load(std::memory_order_relaxed)
+			, (uint32_t)from->counters.bytes_in.load(std::memory_order_relaxed), room - n, iov, iovcnt, n);
 }
 
-bool VirtualTcp::running;
-std::thread VirtualTcp::alternative_tcp_server_th;
-std::vector<VirtualSocketImpl> VirtualTcp::sockets;
-std::unordered_map<VirtualTcpCommand
-	, std::function<void(SOCKET, const char *)>> VirtualTcp::services
-	= {{COM_SOCKET, VirtualTcp::serve_socket}
-		, {COM_CONNECT, VirtualTcp::serve_connect}
-		, {COM_BIND, VirtualTcp::serve_bind}
-		, {COM_LISTEN, VirtualTcp::serve_listen}
-		, {COM_ACCEPT, VirtualTcp::serve_accept}
-		, {COM_SEND, VirtualTcp::serve_send}
-		, {COM_RECV, VirtualTcp::serve_recv}
-		, {COM_CLOSE, VirtualTcp::serve_close}};
-
-void VirtualTcp::alternative_tcp_server_fn ()
+bool VirtualSocketImpl::arrive (std::chrono::steady_clock::time_point now, std::chrono::steady_clock::time_point &next)
 {
-	SOCKET sock0;
-	sock0 = socket(AF_INET, SOCK_STREAM, 0);
-
-	struct sockaddr_in addr;
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(ALTERNATIVE_PORT);
-#ifdef __unix__
-	addr.sin_addr.s_addr = INADDR_ANY;
-#elif _WINDOWS
-	addr.sin_addr.S_un.S_addr = INADDR_ANY;
-#endif
-	bind(sock0, (struct sockaddr *)&addr, sizeof(addr));
+	std::unique_lock<std::mutex> lock(mtx);
 
-	listen(sock0, 5);
+	if (! inflight) { return false; }
 
-	while (VirtualTcp::running)
+	size_t n = 0;
+	while ((! inflight->arrivals.empty()) && (inflight->arrivals.front().first <= now))
 	{
-		struct sockaddr_in client;
-		unsigned int len = sizeof(client);
-		SOCKET sock = accept(sock0, (struct sockaddr *)&client, &len);
-
-		std::thread th = std::thread(VirtualTcp::alternative_tcp_server_service_fn, sock);
-		th.detach();
+		n += inflight->arrivals.front().second;
+		inflight->arrivals.pop_front();
+	}
+	if (n > 0)
+	{
+		std::vector<VirtualSlice> slices;
+		inflight->queue.share(n, slices);
+		inflight->queue.consume(n);
+		for (const VirtualSlice &slice : slices) { queue.append(slice); }
 	}
 
-#ifdef __unix__
-	close(sock0);
-#elif _WINDOWS
-	closesocket(sock0);
-#endif
+	bool more = ! inflight->arrivals.empty();
+	if (more) { next = inflight->arrivals.front().first; }
+	else { inflight.reset(); }
+	if (queue.empty() && (! inflight)) { queued = false; }
+
+	if (n > 0) { wake(lock); }
+
+	return more;
 }
 
+int VirtualSocketImpl::read (char *msg, int len, bool peek)
+{
+	struct iovec iov = {msg, (size_t)std::max(len, 0)};
+	return read(&iov, 1, peek);
+}
 
-void VirtualTcp::alternative_tcp_server_service_fn (SOCKET sock)
+// 溜まっている分を iov に順に読む. peek なら読んだ分を残す
+// リングを読み切ってから queue を読む. 空いたウィンドウを待っている送り手を起こす
+int VirtualSocketImpl::read (const struct iovec *iov, int iovcnt, bool peek)
 {
-	while (VirtualTcp::running)
+	size_t len = iov_length(iov, iovcnt);
+	size_t n = 0;
+	bool woke = false;
 	{
-		char com[1];
-		memset(com, '\0', 1);
-		int n = recv(sock, com, 1, 0);
-		if (n <= 0) { continue; }
-
-		VirtualTcp::services.at((VirtualTcpCommand)com[0])(sock, com);
+		std::lock_guard<std::mutex> reading(read_mtx);
+
+		struct iovec rest[IOV_MAX];
+		while (n < len)
+		{
+			size_t m = ring.copy(peek ? n : 0, rest, iov_slice(iov, iovcnt, n, len - n, rest));
+			if (! peek) { ring.consume(m); }
+			n += m;
+			if ((n == len) || (! queued.load(std::memory_order_acquire))) { break; }
+
+			// queued を立てる前にリングへ入った分があれば、そちらが先
+			if (ring.size() > (peek ? n : 0)) { continue; }
+
+			std::unique_lock<std::mutex> lock(mtx);
+			m = queue.copy(rest, iov_slice(iov, iovcnt, n, len - n, rest));
+			if ((! peek) && (m > 0))
+			{
+				queue.consume(m);
+				if (queue.empty() && (! inflight)) { queued = false; }
+				woke = true;
+			}
+			n += m;
+			break;
+		}
 	}
 
-#ifdef __unix__
-	close(sock);
-#elif _WINDOWS
-	closesocket(sock);
-#endif
+	// 続きを起こす相手が同じリングへ書きに来るので、read_mtx を外してから起こす
+	if ((! peek) && (n > 0) && (woke || attended)) { notify(); }
+	return (int)n;
 }
 
-void VirtualTcp::serve_socket (SOCKET sock, const char*com)
+// read と同じだが、複製せずに切片の参照を out に足す. リングの分はプールの領域へ写して渡す
+int VirtualSocketImpl::share (size_t len, std::vector<VirtualSlice> &out, bool peek)
 {
-	char aft[4 + 2];
-	memset(aft, '\0', 6);
-	int n = recv(sock, aft, 6, 0);
-	if (6 != n) { ; }
+	size_t n = 0;
+	bool woke = false;
+	{
+		std::lock_guard<std::mutex> reading(read_mtx);
+
+		while (n < len)
+		{
+			size_t avail = ring.size() - (peek ? n : 0);
+			if (avail > 0)
+			{
+				VirtualSlice slice{VirtualSegmentPtr(VirtualSegment::pooled(std::min(avail, len - n))), 0, 0};
+				struct iovec iov = {slice.seg->data(), std::min({avail, len - n, slice.seg->cap})};
+				slice.len = ring.copy(peek ? n : 0, &iov, 1);
+				slice.seg->used = slice.len;
+				if (! peek) { ring.consume(slice.len); }
+				n += slice.len;
+				out.push_back(std::move(slice));
+				continue;
+			}
+			if (! queued.load(std::memory_order_acquire)) { break; }
+			if (ring.size() > (peek ? n : 0)) { continue; }
+
+			std::unique_lock<std::mutex> lock(mtx);
+			size_t m = queue.share(len - n, out);
+			if ((! peek) && (m > 0))
+			{
+				queue.consume(m);
+				if (queue.empty() && (! inflight)) { queued = false; }
+				woke = true;
+			}
+			n += m;
+			break;
+		}
+	}
 
-	unsigned long ip = 0;
-	ip |= aft[0] << 24;
-	ip |= aft[1] << 16;
-	ip |= aft[2] << 8;
-	ip |= aft[3];
+	if ((! peek) && (n > 0) && (woke || attended)) { notify(); }
+	return (int)n;
+}
 
-	unsigned short port = 0;
-	port |= aft[4] << 8;
-	port |= aft[5];
+void VirtualSocketImpl::set_window (size_t window_)
+{
+	std::unique_lock<std::mutex> lock(mtx);
 
-	VirtualTcp::sockets.push_back(VirtualSocketImpl(ip, port));
-	VIRTUAL_SOCKET ns = VirtualTcp::sockets.size() - 1;
+	window = std::min(std::max(window_, (size_t)1), window_max.load(std::memory_order_relaxed));
 
-	char ans[4];
-	memset(ans, '\0', 4);
-	ans[0] = (ns & 0xff000000) >> 24;
-	ans[1] = (ns & 0x00ff0000) >> 16;
-	ans[2] = (ns & 0x0000ff00) >> 8;
-	ans[3] = (ns & 0x000000ff);
-	send(sock, ans, 4, 0);
+	wake(lock);
 }
 
-void VirtualTcp::serve_connect (SOCKET sock, const char*com)
+// 既に待ち受け中なら backlog だけ変える
+void VirtualSocketImpl::listen (int backlog_)
 {
-	char aft[4 + 4 + 2];
-	memset(aft, '\0', 10);
-	recv(sock, aft, 10, 0);
+	std::unique_lock<std::mutex> lock(mtx);
 
-	VIRTUAL_SOCKET s = 0;
-	s |= aft[0] << 24;
-	s |= aft[1] << 16;
-	s |= aft[2] << 8;
-	s |= aft[3];
-	auto vsock = VirtualTcp::sockets.begin() + s;
+	status = VIRTUAL_SOCKET_LISTEN;
+	backlog = std::min(std::max(backlog_, 1), (int)MAX_BACKLOG);
 
-	unsigned long ip = 0;
-	ip |= aft[4] << 24;
-	ip |= aft[5] << 16;
-	ip |= aft[6] << 8;
-	ip |= aft[7];
-
-	unsigned short port = 0;
-	port |= aft[8] << 8;
-	port |= aft[9];
-
-	std::vector<VirtualSocketImpl>::iterator partner;
+	// 空きを待っている connect を起こす
+	wake(lock);
+}
 
-	// 接続先がINITIALになるまで(listenになるまで)待つ
-	while (VirtualTcp::running)
+void VirtualSocketImpl::enqueue (VIRTUAL_SOCKET server)
+{
+	if (accept_count == accepts.size())
 	{
-		partner = std::find_if(VirtualTcp::sockets.begin()
-				, VirtualTcp::sockets.end()
-				, [=](const VirtualSocketImpl &s)
-				{
-					return (ip == s.ip)
-						&& (port == s.port)
-						&& (VIRTUAL_SOCKET_INITIAL == s.status);
-				});
-		if (partner != VirtualTcp::sockets.end()) { break; }
-		std::this_thread::sleep_for(
-				std::chrono::milliseconds(VirtualTcp::PollingMs));
+		std::vector<VIRTUAL_SOCKET> grown(std::max(std::min(accepts.size() * 2, (size_t)backlog), (size_t)accept_count + 1));
+		for (size_t i = 0; i < accept_count; ++i) { grown[i] = accepts[(accept_head + i) % accepts.size()]; }
+		accepts.swap(grown);
+		accept_head = 0;
 	}
 
-	char ans[2];
-	memset(ans, '\0', 2);
-	// TODO: vsock.statusがCONNECTのときの動作
-	partner->connect(std::shared_ptr<VirtualSocketImpl>(&*vsock));
-	vsock->connect(std::shared_ptr<VirtualSocketImpl>(&*partner));
-
-	send(sock, ans, 2, 0);
+	accepts[(accept_head + accept_count) % accepts.size()] = server;
+	++accept_count;
 }
 
-void VirtualTcp::serve_bind (SOCKET sock, const char*com)
+// 空きを待っている connect を起こす
+VIRTUAL_SOCKET VirtualSocketImpl::dequeue ()
 {
-	char aft[4 + 4 + 2];
-	memset(aft, '\0', 10);
-	recv(sock, aft, 10, 0);
+	std::unique_lock<std::mutex> lock(mtx);
 
-	VIRTUAL_SOCKET s = 0;
-	s |= aft[0] << 24;
-	s |= aft[1] << 16;
-	s |= aft[2] << 8;
-	s |= aft[3];
-	auto vsock = VirtualTcp::sockets.begin() + s;
+	if (0 == accept_count) { return INVALID_SOCKET; }
 
-	unsigned long ip = 0;
-	ip |= aft[4] << 24;
-	ip |= aft[5] << 16;
-	ip |= aft[6] << 8;
-	ip |= aft[7];
+	VIRTUAL_SOCKET server = accepts[accept_head];
+	accept_head = (accept_head + 1) % accepts.size();
+	--accept_count;
 
-	unsigned short port = 0;
-	port |= aft[8] << 8;
-	port |= aft[9];
+	wake(lock);
 
-	// TODO: client 接続許可範囲の設定
-	// TODO: statusがCONNECTのときの動作
+	return server;
+}
+
+std::vector<VIRTUAL_SOCKET> VirtualSocketImpl::take_accepts ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	std::vector<VIRTUAL_SOCKET> pending;
+	for (size_t i = 0; i < accept_count; ++i) { pending.push_back(accepts[(accept_head + i) % accepts.size()]); }
+	std::vector<VIRTUAL_SOCKET>().swap(accepts);
+	accept_head = 0;
+	accept_count = 0;
 
-	char ans[2];
-	memset(ans, '\0', 2);
-	send(sock, ans, 2, 0);
+	return pending;
 }
 
-void VirtualTcp::serve_listen (SOCKET sock, const char*com)
+// 相手側から切断された. 受信済みのデータは読み出せるように残しておく
+void VirtualSocketImpl::disconnect ()
 {
-	char aft[4];
-	memset(aft, '\0', 4);
-	recv(sock, aft, 4, 0);
+	std::unique_lock<std::mutex> lock(mtx);
 
-	VIRTUAL_SOCKET s = 0;
-	s |= aft[0] << 24;
-	s |= aft[1] << 16;
-	s |= aft[2] << 8;
-	s |= aft[3];
-	auto vsock = VirtualTcp::sockets.begin() + s;
+	status = VIRTUAL_SOCKET_CLOSED;
+	connected = false;
+	partner = INVALID_SOCKET;
 
-	// TODO: backlogの設定
-	// TODO: statusがCONNECTのときの動作
+	wake(lock);
+}
 
-	char ans[2];
-	memset(ans, '\0', 2);
-	send(sock, ans, 2, 0);
+// 以降は待ち受けにも積まれない. 残っている accept 待ちは take_accepts で取り出す
+// リングの領域も返すので、書き手と読み手を止めてから捨てる
+void VirtualSocketImpl::close ()
+{
+	std::unique_lock<std::mutex> writing(write_mtx);
+	std::unique_lock<std::mutex> reading(read_mtx);
+	std::unique_lock<std::mutex> lock(mtx);
+
+	status = VIRTUAL_SOCKET_CLOSED;
+	connected = false;
+	partner = INVALID_SOCKET;
+	VirtualSocketCounters::bump(counters.dropped, buffered());
+	ring.clear();
+	queue.clear();
+	queued = false;
+	inflight.reset();
+	reading.unlock();
+	writing.unlock();
+
+	// 起こした継続が同じソケットを読み書きしに来る
+	wake(lock);
 }
 
-void VirtualTcp::serve_accept (SOCKET sock, const char*com)
+void VirtualSocketImpl::notify ()
 {
-	char aft[4];
-	memset(aft, '\0', 4);
-	recv(sock, aft, 4, 0);
+	std::unique_lock<std::mutex> lock(mtx);
 
-	VIRTUAL_SOCKET s = 0;
-	s |= aft[0] << 24;
-	s |= aft[1] << 16;
-	s |= aft[2] << 8;
-	s |= aft[3];
-	auto vsock = VirtualTcp::sockets.begin() + s;
+	wake(lock);
+}
 
-	vsock->status = VIRTUAL_SOCKET_INITIAL;
+// 同じ epoll と target の組は1つだけ持つ
+void VirtualSocketImpl::watch (const std::shared_ptr<VirtualEpoll> &epoll, VIRTUAL_SOCKET target)
+{
+	std::lock_guard<std::mutex> lock(mtx);
 
-	// connect要求を待つ
-	while (VirtualTcp::running)
-	{
-		if (VIRTUAL_SOCKET_CONNECT == vsock->status) { break; }
-		std::this_thread::sleep_for(
-				std::chrono::milliseconds(VirtualTcp::PollingMs));
-	}
+	auto it = std::remove_if(watchers.begin(), watchers.end(), [](const VirtualEpollWatch &w) { return w.epoll.expired(); });
+	watchers.erase(it, watchers.end());
 
-	VIRTUAL_SOCKET client;
-	for (client = 0
-			; client < (long)VirtualTcp::sockets.size()
-			; ++client)
+	for (const VirtualEpollWatch &w : watchers)
 	{
-		if (&(VirtualTcp::sockets.at(client)) == &*(vsock->partner)) { break; }
+		if ((w.target == target) && (w.epoll.lock() == epoll)) { return; }
 	}
+	watchers.push_back(VirtualEpollWatch{epoll, target});
+	attend();
+}
 
-	char ans[4 + 4 + 2];
-	memset(ans, '\0', 10);
-	// client socket, ip, portをセット
-	ans[0] = (client & 0xff000000) >> 24;
-	ans[1] = (client & 0x00ff0000) >> 16;
-	ans[2] = (client & 0x0000ff00) >> 8;
-	ans[3] = (client & 0x000000ff);
-	ans[4] = (vsock->partner->ip & 0xff000000) >> 24;
-	ans[5] = (vsock->partner->ip & 0x00ff0000) >> 16;
-	ans[6] = (vsock->partner->ip & 0x0000ff00) >> 8;
-	ans[7] = (vsock->partner->ip & 0x000000ff);
-	ans[8] = (vsock->partner->port & 0xff00) >> 8;
-	ans[9] = (vsock->partner->port & 0x00ff);
-
-	send(sock, ans, 10, 0);
+void VirtualSocketImpl::unwatch (const VirtualEpoll *epoll, VIRTUAL_SOCKET target)
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	auto it = std::remove_if(watchers.begin(), watchers.end(), [&](const VirtualEpollWatch &w)
+			{
+				std::shared_ptr<VirtualEpoll> ep = w.epoll.lock();
+				return (! ep) || ((ep.get() == epoll) && (w.target == target));
+			});
+	watchers.erase(it, watchers.end());
+	attend();
 }
 
-void VirtualTcp::serve_send (SOCKET sock, const char*com)
+// 待っているスレッドを起こし、預かった継続を呼ぶ. 継続はロックを外してから呼ぶ
+// 見ている epoll にも状態が変わったことを知らせる
+void VirtualSocketImpl::wake (std::unique_lock<std::mutex> &lock)
 {
-	char aft[4 + 2];
-	memset(aft, '\0', 6);
-	recv(sock, aft, 6, 0);
+	std::vector<std::function<void()>> resumes;
+	resumes.swap(parked);
 
-	VIRTUAL_SOCKET s = 0;
-	s |= aft[0] << 24;
-	s |= aft[1] << 16;
-	s |= aft[2] << 8;
-	s |= aft[3];
-	auto vsock = VirtualTcp::sockets.begin() + s;
+	std::vector<std::pair<std::shared_ptr<VirtualEpoll>, VIRTUAL_SOCKET>> epolls;
+	if (! watchers.empty())
+	{
+		auto it = std::remove_if(watchers.begin(), watchers.end(), [&](const VirtualEpollWatch &w)
+				{
+					std::shared_ptr<VirtualEpoll> ep = w.epoll.lock();
+					if (! ep) { return true; }
 
-	int len = 0;
-	len |= aft[4] << 8;
-	len |= aft[5];
+					epolls.emplace_back(std::move(ep), w.target);
+					return false;
+				});
+		watchers.erase(it, watchers.end());
+	}
+	attend();
 
-	char msg[len];
-	memset(msg, '\0', len);
-	recv(sock, msg, len, 0);
+	lock.unlock();
+	cv.notify_all();
 
-	vsock->write(msg, len);
+	for (auto &resume : resumes) { resume(); }
+	for (auto &ep : epolls) { ep.first->mark(ep.second); }
 }
 
-void VirtualTcp::serve_recv (SOCKET sock, const char*com)
+std::atomic<bool> VirtualTcp::running;
+SOCKET VirtualTcp::alternative_listener;
+int VirtualTcp::alternative_port = VirtualTcp::ALTERNATIVE_PORT;
+#ifdef __linux__
+int VirtualTcp::alternative_shm_listener = -1;
+#endif
+VirtualBroker VirtualTcp::broker;
+VirtualChannelPool VirtualTcp::channels;
+VirtualSocketTable VirtualTcp::sockets;
+VirtualTcp::ListenShard VirtualTcp::shards[VirtualSocketTable::MaxShards];
+size_t VirtualTcp::nshards = 1;
+std::unordered_map<VirtualTcpCommand
+	, std::function<bool(VirtualBrokerConnection &, char *)>> VirtualTcp::services
+	= {{COM_SOCKET, VirtualTcp::serve_socket}
+		, {COM_CONNECT, VirtualTcp::serve_connect}
+		, {COM_BIND, VirtualTcp::serve_bind}
+		, {COM_LISTEN, VirtualTcp::serve_listen}
+		, {COM_ACCEPT, VirtualTcp::serve_accept}
+		, {COM_SEND, VirtualTcp::serve_send}
+		, {COM_RECV, VirtualTcp::serve_recv}
+		, {COM_CLOSE, VirtualTcp::serve_close}
+		, {COM_SETSOCKOPT, VirtualTcp::serve_setsockopt}
+		, {COM_POLL, VirtualTcp::serve_poll}
+		, {COM_EPOLL_CREATE, VirtualTcp::serve_epoll_create}
+		, {COM_EPOLL_CTL, VirtualTcp::serve_epoll_ctl}
+		, {COM_EPOLL_WAIT, VirtualTcp::serve_epoll_wait}
+		, {COM_EPOLL_CLOSE, VirtualTcp::serve_epoll_close}
+		, {COM_PEER, VirtualTcp::serve_peer}
+		, {COM_ROUTE, VirtualTcp::serve_route}
+		, {COM_FORWARD_CONNECT, VirtualTcp::serve_forward_connect}
+		, {COM_FORWARD_SEND, VirtualTcp::serve_forward_send}
+		, {COM_FORWARD_ACK, VirtualTcp::serve_forward_ack}
+		, {COM_FORWARD_CLOSE, VirtualTcp::serve_forward_close}
+		, {COM_STATS, VirtualTcp::serve_stats}};
+VirtualTimer VirtualTcp::timer;
+std::mutex VirtualTcp::epoll_mtx;
+std::unordered_map<int, std::shared_ptr<VirtualEpoll>> VirtualTcp::epolls;
+int VirtualTcp::next_epoll = 1;
+uint32_t VirtualTcp::broker_id = 0;
+std::mutex VirtualTcp::peer_mtx;
+std::vector<std::shared_ptr<VirtualPeer>> VirtualTcp::peers;
+std::atomic<size_t> VirtualTcp::npeers(0);
+std::mutex VirtualTcp::forward_mtx;
+std::unordered_map<uint64_t, std::shared_ptr<VirtualTcp::Forward>> VirtualTcp::forwards;
+std::mutex VirtualTcp::link_mtx;
+std::shared_ptr<const std::vector<std::shared_ptr<VirtualLink>>> VirtualTcp::links;
+std::atomic<bool> VirtualTcp::any_links(false);
+VirtualSocketCounters VirtualTcp::retired;
+std::atomic<uint64_t> VirtualTcp::sockets_created(0);
+std::atomic<uint64_t> VirtualTcp::connects(0);
+std::atomic<uint64_t> VirtualTcp::accepts(0);
+VirtualHistogram VirtualTcp::latency[COM_STATS + 1];
+std::mutex VirtualTcp::capture_mtx;
+std::atomic<VirtualCapture *> VirtualTcp::capture(nullptr);
+std::atomic<uint64_t> VirtualTcp::capture_users(0);
+std::atomic<bool> VirtualTcp::capturing(false);
+std::atomic<uint64_t> VirtualTcp::capture_filter(0);
+
+// 複数のスレッドが書く数に足す
+static void count (std::atomic<uint64_t> &counter, uint64_t n)
 {
-	char aft[4 + 2];
-	memset(aft, '\0', 6);
-	recv(sock, aft, 6, 0);
-
-	VIRTUAL_SOCKET s = 0;
-	s |= aft[0] << 24;
-	s |= aft[1] << 16;
-	s |= aft[2] << 8;
-	s |= aft[3];
-	auto vsock = VirtualTcp::sockets.begin() + s;
-
-	int len = 0;
-	len |= aft[4] << 8;
-	len |= aft[5];
+	if (n > 0) { counter.fetch_add(n, std::memory_order_relaxed); }
+}
 
-	char msg[len];
-	memset(msg, '\0', len);
-	while (VirtualTcp::running)
-	{
-		if (vsock->read(msg, len)) { break; }
-		std::this_thread::sleep_for(
-				std::chrono::milliseconds(VirtualTcp::PollingMs));
-	}
+uint64_t VirtualTcp::listener_key (unsigned long ip, unsigned short port)
+{
+	return ((uint64_t)(uint32_t)ip << 16) | port;
+}
 
-	char ans[2 + len];
-	memset(ans, '\0', 2 + len);
-	ans[0] = 0x00;
-	ans[1] = 0x00;
-	memcpy(&(ans[2]), msg, len);
-	send(sock, ans, 2 + len, 0);
+// 連番のアドレスやポートが同じ shard に偏らないよう、掛けて上位を使う
+size_t VirtualTcp::shard_of (unsigned long ip, unsigned short port)
+{
+	return (size_t)((listener_key(ip, port) * 0x9E3779B97F4A7C15ull) >> 32) % VirtualTcp::nshards;
 }
 
-void VirtualTcp::serve_close (SOCKET sock, const char*com)
+// アドレスの shard の mtx を保持して呼ぶこと. 別の生きているソケットが使用中なら失敗する
+bool VirtualTcp::register_listener (VirtualSocketImpl &vsock)
 {
-	char aft[4];
-	memset(aft, '\0', 4);
-	recv(sock, aft, 4, 0);
+	auto &listeners = VirtualTcp::shards[shard_of(vsock.ip, vsock.port)].listeners;
+	auto res = listeners.emplace(listener_key(vsock.ip, vsock.port), vsock.self);
+	if (res.second || (res.first->second == vsock.self)) { return true; }
 
-	VIRTUAL_SOCKET s = 0;
-	s |= aft[0] << 24;
-	s |= aft[1] << 16;
-	s |= aft[2] << 8;
-	s |= aft[3];
-	auto vsock = VirtualTcp::sockets.begin() + s;
+	if (VirtualTcp::sockets.acquire(res.first->second)) { return false; }
 
-	vsock->partner->close();
-	vsock->close();
+	res.first->second = vsock.self;
+	return true;
 }
 
-int VirtualTcp::startup ()
+void VirtualTcp::unregister_listener (VirtualSocketImpl &vsock)
 {
-#ifdef __unix__
-	signal(SIGPIPE, SIG_IGN);
-#endif
+	ListenShard &shard = VirtualTcp::shards[shard_of(vsock.ip, vsock.port)];
+	std::lock_guard<std::mutex> lock(shard.mtx);
 
-#ifdef _WINDOWS
-	WSADATA wsaData;
-	WSAStartup(MAKEWORD(2, 0), &wsaData);
-#endif
+	auto it = shard.listeners.find(listener_key(vsock.ip, vsock.port));
+	if ((it != shard.listeners.end()) && (it->second == vsock.self))
+	{
+		shard.listeners.erase(it);
+		VirtualTcp::announce(vsock.ip, vsock.port, false);
+	}
+}
 
-	VirtualTcp::running = true;
-	VirtualTcp::alternative_tcp_server_th
-		= std::thread(VirtualTcp::alternative_tcp_server_fn);
+// shard の中で listen を待っている connect をすべて起こす. 宛先が違えば調べ直して待ち直す
+void VirtualTcp::wake_listeners (ListenShard &shard)
+{
+	std::vector<std::function<void()>> resumes;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		resumes.swap(shard.parked);
+	}
+	shard.cv.notify_all();
 
-	return 0;
+	for (auto &resume : resumes) { resume(); }
 }
 
-int VirtualTcp::cleanup ()
+#ifdef __linux__
+std::string VirtualTcp::alternative_shm_path (int port)
 {
-	VirtualTcp::sockets.clear();
-	VirtualTcp::running = false;
-	VirtualTcp::alternative_tcp_server_th.join();
-
-#ifdef _WINDOWS
-	WSACleanup();
+	return std::string("\0virtual_tcp.", 13) + std::to_string(port);
+}
 #endif
 
-	return 0;
+VIRTUAL_SOCKET VirtualTcp::core_socket (unsigned long ip, unsigned short port)
+{
+	count(VirtualTcp::sockets_created, 1);
+	return VirtualTcp::sockets.create(ip, port, shard_of(ip, port));
 }
 
-VirtualTcp::VirtualTcp (const std::string virtual_addr_, const int virtual_port_)
-	  : alternative_server()
-	  , virtual_addr(virtual_addr_)
-	  , virtual_port(virtual_port_)
+// 宛先の待ち受けにサーバ側のソケットを新しく作って繋ぎ、accept 待ちに積んだら返る
+// 宛先が listen するまでと、accept 待ちの列が backlog で一杯の間は待つ
+// MSG_DONTWAIT なら待たずに、listen していなければ ECONNREFUSED、一杯なら EAGAIN で失敗する
+int VirtualTcp::core_connect (VIRTUAL_SOCKET s, unsigned long ip, unsigned short port, int flags
+		, const std::function<void()> &resume)
 {
-#ifdef _WINDOWS
-	WSADATA wsaData;
-	WSAStartup(MAKEWORD(2, 0), &wsaData);
-#endif
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
 
-	alternative_server = socket(AF_INET, SOCK_STREAM, 0);
-
-	struct sockaddr_in addr;
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(ALTERNATIVE_PORT);
-#ifdef __unix__
-	addr.sin_addr.s_addr = inet_addr(ALTERNATIVE_IP);
-#elif _WINDOWS
-	addr.sin_addr.S_un.S_addr = inet_addr(ALTERNATIVE_IP);
-#endif
+	if (VIRTUAL_SOCKET_VOID != vsock->status)
+	{
+		errno = EISCONN;
+		return -1;
+	}
 
-	connect(alternative_server, (struct sockaddr *)&addr, sizeof(addr));
+	uint64_t key = VirtualTcp::listener_key(ip, port);
+	size_t sh = VirtualTcp::shard_of(ip, port);
+	ListenShard &shard = VirtualTcp::shards[sh];
+	while (true)
+	{
+		VirtualSocketTable::Ref listener;
+		std::shared_ptr<VirtualPeer> route;
+		{
+			std::unique_lock<std::mutex> lock(shard.mtx);
+			auto ready = [&]()
+					{
+						auto it = shard.listeners.find(key);
+						if (it == shard.listeners.end())
+						{
+							// 他のブローカで待ち受けていれば、そこへ中継する
+							auto rt = shard.routes.find(key);
+							if ((shard.routes.end() != rt) && (! rt->second->broken())) { route = rt->second; }
+							return route || (! VirtualTcp::running);
+						}
+
+						listener = VirtualTcp::sockets.acquire(it->second);
+						if (! listener)
+						{
+							shard.listeners.erase(it);
+							return ! VirtualTcp::running;
+						}
+						return true;
+					};
+			if (flags & MSG_DONTWAIT)
+			{
+				if (! ready())
+				{
+					errno = ECONNREFUSED;
+					return -1;
+				}
+			}
+			else if (resume)
+			{
+				if (! ready())
+				{
+					shard.parked.push_back(resume);
+					return PARKED;
+				}
+			}
+			else if (! ready())
+			{
+				auto begin = std::chrono::steady_clock::now();
+				shard.cv.wait(lock, ready);
+				count(vsock->counters.wait_ns, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+						std::chrono::steady_clock::now() - begin).count());
+			}
+		}
+		if (! VirtualTcp::running)
+		{
+			errno = ECONNREFUSED;
+			return -1;
+		}
+		if (route) { return VirtualTcp::forward_connect(*vsock, route, ip, port); }
+
+		// 待ち受けが閉じられたら宛先を引き直す
+		auto room = [&]()
+				{
+					return (! VirtualTcp::running) || (VIRTUAL_SOCKET_LISTEN != listener->status)
+						|| (listener->accept_count < (size_t)listener->backlog);
+				};
+		if (flags & MSG_DONTWAIT)
+		{
+			if (! listener->check(room))
+			{
+				count(vsock->counters.would_block, 1);
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+		else if (resume)
+		{
+			if (listener->park(room, resume)) { return PARKED; }
+		}
+		else
+		{
+			count(vsock->counters.wait_ns, listener->wait(room));
+		}
+
+		// 積むまで待ち受けのロックを持ったまま両端を繋ぐ. ロックは待ち受け → 繋ぐ2つの順に取る
+		std::unique_lock<std::mutex> lock(listener->mtx);
+		if ((! VirtualTcp::running) || (! listener->acceptable())) { continue; }
+
+		VIRTUAL_SOCKET server = VirtualTcp::sockets.create(listener->ip, listener->port, sh);
+		VirtualSocketTable::Ref peer = VirtualTcp::sockets.acquire(server);
+		if (! peer)
+		{
+			errno = ENOBUFS;
+			return -1;
+		}
+
+		// accept される前に届いたデータもサーバ側のソケットに溜まる
+		peer->connect(s);
+		vsock->connect(server);
+		listener->enqueue(server);
+		lock.unlock();
+		count(VirtualTcp::sockets_created, 1);
+		count(VirtualTcp::connects, 1);
+
+		listener->notify();
+		return 0;
+	}
 }
 
-VirtualTcp::~VirtualTcp ()
+int VirtualTcp::core_bind (VIRTUAL_SOCKET s, unsigned long ip, unsigned short port)
 {
-#ifdef __unix__
-	close(alternative_server);
-#elif _WINDOWS
-	closesocket(alternative_server);
-	WSACleanup();
-#endif
-}
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
 
+	// TODO: client 接続許可範囲の設定
 
-VIRTUAL_SOCKET VirtualTcp::vsocket (int af, int type, int protocol)
-{
-	assert(AF_INET == af);
-	assert(SOCK_STREAM == type);
-	assert(0 == protocol);
-
-	unsigned long ip = inet_addr(virtual_addr.c_str());
-	unsigned short port = htons(virtual_port);
+	// 待ち受け中や接続済みのアドレスは付け替えない. 待ち受けの登録は listen でするので、ここでは外すものもない
+	if (VIRTUAL_SOCKET_VOID != vsock->status)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	vsock->bind(ip, port);
 
-	char req[1 + 4 + 2];
-	memset(req, '\0', 7);
-	req[0] = COM_SOCKET;
-	req[1] = (char)((ip & 0xff000000) >> 24);
-	req[2] = (char)((ip & 0x00ff0000) >> 16);
-	req[3] = (char)((ip & 0x0000ff00) >> 8);
-	req[4] = (char)( ip & 0x000000ff);
-	req[5] = (char)((port & 0xff00) >> 8);
-	req[6] = (char)( port & 0x00ff);
-	send(alternative_server, req, 7, 0);
-
-	char ans[4];
-	memset(ans, '\0', 4);
-	recv(alternative_server, ans, 4, 0);
-	VIRTUAL_SOCKET s = 0;
-	s |= ans[0] << 24;
-	s |= ans[1] << 16;
-	s |= ans[2] << 8;
-	s |= ans[3];
-
-	return s;
+	return 0;
 }
 
-int VirtualTcp::vconnect (VIRTUAL_SOCKET s, const sockaddr *name, int namelen)
+int VirtualTcp::core_listen (VIRTUAL_SOCKET s, int backlog)
 {
-	if (! VirtualTcp::running)
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
+
+	// 待ち受け中なら backlog だけ変える. 接続済みのソケットは待ち受けにできない
+	if ((VIRTUAL_SOCKET_VOID != vsock->status) && (VIRTUAL_SOCKET_LISTEN != vsock->status))
 	{
-#ifdef _WINDOWS
-		return WSANOTINITIALISED;
-#else
+		errno = EINVAL;
 		return -1;
-#endif
 	}
-	struct sockaddr_in *sname = (struct sockaddr_in *)name;
-	assert(AF_INET == sname->sin_family);
 
-#ifdef __unix__
-	unsigned long ip = sname->sin_addr.s_addr;
-#elif _WINDOWS
-	unsigned long ip = sname->sin_addr.S_un.S_addr;
-#endif
-	unsigned short port = sname->sin_port;
+	ListenShard &shard = VirtualTcp::shards[shard_of(vsock->ip, vsock->port)];
+	bool ok;
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		ok = VirtualTcp::register_listener(*vsock);
+		if (ok)
+		{
+			vsock->listen(backlog);
+			VirtualTcp::announce(vsock->ip, vsock->port, true);
+		}
+	}
+	if (! ok)
+	{
+		errno = EADDRINUSE;
+		return -1;
+	}
+	VirtualTcp::wake_listeners(shard);
 
-	char req[1 + 4 + 4 + 2];
-	memset(req, '\0', 11);
-	req[0] = COM_CONNECT;
-	req[1] = (char)((s & 0xff000000) >> 24);
-	req[2] = (char)((s & 0x00ff0000) >> 16);
-	req[3] = (char)((s & 0x0000ff00) >> 8);
-	req[4] = (char)( s & 0x000000ff);
-	req[5] = (char)((ip & 0xff000000) >> 24);
-	req[6] = (char)((ip & 0x00ff0000) >> 16);
-	req[7] = (char)((ip & 0x0000ff00) >> 8);
-	req[8] = (char)( ip & 0x000000ff);
-	req[9] = (char)((port & 0xff00) >> 8);
-	req[10] = (char)(port & 0x00ff);
-	send(alternative_server, req, 11, 0);
-
-	char ans[2];
-	memset(ans, '\0', 2);
-	recv(alternative_server, ans, 2, 0);
-	int anscode = 0;
-	anscode |= ans[0] << 8;
-	anscode |= ans[1];
-
-	return anscode;
+	return 0;
 }
 
-int VirtualTcp::vbind (VIRTUAL_SOCKET s, const sockaddr *name, int namelen)
+// accept 待ちの先頭を取り出す. ip, port は接続してきた相手のアドレス
+VIRTUAL_SOCKET VirtualTcp::core_accept (VIRTUAL_SOCKET s, unsigned long &ip, unsigned short &port, int flags
+		, const std::function<void()> &resume)
 {
-	if (! VirtualTcp::running)
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return INVALID_SOCKET; }
+
+	// listen を経ずに accept された場合はここで listen する
+	if ((VIRTUAL_SOCKET_VOID == vsock->status)
+			&& (0 != VirtualTcp::core_listen(s, VirtualSocketImpl::MAX_BACKLOG)))
 	{
-#ifdef _WINDOWS
-		return WSANOTINITIALISED;
-#else
-		return -1;
-#endif
+		return INVALID_SOCKET;
 	}
-	struct sockaddr_in *sname = (struct sockaddr_in *)name;
-	assert(AF_INET == sname->sin_family);
-
-#ifdef __unix__
-	unsigned long ip = sname->sin_addr.s_addr;
-#elif _WINDOWS
-	unsigned long ip = sname->sin_addr.S_un.S_addr;
-#endif
-	unsigned short port = sname->sin_port;
 
-	char req[1 + 4 + 4 + 2];
-	memset(req, '\0', 11);
-	req[0] = COM_BIND;
-	req[1] = (char)((s & 0xff000000) >> 24);
-	req[2] = (char)((s & 0x00ff0000) >> 16);
-	req[3] = (char)((s & 0x0000ff00) >> 8);
-	req[4] = (char)( s & 0x000000ff);
-	req[5] = (char)((ip & 0xff000000) >> 24);
-	req[6] = (char)((ip & 0x00ff0000) >> 16);
-	req[7] = (char)((ip & 0x0000ff00) >> 8);
-	req[8] = (char)( ip & 0x000000ff);
-	req[9] = (char)((port & 0xff00) >> 8);
-	req[10] = (char)(port & 0x00ff);
-	send(alternative_server, req, 11, 0);
+	auto ready = [&]()
+			{
+				return (! VirtualTcp::running) || (VIRTUAL_SOCKET_LISTEN != vsock->status)
+					|| (vsock->accept_count > 0);
+			};
+	if (flags & MSG_DONTWAIT)
+	{
+		if (! vsock->check(ready))
+		{
+			count(vsock->counters.would_block, 1);
+			errno = EAGAIN;
+			return INVALID_SOCKET;
+		}
+	}
+	else if (resume)
+	{
+		if (vsock->park(ready, resume)) { return PARKED; }
+	}
+	else
+	{
+		count(vsock->counters.wait_ns, vsock->wait(ready));
+	}
 
-	char ans[2];
-	memset(ans, '\0', 2);
-	recv(alternative_server, ans, 2, 0);
+	VIRTUAL_SOCKET server = vsock->dequeue();
+	if (INVALID_SOCKET == server)
+	{
+		errno = EINVAL;
+		return INVALID_SOCKET;
+	}
 
-	int anscode = 0;
-	anscode |= ans[0] << 8;
-	anscode |= ans[1];
+	// 相手が既に閉じていれば 0.0.0.0:0
+	VirtualSocketTable::Ref peer = VirtualTcp::sockets.acquire(server);
+	VirtualSocketTable::Ref partner = VirtualTcp::sockets.acquire(peer ? peer->peer() : INVALID_SOCKET);
+	ip = partner ? partner->ip : 0;
+	port = partner ? partner->port : 0;
+	count(VirtualTcp::accepts, 1);
 
-	return anscode;
+	return server;
 }
 
-int VirtualTcp::vlisten (VIRTUAL_SOCKET s, int backlog)
+// 相手の受信ウィンドウの空きへ書き込む. 既定では iov をすべて書き込むまで待つ
+// MSG_DONTWAIT とブローカからの呼び出しは、書き込めた分だけで返す
+// iov が owner の領域を指していれば、相手の受信キューへは参照で渡す
+int VirtualTcp::core_send (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags
+		, const std::function<void()> &resume, const VirtualSegmentPtr *owner)
 {
-	if (! VirtualTcp::running)
+	if ((iovcnt < 0) || (iovcnt > IOV_MAX))
 	{
-#ifdef _WINDOWS
-		return WSANOTINITIALISED;
-#else
+		errno = EINVAL;
 		return -1;
-#endif
 	}
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
 
-	// TODO: backlog
+	int len = (int)std::min(iov_length(iov, iovcnt), (size_t)INT_MAX);
+	if (len <= 0) { return 0; }
+
+	struct iovec rest[IOV_MAX];
+	int sent = 0;
+	int err = EPIPE;
+	while (sent < len)
+	{
+		VirtualSocketTable::Ref partner = VirtualTcp::sockets.acquire(vsock->peer());
+		if (! partner) { break; }
 
-	char req[1 + 4];
-	memset(req, '\0', 5);
-	req[0] = COM_LISTEN;
-	req[1] = (char)((s & 0xff000000) >> 24);
-	req[2] = (char)((s & 0x00ff0000) >> 16);
-	req[3] = (char)((s & 0x0000ff00) >> 8);
-	req[4] = (char)( s & 0x000000ff);
-	send(alternative_server, req, 5, 0);
+		auto ready = [&]()
+				{
+					return (! VirtualTcp::running)
+						|| (VIRTUAL_SOCKET_CONNECT != partner->status)
+						|| (partner->buffered() < partner->window);
+				};
+		// リングに空きがあれば相手の mtx を取らない
+		if (! partner->writable())
+		{
+			if (flags & MSG_DONTWAIT)
+			{
+				if (! partner->check(ready))
+				{
+					err = EAGAIN;
+					break;
+				}
+			}
+			else if (resume)
+			{
+				if (partner->park(ready, resume)) { return PARKED; }
+			}
+			else
+			{
+				count(vsock->counters.wait_ns, partner->wait(ready));
+			}
+		}
+		if (! VirtualTcp::running) { break; }
+
+		std::shared_ptr<VirtualLink> link;
+		if (VirtualTcp::any_links.load(std::memory_order_relaxed)) { link = VirtualTcp::find_link(vsock->ip, partner->ip); }
+		bool traced = VirtualTcp::capturing.load(std::memory_order_relaxed)
+			&& VirtualCaptureFilter::unpack(VirtualTcp::capture_filter.load(std::memory_order_relaxed)).match(
+					vsock->ip, vsock->port, partner->ip, partner->port);
+		VirtualCapture *cap = nullptr;
+		if (traced)
+		{
+			VirtualTcp::capture_users.fetch_add(1);
+			cap = VirtualTcp::capture.load();
+		}
+
+		auto arm = std::chrono::steady_clock::time_point::min();
+		int n = partner->write(rest, iov_slice(iov, iovcnt, sent, len - sent, rest), owner, link.get(), &(*vsock), &arm
+				, cap);
+		if (traced) { VirtualTcp::capture_users.fetch_sub(1, std::memory_order_release); }
+		if (n < 0) { break; }
+		sent += n;
+
+		if (std::chrono::steady_clock::time_point::min() != arm)
+		{
+			VIRTUAL_SOCKET target = partner->self;
+			VirtualTcp::timer.schedule(arm, [target]() { VirtualTcp::arrive(target); });
+		}
+
+		if ((n > 0) && (resume || (flags & MSG_DONTWAIT))) { break; }
+	}
 
-	char ans[2];
-	recv(alternative_server, ans, 2, 0);
-	int anscode = 0;
-	anscode |= ans[0] << 8;
-	anscode |= ans[1];
+	if (sent > 0)
+	{
+		count(vsock->counters.bytes_out, (uint64_t)sent);
+		count(vsock->counters.msgs_out, 1);
+		return sent;
+	}
 
-	return anscode;
+	if (EAGAIN == err) { count(vsock->counters.would_block, 1); }
+	errno = err;
+	return -1;
 }
 
-VIRTUAL_SOCKET VirtualTcp::vaccept (VIRTUAL_SOCKET s, sockaddr *addr, unsigned int *addrlen)
+// recv できるようになるまで待つ. 待たずに返せなければ -1 (errno = EAGAIN)、継続を預けたら PARKED
+int VirtualTcp::core_recv_wait (VirtualSocketImpl &vsock, size_t len, int flags
+		, const std::function<void()> &resume)
 {
-	if (! VirtualTcp::running)
+	// 既定では1バイトでも届けば返す. MSG_WAITALL なら len バイト揃うまで待つ
+	// どちらも相手が切断したら残っている分だけ返す. 経路の途中にある分は届くのを待つ
+	size_t want = 1;
+	if ((flags & MSG_WAITALL) && (! (flags & MSG_DONTWAIT))) { want = len; }
+	if (vsock.readable(want)) { return 0; }
+
+	auto ready = [&]()
+			{
+				return (! VirtualTcp::running)
+					|| ((VIRTUAL_SOCKET_CONNECT != vsock.status) && (! vsock.inflight))
+					|| (vsock.available() >= std::min(want, vsock.window.load()));
+			};
+	if (flags & MSG_DONTWAIT)
 	{
-#ifdef _WINDOWS
-		return WSANOTINITIALISED;
-#else
-		return -1;
-#endif
+		if (! vsock.check(ready))
+		{
+			count(vsock.counters.would_block, 1);
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	else if (resume)
+	{
+		if (vsock.park(ready, resume)) { return PARKED; }
+	}
+	else
+	{
+		count(vsock.counters.wait_ns, vsock.wait(ready));
 	}
 
-	char req[1 + 4];
-	memset(req, '\0', 5);
-	req[0] = COM_ACCEPT;
-	req[1] = (char)((s & 0xff000000) >> 24);
-	req[2] = (char)((s & 0x00ff0000) >> 16);
-	req[3] = (char)((s & 0x0000ff00) >> 8);
-	req[4] = (char)( s & 0x000000ff);
-	send(alternative_server, req, 5, 0);
-
-	char ans[4 + 4 + 2];
-	memset(ans, '\0', 10);
-	recv(alternative_server, ans, 10, 0);
-	VIRTUAL_SOCKET client = 0;
-	client |= ans[0] << 24;
-	client |= ans[1] << 16;
-	client |= ans[2] << 8;
-	client |= ans[3];
-
-	unsigned long ip = 0;
-	ip |= ans[4] << 24;
-	ip |= ans[5] << 16;
-	ip |= ans[6] << 8;
-	ip |= ans[7];
+	return 0;
+}
 
-	unsigned short port = 0;
-	port |= ans[8] << 8;
-	port |= ans[9];
+int VirtualTcp::core_recv (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags
+		, const std::function<void()> &resume)
+{
+	if ((iovcnt < 0) || (iovcnt > IOV_MAX))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
+
+	size_t len = std::min(iov_length(iov, iovcnt), (size_t)INT_MAX);
+	if (0 == len) { return 0; }
+
+	int res = VirtualTcp::core_recv_wait(*vsock, len, flags, resume);
+	if (0 != res) { return res; }
+
+	return vsock->read(iov, iovcnt, flags & MSG_PEEK);
+}
+
+// 受信キューの切片を複製せずに out へ渡す (ブローカ用)
+int VirtualTcp::core_recv (VIRTUAL_SOCKET s, size_t len, int flags, std::vector<VirtualSlice> &out
+		, const std::function<void()> &resume)
+{
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
+
+	len = std::min(len, (size_t)INT_MAX);
+	if (0 == len) { return 0; }
+
+	int res = VirtualTcp::core_recv_wait(*vsock, len, flags, resume);
+	if (0 != res) { return res; }
+
+	return vsock->share(len, out, flags & MSG_PEEK);
+}
+
+int VirtualTcp::core_close (VIRTUAL_SOCKET s)
+{
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
+
+	VirtualTcp::unregister_listener(*vsock);
+
+	VirtualSocketTable::Ref partner = VirtualTcp::sockets.acquire(vsock->peer());
+	if (partner) { partner->disconnect(); }
+	vsock->close();
+
+	// accept されずに残った接続は閉じて、connect した側へ切断を伝える
+	for (VIRTUAL_SOCKET server : vsock->take_accepts()) { VirtualTcp::core_close(server); }
+
+	// 参照が外れた時点でスロットが再利用へ回る. 数はそれまでに合計へ移す
+	if (VirtualTcp::sockets.retire(s)) { vsock->counters.add_to(VirtualTcp::retired); }
+	return 0;
+}
+
+int VirtualTcp::core_setsockopt (VIRTUAL_SOCKET s, int level, int optname, int value)
+{
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return -1; }
+
+	if ((SOL_SOCKET == level) && (SO_RCVBUF == optname))
+	{
+		vsock->set_window((size_t)std::max(value, 0));
+		return 0;
+	}
+
+	errno = ENOPROTOOPT;
+	return -1;
+}
+
+short VirtualTcp::core_readiness (VIRTUAL_SOCKET s, short events, const std::shared_ptr<VirtualEpoll> &epoll)
+{
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return POLLNVAL; }
+
+	short revents = 0;
+	VIRTUAL_SOCKET partner = INVALID_SOCKET;
+	{
+		std::lock_guard<std::mutex> lock(vsock->mtx);
+
+		switch (vsock->status)
+		{
+			case VIRTUAL_SOCKET_LISTEN:
+				if (vsock->accept_count > 0) { revents |= POLLIN; }
+				break;
+			case VIRTUAL_SOCKET_CONNECT:
+				if (0 < vsock->available()) { revents |= POLLIN; }
+				partner = vsock->partner;
+				break;
+			case VIRTUAL_SOCKET_CLOSED:
+				// 経路の途中にある分が届き切るまでは切断を見せない
+				if (! vsock->inflight) { revents |= POLLIN | POLLHUP; }
+				else if (0 < vsock->available()) { revents |= POLLIN; }
+				break;
+			default:
+				break;
+		}
+	}
+
+	// 送信の空きは相手の受信ウィンドウで決まるので、相手の状態の変化も知らせてもらう
+	// 見落とさないよう、調べる前に登録する
+	if ((events & POLLOUT) && (INVALID_SOCKET != partner))
+	{
+		VirtualSocketTable::Ref peer = VirtualTcp::sockets.acquire(partner);
+		if (peer && epoll) { peer->watch(epoll, s); }
+
+		if ((! peer) || peer->check([&]()
+					{
+						return (VIRTUAL_SOCKET_CONNECT != peer->status) || (peer->buffered() < peer->window);
+					}))
+		{
+			revents |= POLLOUT;
+		}
+	}
+
+	return revents & (events | POLLHUP | POLLNVAL);
+}
+
+// 準備のできたものがなければ、すべてを一時的な epoll に登録して変化を待つ
+int VirtualTcp::core_poll (VirtualPollFd *fds, unsigned long nfds
+		, std::chrono::steady_clock::time_point deadline, const std::function<void()> &resume)
+{
+	std::shared_ptr<VirtualEpoll> epoll;
+	while (true)
+	{
+		if (! VirtualTcp::running)
+		{
+			errno = EINTR;
+			return -1;
+		}
+
+		// 調べ直している間の変化は ready に残り、park や wait_until がすぐに返る
+		if (epoll) { epoll->take_ready(); }
+
+		int n = 0;
+		for (unsigned long i = 0; i < nfds; ++i)
+		{
+			fds[i].revents = (fds[i].fd < 0) ? 0 : VirtualTcp::core_readiness(fds[i].fd, fds[i].events, epoll);
+			if (0 != fds[i].revents) { ++n; }
+		}
+		if (0 < n) { return n; }
+		if (std::chrono::steady_clock::now() >= deadline) { return 0; }
+
+		if (! epoll)
+		{
+			epoll = std::make_shared<VirtualEpoll>();
+			for (unsigned long i = 0; i < nfds; ++i)
+			{
+				VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(fds[i].fd);
+				if (! vsock) { continue; }
+
+				epoll->add(fds[i].fd, (uint32_t)fds[i].events, 0);
+				vsock->watch(epoll, fds[i].fd);
+			}
+			continue;
+		}
+
+		if (resume)
+		{
+			// 起こされるまで epoll は継続が持つ. 起こされたら要求ごと最初から調べ直す
+			if (! epoll->park([epoll, resume]() { resume(); })) { continue; }
+			if (std::chrono::steady_clock::time_point::max() != deadline)
+			{
+				VirtualTcp::timer.schedule(deadline, [epoll]() { epoll->notify(); });
+			}
+			return PARKED;
+		}
+
+		epoll->wait_until(deadline);
+	}
+}
+
+int VirtualTcp::core_epoll_create ()
+{
+	std::lock_guard<std::mutex> lock(VirtualTcp::epoll_mtx);
+
+	int epfd = VirtualTcp::next_epoll++;
+	VirtualTcp::epolls.emplace(epfd, std::make_shared<VirtualEpoll>());
+	return epfd;
+}
+
+std::shared_ptr<VirtualEpoll> VirtualTcp::find_epoll (int epfd)
+{
+	std::lock_guard<std::mutex> lock(VirtualTcp::epoll_mtx);
+
+	auto it = VirtualTcp::epolls.find(epfd);
+	if (VirtualTcp::epolls.end() == it) { return nullptr; }
+	return it->second;
+}
+
+int VirtualTcp::core_epoll_ctl (int epfd, int op, VIRTUAL_SOCKET s, const VirtualEpollEvent *event)
+{
+	std::shared_ptr<VirtualEpoll> epoll = VirtualTcp::find_epoll(epfd);
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if ((! epoll) || (! vsock))
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if ((VEPOLL_CTL_DEL != op) && (nullptr == event))
+	{
+		errno = EFAULT;
+		return -1;
+	}
+
+	switch (op)
+	{
+		case VEPOLL_CTL_ADD:
+			if (! epoll->add(s, event->events, event->data))
+			{
+				errno = EEXIST;
+				return -1;
+			}
+			vsock->watch(epoll, s);
+			return 0;
+		case VEPOLL_CTL_MOD:
+			if (! epoll->modify(s, event->events, event->data))
+			{
+				errno = ENOENT;
+				return -1;
+			}
+			return 0;
+		case VEPOLL_CTL_DEL:
+			// 相手に残した送信の空きの登録は、相手が起こしたときに読み飛ばされる
+			if (! epoll->remove(s))
+			{
+				errno = ENOENT;
+				return -1;
+			}
+			vsock->unwatch(epoll.get(), s);
+			return 0;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+}
+
+// ready に積まれたソケットだけを調べる. レベルトリガで報告したものは次の呼び出しでも調べ直す
+int VirtualTcp::core_epoll_wait (int epfd, VirtualEpollEvent *events, int maxevents
+		, std::chrono::steady_clock::time_point deadline, const std::function<void()> &resume)
+{
+	std::shared_ptr<VirtualEpoll> epoll = VirtualTcp::find_epoll(epfd);
+	if (! epoll)
+	{
+		errno = EBADF;
+		return -1;
+	}
+	if (maxevents <= 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	std::vector<VIRTUAL_SOCKET> again;
+	while (true)
+	{
+		if ((! VirtualTcp::running) || epoll->closed())
+		{
+			errno = (VirtualTcp::running) ? EBADF : EINTR;
+			return -1;
+		}
+
+		int n = 0;
+		again.clear();
+		for (VIRTUAL_SOCKET s : epoll->take_ready())
+		{
+			VirtualEpoll::Entry entry;
+			if (! epoll->lookup(s, entry)) { continue; }
+
+			// 入りきらない分は次の呼び出しに回す
+			if (n >= maxevents)
+			{
+				again.push_back(s);
+				continue;
+			}
+
+			short revents = VirtualTcp::core_readiness(s, (short)(entry.events & 0xffff), epoll);
+			if (revents & POLLNVAL)
+			{
+				epoll->remove(s);
+				continue;
+			}
+			if (0 == revents) { continue; }
+
+			events[n].events = (uint32_t)(uint16_t)revents;
+			events[n].data = entry.data;
+			++n;
+			if (! (entry.events & VEPOLLET)) { again.push_back(s); }
+		}
+		epoll->requeue(again);
+
+		if (0 < n) { return n; }
+		if (std::chrono::steady_clock::now() >= deadline) { return 0; }
+
+		if (resume)
+		{
+			if (! epoll->park(resume)) { continue; }
+			if (std::chrono::steady_clock::time_point::max() != deadline)
+			{
+				VirtualTcp::timer.schedule(deadline, [epoll]() { epoll->notify(); });
+			}
+			return PARKED;
+		}
+
+		epoll->wait_until(deadline);
+	}
+}
+
+// 待っている vepoll_wait は EBADF で返る
+int VirtualTcp::core_epoll_close (int epfd)
+{
+	std::shared_ptr<VirtualEpoll> epoll;
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::epoll_mtx);
+
+		auto it = VirtualTcp::epolls.find(epfd);
+		if (VirtualTcp::epolls.end() == it)
+		{
+			errno = EBADF;
+			return -1;
+		}
+		epoll = std::move(it->second);
+		VirtualTcp::epolls.erase(it);
+	}
+
+	epoll->close();
+	return 0;
+}
+
+// 生きているソケットの数は表を1周して足す. 数えている間も送受信は止めない
+void VirtualTcp::core_stats (VirtualStats &out, bool per_socket)
+{
+	out.clear();
+
+	VirtualSocketCounters total;
+	VirtualTcp::retired.add_to(total);
+	VirtualTcp::sockets.for_each([&](VirtualSocketImpl &vsock)
+			{
+				++out.sockets_live;
+				vsock.counters.add_to(total);
+				if (! per_socket) { return; }
+
+				std::lock_guard<std::mutex> lock(vsock.mtx);
+				const VirtualSocketCounters &c = vsock.counters;
+				out.sockets.push_back(VirtualSocketStats{vsock.self, (uint32_t)vsock.ip, vsock.port, (uint16_t)vsock.status
+						, c.bytes_in.load(std::memory_order_relaxed), c.msgs_in.load(std::memory_order_relaxed)
+						, c.bytes_out.load(std::memory_order_relaxed), c.msgs_out.load(std::memory_order_relaxed)
+						, c.dropped.load(std::memory_order_relaxed), c.would_block.load(std::memory_order_relaxed)
+						, c.wait_ns.load(std::memory_order_relaxed), vsock.buffered()
+						, c.high_water.load(std::memory_order_relaxed), vsock.window});
+			});
+
+	out.sockets_created = VirtualTcp::sockets_created.load(std::memory_order_relaxed);
+	out.connects = VirtualTcp::connects.load(std::memory_order_relaxed);
+	out.accepts = VirtualTcp::accepts.load(std::memory_order_relaxed);
+	out.bytes_in = total.bytes_in.load(std::memory_order_relaxed);
+	out.msgs_in = total.msgs_in.load(std::memory_order_relaxed);
+	out.bytes_out = total.bytes_out.load(std::memory_order_relaxed);
+	out.msgs_out = total.msgs_out.load(std::memory_order_relaxed);
+	out.dropped = total.dropped.load(std::memory_order_relaxed);
+	out.would_block = total.would_block.load(std::memory_order_relaxed);
+	out.wait_ns = total.wait_ns.load(std::memory_order_relaxed);
+	out.high_water = total.high_water.load(std::memory_order_relaxed);
+
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::capture_mtx);
+
+		VirtualCapture *cap = VirtualTcp::capture.load();
+		if (nullptr != cap)
+		{
+			out.capture_packets = cap->packets();
+			out.capture_dropped = cap->dropped();
+		}
+	}
+
+	// 一度も届いていないコマンドは入れない
+	std::vector<uint64_t> counts;
+	for (uint32_t command = 0; command <= COM_STATS; ++command)
+	{
+		uint64_t max;
+		VirtualTcp::latency[command].snapshot(counts, max);
+
+		uint64_t n = 0;
+		for (uint64_t c : counts) { n += c; }
+		if (0 == n) { continue; }
+
+		out.commands.push_back(VirtualCommandStats{command, n, virtual_percentile(counts, max, 0.5)
+				, virtual_percentile(counts, max, 0.9), virtual_percentile(counts, max, 0.99)
+				, virtual_percentile(counts, max, 0.999), max});
+	}
+
+	VirtualTcp::broker.stats(out.workers, out.connections);
+}
+
+// 新しい経路から順に探す
+std::shared_ptr<VirtualLink> VirtualTcp::find_link (unsigned long src, unsigned long dst)
+{
+	std::shared_ptr<const std::vector<std::shared_ptr<VirtualLink>>> current = std::atomic_load(&(VirtualTcp::links));
+	if (! current) { return nullptr; }
+
+	for (const auto &link : *current)
+	{
+		if (link->match(src, dst)) { return link; }
+	}
+	return nullptr;
+}
+
+// 届き切るまで、次に届く時刻でタイマーに登録し直す
+void VirtualTcp::arrive (VIRTUAL_SOCKET s)
+{
+	VirtualSocketTable::Ref vsock = VirtualTcp::sockets.acquire(s);
+	if (! vsock) { return; }
+
+	std::chrono::steady_clock::time_point next;
+	if (vsock->arrive(std::chrono::steady_clock::now(), next))
+	{
+		VirtualTcp::timer.schedule(next, [s]() { VirtualTcp::arrive(s); });
+	}
+}
+
+// 同じ相手へ二重に張らないよう、張り終えるまで peer_mtx を持つ
+// 張ったらまず自分の id と待ち受けを名乗る
+std::shared_ptr<VirtualPeer> VirtualTcp::peer_link (const std::string &host, int port)
+{
+	std::lock_guard<std::mutex> lock(VirtualTcp::peer_mtx);
+
+	for (auto &link : VirtualTcp::peers)
+	{
+		if ((link->host == host) && (link->port == port) && (! link->broken())) { return link; }
+	}
+
+	VirtualStream *stream = VirtualTcpStream::connect(host.c_str(), port);
+	if (nullptr == stream) { return nullptr; }
+
+	auto link = std::make_shared<VirtualPeer>(stream, host, port, VirtualTcp::peer_broken);
+	VirtualTcp::peers.push_back(link);
+	++VirtualTcp::npeers;
+
+	char body[4 + 2];
+	put_u32(&(body[0]), (uint32_t)inet_addr(ALTERNATIVE_IP));
+	put_u16(&(body[4]), (uint16_t)VirtualTcp::alternative_port);
+	link->post(COM_PEER, VirtualTcp::broker_id, 0, body, sizeof(body));
+
+	return link;
+}
+
+std::shared_ptr<VirtualPeer> VirtualTcp::find_peer (uint32_t id)
+{
+	std::lock_guard<std::mutex> lock(VirtualTcp::peer_mtx);
+
+	for (auto &link : VirtualTcp::peers)
+	{
+		if ((id == link->id) && (! link->broken())) { return link; }
+	}
+	return nullptr;
+}
+
+// リンクのスレッドから呼ばれる. 相手で待ち受けていたアドレスを忘れ、中継していた接続を閉じる
+void VirtualTcp::peer_broken (VirtualPeer &peer)
+{
+	for (auto &shard : VirtualTcp::shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+
+		for (auto it = shard.routes.begin(); it != shard.routes.end();)
+		{
+			if (it->second.get() == &peer) { it = shard.routes.erase(it); }
+			else { ++it; }
+		}
+	}
+
+	std::vector<std::shared_ptr<Forward>> dead;
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::forward_mtx);
+
+		for (auto &fw : VirtualTcp::forwards)
+		{
+			if (fw.second->peer.get() == &peer) { dead.push_back(fw.second); }
+		}
+	}
+	for (auto &fw : dead) { VirtualTcp::forward_drop(fw, false); }
+}
+
+// COM_ROUTE は [ip:4][port:2] を並べられるので、まとめて送る
+// 後から閉じた待ち受けの取り消しが追い越さないよう、shard の mtx を持ったまま積む
+void VirtualTcp::announce_all (VirtualPeer &peer)
+{
+	static const size_t Batch = 4096;
+
+	std::vector<char> body;
+	for (auto &shard : VirtualTcp::shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+
+		for (auto &listener : shard.listeners)
+		{
+			size_t pos = body.size();
+			body.resize(pos + 4 + 2);
+			put_u32(&(body[pos]), (uint32_t)(listener.first >> 16));
+			put_u16(&(body[pos + 4]), (uint16_t)(listener.first & 0xffff));
+
+			if (body.size() >= Batch * (4 + 2))
+			{
+				peer.post(COM_ROUTE, VirtualTcp::broker_id, 1, body.data(), body.size());
+				body.clear();
+			}
+		}
+		if (! body.empty())
+		{
+			peer.post(COM_ROUTE, VirtualTcp::broker_id, 1, body.data(), body.size());
+			body.clear();
+		}
+	}
+}
+
+void VirtualTcp::announce (unsigned long ip, unsigned short port, bool add)
+{
+	if (0 == VirtualTcp::npeers) { return; }
+
+	char body[4 + 2];
+	put_u32(&(body[0]), (uint32_t)ip);
+	put_u16(&(body[4]), port);
+
+	// 名乗りを受け取る前のリンクには、受け取ったときに announce_all でまとめて知らせる
+	std::lock_guard<std::mutex> lock(VirtualTcp::peer_mtx);
+	for (auto &link : VirtualTcp::peers)
+	{
+		if (0 != link->id) { link->post(COM_ROUTE, VirtualTcp::broker_id, add ? 1 : 0, body, sizeof(body)); }
+	}
+}
+
+// 手元に stub を作って vsock と繋ぎ、相手のブローカに宛先へ繋がせる
+// 相手が繋いで COM_FORWARD_ACK を返すまでは、vsock が書いたデータは stub に溜まる
+int VirtualTcp::forward_connect (VirtualSocketImpl &vsock, const std::shared_ptr<VirtualPeer> &peer
+		, unsigned long ip, unsigned short port)
+{
+	VIRTUAL_SOCKET stub = VirtualTcp::core_socket(ip, port);
+	VirtualSocketTable::Ref st = VirtualTcp::sockets.acquire(stub);
+	if (! st)
+	{
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	auto fw = std::make_shared<Forward>(Forward{VirtualTcp::broker_id, (uint32_t)stub, stub, peer});
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::forward_mtx);
+		VirtualTcp::forwards[((uint64_t)fw->origin << 32) | fw->id] = fw;
+	}
+
+	st->connect(vsock.self);
+	vsock.connect(stub);
+
+	char body[4 + 2 + 4 + 2];
+	put_u32(&(body[0]), (uint32_t)ip);
+	put_u16(&(body[4]), port);
+	put_u32(&(body[6]), (uint32_t)vsock.ip);
+	put_u16(&(body[10]), vsock.port);
+	if (! peer->post(COM_FORWARD_CONNECT, fw->origin, fw->id, body, sizeof(body)))
+	{
+		VirtualTcp::forward_drop(fw, false);
+		errno = ECONNREFUSED;
+		return -1;
+	}
+
+	return 0;
+}
+
+// 相手のブローカから頼まれた connect. 宛先が listen するまで継続を預けて待つ
+void VirtualTcp::forward_accept (const std::shared_ptr<Forward> &fw, unsigned long ip, unsigned short port)
+{
+	int res = VirtualTcp::core_connect(fw->stub, ip, port, 0, [fw, ip, port]() { VirtualTcp::forward_accept(fw, ip, port); });
+	if (PARKED == res) { return; }
+	if (res < 0)
+	{
+		VirtualTcp::forward_drop(fw, true);
+		return;
+	}
+
+	// 繋がったので相手に送り始めさせ、こちらからも送り始める
+	fw->peer->post(COM_FORWARD_ACK, fw->origin, fw->id);
+	VirtualTcp::forward_pump(fw);
+}
+
+// stub に溜まった分をリンクへ送る. 送ったら COM_FORWARD_ACK が届くまで次は読まない
+void VirtualTcp::forward_pump (const std::shared_ptr<Forward> &fw)
+{
+	std::vector<VirtualSlice> data;
+	int res = VirtualTcp::core_recv(fw->stub, FORWARD_CHUNK, 0, data, [fw]() { VirtualTcp::forward_pump(fw); });
+	if (PARKED == res) { return; }
+	if ((res > 0) && fw->peer->post(COM_FORWARD_SEND, fw->origin, fw->id, nullptr, 0, &data)) { return; }
+
+	// 手元の相手が閉じて読み切ったか、リンクが切れた
+	VirtualTcp::forward_drop(fw, 0 == res);
+}
+
+// 相手から届いた分を手元の相手へ書き込み終えたら COM_FORWARD_ACK を返す
+// 手元の相手が閉じていれば捨てる. 相手のブローカには、こちらの stub が読み切ったときに閉じたことが伝わる
+void VirtualTcp::forward_deliver (const std::shared_ptr<Forward> &fw, const std::shared_ptr<VirtualSlice> &data
+		, size_t offset)
+{
+	while (offset < data->len)
+	{
+		struct iovec iov = {data->data() + offset, data->len - offset};
+		int res = VirtualTcp::core_send(fw->stub, &iov, 1, 0
+				, [fw, data, offset]() { VirtualTcp::forward_deliver(fw, data, offset); }, &(data->seg));
+		if (PARKED == res) { return; }
+		if (res < 0) { break; }
+		offset += res;
+	}
+
+	fw->peer->post(COM_FORWARD_ACK, fw->origin, fw->id);
+}
+
+std::shared_ptr<VirtualTcp::Forward> VirtualTcp::find_forward (uint32_t origin, uint32_t id)
+{
+	std::lock_guard<std::mutex> lock(VirtualTcp::forward_mtx);
+
+	auto it = VirtualTcp::forwards.find(((uint64_t)origin << 32) | id);
+	if (VirtualTcp::forwards.end() == it) { return nullptr; }
+	return it->second;
+}
+
+void VirtualTcp::forward_drop (const std::shared_ptr<Forward> &fw, bool tell)
+{
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::forward_mtx);
+
+		auto it = VirtualTcp::forwards.find(((uint64_t)fw->origin << 32) | fw->id);
+		if ((VirtualTcp::forwards.end() == it) || (it->second != fw)) { return; }
+		VirtualTcp::forwards.erase(it);
+	}
+
+	if (tell) { fw->peer->post(COM_FORWARD_CLOSE, fw->origin, fw->id); }
+	VirtualTcp::core_close(fw->stub);
+}
+
+// 届いた要求を順に処理する. 待ちになった要求は脇へ置いて後続の要求を先に処理し、
+// 預けた継続から再開したときにもう一度同じ要求を処理する
+// 届いた要求はどれも呼ばれた時刻に読んだものとし、時刻は処理し終えたときだけ読む
+bool VirtualTcp::serve_frames (VirtualBrokerConnection &conn)
+{
+	auto arrived = std::chrono::steady_clock::now();
+
+	for (uint64_t key : conn.take_resumed())
+	{
+		auto it = conn.parked.find(key);
+		if (conn.parked.end() == it) { continue; }
+
+		conn.current = std::move(it->second.frame);
+		conn.started = it->second.started;
+		conn.parked.erase(it);
+
+		uint64_t nkey = conn.prepare();
+		if (VirtualTcp::serve_frame(conn, conn.current.data()))
+		{
+			VirtualTcp::served(conn.current.data(), conn.started, std::chrono::steady_clock::now());
+		}
+		else
+		{
+			conn.park(nkey);
+		}
+	}
+
+	size_t pos = 0;
+	size_t need = VirtualFrameHeader::SIZE;
+	bool ok = true;
+
+	while (conn.input && (conn.input->used - conn.input_begin - pos >= VirtualFrameHeader::SIZE))
+	{
+		size_t avail = conn.input->used - conn.input_begin - pos;
+		char *frame = conn.input->data() + conn.input_begin + pos;
+
+		VirtualFrameHeader head;
+		if (! head.decode(frame)) { ok = false; break; }
+
+		size_t n = VirtualFrameHeader::SIZE + head.length;
+		if (avail < n)
+		{
+			need = n;
+			break;
+		}
+
+		// 本文はこの領域を参照したまま処理する
+		conn.current = VirtualSlice{conn.input, conn.input_begin + pos, n};
+		conn.started = arrived;
+		uint64_t key = conn.prepare();
+		if (VirtualTcp::serve_frame(conn, frame))
+		{
+			VirtualTcp::served(frame, conn.started, std::chrono::steady_clock::now());
+		}
+		else
+		{
+			conn.park(key);
+		}
+		pos += n;
+	}
+
+	conn.current = VirtualSlice();
+	if ((! ok) || (! conn.input)) { return ok; }
+
+	// 途中まで届いている要求が続けて読めるように空けておく. 読み終えていれば領域は手放される
+	conn.consume(pos);
+	if (! conn.input) { return true; }
+
+	size_t rest = conn.input->used - conn.input_begin;
+	if (need > rest) { conn.reserve(need - rest); }
+	return true;
+}
+
+void VirtualTcp::served (const char *frame, std::chrono::steady_clock::time_point started
+		, std::chrono::steady_clock::time_point now)
+{
+	uint8_t command = (uint8_t)frame[1];
+	if (command > COM_STATS) { return; }
+
+	VirtualTcp::latency[command].record(
+			(uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - started).count());
+}
+
+// 要求1つを処理する. 待ちになったら false
+bool VirtualTcp::serve_frame (VirtualBrokerConnection &conn, char *frame)
+{
+	VirtualFrameHeader head;
+	head.decode(frame);
+
+	// 知らないコマンドには -1 を、本文の固定部分が足りない要求には EINVAL で -1 を返す
+	size_t body;
+	switch (head.command)
+	{
+		case COM_SOCKET: body = 4 + 2; break;
+		case COM_CONNECT: body = 4 + 2; break;
+		case COM_BIND: body = 4 + 2; break;
+		case COM_LISTEN: body = 4; break;
+		case COM_SEND: body = 4 + 4; break;
+		case COM_RECV: body = 4 + 4; break;
+		case COM_SETSOCKOPT: body = 4 + 4 + 4; break;
+		case COM_POLL: body = 4 + 8; break;
+		case COM_EPOLL_CTL: body = 4 + 4 + 4 + 8; break;
+		case COM_EPOLL_WAIT: body = 4 + 4 + 8; break;
+		case COM_PEER: body = 4 + 2; break;
+		case COM_FORWARD_CONNECT: body = 4 + 2 + 4 + 2; break;
+		default: body = 0; break;
+	}
+
+	auto it = VirtualTcp::services.find(head.command);
+	if (VirtualTcp::services.end() == it)
+	{
+		VirtualTcp::reply(conn, frame, -1);
+		return true;
+	}
+	if (head.length < body)
+	{
+		VirtualTcp::reply(conn, frame, -1, nullptr, 0, EINVAL);
+		return true;
+	}
+
+	return it->second(conn, frame);
+}
+
+// 要求と同じ request で応答する. FRAME_NOREPLY の要求には返さない
+// 本文は body の後に slices が続く. slices は複製せずに送る
+void VirtualTcp::reply (VirtualBrokerConnection &conn, const char *frame
+		, int32_t result, const char *body, size_t len, int err
+		, const std::vector<VirtualSlice> *slices)
+{
+	VirtualFrameHeader req;
+	req.decode(frame);
+	if (req.flags & FRAME_NOREPLY) { return; }
+
+	size_t length = len;
+	if (nullptr != slices)
+	{
+		for (const VirtualSlice &slice : *slices) { length += slice.len; }
+	}
+
+	char buf[VirtualFrameHeader::SIZE];
+	VirtualFrameHeader(req.command, (uint16_t)err, req.request, (uint32_t)result, (uint32_t)length).encode(buf);
+
+	struct iovec iov[2] = {{buf, VirtualFrameHeader::SIZE}, {(void *)body, len}};
+	if (nullptr == slices)
+	{
+		conn.send(iov, (len > 0) ? 2 : 1);
+		return;
+	}
+	conn.send(iov, (len > 0) ? 2 : 1, slices->data(), (int)slices->size());
+}
+
+// 以下の serve_* の com はフレームの先頭を指す
+bool VirtualTcp::serve_socket (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	unsigned long ip = get_u32(&(aft[0]));
+	unsigned short port = get_u16(&(aft[4]));
+
+	VIRTUAL_SOCKET ns = VirtualTcp::core_socket(ip, port);
+
+	VirtualTcp::reply(conn, com, (int32_t)ns);
+	return true;
+}
+
+bool VirtualTcp::serve_connect (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+	unsigned long ip = get_u32(&(aft[0]));
+	unsigned short port = get_u16(&(aft[4]));
+	// flags は後から足したので、ない要求も受け付ける
+	int flags = (get_u32(&(com[12])) >= 4 + 2 + 4) ? (int32_t)get_u32(&(aft[6])) : 0;
+
+	int res = VirtualTcp::core_connect(s, ip, port, flags, conn.resume);
+	if (PARKED == res) { return false; }
+
+	VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0);
+	return true;
+}
+
+bool VirtualTcp::serve_bind (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+	unsigned long ip = get_u32(&(aft[0]));
+	unsigned short port = get_u16(&(aft[4]));
+
+	int res = VirtualTcp::core_bind(s, ip, port);
+
+	VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0);
+	return true;
+}
+
+bool VirtualTcp::serve_listen (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+	int backlog = (int32_t)get_u32(&(aft[0]));
+
+	int res = VirtualTcp::core_listen(s, backlog);
+
+	VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0);
+	return true;
+}
+
+// 本文は [flags:4]. 空でもよい
+bool VirtualTcp::serve_accept (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+	int flags = (get_u32(&(com[12])) >= 4) ? (int32_t)get_u32(&(aft[0])) : 0;
+
+	unsigned long ip = 0;
+	unsigned short port = 0;
+	VIRTUAL_SOCKET client = VirtualTcp::core_accept(s, ip, port, flags, conn.resume);
+	if (PARKED == client) { return false; }
+
+	char ans[4 + 2];
+	// client socket は結果に、ip, portは本文にセット
+	put_u32(&(ans[0]), (uint32_t)ip);
+	put_u16(&(ans[4]), port);
+	VirtualTcp::reply(conn, com, (int32_t)client, ans, 6, (client < 0) ? errno : 0);
+	return true;
+}
+
+// 本文は [flags:4][offset:4][data]. offset は書き込み済みの位置で、待ちになるときに
+// 預けるフレームへ書き戻し、再開したらその続きから書き込む
+bool VirtualTcp::serve_send (VirtualBrokerConnection &conn, char *com)
+{
+	char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+	// 本文が [flags:4][offset:4] に足りない要求は serve_frame が断っている
+	int len = (int)(get_u32(&(com[12])) - (4 + 4));
+	int flags = (int32_t)get_u32(&(aft[0]));
+	int offset = (int32_t)get_u32(&(aft[4]));
+	if ((offset < 0) || (offset > len))
+	{
+		VirtualTcp::reply(conn, com, -1, nullptr, 0, EINVAL);
+		return true;
+	}
+	char *data = &(aft[4 + 4]);
+
+	// vsendv で分けて送られた部分もフレームの中では連続している
+	// 本文は要求を受け取った領域ごと相手の受信キューへ参照で渡す
+	const VirtualSegmentPtr *owner = &(conn.current.seg);
+	if (flags & MSG_DONTWAIT)
+	{
+		struct iovec iov = {data, (size_t)len};
+		int res = VirtualTcp::core_send(s, &iov, 1, MSG_DONTWAIT, nullptr, owner);
+		VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0);
+		return true;
+	}
+
+	// 全部書き込めたら応答する
+	while (offset < len)
+	{
+		struct iovec iov = {&(data[offset]), (size_t)(len - offset)};
+		int res = VirtualTcp::core_send(s, &iov, 1, 0, conn.resume, owner);
+		if (PARKED == res)
+		{
+			put_u32(&(aft[4]), (uint32_t)offset);
+			return false;
+		}
+		if (res < 0)
+		{
+			VirtualTcp::reply(conn, com, -1, nullptr, 0, errno);
+			return true;
+		}
+		offset += res;
+	}
+
+	VirtualTcp::reply(conn, com, len);
+	return true;
+}
+
+bool VirtualTcp::serve_recv (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+	int len = (int)std::min(get_u32(&(aft[0])), (uint32_t)VirtualFrameHeader::MAX_BODY);
+	int flags = (int32_t)get_u32(&(aft[4]));
+
+	// 受信キューの切片をそのまま応答の本文として送る
+	std::vector<VirtualSlice> ans;
+	int res = VirtualTcp::core_recv(s, (size_t)len, flags, ans, conn.resume);
+	if (PARKED == res) { return false; }
+
+	VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0, &ans);
+	return true;
+}
+
+bool VirtualTcp::serve_close (VirtualBrokerConnection &conn, char *com)
+{
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+
+	int res = VirtualTcp::core_close(s);
+
+	VirtualTcp::reply(conn, com, res);
+	return true;
+}
+
+bool VirtualTcp::serve_setsockopt (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(com[8]));
+	int level = (int32_t)get_u32(&(aft[0]));
+	int optname = (int32_t)get_u32(&(aft[4]));
+	int value = (int32_t)get_u32(&(aft[8]));
+
+	int res = VirtualTcp::core_setsockopt(s, level, optname, value);
+
+	VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0);
+	return true;
+}
+
+// 待ちになるときに期限 (steady_clock のナノ秒) を要求の中へ書き戻し、再開したらそれを使う
+// 0 はまだ決めていないことを表す
+static std::chrono::steady_clock::time_point frame_deadline (char *p, int timeout)
+{
+	uint64_t ns = get_u64(p);
+	if (0 == ns)
+	{
+		if (timeout < 0)
+		{
+			ns = UINT64_MAX;
+		}
+		else
+		{
+			auto t = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+			ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+		}
+		put_u64(p, ns);
+	}
+
+	if (UINT64_MAX == ns) { return std::chrono::steady_clock::time_point::max(); }
+	return std::chrono::steady_clock::time_point(
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::nanoseconds(ns)));
+}
+
+// 本文は [timeout:4][deadline:8][fd:4, events:2 が nfds 個]. 応答の本文は revents:2 が nfds 個
+bool VirtualTcp::serve_poll (VirtualBrokerConnection &conn, char *com)
+{
+	char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	unsigned long nfds = get_u32(&(com[8]));
+	size_t length = get_u32(&(com[12]));
+	if ((length - (4 + 8)) / (4 + 2) < nfds)
+	{
+		VirtualTcp::reply(conn, com, -1, nullptr, 0, EINVAL);
+		return true;
+	}
+	int timeout = (int32_t)get_u32(&(aft[0]));
+	auto deadline = frame_deadline(&(aft[4]), timeout);
+
+	std::vector<VirtualPollFd> fds(nfds);
+	for (unsigned long i = 0; i < nfds; ++i)
+	{
+		const char *p = &(aft[4 + 8 + i * (4 + 2)]);
+		fds[i].fd = (VIRTUAL_SOCKET)(int32_t)get_u32(&(p[0]));
+		fds[i].events = (short)get_u16(&(p[4]));
+		fds[i].revents = 0;
+	}
+
+	int res = VirtualTcp::core_poll(fds.data(), nfds, deadline, conn.resume);
+	if (PARKED == res) { return false; }
+
+	std::vector<char> ans(nfds * 2);
+	for (unsigned long i = 0; i < nfds; ++i) { put_u16(&(ans[i * 2]), (uint16_t)fds[i].revents); }
+	VirtualTcp::reply(conn, com, res, ans.data(), ans.size(), (res < 0) ? errno : 0);
+	return true;
+}
+
+bool VirtualTcp::serve_epoll_create (VirtualBrokerConnection &conn, char *com)
+{
+	int res = VirtualTcp::core_epoll_create();
+
+	VirtualTcp::reply(conn, com, res);
+	return true;
+}
+
+// 本文は [op:4][fd:4][events:4][data:8]
+bool VirtualTcp::serve_epoll_ctl (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	int epfd = (int32_t)get_u32(&(com[8]));
+	int op = (int32_t)get_u32(&(aft[0]));
+	VIRTUAL_SOCKET s = (VIRTUAL_SOCKET)(int32_t)get_u32(&(aft[4]));
+	VirtualEpollEvent event;
+	event.events = get_u32(&(aft[8]));
+	event.data = get_u64(&(aft[12]));
+
+	int res = VirtualTcp::core_epoll_ctl(epfd, op, s, &event);
+
+	VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0);
+	return true;
+}
+
+// 本文は [maxevents:4][timeout:4][deadline:8]. 応答の本文は [events:4][data:8] が結果の数だけ
+bool VirtualTcp::serve_epoll_wait (VirtualBrokerConnection &conn, char *com)
+{
+	char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	int epfd = (int32_t)get_u32(&(com[8]));
+	int maxevents = (int)std::min((int32_t)get_u32(&(aft[0])), (int32_t)(VirtualFrameHeader::MAX_BODY / (4 + 8)));
+	int timeout = (int32_t)get_u32(&(aft[4]));
+	auto deadline = frame_deadline(&(aft[8]), timeout);
+
+	std::vector<VirtualEpollEvent> events((size_t)std::max(maxevents, 0));
+	int res = VirtualTcp::core_epoll_wait(epfd, events.data(), maxevents, deadline, conn.resume);
+	if (PARKED == res) { return false; }
+
+	std::vector<char> ans((size_t)std::max(res, 0) * (4 + 8));
+	for (int i = 0; i < res; ++i)
+	{
+		put_u32(&(ans[i * (4 + 8)]), events[i].events);
+		put_u64(&(ans[i * (4 + 8) + 4]), events[i].data);
+	}
+	VirtualTcp::reply(conn, com, res, ans.data(), ans.size(), (res < 0) ? errno : 0);
+	return true;
+}
+
+bool VirtualTcp::serve_epoll_close (VirtualBrokerConnection &conn, char *com)
+{
+	int epfd = (int32_t)get_u32(&(com[8]));
+
+	int res = VirtualTcp::core_epoll_close(epfd);
+
+	VirtualTcp::reply(conn, com, res, nullptr, 0, (res < 0) ? errno : 0);
+	return true;
+}
+
+// 以下は連合したブローカからのフレーム. request は送り手 (COM_FORWARD_* では接続を始めたブローカ) の id
+// どれも FRAME_NOREPLY で、待ちになるものは継続を自分で預けて、リンクの後続のフレームを塞がない
+
+// body は名乗ったブローカの待ち受け [ip:4][port:2]
+// 知らないブローカなら張り返して名乗り、知っている他のブローカと自分の待ち受けを教える
+bool VirtualTcp::serve_peer (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	uint32_t id = get_u32(&(com[4]));
+	struct in_addr addr;
+	addr.s_addr = (in_addr_t)get_u32(&(aft[0]));
+	int port = get_u16(&(aft[4]));
+
+	if ((0 == id) || (VirtualTcp::broker_id == id) || VirtualTcp::find_peer(id)) { return true; }
+
+	std::shared_ptr<VirtualPeer> link = VirtualTcp::peer_link(inet_ntoa(addr), port);
+	if (! link) { return true; }
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::peer_mtx);
+
+		link->id = id;
+		for (auto &other : VirtualTcp::peers)
+		{
+			if ((0 == other->id) || (id == other->id) || other->broken()) { continue; }
+
+			char body[4 + 2];
+			put_u32(&(body[0]), (uint32_t)inet_addr(other->host.c_str()));
+			put_u16(&(body[4]), (uint16_t)other->port);
+			link->post(COM_PEER, other->id, 0, body, sizeof(body));
+		}
+	}
+	VirtualTcp::announce_all(*link);
+
+	return true;
+}
+
+// value が 1 なら追加、0 なら取り消し. body は [ip:4][port:2] の並び
+bool VirtualTcp::serve_route (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	std::shared_ptr<VirtualPeer> link = VirtualTcp::find_peer(get_u32(&(com[4])));
+	if (! link) { return true; }
+	bool add = (0 != get_u32(&(com[8])));
+	size_t n = get_u32(&(com[12])) / (4 + 2);
+
+	// 追加した shard で宛先を待っている connect を起こす
+	bool touched[VirtualSocketTable::MaxShards] = {};
+	for (size_t i = 0; i < n; ++i)
+	{
+		unsigned long ip = get_u32(&(aft[i * (4 + 2)]));
+		unsigned short port = get_u16(&(aft[i * (4 + 2) + 4]));
+		uint64_t key = VirtualTcp::listener_key(ip, port);
+		size_t sh = VirtualTcp::shard_of(ip, port);
+		ListenShard &shard = VirtualTcp::shards[sh];
+
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		if (add)
+		{
+			shard.routes[key] = link;
+			touched[sh] = true;
+			continue;
+		}
+
+		auto it = shard.routes.find(key);
+		if ((shard.routes.end() != it) && (it->second == link)) { shard.routes.erase(it); }
+	}
+	for (size_t sh = 0; sh < VirtualSocketTable::MaxShards; ++sh)
+	{
+		if (touched[sh]) { VirtualTcp::wake_listeners(VirtualTcp::shards[sh]); }
+	}
+
+	return true;
+}
+
+// body は [宛先 ip:4][port:2][接続元 ip:4][port:2]. 接続元を名乗る stub から宛先へ繋ぐ
+bool VirtualTcp::serve_forward_connect (VirtualBrokerConnection &conn, char *com)
+{
+	const char *aft = &(com[VirtualFrameHeader::SIZE]);
+
+	uint32_t origin = get_u32(&(com[4]));
+	uint32_t id = get_u32(&(com[8]));
+	unsigned long ip = get_u32(&(aft[0]));
+	unsigned short port = get_u16(&(aft[4]));
+
+	std::shared_ptr<VirtualPeer> link = VirtualTcp::find_peer(origin);
+	if (! link) { return true; }
+
+	VIRTUAL_SOCKET stub = VirtualTcp::core_socket(get_u32(&(aft[6])), get_u16(&(aft[10])));
+	if (stub < 0)
+	{
+		link->post(COM_FORWARD_CLOSE, origin, id);
+		return true;
+	}
+
+	auto fw = std::make_shared<Forward>(Forward{origin, id, stub, link});
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::forward_mtx);
+		VirtualTcp::forwards[((uint64_t)origin << 32) | id] = fw;
+	}
+	VirtualTcp::forward_accept(fw, ip, port);
+
+	return true;
+}
+
+// 本文は要求を受け取った領域ごと、手元の相手の受信キューへ参照で渡す
+bool VirtualTcp::serve_forward_send (VirtualBrokerConnection &conn, char *com)
+{
+	std::shared_ptr<Forward> fw = VirtualTcp::find_forward(get_u32(&(com[4])), get_u32(&(com[8])));
+	if (! fw) { return true; }
+
+	auto data = std::make_shared<VirtualSlice>(VirtualSlice{conn.current.seg
+			, conn.current.offset + VirtualFrameHeader::SIZE, get_u32(&(com[12]))});
+	VirtualTcp::forward_deliver(fw, data, 0);
+
+	return true;
+}
+
+bool VirtualTcp::serve_forward_ack (VirtualBrokerConnection &conn, char *com)
+{
+	std::shared_ptr<Forward> fw = VirtualTcp::find_forward(get_u32(&(com[4])), get_u32(&(com[8])));
+	if (fw) { VirtualTcp::forward_pump(fw); }
+
+	return true;
+}
+
+bool VirtualTcp::serve_forward_close (VirtualBrokerConnection &conn, char *com)
+{
+	std::shared_ptr<Forward> fw = VirtualTcp::find_forward(get_u32(&(com[4])), get_u32(&(com[8])));
+	if (fw) { VirtualTcp::forward_drop(fw, false); }
+
+	return true;
+}
+
+// value が 0 でなければソケットごとの数も返す. 結果は本文の長さ
+bool VirtualTcp::serve_stats (VirtualBrokerConnection &conn, char *com)
+{
+	VirtualStats stats;
+	VirtualTcp::core_stats(stats, 0 != get_u32(&(com[8])));
+
+	std::vector<char> body;
+	stats.encode(body);
+
+	VirtualTcp::reply(conn, com, (int32_t)body.size(), body.data(), body.size());
+	return true;
+}
+
+int VirtualTcp::startup (size_t shards_)
+{
+#ifdef __unix__
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+#ifdef _WINDOWS
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 0), &wsaData);
+#endif
+
+	// クライアントが直後に connect できるよう、listen までは呼び出し元で済ませる
+	SOCKET sock0 = socket(AF_INET, SOCK_STREAM, 0);
+
+	int reuse = 1;
+	setsockopt(sock0, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(VirtualTcp::alternative_port);
+#ifdef __unix__
+	addr.sin_addr.s_addr = INADDR_ANY;
+#elif _WINDOWS
+	addr.sin_addr.S_un.S_addr = INADDR_ANY;
+#endif
+	if (0 != bind(sock0, (struct sockaddr *)&addr, sizeof(addr))) { return -1; }
+
+	listen(sock0, SOMAXCONN);
+
+	VirtualTcp::alternative_listener = sock0;
+
+#ifdef __linux__
+	// 共有メモリ接続のハンドシェイク用. 抽象名前空間なのでファイルは残らない
+	int shm0 = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	std::string path = VirtualTcp::alternative_shm_path(VirtualTcp::alternative_port);
+	struct sockaddr_un uaddr;
+	memset(&uaddr, '\0', sizeof(uaddr));
+	uaddr.sun_family = AF_UNIX;
+	memcpy(uaddr.sun_path, path.data(), path.size());
+	socklen_t ulen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path.size());
+	if (0 != bind(shm0, (struct sockaddr *)&uaddr, ulen))
+	{
+		close(shm0);
+		close(sock0);
+		return -1;
+	}
+	listen(shm0, SOMAXCONN);
+	VirtualTcp::alternative_shm_listener = shm0;
+#endif
+
+	size_t ncores = std::max(1u, std::thread::hardware_concurrency());
+	VirtualTcp::nshards = std::min((0 < shards_) ? shards_ : ncores, (size_t)VirtualSocketTable::MaxShards);
+
+	// 0 は「まだ知らない」に使うので避ける
+	std::random_device rd;
+	do { VirtualTcp::broker_id = rd(); } while (0 == VirtualTcp::broker_id);
+
+	VirtualTcp::running = true;
+	VirtualTcp::timer.start();
+
+	// 接続数によらず、ワーカーはコア数だけ
+	VirtualTcp::broker.start(ncores, VirtualTcp::serve_frames);
+	VirtualTcp::broker.add_listener(sock0, [](int sock) -> VirtualStream *
+			{
+				return new VirtualTcpStream(sock);
+			});
+#ifdef __linux__
+	VirtualTcp::broker.add_listener(shm0, [](int ctl) -> VirtualStream *
+			{
+				return VirtualShmStream::accept(ctl);
+			});
+#endif
+
+	return 0;
+}
+
+int VirtualTcp::cleanup ()
+{
+	VirtualTcp::running = false;
+
+	// ワーカーを止めて制御用接続をすべて閉じる. 待ちになっていた要求は捨てる
+	VirtualTcp::broker.stop();
+	VirtualTcp::timer.stop();
+	VirtualTcp::stop_capture();
+	// このブローカへの接続は切れたので、次の startup の後に借りる VirtualTcp には張り直させる
+	VirtualTcp::channels.clear();
+
+	// 他のブローカへのリンクを閉じる. 相手は切断に気付いて中継を閉じる
+	std::vector<std::shared_ptr<VirtualPeer>> links;
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::peer_mtx);
+		links.swap(VirtualTcp::peers);
+		VirtualTcp::npeers = 0;
+	}
+	for (auto &link : links) { link->close(); }
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::forward_mtx);
+		VirtualTcp::forwards.clear();
+	}
+#ifdef __unix__
+	close(VirtualTcp::alternative_listener);
+#elif _WINDOWS
+	closesocket(VirtualTcp::alternative_listener);
+#endif
+#ifdef __linux__
+	close(VirtualTcp::alternative_shm_listener);
+#endif
+
+	// 直接呼び出しで待っているスレッドを起こす
+	for (auto &shard : VirtualTcp::shards) { VirtualTcp::wake_listeners(shard); }
+	VirtualTcp::sockets.for_each([](VirtualSocketImpl &vsock) { vsock.notify(); });
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::epoll_mtx);
+		for (auto &ep : VirtualTcp::epolls) { ep.second->close(); }
+		VirtualTcp::epolls.clear();
+	}
+
+	for (auto &shard : VirtualTcp::shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mtx);
+		shard.listeners.clear();
+		shard.routes.clear();
+	}
+	VirtualTcp::sockets.clear();
+	VirtualSegment::trim();
+
+#ifdef _WINDOWS
+	WSACleanup();
+#endif
+
+	return 0;
+}
+
+void VirtualTcp::set_window_max (size_t max)
+{
+	VirtualSocketImpl::window_max = std::min(std::max(max, (size_t)1), (size_t)VirtualFrameHeader::MAX_BODY);
+}
+
+void VirtualTcp::set_alternative_port (int port)
+{
+	VirtualTcp::alternative_port = port;
+}
+
+// send は古い一覧を持ったまま読み終えられるよう、複製に足して差し替える
+int VirtualTcp::set_link (const std::string &src, const std::string &dst, const VirtualLinkProfile &profile)
+{
+	unsigned long src_net, src_mask, dst_net, dst_mask;
+	if ((! VirtualLink::parse(src, src_net, src_mask)) || (! VirtualLink::parse(dst, dst_net, dst_mask)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(VirtualTcp::link_mtx);
+
+	auto next = std::make_shared<std::vector<std::shared_ptr<VirtualLink>>>();
+	next->push_back(std::make_shared<VirtualLink>(src_net, src_mask, dst_net, dst_mask, profile));
+	std::shared_ptr<const std::vector<std::shared_ptr<VirtualLink>>> current = std::atomic_load(&(VirtualTcp::links));
+	if (current) { next->insert(next->end(), current->begin(), current->end()); }
+
+	std::atomic_store(&(VirtualTcp::links), std::shared_ptr<const std::vector<std::shared_ptr<VirtualLink>>>(next));
+	VirtualTcp::any_links = true;
+	return 0;
+}
+
+void VirtualTcp::clear_links ()
+{
+	std::lock_guard<std::mutex> lock(VirtualTcp::link_mtx);
+
+	VirtualTcp::any_links = false;
+	std::atomic_store(&(VirtualTcp::links), std::shared_ptr<const std::vector<std::shared_ptr<VirtualLink>>>());
+}
+
+int VirtualTcp::start_capture (const std::string &path, const std::string &filter, size_t snaplen)
+{
+	VirtualCaptureFilter match;
+	std::unique_ptr<VirtualCapture> next(new VirtualCapture());
+	if ((! VirtualCaptureFilter::parse(filter, match)) || (! next->open(path, snaplen)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	// 前の書き出し先は閉じてから差し替える
+	VirtualTcp::stop_capture();
+
+	std::lock_guard<std::mutex> lock(VirtualTcp::capture_mtx);
+
+	VirtualTcp::capture = next.release();
+	VirtualTcp::capture_filter = match.pack();
+	VirtualTcp::capturing = true;
+	return 0;
+}
+
+// 記録中の send が手放すのを待ってから閉じるので、戻ったときにはファイルが書き終わっている
+// capture を外した後に capture_users が 0 なら、それより後に上げた send は nullptr を読む
+void VirtualTcp::stop_capture ()
+{
+	std::unique_ptr<VirtualCapture> prev;
+	{
+		std::lock_guard<std::mutex> lock(VirtualTcp::capture_mtx);
+
+		VirtualTcp::capturing = false;
+		prev.reset(VirtualTcp::capture.exchange(nullptr));
+	}
+	if (! prev) { return; }
+
+	while (0 < VirtualTcp::capture_users.load()) { std::this_thread::yield(); }
+	prev->close();
+}
+
+int VirtualTcp::federate (const std::string &host, int port)
+{
+	return VirtualTcp::peer_link(host, port) ? 0 : -1;
+}
+
+VirtualTcp::VirtualTcp (const std::string virtual_addr_, const int virtual_port_
+		, VirtualTcpMode mode)
+	  : direct(false)
+	  , server_mtx()
+	  , alternative_server()
+	  , server_key(0)
+	  , sends_mtx()
+	  , sends_cv()
+	  , sends()
+	  , nonblocking_mtx()
+	  , nonblocking()
+	  , any_nonblocking(false)
+	  , executor()
+	  , virtual_addr(virtual_addr_)
+	  , virtual_port(virtual_port_)
+{
+	// 同じプロセスにブローカがいればソケット表を直接呼び出し、制御用の接続は張らない
+	direct = (VIRTUAL_TCP_DIRECT == mode)
+		|| ((VIRTUAL_TCP_AUTO == mode) && VirtualTcp::running);
+	if (direct) { return; }
+
+#ifdef _WINDOWS
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 0), &wsaData);
+#endif
+
+	// 制御用接続はプロセスで共有する. 同じブローカへの接続が揃っていれば、ここでは何も張らない
+	// AUTO と BROKER は同じ接続を使う
+	server_key = ((uint64_t)(VIRTUAL_TCP_SHM == mode) << 32) | (uint32_t)VirtualTcp::alternative_port;
+	alternative_server = VirtualTcp::channels.acquire(server_key, VirtualTcp::connect_server);
+}
+
+VirtualStream *VirtualTcp::connect_server (uint64_t key)
+{
+	int port = (int)(uint32_t)key;
+#ifdef __linux__
+	// 共有メモリのリングで繋ぐ. ブローカが応じなければ TCP に戻る
+	if (key >> 32)
+	{
+		VirtualStream *stream = VirtualShmStream::connect(VirtualTcp::alternative_shm_path(port));
+		if (nullptr != stream) { return stream; }
+	}
+#endif
+	return VirtualTcpStream::connect(ALTERNATIVE_IP, port);
+}
+
+// 切れた接続を持ち続けないよう、使うたびに確かめる. 借り直しは接続を増やすときだけシステムコールを呼ぶ
+std::shared_ptr<VirtualChannel> VirtualTcp::server ()
+{
+	std::lock_guard<std::mutex> lock(server_mtx);
+
+	if ((! alternative_server) || (! alternative_server->alive()))
+	{
+		alternative_server = VirtualTcp::channels.acquire(server_key, VirtualTcp::connect_server);
+	}
+	return alternative_server;
+}
+
+VirtualTcp::~VirtualTcp ()
+{
+	if (direct) { return; }
+
+	// 接続は他の VirtualTcp と共有しているので、結果を受け取っていない send の応答待ちを残さない
+	{
+		std::lock_guard<std::mutex> lock(sends_mtx);
+		for (auto &it : sends) { finish_send(it.second); }
+	}
+	alternative_server.reset();
+#ifdef _WINDOWS
+	WSACleanup();
+#endif
+}
+
+
+VIRTUAL_SOCKET VirtualTcp::vsocket (int af, int type, int protocol)
+{
+	assert(AF_INET == af);
+	assert(SOCK_STREAM == type);
+	assert(0 == protocol);
+
+	unsigned long ip = inet_addr(virtual_addr.c_str());
+	unsigned short port = htons(virtual_port);
+
+	if (direct)
+	{
+		if (! VirtualTcp::running) { return INVALID_SOCKET; }
+		return VirtualTcp::core_socket(ip, port);
+	}
+
+	char req[4 + 2];
+	put_u32(&(req[0]), (uint32_t)ip);
+	put_u16(&(req[4]), port);
+	struct iovec iov = {req, 6};
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_SOCKET, 0, &iov, 1, res))) { return INVALID_SOCKET; }
+
+	return (VIRTUAL_SOCKET)res;
+}
+
+int VirtualTcp::vconnect (VIRTUAL_SOCKET s, const sockaddr *name, int namelen)
+{
+	if (direct && (! VirtualTcp::running))
+	{
+#ifdef _WINDOWS
+		return WSANOTINITIALISED;
+#else
+		return -1;
+#endif
+	}
+	struct sockaddr_in *sname = (struct sockaddr_in *)name;
+	assert(AF_INET == sname->sin_family);
+
+#ifdef __unix__
+	unsigned long ip = sname->sin_addr.s_addr;
+#elif _WINDOWS
+	unsigned long ip = sname->sin_addr.S_un.S_addr;
+#endif
+	unsigned short port = sname->sin_port;
+	int flags = is_nonblocking(s) ? MSG_DONTWAIT : 0;
+
+	if (direct) { return VirtualTcp::core_connect(s, ip, port, flags); }
+
+	char req[4 + 2 + 4];
+	put_u32(&(req[0]), (uint32_t)ip);
+	put_u16(&(req[4]), port);
+	put_u32(&(req[6]), (uint32_t)flags);
+	struct iovec iov = {req, sizeof(req)};
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_CONNECT, (uint32_t)s, &iov, 1, res))) { return -1; }
+
+	return res;
+}
+
+int VirtualTcp::vbind (VIRTUAL_SOCKET s, const sockaddr *name, int namelen)
+{
+	if (direct && (! VirtualTcp::running))
+	{
+#ifdef _WINDOWS
+		return WSANOTINITIALISED;
+#else
+		return -1;
+#endif
+	}
+	struct sockaddr_in *sname = (struct sockaddr_in *)name;
+	assert(AF_INET == sname->sin_family);
+
+#ifdef __unix__
+	unsigned long ip = sname->sin_addr.s_addr;
+#elif _WINDOWS
+	unsigned long ip = sname->sin_addr.S_un.S_addr;
+#endif
+	unsigned short port = sname->sin_port;
+
+	if (direct) { return VirtualTcp::core_bind(s, ip, port); }
+
+	char req[4 + 2];
+	put_u32(&(req[0]), (uint32_t)ip);
+	put_u16(&(req[4]), port);
+	struct iovec iov = {req, 6};
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_BIND, (uint32_t)s, &iov, 1, res))) { return -1; }
+
+	return res;
+}
+
+int VirtualTcp::vlisten (VIRTUAL_SOCKET s, int backlog)
+{
+	if (direct && (! VirtualTcp::running))
+	{
+#ifdef _WINDOWS
+		return WSANOTINITIALISED;
+#else
+		return -1;
+#endif
+	}
+
+	if (direct) { return VirtualTcp::core_listen(s, backlog); }
+
+	char req[4];
+	put_u32(&(req[0]), (uint32_t)backlog);
+	struct iovec iov = {req, 4};
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_LISTEN, (uint32_t)s, &iov, 1, res))) { return -1; }
+
+	return res;
+}
+
+VIRTUAL_SOCKET VirtualTcp::vaccept (VIRTUAL_SOCKET s, sockaddr *addr, unsigned int *addrlen)
+{
+	if (direct && (! VirtualTcp::running))
+	{
+#ifdef _WINDOWS
+		return WSANOTINITIALISED;
+#else
+		return -1;
+#endif
+	}
+
+	VIRTUAL_SOCKET client;
+	unsigned long ip;
+	unsigned short port;
+	int flags = is_nonblocking(s) ? MSG_DONTWAIT : 0;
+
+	if (direct)
+	{
+		client = VirtualTcp::core_accept(s, ip, port, flags);
+		if (INVALID_SOCKET == client) { return INVALID_SOCKET; }
+	}
+	else
+	{
+		char req[4];
+		put_u32(&(req[0]), (uint32_t)flags);
+		struct iovec iov = {req, 4};
+
+		int32_t res;
+		char ans[4 + 2];
+		size_t len;
+		std::shared_ptr<VirtualChannel> channel = server();
+		if ((! channel) || (! channel->call(COM_ACCEPT, (uint32_t)s, &iov, 1, res, ans, sizeof(ans), &len))
+				|| (sizeof(ans) != len) || (res < 0))
+		{
+			return INVALID_SOCKET;
+		}
+		client = (VIRTUAL_SOCKET)res;
+		ip = get_u32(&(ans[0]));
+		port = get_u16(&(ans[4]));
+	}
 
 	struct sockaddr_in *saddr = (struct sockaddr_in *)addr;
 
@@ -693,7 +2725,13 @@ VIRTUAL_SOCKET VirtualTcp::vaccept (VIRTUAL_SOCKET s, sockaddr *addr, unsigned i
 
 int VirtualTcp::vsend (VIRTUAL_SOCKET s, const char *buf, int len, int flags)
 {
-	if (! VirtualTcp::running)
+	struct iovec iov = {(void *)buf, (size_t)std::max(len, 0)};
+	return vsendv(s, &iov, 1, flags);
+}
+
+int VirtualTcp::vsendv (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags)
+{
+	if (direct && (! VirtualTcp::running))
 	{
 #ifdef _WINDOWS
 		return WSANOTINITIALISED;
@@ -701,60 +2739,621 @@ int VirtualTcp::vsend (VIRTUAL_SOCKET s, const char *buf, int len, int flags)
 		return -1;
 #endif
 	}
+	if ((iovcnt < 0) || (iovcnt > IOV_MAX))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (is_nonblocking(s)) { flags |= MSG_DONTWAIT; }
+	if (direct) { return VirtualTcp::core_send(s, iov, iovcnt, flags); }
+
+	// 同じソケットの send は1つずつ. 前の send がブローカで書き終わるのを待ってから次を送るので、
+	// 相手の受信ウィンドウが詰まっていればここで待たされる
+	PendingSend *ps;
+	{
+		std::unique_lock<std::mutex> lock(sends_mtx);
+		sends_cv.wait(lock, [&]() { return ! sends[s].busy; });
+		ps = &(sends[s]);
+		ps->busy = true;
+	}
+
+	int len = (int)std::min(iov_length(iov, iovcnt), (size_t)INT_MAX);
+	int sent = 0;
+	bool failed = false;
+	std::shared_ptr<VirtualChannel> channel = server();
+	while ((! failed) && (sent < len))
+	{
+		// 前の send の失敗 (相手の切断など) はこの send の失敗として返す
+		if (0 != finish_send(*ps))
+		{
+			failed = true;
+			break;
+		}
+
+		int n = (int)std::min((size_t)(len - sent), (size_t)(VirtualFrameHeader::MAX_BODY - (4 + 4)));
+
+		// 各部分はまとめて writev で送り、一時領域には集めない
+		char req[4 + 4];
+		put_u32(&(req[0]), (uint32_t)flags);
+		put_u32(&(req[4]), 0);
+		struct iovec vec[1 + IOV_MAX];
+		vec[0].iov_base = req;
+		vec[0].iov_len = 4 + 4;
+		int veccnt = 1 + iov_slice(iov, iovcnt, sent, n, &(vec[1]));
+
+		if (flags & MSG_DONTWAIT)
+		{
+			// 待たない send は書き込めた分をその場で返す
+			int32_t res;
+			if ((! channel) || (! channel->call(COM_SEND, (uint32_t)s, vec, veccnt, res)) || (res < 0))
+			{
+				failed = true;
+				break;
+			}
+			sent += res;
+			if (res < n) { break; }
+		}
+		else
+		{
+			// 応答は待たない. 本文は送り終えているので iov はすぐに再利用できる
+			if ((! channel) || (! channel->begin(COM_SEND, (uint32_t)s, vec, veccnt, ps->request)))
+			{
+				failed = true;
+				break;
+			}
+			ps->channel = channel;
+			ps->pending = true;
+			sent += n;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sends_mtx);
+		ps->busy = false;
+	}
+	sends_cv.notify_all();
 
-	char req[1 + 4 + 2 + len];
-	memset(req, '\0', 7 + len);
-	req[0] = COM_SEND;
-	req[1] = (char)((s & 0xff000000) >> 24);
-	req[2] = (char)((s & 0x00ff0000) >> 16);
-	req[3] = (char)((s & 0x0000ff00) >> 8);
-	req[4] = (char)( s & 0x000000ff);
-	req[5] = (char)((len & 0xff00) >> 8);
-	req[6] = (char)( len & 0x00ff);
-	memcpy(&(req[7]), buf, len);
-	int res = send(alternative_server, req, 7 + len, 0);
-	return res - 7;
+	if (failed && (0 == sent)) { return -1; }
+	return sent;
+}
+
+// 応答を待たずに返した send の結果を受け取る. 失敗していれば -1 (errno はブローカ側のもの)
+int VirtualTcp::finish_send (PendingSend &ps)
+{
+	if (! ps.pending) { return 0; }
+	ps.pending = false;
+
+	// 要求を送った接続で待つ. 借り直した後の接続には同じ番号の別の要求がありうる
+	std::shared_ptr<VirtualChannel> channel = std::move(ps.channel);
+	int32_t res;
+	if (! channel->finish(ps.request, res)) { return -1; }
+	return (res < 0) ? -1 : 0;
 }
 
 int VirtualTcp::vrecv (VIRTUAL_SOCKET s, char *buf, int len, int flags)
 {
-	if (! VirtualTcp::running) { return -1; }
+	struct iovec iov = {buf, (size_t)std::max(len, 0)};
+	return vrecvv(s, &iov, 1, flags);
+}
+
+int VirtualTcp::vrecvv (VIRTUAL_SOCKET s, const struct iovec *iov, int iovcnt, int flags)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+	if ((iovcnt < 0) || (iovcnt > IOV_MAX))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (is_nonblocking(s)) { flags |= MSG_DONTWAIT; }
+	if (direct) { return VirtualTcp::core_recv(s, iov, iovcnt, flags); }
 
-	char req[1 + 4 + 2];
-	memset(req, '\0', 7);
-	req[0] = COM_RECV;
-	req[1] = (char)((s & 0xff000000) >> 24);
-	req[2] = (char)((s & 0x00ff0000) >> 16);
-	req[3] = (char)((s & 0x0000ff00) >> 8);
-	req[4] = (char)( s & 0x000000ff);
-	req[5] = (char)((len & 0xff00) >> 8);
-	req[6] = (char)( len & 0x00ff);
-	send(alternative_server, req, 7, 0);
+	size_t len = std::min(iov_length(iov, iovcnt), (size_t)INT_MAX);
 
-	char ans[2 + len];
-	memset(ans, '\0', 2 + len);
-	recv(alternative_server, ans, 2 + len, 0);
+	char req[4 + 4];
+	put_u32(&(req[0]), (uint32_t)len);
+	put_u32(&(req[4]), (uint32_t)flags);
+	struct iovec vec = {req, 8};
 
-	int recvlen = 0;
-	recvlen |= (ans[0] << 8);
-	recvlen |= ans[1];
-	memcpy(buf, &(ans[2]), len);
+	// 本文は iov の各領域へ readv で直接受け取る
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_RECV, (uint32_t)s, &vec, 1, res, iov, iovcnt))) { return -1; }
 
-	return recvlen;
+	return res;
 }
 
 int VirtualTcp::vclosesocket (VIRTUAL_SOCKET s)
 {
-	if (! VirtualTcp::running) { return -1; }
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (any_nonblocking)
+	{
+		std::lock_guard<std::mutex> lock(nonblocking_mtx);
+		nonblocking.erase(s);
+	}
 
-	char req[5];
-	memset(req, '\0', 5);
-	req[0] = COM_CLOSE;
-	req[1] = (char)((s & 0xff000000) >> 24);
-	req[2] = (char)((s & 0x00ff0000) >> 16);
-	req[3] = (char)((s & 0x0000ff00) >> 8);
-	req[4] = (char)( s & 0x000000ff);
-	send(alternative_server, req, 5, 0);
+	if (direct) { return VirtualTcp::core_close(s); }
 
-	return 0;
+	// 書き終わっていない send を相手へ届けてから閉じる
+	{
+		std::unique_lock<std::mutex> lock(sends_mtx);
+		sends_cv.wait(lock, [&]() { return ! sends[s].busy; });
+		PendingSend ps = sends[s];
+		sends.erase(s);
+		lock.unlock();
+
+		finish_send(ps);
+	}
+
+	// 閉じ終わってから返す. 同じアドレスをすぐに listen し直しても先に閉じたほうとぶつからない
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_CLOSE, (uint32_t)s, nullptr, 0, res))) { return -1; }
+
+	return res;
+}
+
+int VirtualTcp::vsetsockopt (VIRTUAL_SOCKET s, int level, int optname, const char *optval, int optlen)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if ((nullptr == optval) || (optlen < (int)sizeof(int)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	int value;
+	memcpy(&value, optval, sizeof(value));
+
+	if (direct) { return VirtualTcp::core_setsockopt(s, level, optname, value); }
+
+	char req[4 + 4 + 4];
+	put_u32(&(req[0]), (uint32_t)level);
+	put_u32(&(req[4]), (uint32_t)optname);
+	put_u32(&(req[8]), (uint32_t)value);
+	struct iovec iov = {req, 12};
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_SETSOCKOPT, (uint32_t)s, &iov, 1, res))) { return -1; }
+
+	return res;
+}
+
+static std::chrono::steady_clock::time_point poll_deadline (int timeout)
+{
+	if (timeout < 0) { return std::chrono::steady_clock::time_point::max(); }
+	return std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+}
+
+int VirtualTcp::vpoll (VirtualPollFd *fds, unsigned long nfds, int timeout)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (direct) { return VirtualTcp::core_poll(fds, nfds, poll_deadline(timeout)); }
+
+	if ((4 + 8) + nfds * (4 + 2) > VirtualFrameHeader::MAX_BODY)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	std::vector<char> req((4 + 8) + nfds * (4 + 2));
+	put_u32(&(req[0]), (uint32_t)timeout);
+	put_u64(&(req[4]), 0);
+	for (unsigned long i = 0; i < nfds; ++i)
+	{
+		put_u32(&(req[4 + 8 + i * (4 + 2)]), (uint32_t)fds[i].fd);
+		put_u16(&(req[4 + 8 + i * (4 + 2) + 4]), (uint16_t)fds[i].events);
+	}
+	struct iovec iov = {req.data(), req.size()};
+
+	std::vector<char> ans(nfds * 2);
+	struct iovec out = {ans.data(), ans.size()};
+	int32_t res;
+	size_t len;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_POLL, (uint32_t)nfds, &iov, 1, res, &out, 1, &len))) { return -1; }
+	if (res < 0) { return res; }
+	if (ans.size() != len) { return -1; }
+
+	for (unsigned long i = 0; i < nfds; ++i) { fds[i].revents = (short)get_u16(&(ans[i * 2])); }
+	return res;
+}
+
+int VirtualTcp::vepoll_create ()
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (direct) { return VirtualTcp::core_epoll_create(); }
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_EPOLL_CREATE, 0, nullptr, 0, res))) { return -1; }
+
+	return res;
+}
+
+int VirtualTcp::vepoll_ctl (int epfd, int op, VIRTUAL_SOCKET fd, VirtualEpollEvent *event)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (direct) { return VirtualTcp::core_epoll_ctl(epfd, op, fd, event); }
+
+	if ((VEPOLL_CTL_DEL != op) && (nullptr == event))
+	{
+		errno = EFAULT;
+		return -1;
+	}
+
+	char req[4 + 4 + 4 + 8];
+	put_u32(&(req[0]), (uint32_t)op);
+	put_u32(&(req[4]), (uint32_t)fd);
+	put_u32(&(req[8]), (nullptr != event) ? event->events : 0);
+	put_u64(&(req[12]), (nullptr != event) ? event->data : 0);
+	struct iovec iov = {req, sizeof(req)};
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_EPOLL_CTL, (uint32_t)epfd, &iov, 1, res))) { return -1; }
+
+	return res;
+}
+
+int VirtualTcp::vepoll_wait (int epfd, VirtualEpollEvent *events, int maxevents, int timeout)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (direct) { return VirtualTcp::core_epoll_wait(epfd, events, maxevents, poll_deadline(timeout)); }
+
+	if (maxevents <= 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	maxevents = std::min(maxevents, (int)(VirtualFrameHeader::MAX_BODY / (4 + 8)));
+
+	char req[4 + 4 + 8];
+	put_u32(&(req[0]), (uint32_t)maxevents);
+	put_u32(&(req[4]), (uint32_t)timeout);
+	put_u64(&(req[8]), 0);
+	struct iovec iov = {req, sizeof(req)};
+
+	// 結果は固定長で並ぶので、いったん受け取ってから events へ移す
+	std::vector<char> ans((size_t)maxevents * (4 + 8));
+	struct iovec out = {ans.data(), ans.size()};
+	int32_t res;
+	size_t len;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_EPOLL_WAIT, (uint32_t)epfd, &iov, 1, res, &out, 1, &len))) { return -1; }
+	if (res < 0) { return res; }
+	if ((size_t)res * (4 + 8) != len) { return -1; }
+
+	for (int i = 0; i < res; ++i)
+	{
+		events[i].events = get_u32(&(ans[i * (4 + 8)]));
+		events[i].data = get_u64(&(ans[i * (4 + 8) + 4]));
+	}
+	return res;
+}
+
+int VirtualTcp::vepoll_close (int epfd)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (direct) { return VirtualTcp::core_epoll_close(epfd); }
+
+	int32_t res;
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->call(COM_EPOLL_CLOSE, (uint32_t)epfd, nullptr, 0, res))) { return -1; }
+
+	return res;
+}
+
+bool VirtualTcp::is_nonblocking (VIRTUAL_SOCKET s)
+{
+	if (! any_nonblocking) { return false; }
+
+	std::lock_guard<std::mutex> lock(nonblocking_mtx);
+	return 0 < nonblocking.count(s);
+}
+
+int VirtualTcp::vfcntl (VIRTUAL_SOCKET s, int cmd, int arg)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (direct && (! VirtualTcp::sockets.acquire(s)))
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(nonblocking_mtx);
+	switch (cmd)
+	{
+		case F_GETFL:
+			return O_RDWR | ((0 < nonblocking.count(s)) ? O_NONBLOCK : 0);
+		case F_SETFL:
+			if (arg & O_NONBLOCK)
+			{
+				nonblocking.insert(s);
+				any_nonblocking = true;
+			}
+			else
+			{
+				nonblocking.erase(s);
+			}
+			return 0;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+}
+
+// 応答が buf に入り切らなければ、結果の長さに広げて問い直す
+int VirtualTcp::stats (VirtualStats &out, bool per_socket)
+{
+	if (direct && (! VirtualTcp::running)) { return -1; }
+
+	if (direct)
+	{
+		VirtualTcp::core_stats(out, per_socket);
+		return 0;
+	}
+
+	std::vector<char> buf(64 * 1024);
+	while (true)
+	{
+		int32_t res;
+		size_t len = 0;
+		std::shared_ptr<VirtualChannel> channel = server();
+		if ((! channel) || (! channel->call(COM_STATS, per_socket ? 1 : 0, nullptr, 0, res, buf.data(), buf.size(), &len)))
+		{
+			return -1;
+		}
+		if (res < 0) { return -1; }
+
+		if ((size_t)res <= buf.size()) { return out.decode(buf.data(), len) ? 0 : -1; }
+		buf.resize((size_t)res + (size_t)res / 4);
+	}
+}
+
+void VirtualTcp::set_executor (const VirtualExecutor &executor_)
+{
+	executor = executor_;
+}
+
+void VirtualTcp::async_run (const std::shared_ptr<AsyncStep> &step, const std::shared_ptr<VirtualAsync::State> &state)
+{
+	long res = (*step)([step, state]() { VirtualTcp::async_run(step, state); });
+	if (PARKED == res) { return; }
+
+	state->complete(res, (res < 0) ? errno : 0);
+}
+
+VirtualAsync VirtualTcp::async_connect (VIRTUAL_SOCKET s, const sockaddr *name, int namelen)
+{
+	auto state = std::make_shared<VirtualAsync::State>(executor);
+	if (direct && (! VirtualTcp::running))
+	{
+		state->complete(-1, ENOTCONN);
+		return VirtualAsync(state);
+	}
+
+	const struct sockaddr_in *sname = (const struct sockaddr_in *)name;
+	assert(AF_INET == sname->sin_family);
+#ifdef __unix__
+	unsigned long ip = sname->sin_addr.s_addr;
+#elif _WINDOWS
+	unsigned long ip = sname->sin_addr.S_un.S_addr;
+#endif
+	unsigned short port = sname->sin_port;
+
+	if (direct)
+	{
+		auto step = std::make_shared<AsyncStep>([s, ip, port](const std::function<void()> &resume) -> long
+				{
+					return VirtualTcp::core_connect(s, ip, port, 0, resume);
+				});
+		VirtualTcp::async_run(step, state);
+		return VirtualAsync(state);
+	}
+
+	char req[4 + 2 + 4];
+	put_u32(&(req[0]), (uint32_t)ip);
+	put_u16(&(req[4]), port);
+	put_u32(&(req[6]), 0);
+	struct iovec iov = {req, sizeof(req)};
+
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->begin_async(COM_CONNECT, (uint32_t)s, &iov, 1, [state](int32_t res, int err, size_t)
+				{
+					state->complete(res, (res < 0) ? err : 0);
+				})))
+	{
+		state->complete(-1, ECONNRESET);
+	}
+	return VirtualAsync(state);
+}
+
+static void set_peer_addr (sockaddr *addr, unsigned long ip, unsigned short port)
+{
+	struct sockaddr_in *saddr = (struct sockaddr_in *)addr;
+
+#ifdef __unix__
+	saddr->sin_addr.s_addr = ip;
+#elif _WINDOWS
+	saddr->sin_addr.S_un.S_addr = ip;
+#endif
+	saddr->sin_port = port;
+	saddr->sin_family = AF_INET;
+}
+
+VirtualAsync VirtualTcp::async_accept (VIRTUAL_SOCKET s, sockaddr *addr, unsigned int *addrlen)
+{
+	auto state = std::make_shared<VirtualAsync::State>(executor);
+	if (direct && (! VirtualTcp::running))
+	{
+		state->complete(-1, ENOTCONN);
+		return VirtualAsync(state);
+	}
+
+	if (direct)
+	{
+		auto step = std::make_shared<AsyncStep>([s, addr](const std::function<void()> &resume) -> long
+				{
+					unsigned long ip;
+					unsigned short port;
+					VIRTUAL_SOCKET client = VirtualTcp::core_accept(s, ip, port, 0, resume);
+					if (0 <= client) { set_peer_addr(addr, ip, port); }
+					return client;
+				});
+		VirtualTcp::async_run(step, state);
+		return VirtualAsync(state);
+	}
+
+	// 応答の本文の受け取り先は完了まで残す
+	struct Answer
+	{
+		char ans[4 + 2];
+		struct iovec out;
+	};
+	auto answer = std::make_shared<Answer>();
+	answer->out.iov_base = answer->ans;
+	answer->out.iov_len = sizeof(answer->ans);
+
+	char req[4];
+	put_u32(&(req[0]), 0);
+	struct iovec iov = {req, 4};
+
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->begin_async(COM_ACCEPT, (uint32_t)s, &iov, 1, [state, answer, addr](int32_t res, int err, size_t len)
+				{
+					if ((0 <= res) && (sizeof(answer->ans) != len))
+					{
+						state->complete(-1, EPROTO);
+						return;
+					}
+					if (0 <= res) { set_peer_addr(addr, get_u32(&(answer->ans[0])), get_u16(&(answer->ans[4]))); }
+					state->complete(res, (res < 0) ? err : 0);
+				}, &(answer->out), 1)))
+	{
+		state->complete(-1, ECONNRESET);
+	}
+	return VirtualAsync(state);
+}
+
+VirtualAsync VirtualTcp::async_send (VIRTUAL_SOCKET s, const char *buf, int len, int flags)
+{
+	auto state = std::make_shared<VirtualAsync::State>(executor);
+	if (direct && (! VirtualTcp::running))
+	{
+		state->complete(-1, ENOTCONN);
+		return VirtualAsync(state);
+	}
+	len = std::max(len, 0);
+
+	if (direct)
+	{
+		// 書き込んだ位置は試行をまたいで持ち越す
+		auto step = std::make_shared<AsyncStep>([s, buf, len, flags, sent = 0](const std::function<void()> &resume) mutable -> long
+				{
+					while (sent < len)
+					{
+						struct iovec iov = {(void *)&(buf[sent]), (size_t)(len - sent)};
+						int res = VirtualTcp::core_send(s, &iov, 1, flags, (flags & MSG_DONTWAIT) ? nullptr : resume);
+						if (PARKED == res) { return PARKED; }
+						if (res < 0) { return (0 < sent) ? sent : -1; }
+						sent += res;
+						if (flags & MSG_DONTWAIT) { break; }
+					}
+					return sent;
+				});
+		VirtualTcp::async_run(step, state);
+		return VirtualAsync(state);
+	}
+
+	std::shared_ptr<VirtualChannel> channel = server();
+	if (! channel)
+	{
+		state->complete(-1, ECONNRESET);
+		return VirtualAsync(state);
+	}
+	VirtualTcp::async_send_frame(channel.get(), s, buf, len, flags, 0, state);
+	return VirtualAsync(state);
+}
+
+void VirtualTcp::async_send_frame (VirtualChannel *channel, VIRTUAL_SOCKET s, const char *buf, int len, int flags
+		, int sent, const std::shared_ptr<VirtualAsync::State> &state)
+{
+	int n = (int)std::min((size_t)(len - sent), (size_t)(VirtualFrameHeader::MAX_BODY - (4 + 4)));
+
+	char req[4 + 4];
+	put_u32(&(req[0]), (uint32_t)flags);
+	put_u32(&(req[4]), 0);
+	struct iovec iov[2] = {{req, 4 + 4}, {(void *)&(buf[sent]), (size_t)n}};
+
+	auto done = [channel, s, buf, len, flags, sent, state](int32_t res, int err, size_t)
+			{
+				if (res < 0)
+				{
+					state->complete((0 < sent) ? sent : -1, (0 < sent) ? 0 : err);
+					return;
+				}
+
+				if ((sent + res < len) && (! (flags & MSG_DONTWAIT)))
+				{
+					VirtualTcp::async_send_frame(channel, s, buf, len, flags, sent + res, state);
+					return;
+				}
+				state->complete(sent + res, 0);
+			};
+	if (! channel->begin_async(COM_SEND, (uint32_t)s, iov, 2, done))
+	{
+		state->complete((0 < sent) ? sent : -1, (0 < sent) ? 0 : ECONNRESET);
+	}
+}
+
+VirtualAsync VirtualTcp::async_recv (VIRTUAL_SOCKET s, char *buf, int len, int flags)
+{
+	auto state = std::make_shared<VirtualAsync::State>(executor);
+	if (direct && (! VirtualTcp::running))
+	{
+		state->complete(-1, ENOTCONN);
+		return VirtualAsync(state);
+	}
+	len = std::max(len, 0);
+
+	if (direct)
+	{
+		auto step = std::make_shared<AsyncStep>([s, buf, len, flags](const std::function<void()> &resume) -> long
+				{
+					struct iovec iov = {buf, (size_t)len};
+					return VirtualTcp::core_recv(s, &iov, 1, flags, (flags & MSG_DONTWAIT) ? nullptr : resume);
+				});
+		VirtualTcp::async_run(step, state);
+		return VirtualAsync(state);
+	}
+
+	// 本文は buf へ直接受け取る. iovec は完了まで残す
+	auto out = std::make_shared<struct iovec>();
+	out->iov_base = buf;
+	out->iov_len = (size_t)len;
+
+	char req[4 + 4];
+	put_u32(&(req[0]), (uint32_t)len);
+	put_u32(&(req[4]), (uint32_t)flags);
+	struct iovec iov = {req, 8};
+
+	std::shared_ptr<VirtualChannel> channel = server();
+	if ((! channel) || (! channel->begin_async(COM_RECV, (uint32_t)s, &iov, 1, [state, out](int32_t res, int err, size_t)
+				{
+					state->complete(res, (res < 0) ? err : 0);
+				}, out.get(), 1)))
+	{
+		state->complete(-1, ECONNRESET);
+	}
+	return VirtualAsync(state);
 }
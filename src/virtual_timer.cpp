@@ -0,0 +1,188 @@
+#include <limits>
+#include <string.h>
+#include "virtual_timer.h"
+
+constexpr std::chrono::microseconds VirtualTimer::TICK;
+
+VirtualTimer::VirtualTimer ()
+	: mtx()
+	  , cv()
+	  , wheel()
+	  , occupied()
+	  , count(0)
+	  , origin(Clock::now())
+	  , current(0)
+	  , wake_tick(std::numeric_limits<uint64_t>::max())
+	  , running(false)
+	  , thread()
+{
+}
+
+VirtualTimer::~VirtualTimer ()
+{
+	stop();
+}
+
+void VirtualTimer::start ()
+{
+	std::lock_guard<std::mutex> lock(mtx);
+
+	if (running) { return; }
+	running = true;
+	thread = std::thread(&VirtualTimer::thread_fn, this);
+}
+
+void VirtualTimer::stop ()
+{
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		running = false;
+		clear();
+	}
+	cv.notify_all();
+
+	if (thread.joinable()) { thread.join(); }
+}
+
+void VirtualTimer::schedule (Clock::time_point when, const std::function<void()> &fn)
+{
+	bool earlier;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+
+		if (! running) { return; }
+
+		// 空の間は進めていないので、今の tick から数え直す
+		if (0 == count)
+		{
+			Clock::time_point now = Clock::now();
+			uint64_t now_tick = (now > origin) ? (uint64_t)((now - origin) / TICK) : 0;
+			if (now_tick > current) { current = now_tick; }
+		}
+
+		Entry entry{tick_of(when), fn};
+		earlier = entry.tick < wake_tick;
+		insert(std::move(entry));
+		++count;
+	}
+
+	// 眠っている期限より早ければ待ち直させる
+	if (earlier) { cv.notify_all(); }
+}
+
+// 切り上げる. 期限より前には呼ばない
+uint64_t VirtualTimer::tick_of (Clock::time_point when) const
+{
+	if (when <= origin) { return 0; }
+	return (uint64_t)((when - origin + TICK - Clock::duration(1)) / TICK);
+}
+
+void VirtualTimer::insert (Entry &&entry)
+{
+	uint64_t tick = std::max(entry.tick, current);
+	uint64_t delta = tick - current;
+
+	int level = 0;
+	while ((level < LEVELS - 1) && (delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))) { ++level; }
+
+	size_t idx = (size_t)(tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+	if ((LEVELS - 1 == level) && (delta >= ((uint64_t)1 << (SLOT_BITS * LEVELS))))
+	{
+		// 最上段でも届かない期限は、最後に回ってくる枠に置いて下ろすときに置き直す
+		idx = (size_t)((current >> (SLOT_BITS * level)) + SLOTS - 1) & (SLOTS - 1);
+	}
+
+	wheel[level][idx].push_back(std::move(entry));
+	occupied[level][idx / 64] |= (uint64_t)1 << (idx % 64);
+}
+
+void VirtualTimer::clear ()
+{
+	for (auto &level : wheel)
+	{
+		for (auto &slot : level) { std::vector<Entry>().swap(slot); }
+	}
+	memset(occupied, '\0', sizeof(occupied));
+	count = 0;
+}
+
+void VirtualTimer::advance (std::vector<std::function<void()>> &due)
+{
+	if (0 == (current & (SLOTS - 1)))
+	{
+		for (int level = 1; level < LEVELS; ++level)
+		{
+			size_t idx = (size_t)(current >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+			std::vector<Entry> moved;
+			moved.swap(wheel[level][idx]);
+			occupied[level][idx / 64] &= ~((uint64_t)1 << (idx % 64));
+			for (Entry &entry : moved) { insert(std::move(entry)); }
+
+			// 上の段も境目のときだけ続けて下ろす
+			if (0 != idx) { break; }
+		}
+	}
+
+	size_t idx = (size_t)current & (SLOTS - 1);
+	std::vector<Entry> fired;
+	fired.swap(wheel[0][idx]);
+	occupied[0][idx / 64] &= ~((uint64_t)1 << (idx % 64));
+	for (Entry &entry : fired) { due.push_back(std::move(entry.fn)); }
+	count -= fired.size();
+
+	++current;
+}
+
+uint64_t VirtualTimer::next_tick () const
+{
+	size_t idx = (size_t)current & (SLOTS - 1);
+	if (0 == idx) { return current; }
+
+	// この周の残りで最初に埋まっている枠. なければ次の境目
+	for (size_t word = idx / 64; word < SLOTS / 64; ++word)
+	{
+		uint64_t bits = occupied[0][word];
+		if (word == idx / 64) { bits &= ~(uint64_t)0 << (idx % 64); }
+		if (0 != bits) { return (current & ~(uint64_t)(SLOTS - 1)) + word * 64 + __builtin_ctzll(bits); }
+	}
+	return (current | (SLOTS - 1)) + 1;
+}
+
+void VirtualTimer::thread_fn ()
+{
+	std::vector<std::function<void()>> due;
+
+	std::unique_lock<std::mutex> lock(mtx);
+	while (running)
+	{
+		if (0 == count)
+		{
+			wake_tick = std::numeric_limits<uint64_t>::max();
+			cv.wait(lock);
+			continue;
+		}
+
+		// 何もない tick は飛ばし、次に処理の要る tick まで眠る
+		Clock::time_point now = Clock::now();
+		uint64_t now_tick = (now > origin) ? (uint64_t)((now - origin) / TICK) : 0;
+		uint64_t next = next_tick();
+		if (next > now_tick)
+		{
+			wake_tick = next;
+			cv.wait_until(lock, origin + next * TICK);
+			wake_tick = std::numeric_limits<uint64_t>::max();
+			continue;
+		}
+
+		current = next;
+		advance(due);
+		if (due.empty()) { continue; }
+
+		lock.unlock();
+		for (auto &fn : due) { fn(); }
+		due.clear();
+		lock.lock();
+	}
+}